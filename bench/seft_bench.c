@@ -0,0 +1,672 @@
+/**
+ * Transfer benchmark, run with ``make bench``.
+ *
+ * Copies a fixed set of trees through the client's own copy functions to an SFTP
+ * server started in this process on a loopback port, so the numbers measure seft and
+ * libssh rather than the network or a remote disk. Files are generated under a tmpfs
+ * directory with a fixed seed and removed at the end.
+ */
+
+/* nftw() */
+#define _GNU_SOURCE
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libssh/libssh.h>
+
+#include "seft_bench_server.h"
+#include "seft_client.h"
+#include "seft_commands.h"
+#include "seft_debug.h"
+#include "seft_limit.h"
+#include "seft_list.h"
+#include "seft_loop.h"
+#include "seft_path.h"
+#include "seft_utils.h"
+#include "seft_wan.h"
+
+#define BENCH_PASSWORD "seft-bench"
+
+/** Size of each of the small files */
+#define BENCH_SMALL_FILE_SIZE 4096
+
+/** Files in every level of the deep tree */
+#define BENCH_TREE_FILES_PER_LEVEL 4
+
+/** Times the wide directory is listed */
+#define BENCH_LIST_ROUNDS 10
+
+/** Size of the optional very large file, in MiB */
+#define BENCH_LARGE_SIZE_MIB (10 * 1024)
+
+#define MAX_BENCH_SCENARIOS 16
+
+/** Most round trip times a run sweeps */
+#define MAX_BENCH_RTTS 16
+
+#define BUF_SIZE_BENCH_LINE 1024
+#define BUF_SIZE_BENCH_FILL (1024 * 1024)
+
+#define BYTES_PER_MIB (1024.0 * 1024.0)
+
+const char *argp_program_version = "seft-bench 0.1";
+
+static char doc_bench[] =
+    "Measure uploads, downloads and listings against an in-process SFTP server";
+
+static struct argp_option option_bench[] = {
+    {"dir", 'd', "DIR", 0, "Directory the files are generated in (tmpfs by default)",
+     0},
+    {"size", 's', "MiB", 0, "Size of the large file", 0},
+    {"large", 'l', 0, 0, "Also copy a 10 GiB file", 0},
+    {"files", 'n', "N", 0, "Number of small files", 0},
+    {"depth", 'D', "N", 0, "Depth of the deep tree", 0},
+    {"json", 'j', "FILE", 0, "Write the results as JSON to FILE", 0},
+    {"baseline", 'b', "FILE", 0, "Compare against the JSON results of an earlier run", 0},
+    {"tolerance", 't', "PCT", 0, "Slowdown beyond which a scenario has regressed", 0},
+    {"rtt", 'r', "MS,...", 0, "Run the scenarios through an emulated link at each RTT",
+     0},
+    {"jitter", 'J', "MS", 0, "Most extra one-way delay of the emulated link", 0},
+    {"rate", 'R', "RATE", 0, "Bandwidth of the emulated link, e.g. 100M (bytes/s)", 0},
+    {"loss", 'L', "PCT", 0, "Loss of the emulated link", 0},
+    {0},
+};
+
+typedef struct {
+    const char *dir;
+    size_t size_mib;
+    bool is_large;
+    size_t num_files;
+    size_t depth;
+    const char *path_json;
+    const char *path_baseline;
+    double tolerance;
+
+    /** Round trip times swept, the link's delay is half of each */
+    uint32_t rtts[MAX_BENCH_RTTS];
+    size_t num_rtts;
+    WanConfigT link;
+} BenchArgsT;
+
+typedef enum {
+    BENCH_UPLOAD,
+    BENCH_DOWNLOAD,
+    BENCH_LIST,
+} BenchKindE;
+
+/** Outcome of a scenario */
+typedef struct {
+    char name[32];
+    CommandStatusE status;
+    double seconds;
+    uint64_t num_bytes;
+    size_t num_files;
+    size_t num_ops;
+    double p50_us;
+    double p99_us;
+} BenchResultT;
+
+/** Scenarios in the order they run, the huge ones only with ``--large`` */
+static const struct {
+    const char *name;
+    const char *tree;
+    BenchKindE kind;
+} bench_scenarios[] = {
+    {"upload_large", "large", BENCH_UPLOAD},
+    {"download_large", "large", BENCH_DOWNLOAD},
+    {"upload_huge", "huge", BENCH_UPLOAD},
+    {"download_huge", "huge", BENCH_DOWNLOAD},
+    {"upload_small", "small", BENCH_UPLOAD},
+    {"download_small", "small", BENCH_DOWNLOAD},
+    {"upload_tree", "tree", BENCH_UPLOAD},
+    {"download_tree", "tree", BENCH_DOWNLOAD},
+    {"list_wide", "small", BENCH_LIST},
+};
+
+#define NUM_BENCH_SCENARIOS (sizeof bench_scenarios / sizeof *bench_scenarios)
+
+/** Latency of every request answered since the scenario started, in nanoseconds.
+ * Only the main thread runs a loop, so the observer needs no lock. */
+static uint64_t *bench_samples;
+static size_t bench_num_samples;
+static size_t bench_cap_samples;
+
+/** Paths every scenario works with */
+static char bench_path_local[BUF_SIZE_FS_PATH];
+static char bench_path_remote[BUF_SIZE_FS_PATH];
+static char bench_path_download[BUF_SIZE_FS_PATH];
+
+static error_t
+parse_option_bench(int32_t key, char *arg, struct argp_state *state) {
+    BenchArgsT *args = state->input;
+    char *rtt;
+
+    switch (key) {
+        case 'd':
+            args->dir = arg;
+            break;
+        case 's':
+            args->size_mib = strtoull(arg, NULL, 10);
+            break;
+        case 'l':
+            args->is_large = true;
+            break;
+        case 'n':
+            args->num_files = strtoull(arg, NULL, 10);
+            break;
+        case 'D':
+            args->depth = strtoull(arg, NULL, 10);
+            break;
+        case 'j':
+            args->path_json = arg;
+            break;
+        case 'b':
+            args->path_baseline = arg;
+            break;
+        case 't':
+            args->tolerance = strtod(arg, NULL);
+            break;
+        case 'r':
+            args->num_rtts = 0;
+            for (rtt = strtok(arg, ","); rtt != NULL && args->num_rtts < MAX_BENCH_RTTS;
+                 rtt = strtok(NULL, ",")) {
+                args->rtts[args->num_rtts++] = strtoul(rtt, NULL, 10);
+            }
+            break;
+        case 'J':
+            args->link.jitter_ms = strtoul(arg, NULL, 10);
+            break;
+        case 'R':
+            if (!limit_rate_parse(arg, &args->link.rate)) {
+                argp_error(state, "Invalid rate: %s", arg);
+                return EINVAL;
+            }
+            break;
+        case 'L':
+            args->link.loss = strtod(arg, NULL) / 100;
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static void
+bench_observe(LoopOpE op, uint32_t status, uint32_t length, uint64_t latency_ns,
+              void *user_data) {
+    (void)op;
+    (void)status;
+    (void)length;
+    (void)user_data;
+
+    if (bench_num_samples == bench_cap_samples) {
+        bench_cap_samples = bench_cap_samples ? 2 * bench_cap_samples : 4096;
+        bench_samples =
+            DBG_REALLOC(bench_samples, bench_cap_samples * sizeof *bench_samples);
+    }
+    bench_samples[bench_num_samples++] = latency_ns;
+}
+
+static int
+bench_compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/** Fill a file with ``num_bytes`` of pseudo-random data, never a chunk of zeros the
+ * sparse copy would skip. The seed is fixed so every run copies the same bytes. */
+static CommandStatusE
+bench_fill_file(const char *path, uint64_t num_bytes, uint64_t *seed, uint8_t *buf) {
+    int32_t fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    uint64_t num_written = 0;
+    size_t length;
+
+    if (fd < 0) {
+        DBG_ERR("Couldn't create %s: %s", path, strerror(errno));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    while (num_written < num_bytes) {
+        length = MIN(num_bytes - num_written, BUF_SIZE_BENCH_FILL);
+        for (size_t i = 0; i + sizeof *seed <= length; i += sizeof *seed) {
+            *seed ^= *seed << 13;
+            *seed ^= *seed >> 7;
+            *seed ^= *seed << 17;
+            memcpy(buf + i, seed, sizeof *seed);
+        }
+        buf[0] |= 1;
+        if (write(fd, buf, length) != (ssize_t)length) {
+            DBG_ERR("Couldn't write %s: %s", path, strerror(errno));
+            close(fd);
+            return CMD_INTERNAL_ERROR;
+        }
+        num_written += length;
+    }
+
+    close(fd);
+    return CMD_OK;
+}
+
+/** Generate the files the scenarios copy under ``bench_path_local``. */
+static CommandStatusE
+bench_generate(const BenchArgsT *args) {
+    char path[BUF_SIZE_FS_PATH];
+    uint8_t *buf = DBG_MALLOC(BUF_SIZE_BENCH_FILL);
+    uint64_t seed = 0x5ef7be9c4u;
+    CommandStatusE status;
+    size_t length;
+
+    snprintf(path, sizeof path, "%s/large", bench_path_local);
+    status = bench_fill_file(path, args->size_mib * BYTES_PER_MIB, &seed, buf);
+    if (status == CMD_OK && args->is_large) {
+        snprintf(path, sizeof path, "%s/huge", bench_path_local);
+        status = bench_fill_file(path, BENCH_LARGE_SIZE_MIB * BYTES_PER_MIB, &seed, buf);
+    }
+
+    snprintf(path, sizeof path, "%s/small", bench_path_local);
+    mkdir(path, 0755);
+    for (size_t i = 0; status == CMD_OK && i < args->num_files; i++) {
+        snprintf(path, sizeof path, "%s/small/file_%06zu", bench_path_local, i);
+        status = bench_fill_file(path, BENCH_SMALL_FILE_SIZE, &seed, buf);
+    }
+
+    snprintf(path, sizeof path, "%s/tree", bench_path_local);
+    for (size_t level = 0; status == CMD_OK && level < args->depth; level++) {
+        length = strlen(path);
+        if (mkdir(path, 0755) || length + 16 >= sizeof path) {
+            DBG_ERR("Couldn't create %s", path);
+            status = CMD_INTERNAL_ERROR;
+            break;
+        }
+        for (size_t i = 0; status == CMD_OK && i < BENCH_TREE_FILES_PER_LEVEL; i++) {
+            snprintf(path + length, sizeof path - length, "/file_%zu", i);
+            status = bench_fill_file(path, BENCH_SMALL_FILE_SIZE, &seed, buf);
+        }
+        snprintf(path + length, sizeof path - length, "/d");
+    }
+
+    DBG_SAFE_FREE(buf);
+    return status;
+}
+
+static int
+bench_remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+
+    return remove(path);
+}
+
+static void
+bench_remove_tree(const char *path) {
+    nftw(path, bench_remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+/** Copy ``name`` of the local tree to the remote one, or back when ``is_download``. */
+static CommandStatusE
+bench_copy(ssh_session session, const char *name, bool is_download) {
+    char path_from[BUF_SIZE_FS_PATH], path_to[BUF_SIZE_FS_PATH];
+
+    if (is_download) {
+        snprintf(path_from, sizeof path_from, "%s/%s", bench_path_remote, name);
+        snprintf(path_to, sizeof path_to, "%s/%s", bench_path_download, name);
+        return copy_from_remote_to_local(session, NULL, path_from, path_to);
+    }
+
+    snprintf(path_from, sizeof path_from, "%s/%s", bench_path_local, name);
+    snprintf(path_to, sizeof path_to, "%s/%s", bench_path_remote, name);
+    return copy_from_local_to_remote(session, NULL, path_from, path_to);
+}
+
+static CommandStatusE
+bench_list(ssh_session session, const char *name) {
+    char path[BUF_SIZE_FS_PATH];
+    SftpLoopT *loop = SftpLoop_for_session(session);
+    ListT *entries;
+
+    snprintf(path, sizeof path, "%s/%s", bench_path_remote, name);
+    for (size_t i = 0; loop != NULL && i < BENCH_LIST_ROUNDS; i++) {
+        entries = SftpLoop_read_dir(loop, path, NULL);
+        if (entries == NULL) {
+            return CMD_INTERNAL_ERROR;
+        }
+        FileSystem_list_free(entries);
+    }
+
+    return loop != NULL ? CMD_OK : CMD_INTERNAL_ERROR;
+}
+
+/**
+ * Time a scenario and summarize the latencies of its requests.
+ *
+ * :param suffix: Appended to the scenario's name, to tell apart the runs of a sweep.
+ */
+static void
+bench_run(BenchResultT *result, ssh_session session, const BenchArgsT *args,
+          size_t index, const char *suffix) {
+    const char *tree = bench_scenarios[index].tree;
+    size_t num_files_tree = args->depth * BENCH_TREE_FILES_PER_LEVEL;
+    double start;
+
+    *result = (BenchResultT){0};
+    snprintf(result->name, sizeof result->name, "%s%s", bench_scenarios[index].name,
+             suffix);
+    if (bench_scenarios[index].kind == BENCH_LIST) {
+        result->num_files = BENCH_LIST_ROUNDS * args->num_files;
+    } else if (!strcmp(tree, "large") || !strcmp(tree, "huge")) {
+        result->num_bytes =
+            (!strcmp(tree, "large") ? args->size_mib : BENCH_LARGE_SIZE_MIB) *
+            BYTES_PER_MIB;
+        result->num_files = 1;
+    } else {
+        result->num_files = !strcmp(tree, "small") ? args->num_files : num_files_tree;
+        result->num_bytes = result->num_files * BENCH_SMALL_FILE_SIZE;
+    }
+    bench_num_samples = 0;
+
+    start = get_time_monotonic();
+    result->status = bench_scenarios[index].kind == BENCH_LIST
+                         ? bench_list(session, tree)
+                         : bench_copy(session, tree,
+                                      bench_scenarios[index].kind == BENCH_DOWNLOAD);
+    result->seconds = get_time_monotonic() - start;
+
+    result->num_ops = bench_num_samples;
+    if (bench_num_samples) {
+        qsort(bench_samples, bench_num_samples, sizeof *bench_samples,
+              bench_compare_u64);
+        result->p50_us = bench_samples[bench_num_samples / 2] / 1e3;
+        result->p99_us = bench_samples[bench_num_samples * 99 / 100] / 1e3;
+    }
+
+    printf("%-16s %-6s %9.2f s %10.1f MiB/s %10.0f files/s %9zu ops %9.0f us p50 "
+           "%9.0f us p99\n",
+           result->name, result->status == CMD_OK ? "ok" : "FAILED", result->seconds,
+           result->num_bytes / BYTES_PER_MIB / result->seconds,
+           result->num_files / result->seconds, result->num_ops, result->p50_us,
+           result->p99_us);
+    fflush(stdout);
+}
+
+/** Copies of a single file are measured by throughput and the others by files per
+ * second. */
+static double
+bench_metric(const BenchResultT *result, bool *is_bytes) {
+    *is_bytes = result->num_files <= 1;
+
+    return *is_bytes ? result->num_bytes / BYTES_PER_MIB / result->seconds
+                     : result->num_files / result->seconds;
+}
+
+static void
+bench_write_json(const char *path_json, const BenchArgsT *args,
+                 const BenchResultT *results, size_t num_results) {
+    FILE *file = fopen(path_json, "w");
+
+    if (file == NULL) {
+        DBG_ERR("Couldn't write %s: %s", path_json, strerror(errno));
+        return;
+    }
+
+    fprintf(file,
+            "{\"config\": {\"size_mib\": %zu, \"large\": %s, \"files\": %zu, "
+            "\"depth\": %zu, \"jitter_ms\": %u, \"rate\": %" PRIu64 ", "
+            "\"loss\": %.4f},\n \"scenarios\": [\n",
+            args->size_mib, args->is_large ? "true" : "false", args->num_files,
+            args->depth, args->link.jitter_ms, args->link.rate, args->link.loss);
+    for (size_t i = 0; i < num_results; i++) {
+        fprintf(file,
+                "  {\"name\": \"%s\", \"status\": \"%s\", \"seconds\": %.3f, "
+                "\"bytes\": %" PRIu64 ", \"files\": %zu, \"ops\": %zu, "
+                "\"mib_s\": %.2f, \"files_s\": %.1f, \"p50_us\": %.1f, "
+                "\"p99_us\": %.1f}%s\n",
+                results[i].name, results[i].status == CMD_OK ? "ok" : "failed",
+                results[i].seconds, results[i].num_bytes, results[i].num_files,
+                results[i].num_ops,
+                results[i].num_bytes / BYTES_PER_MIB / results[i].seconds,
+                results[i].num_files / results[i].seconds, results[i].p50_us,
+                results[i].p99_us, i + 1 < num_results ? "," : "");
+    }
+    fprintf(file, " ]}\n");
+    fclose(file);
+}
+
+/** Value of ``"key": <number>`` in a line of the JSON results, negative if absent. */
+static double
+bench_json_number(const char *line, const char *key) {
+    char pattern[64];
+    const char *found;
+
+    snprintf(pattern, sizeof pattern, "\"%s\": ", key);
+    found = strstr(line, pattern);
+
+    return found != NULL ? strtod(found + strlen(pattern), NULL) : -1;
+}
+
+/**
+ * Compare with the results of an earlier run by ``bench_metric``, the p99 latency is
+ * shown alongside.
+ *
+ * :return: Whether a scenario got slower than ``tolerance`` percent.
+ */
+static bool
+bench_compare(const char *path_baseline, double tolerance, const BenchResultT *results,
+              size_t num_results) {
+    FILE *file = fopen(path_baseline, "r");
+    char line[BUF_SIZE_BENCH_LINE], pattern[64];
+    double before, now, change, p99_before;
+    bool is_bytes, has_regressed = false;
+
+    if (file == NULL) {
+        DBG_ERR("Couldn't read the baseline %s: %s", path_baseline, strerror(errno));
+        return true;
+    }
+
+    printf("\n%-16s %12s %12s %9s %9s\n", "vs baseline", "before", "now", "change",
+           "p99");
+    while (fgets(line, sizeof line, file) != NULL) {
+        for (size_t i = 0; i < num_results; i++) {
+            snprintf(pattern, sizeof pattern, "\"name\": \"%s\"", results[i].name);
+            if (strstr(line, pattern) == NULL) {
+                continue;
+            }
+
+            now = bench_metric(&results[i], &is_bytes);
+            before = bench_json_number(line, is_bytes ? "mib_s" : "files_s");
+            p99_before = bench_json_number(line, "p99_us");
+            if (before <= 0) {
+                break;
+            }
+
+            change = 100 * (now - before) / before;
+            printf("%-16s %12.1f %12.1f %+8.1f%% %+8.1f%%%s\n", results[i].name,
+                   before, now, change,
+                   p99_before > 0 ? 100 * (results[i].p99_us - p99_before) / p99_before
+                                  : 0.0,
+                   change < -tolerance ? "  REGRESSION" : "");
+            has_regressed |= change < -tolerance;
+            break;
+        }
+    }
+
+    fclose(file);
+    return has_regressed;
+}
+
+/** Print each scenario's throughput at every round trip time of the sweep. */
+static void
+bench_print_curves(const BenchArgsT *args, const BenchResultT *results,
+                   size_t num_per_round) {
+    bool is_bytes;
+
+    printf("\n%-16s", "by RTT (ms)");
+    for (size_t r = 0; r < args->num_rtts; r++) {
+        printf(" %9u", args->rtts[r]);
+    }
+    printf("\n");
+
+    for (size_t i = 0; i < num_per_round; i++) {
+        printf("%-16.*s", (int)strcspn(results[i].name, "@"), results[i].name);
+        for (size_t r = 0; r < args->num_rtts; r++) {
+            printf(" %9.1f", bench_metric(&results[r * num_per_round + i], &is_bytes));
+        }
+        printf(" %s\n", is_bytes ? "MiB/s" : "files/s");
+    }
+}
+
+/**
+ * Connect to ``port`` and run every scenario.
+ *
+ * :return: Number of results written to ``results``, 0 if the connection failed.
+ */
+static size_t
+bench_run_round(ConnectOptionsT *options, uint32_t port, const BenchArgsT *args,
+                const char *suffix, BenchResultT *results) {
+    char path_huge[BUF_SIZE_FS_PATH];
+    ssh_session session;
+    size_t num_results = 0;
+
+    options->port_id = port;
+    session = try_ssh_init(options);
+    if (session == NULL) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < NUM_BENCH_SCENARIOS; i++) {
+        if (!args->is_large && !strcmp(bench_scenarios[i].tree, "huge")) {
+            continue;
+        }
+        bench_run(&results[num_results++], session, args, i, suffix);
+    }
+
+    /* Three copies of the huge file would hardly fit the tmpfs with the rest */
+    snprintf(path_huge, sizeof path_huge, "%s/huge", bench_path_remote);
+    unlink(path_huge);
+    snprintf(path_huge, sizeof path_huge, "%s/huge", bench_path_download);
+    unlink(path_huge);
+
+    clean_ssh_session(session);
+    return num_results;
+}
+
+int
+main(int argc, char **argv) {
+    BenchArgsT args = {.dir = "/dev/shm",
+                       .size_mib = 1024,
+                       .num_files = 100000,
+                       .depth = 64,
+                       .tolerance = 10};
+    struct argp arg_parser = {option_bench, parse_option_bench, 0, doc_bench,
+                              0,            0,                  0};
+    char path_workspace[BUF_SIZE_FS_PATH], suffix[32];
+    BenchResultT results[MAX_BENCH_SCENARIOS * MAX_BENCH_RTTS] = {0};
+    ConnectOptionsT options = {0};
+    BenchServerT *server = NULL;
+    WanProxyT *proxy;
+    size_t num_results = 0, num_per_round = 0;
+    bool is_wan, has_failed = false;
+
+    argp_parse(&arg_parser, argc, argv, 0, 0, &args);
+
+    snprintf(path_workspace, sizeof path_workspace, "%s/seft-bench-XXXXXX", args.dir);
+    if (mkdtemp(path_workspace) == NULL) {
+        DBG_ERR("Couldn't create a directory in %s: %s", args.dir, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    snprintf(bench_path_local, sizeof bench_path_local, "%s/local", path_workspace);
+    snprintf(bench_path_remote, sizeof bench_path_remote, "%s/remote", path_workspace);
+    snprintf(bench_path_download, sizeof bench_path_download, "%s/download",
+             path_workspace);
+    mkdir(bench_path_local, 0755);
+    mkdir(bench_path_remote, 0755);
+    mkdir(bench_path_download, 0755);
+
+    printf("Generating %zu MiB, %zu small files and a tree %zu deep in %s\n",
+           args.size_mib + (args.is_large ? BENCH_LARGE_SIZE_MIB : 0), args.num_files,
+           args.depth, path_workspace);
+    fflush(stdout);
+    if (bench_generate(&args) != CMD_OK) {
+        has_failed = true;
+        goto cleanup;
+    }
+
+    server = BenchServer_start(BENCH_PASSWORD);
+    if (server == NULL) {
+        has_failed = true;
+        goto cleanup;
+    }
+
+    /* Set before the session's loop exists, it is read without a lock */
+    SftpLoop_set_observer(bench_observe, NULL);
+    options.host_name = strdup("127.0.0.1");
+    snprintf(options.passphrase, sizeof options.passphrase, "%s", BENCH_PASSWORD);
+
+    is_wan = args.num_rtts || args.link.jitter_ms || args.link.rate || args.link.loss;
+    if (is_wan && !args.num_rtts) {
+        args.num_rtts = 1;
+    }
+
+    if (!is_wan) {
+        num_results =
+            bench_run_round(&options, BenchServer_port(server), &args, "", results);
+        has_failed |= !num_results;
+    }
+    for (size_t r = 0; is_wan && r < args.num_rtts; r++) {
+        args.link.delay_ms = args.rtts[r] / 2;
+        proxy = WanProxy_start("127.0.0.1", BenchServer_port(server), 0, &args.link);
+        if (proxy == NULL) {
+            has_failed = true;
+            break;
+        }
+
+        printf("\nThrough a link of %u ms RTT\n", args.rtts[r]);
+        snprintf(suffix, sizeof suffix, "@%ums", args.rtts[r]);
+        num_per_round = bench_run_round(&options, WanProxy_port(proxy), &args, suffix,
+                                        &results[num_results]);
+        num_results += num_per_round;
+        has_failed |= !num_per_round;
+        WanProxy_stop(proxy);
+    }
+    if (args.num_rtts > 1 && num_results == args.num_rtts * num_per_round) {
+        bench_print_curves(&args, results, num_per_round);
+    }
+
+    for (size_t i = 0; i < num_results; i++) {
+        has_failed |= results[i].status != CMD_OK;
+    }
+    if (args.path_json != NULL) {
+        bench_write_json(args.path_json, &args, results, num_results);
+    }
+    if (args.path_baseline != NULL) {
+        has_failed |= bench_compare(args.path_baseline, args.tolerance, results,
+                                    num_results);
+    }
+
+cleanup:
+    if (options.host_name != NULL) {
+        clean_connect_options(&options);
+    }
+    if (server != NULL) {
+        BenchServer_stop(server);
+    }
+    if (bench_samples != NULL) {
+        DBG_SAFE_FREE(bench_samples);
+    }
+    bench_remove_tree(path_workspace);
+
+    return has_failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,623 @@
+/* The SFTP server half of libssh's API is only declared for server builds */
+#define WITH_SERVER
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <libssh/libssh.h>
+#include <libssh/server.h>
+#include <libssh/sftp.h>
+
+#include "seft_bench_server.h"
+#include "seft_debug.h"
+#include "seft_path.h"
+#include "seft_utils.h"
+
+/** A file or directory opened by a client */
+typedef struct {
+    int32_t fd;
+    DIR *dir;
+    char path[BUF_SIZE_FS_PATH];
+} BenchHandleT;
+
+struct BenchServerS {
+    ssh_bind bind;
+    int32_t fd_listen;
+    uint32_t port;
+    char *password;
+    pthread_t thread_accept;
+
+    /** Connections being served, ``BenchServer_stop`` waits for them */
+    size_t num_connections;
+    bool is_stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/** A connection accepted by the server */
+typedef struct {
+    BenchServerT *server;
+    ssh_session session;
+} BenchConnT;
+
+static uint32_t
+bench_server_status(int32_t error) {
+    switch (error) {
+        case 0:
+            return SSH_FX_OK;
+        case ENOENT:
+        case ENOTDIR:
+            return SSH_FX_NO_SUCH_FILE;
+        case EACCES:
+        case EPERM:
+            return SSH_FX_PERMISSION_DENIED;
+        default:
+            return SSH_FX_FAILURE;
+    }
+}
+
+static int32_t
+bench_server_reply_errno(sftp_client_message message, int32_t result) {
+    int32_t error = result < 0 ? errno : 0;
+
+    return sftp_reply_status(message, bench_server_status(error),
+                             error ? strerror(error) : NULL);
+}
+
+static void
+bench_server_attr(const struct stat *st, struct sftp_attributes_struct *attr) {
+    *attr = (struct sftp_attributes_struct){
+        .flags = SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_UIDGID |
+                 SSH_FILEXFER_ATTR_PERMISSIONS | SSH_FILEXFER_ATTR_ACMODTIME,
+        .size = st->st_size,
+        .uid = st->st_uid,
+        .gid = st->st_gid,
+        .permissions = st->st_mode,
+        .atime = st->st_atime,
+        .mtime = st->st_mtime};
+}
+
+/** ``ls -l`` style line of an entry, what OpenSSH puts in READDIR replies. */
+static void
+bench_server_longname(const char *name, const struct stat *st, char *longname,
+                      size_t size) {
+    const char *bits = "rwxrwxrwx";
+    char mode[11];
+
+    mode[0] = S_ISDIR(st->st_mode) ? 'd' : S_ISLNK(st->st_mode) ? 'l' : '-';
+    for (size_t i = 0; i < 9; i++) {
+        mode[i + 1] = st->st_mode & (0400 >> i) ? bits[i] : '-';
+    }
+    mode[10] = '\0';
+
+    snprintf(longname, size, "%s %3lu %-8u %-8u %12llu %s", mode,
+             (unsigned long)st->st_nlink, st->st_uid, st->st_gid,
+             (unsigned long long)st->st_size, name);
+}
+
+static int32_t
+bench_server_open(sftp_session sftp, sftp_client_message message) {
+    BenchHandleT *handle;
+    ssh_string handle_str;
+    int32_t flags = 0, fd;
+    mode_t mode = 0644;
+
+    if ((message->flags & SSH_FXF_READ) && (message->flags & SSH_FXF_WRITE)) {
+        flags = O_RDWR;
+    } else if (message->flags & SSH_FXF_WRITE) {
+        flags = O_WRONLY;
+    }
+    flags |= message->flags & SSH_FXF_CREAT ? O_CREAT : 0;
+    flags |= message->flags & SSH_FXF_TRUNC ? O_TRUNC : 0;
+    flags |= message->flags & SSH_FXF_EXCL ? O_EXCL : 0;
+    flags |= message->flags & SSH_FXF_APPEND ? O_APPEND : 0;
+    if (message->attr != NULL &&
+        (message->attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+        mode = message->attr->permissions & 07777;
+    }
+
+    fd = open(message->filename, flags, mode);
+    if (fd < 0) {
+        return bench_server_reply_errno(message, fd);
+    }
+
+    handle = DBG_CALLOC(1, sizeof *handle);
+    handle->fd = fd;
+    handle_str = sftp_handle_alloc(sftp, handle);
+    if (handle_str == NULL) {
+        close(fd);
+        DBG_SAFE_FREE(handle);
+        return sftp_reply_status(message, SSH_FX_FAILURE, "Too many handles");
+    }
+
+    sftp_reply_handle(message, handle_str);
+    ssh_string_free(handle_str);
+
+    return SSH_OK;
+}
+
+static int32_t
+bench_server_opendir(sftp_session sftp, sftp_client_message message) {
+    BenchHandleT *handle;
+    ssh_string handle_str;
+    DIR *dir = opendir(message->filename);
+
+    if (dir == NULL) {
+        return bench_server_reply_errno(message, -1);
+    }
+
+    handle = DBG_CALLOC(1, sizeof *handle);
+    handle->fd = -1;
+    handle->dir = dir;
+    snprintf(handle->path, sizeof handle->path, "%s", message->filename);
+    handle_str = sftp_handle_alloc(sftp, handle);
+    if (handle_str == NULL) {
+        closedir(dir);
+        DBG_SAFE_FREE(handle);
+        return sftp_reply_status(message, SSH_FX_FAILURE, "Too many handles");
+    }
+
+    sftp_reply_handle(message, handle_str);
+    ssh_string_free(handle_str);
+
+    return SSH_OK;
+}
+
+static int32_t
+bench_server_readdir(BenchHandleT *handle, sftp_client_message message) {
+    struct sftp_attributes_struct attr;
+    char path[BUF_SIZE_FS_PATH], longname[BUF_SIZE_FS_PATH];
+    struct dirent *entry;
+    struct stat st;
+    size_t num_names = 0;
+
+    while (num_names < BENCH_SERVER_READDIR_BATCH &&
+           (entry = readdir(handle->dir)) != NULL) {
+        snprintf(path, sizeof path, "%s/%s", handle->path, entry->d_name);
+        if (lstat(path, &st)) {
+            continue;
+        }
+
+        bench_server_attr(&st, &attr);
+        bench_server_longname(entry->d_name, &st, longname, sizeof longname);
+        sftp_reply_names_add(message, entry->d_name, longname, &attr);
+        num_names++;
+    }
+
+    if (!num_names) {
+        return sftp_reply_status(message, SSH_FX_EOF, NULL);
+    }
+
+    return sftp_reply_names(message);
+}
+
+static int32_t
+bench_server_read(BenchHandleT *handle, sftp_client_message message, uint8_t *buf) {
+    ssize_t num_bytes;
+
+    num_bytes = pread(handle->fd, buf, MIN(message->len, BENCH_SERVER_MAX_READ),
+                      message->offset);
+    if (num_bytes < 0) {
+        return bench_server_reply_errno(message, -1);
+    } else if (!num_bytes) {
+        return sftp_reply_status(message, SSH_FX_EOF, NULL);
+    }
+
+    return sftp_reply_data(message, buf, num_bytes);
+}
+
+static int32_t
+bench_server_write(BenchHandleT *handle, sftp_client_message message) {
+    const uint8_t *data = ssh_string_data(message->data);
+    size_t length = ssh_string_len(message->data), num_written = 0;
+    ssize_t num_bytes;
+
+    while (num_written < length) {
+        num_bytes = pwrite(handle->fd, data + num_written, length - num_written,
+                           message->offset + num_written);
+        if (num_bytes < 0) {
+            return bench_server_reply_errno(message, -1);
+        }
+        num_written += num_bytes;
+    }
+
+    return sftp_reply_status(message, SSH_FX_OK, NULL);
+}
+
+static int32_t
+bench_server_stat(BenchHandleT *handle, sftp_client_message message) {
+    struct sftp_attributes_struct attr;
+    struct stat st;
+    int32_t result;
+
+    switch (message->type) {
+        case SSH_FXP_FSTAT:
+            result = fstat(handle->fd, &st);
+            break;
+        case SSH_FXP_LSTAT:
+            result = lstat(message->filename, &st);
+            break;
+        default:
+            result = stat(message->filename, &st);
+    }
+
+    if (result) {
+        return bench_server_reply_errno(message, result);
+    }
+
+    bench_server_attr(&st, &attr);
+    return sftp_reply_attr(message, &attr);
+}
+
+static int32_t
+bench_server_setstat(BenchHandleT *handle, sftp_client_message message) {
+    sftp_attributes attr = message->attr;
+    int32_t result = 0;
+
+    if (attr == NULL) {
+        return sftp_reply_status(message, SSH_FX_OK, NULL);
+    }
+
+    if (attr->flags & SSH_FILEXFER_ATTR_SIZE) {
+        result = handle != NULL ? ftruncate(handle->fd, attr->size)
+                                : truncate(message->filename, attr->size);
+    }
+    if (!result && (attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+        result = handle != NULL ? fchmod(handle->fd, attr->permissions & 07777)
+                                : chmod(message->filename, attr->permissions & 07777);
+    }
+
+    return bench_server_reply_errno(message, result);
+}
+
+static int32_t
+bench_server_realpath(sftp_client_message message) {
+    struct sftp_attributes_struct attr = {0};
+    char path[PATH_MAX];
+
+    if (realpath(message->filename, path) == NULL) {
+        return bench_server_reply_errno(message, -1);
+    }
+
+    return sftp_reply_name(message, path, &attr);
+}
+
+static int32_t
+bench_server_rename(sftp_client_message message) {
+    char *path_new = ssh_string_to_char(message->data);
+    int32_t result;
+
+    if (path_new == NULL) {
+        return sftp_reply_status(message, SSH_FX_BAD_MESSAGE, NULL);
+    }
+
+    result = rename(message->filename, path_new);
+    ssh_string_free_char(path_new);
+
+    return bench_server_reply_errno(message, result);
+}
+
+/** Answer a request, every request is answered before the next one is read. */
+static void
+bench_server_handle(sftp_session sftp, sftp_client_message message, uint8_t *buf) {
+    BenchHandleT *handle = NULL;
+
+    if (message->handle != NULL) {
+        handle = sftp_handle(sftp, message->handle);
+        if (handle == NULL) {
+            sftp_reply_status(message, SSH_FX_INVALID_HANDLE, NULL);
+            return;
+        }
+    }
+
+    switch (message->type) {
+        case SSH_FXP_OPEN:
+            bench_server_open(sftp, message);
+            break;
+        case SSH_FXP_CLOSE:
+            if (handle->dir != NULL) {
+                closedir(handle->dir);
+            } else {
+                close(handle->fd);
+            }
+            sftp_handle_remove(sftp, handle);
+            DBG_SAFE_FREE(handle);
+            sftp_reply_status(message, SSH_FX_OK, NULL);
+            break;
+        case SSH_FXP_READ:
+            bench_server_read(handle, message, buf);
+            break;
+        case SSH_FXP_WRITE:
+            bench_server_write(handle, message);
+            break;
+        case SSH_FXP_OPENDIR:
+            bench_server_opendir(sftp, message);
+            break;
+        case SSH_FXP_READDIR:
+            bench_server_readdir(handle, message);
+            break;
+        case SSH_FXP_STAT:
+        case SSH_FXP_LSTAT:
+        case SSH_FXP_FSTAT:
+            bench_server_stat(handle, message);
+            break;
+        case SSH_FXP_SETSTAT:
+        case SSH_FXP_FSETSTAT:
+            bench_server_setstat(handle, message);
+            break;
+        case SSH_FXP_MKDIR:
+            bench_server_reply_errno(
+                message,
+                mkdir(message->filename,
+                      message->attr != NULL ? message->attr->permissions & 07777 : 0755));
+            break;
+        case SSH_FXP_RMDIR:
+            bench_server_reply_errno(message, rmdir(message->filename));
+            break;
+        case SSH_FXP_REMOVE:
+            bench_server_reply_errno(message, unlink(message->filename));
+            break;
+        case SSH_FXP_REALPATH:
+            bench_server_realpath(message);
+            break;
+        case SSH_FXP_RENAME:
+            bench_server_rename(message);
+            break;
+        default:
+            sftp_reply_status(message, SSH_FX_OP_UNSUPPORTED, NULL);
+    }
+}
+
+/** Serve the SFTP subsystem of a channel until the client closes it. */
+static void
+bench_server_sftp(ssh_session session, ssh_channel channel) {
+    sftp_session sftp = sftp_server_new(session, channel);
+    sftp_client_message message;
+    uint8_t *buf;
+
+    if (sftp == NULL || sftp_server_init(sftp)) {
+        DBG_ERR("Couldn't start the SFTP server: %s", ssh_get_error(session));
+        return;
+    }
+
+    buf = DBG_MALLOC(BENCH_SERVER_MAX_READ);
+    while ((message = sftp_get_client_message(sftp)) != NULL) {
+        bench_server_handle(sftp, message, buf);
+        sftp_client_message_free(message);
+    }
+
+    DBG_SAFE_FREE(buf);
+    sftp_server_free(sftp);
+}
+
+/**
+ * Authenticate a client with the password and wait for its SFTP channel, one per
+ * connection like the client opens.
+ *
+ * :return: The channel once its ``sftp`` subsystem was requested, ``NULL`` if the
+ *     client went away first.
+ */
+static ssh_channel
+bench_server_accept_sftp(BenchServerT *self, ssh_session session) {
+    ssh_channel channel = NULL;
+    ssh_message message;
+    bool is_sftp = false;
+    const char *password;
+
+    while (!is_sftp && (message = ssh_message_get(session)) != NULL) {
+        switch (ssh_message_type(message)) {
+            case SSH_REQUEST_AUTH:
+                password = ssh_message_auth_password(message);
+                if (ssh_message_subtype(message) == SSH_AUTH_METHOD_PASSWORD &&
+                    password != NULL && !strcmp(password, self->password)) {
+                    ssh_message_auth_reply_success(message, 0);
+                } else {
+                    ssh_message_auth_set_methods(message, SSH_AUTH_METHOD_PASSWORD);
+                    ssh_message_reply_default(message);
+                }
+                break;
+            case SSH_REQUEST_CHANNEL_OPEN:
+                if (ssh_message_subtype(message) == SSH_CHANNEL_SESSION &&
+                    channel == NULL) {
+                    channel = ssh_message_channel_request_open_reply_accept(message);
+                } else {
+                    ssh_message_reply_default(message);
+                }
+                break;
+            case SSH_REQUEST_CHANNEL:
+                if (ssh_message_subtype(message) == SSH_CHANNEL_REQUEST_SUBSYSTEM &&
+                    !strcmp(ssh_message_channel_request_subsystem(message), "sftp")) {
+                    ssh_message_channel_request_reply_success(message);
+                    is_sftp = true;
+                } else {
+                    ssh_message_reply_default(message);
+                }
+                break;
+            default:
+                ssh_message_reply_default(message);
+        }
+        ssh_message_free(message);
+    }
+
+    return is_sftp ? channel : NULL;
+}
+
+static void *
+bench_server_connection(void *arg) {
+    BenchConnT *conn = arg;
+    BenchServerT *self = conn->server;
+    ssh_channel channel;
+
+    if (ssh_handle_key_exchange(conn->session) != SSH_OK) {
+        DBG_ERR("Key exchange failed: %s", ssh_get_error(conn->session));
+    } else if ((channel = bench_server_accept_sftp(self, conn->session)) != NULL) {
+        bench_server_sftp(conn->session, channel);
+    }
+
+    ssh_disconnect(conn->session);
+    ssh_free(conn->session);
+    DBG_SAFE_FREE(conn);
+
+    pthread_mutex_lock(&self->lock);
+    self->num_connections--;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+
+    return NULL;
+}
+
+/** Accept connections until the server stops, each is served on a thread of its
+ * own. */
+static void *
+bench_server_accept(void *arg) {
+    BenchServerT *self = arg;
+    BenchConnT *conn;
+    pthread_t thread;
+    int32_t fd;
+
+    for (;;) {
+        fd = accept(self->fd_listen, NULL, NULL);
+        pthread_mutex_lock(&self->lock);
+        if (self->is_stopping) {
+            pthread_mutex_unlock(&self->lock);
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        pthread_mutex_unlock(&self->lock);
+        if (fd < 0) {
+            continue;
+        }
+
+        conn = DBG_CALLOC(1, sizeof *conn);
+        conn->server = self;
+        conn->session = ssh_new();
+        if (conn->session == NULL ||
+            ssh_bind_accept_fd(self->bind, conn->session, fd) != SSH_OK) {
+            DBG_ERR("Couldn't accept a connection: %s", ssh_get_error(self->bind));
+            if (conn->session != NULL) {
+                ssh_free(conn->session);
+            }
+            close(fd);
+            DBG_SAFE_FREE(conn);
+            continue;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        self->num_connections++;
+        pthread_mutex_unlock(&self->lock);
+        if (pthread_create(&thread, NULL, bench_server_connection, conn)) {
+            bench_server_connection(conn);
+        } else {
+            pthread_detach(thread);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Start a server on an ephemeral port of 127.0.0.1, with a host key generated for
+ * the run. Clients authenticate with ``password`` and get the whole local
+ * filesystem, with the rights of this process.
+ *
+ * :return: The server, ``NULL`` if it couldn't start.
+ */
+BenchServerT *
+BenchServer_start(const char *password) {
+    BenchServerT *self = DBG_CALLOC(1, sizeof *self);
+    struct sockaddr_in address = {.sin_family = AF_INET,
+                                  .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len_address = sizeof address;
+    ssh_key key = NULL;
+
+    ssh_init();
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    self->password = strdup(password);
+
+    /* The bind only does the handshakes, accepting is done on our own socket */
+    self->fd_listen = socket(AF_INET, SOCK_STREAM, 0);
+    if (self->fd_listen < 0 ||
+        bind(self->fd_listen, (struct sockaddr *)&address, sizeof address) ||
+        listen(self->fd_listen, 16) ||
+        getsockname(self->fd_listen, (struct sockaddr *)&address, &len_address)) {
+        DBG_ERR("Couldn't listen on the loopback: %s", strerror(errno));
+        goto fail;
+    }
+    self->port = ntohs(address.sin_port);
+
+    self->bind = ssh_bind_new();
+    if (self->bind == NULL || ssh_pki_generate(SSH_KEYTYPE_ED25519, 0, &key) ||
+        ssh_bind_options_set(self->bind, SSH_BIND_OPTIONS_IMPORT_KEY, key)) {
+        DBG_ERR("Couldn't set up the host key %s", "");
+        ssh_key_free(key);
+        goto fail;
+    }
+
+    if (pthread_create(&self->thread_accept, NULL, bench_server_accept, self)) {
+        goto fail;
+    }
+
+    return self;
+
+fail:
+    if (self->bind != NULL) {
+        ssh_bind_free(self->bind);
+    }
+    if (self->fd_listen >= 0) {
+        close(self->fd_listen);
+    }
+    free(self->password);
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+    DBG_SAFE_FREE(self);
+    ssh_finalize();
+
+    return NULL;
+}
+
+uint32_t
+BenchServer_port(BenchServerT *self) {
+    return self->port;
+}
+
+/** Stop accepting connections and wait for the connections still served. */
+void
+BenchServer_stop(BenchServerT *self) {
+    pthread_mutex_lock(&self->lock);
+    self->is_stopping = true;
+    pthread_mutex_unlock(&self->lock);
+
+    /* Wakes the accepting thread up */
+    shutdown(self->fd_listen, SHUT_RDWR);
+    pthread_join(self->thread_accept, NULL);
+    close(self->fd_listen);
+
+    pthread_mutex_lock(&self->lock);
+    while (self->num_connections) {
+        pthread_cond_wait(&self->cond, &self->lock);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    ssh_bind_free(self->bind);
+    free(self->password);
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+    DBG_SAFE_FREE(self);
+    ssh_finalize();
+}
@@ -0,0 +1,19 @@
+#ifndef SFTP_BENCH_SERVER_H
+#define SFTP_BENCH_SERVER_H
+
+#include <stdint.h>
+
+/** Most bytes a READ is answered with */
+#define BENCH_SERVER_MAX_READ (64 * 1024)
+
+/** Entries returned by a READDIR */
+#define BENCH_SERVER_READDIR_BATCH 100
+
+/** An SFTP server on a loopback port, serving the local filesystem */
+typedef struct BenchServerS BenchServerT;
+
+BenchServerT *BenchServer_start(const char *password);
+uint32_t BenchServer_port(BenchServerT *self);
+void BenchServer_stop(BenchServerT *self);
+
+#endif /* SFTP_BENCH_SERVER_H */
@@ -0,0 +1,461 @@
+/**
+ * Microbenchmarks of the functions run once per entry of every traversal, run with
+ * ``make microbench``.
+ *
+ * Each case is warmed up, then timed over repetitions of a batch sized to take
+ * ``MICRO_BATCH_MS``. It reports the median and fastest ns/op and the allocations
+ * made per op through the ``DBG_*`` macros, which unlike times are exact and catch a
+ * regression on any machine.
+ */
+
+#include <argp.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "seft_ansi_colors.h"
+#include "seft_debug.h"
+#include "seft_list.h"
+#include "seft_path.h"
+#include "seft_utils.h"
+
+/** Time each case runs before it's measured */
+#define MICRO_WARMUP_MS 50
+
+/** Time each repetition takes, more ops per batch for faster cases */
+#define MICRO_BATCH_MS 20
+
+#define MICRO_DEFAULT_REPETITIONS 9
+#define MAX_MICRO_REPETITIONS 101
+
+/** Width the listings are formatted for */
+#define MICRO_SCREEN_WIDTH 120
+
+#define BUF_SIZE_MICRO_NAME 64
+#define BUF_SIZE_MICRO_LINE 512
+
+const char *argp_program_version = "seft-microbench 0.1";
+
+static char doc_microbench[] =
+    "Measure the per-entry cost of the path, list and formatting functions";
+
+static struct argp_option option_microbench[] = {
+    {"filter", 'f', "TEXT", 0, "Only run the cases whose name contains TEXT", 0},
+    {"repetitions", 'r', "N", 0, "Timed batches per case", 0},
+    {"json", 'j', "FILE", 0, "Write the results as JSON to FILE", 0},
+    {"baseline", 'b', "FILE", 0, "Compare against the JSON results of an earlier run", 0},
+    {"tolerance", 't', "PCT", 0, "Slowdown beyond which a case has regressed", 0},
+    {0},
+};
+
+typedef struct {
+    const char *filter;
+    size_t num_repetitions;
+    const char *path_json;
+    const char *path_baseline;
+    double tolerance;
+} MicroArgsT;
+
+/** Inputs of a case, built once before it runs */
+typedef struct {
+    size_t param;
+
+    /** Components of a path ``param`` deep, and that path */
+    char (*names)[BUF_SIZE_MICRO_NAME];
+    char path[BUF_SIZE_FS_PATH];
+    char buf[BUF_SIZE_FS_PATH];
+
+    /** Listing of ``param`` entries, colored like ``list`` does */
+    ListT *entries;
+
+    /** ``stdout`` while it's sent to /dev/null */
+    int32_t fd_stdout;
+} MicroStateT;
+
+typedef struct {
+    const char *name;
+
+    /** Path depth or list length the case runs with */
+    size_t param;
+
+    /** Whether ``run`` does an op per entry of ``param`` rather than a single one */
+    bool is_per_entry;
+    void (*setup)(MicroStateT *state);
+    void (*run)(MicroStateT *state);
+    void (*teardown)(MicroStateT *state);
+} MicroCaseT;
+
+/** Outcome of a case */
+typedef struct {
+    char name[BUF_SIZE_MICRO_NAME];
+    double ns_median;
+    double ns_min;
+    double allocs;
+    double bytes;
+} MicroResultT;
+
+static error_t
+parse_option_microbench(int32_t key, char *arg, struct argp_state *state) {
+    MicroArgsT *args = state->input;
+
+    switch (key) {
+        case 'f':
+            args->filter = arg;
+            break;
+        case 'r':
+            args->num_repetitions =
+                MAX(1, MIN(strtoull(arg, NULL, 10), MAX_MICRO_REPETITIONS));
+            break;
+        case 'j':
+            args->path_json = arg;
+            break;
+        case 'b':
+            args->path_baseline = arg;
+            break;
+        case 't':
+            args->tolerance = strtod(arg, NULL);
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+static double
+micro_now_ns(void) {
+    return get_time_monotonic() * 1e9;
+}
+
+/** Keep the compiler from optimizing away a result nobody reads. */
+static void
+micro_use(void *ptr) {
+    __asm__ volatile("" : : "g"(ptr) : "memory");
+}
+
+static void
+micro_setup_path(MicroStateT *state) {
+    size_t length = 0;
+
+    state->names = DBG_CALLOC(state->param, sizeof *state->names);
+    for (size_t i = 0; i < state->param; i++) {
+        snprintf(state->names[i], sizeof *state->names, "dir_%02zu", i);
+        length += snprintf(state->path + length, sizeof state->path - length, "/%s",
+                           state->names[i]);
+    }
+}
+
+static void
+micro_teardown_path(MicroStateT *state) {
+    DBG_SAFE_FREE(state->names);
+}
+
+static void
+micro_setup_list(MicroStateT *state) {
+    char entry[BUF_SIZE_MICRO_NAME];
+
+    state->entries = List_new(1, sizeof(char *));
+    for (size_t i = 0; i < state->param; i++) {
+        snprintf(entry, sizeof entry, COLOR_FILE ICON_FILE " file_%06zu.txt" ANSI_RESET,
+                 i);
+        List_push(state->entries, entry, strlen(entry) + 1);
+    }
+}
+
+static void
+micro_free_list(ListT *list) {
+    for (size_t i = 0; i < List_length(list); i++) {
+        DBG_SAFE_FREE(List_get(list, i));
+    }
+    List_free(list);
+}
+
+static void
+micro_teardown_list(MicroStateT *state) {
+    micro_free_list(state->entries);
+}
+
+/** A path built a component at a time, as the walkers do for every entry */
+static void
+micro_run_path_join(MicroStateT *state) {
+    state->buf[0] = '\0';
+    for (size_t i = 0; i < state->param; i++) {
+        path_join(state->buf, 1, state->names[i]);
+    }
+    micro_use(state->buf);
+}
+
+static void
+micro_run_path_split(MicroStateT *state) {
+    ListT *components = path_split(state->path, strlen(state->path));
+
+    micro_use(components);
+    micro_free_list(components);
+}
+
+/** Includes copying the path back, ``path_replace`` works in place */
+static void
+micro_run_path_replace(MicroStateT *state) {
+    strcpy(state->buf, state->path);
+    path_replace(state->buf, state->names[0], "replaced_head", 1);
+    micro_use(state->buf);
+}
+
+/** The ``./`` removal of ``path_remove_prefix``, with the copy back */
+static void
+micro_run_path_shift_left(MicroStateT *state) {
+    strcpy(state->buf, state->path);
+    path_str_shift_left(state->buf, 2);
+    micro_use(state->buf);
+}
+
+static void
+micro_run_list_push(MicroStateT *state) {
+    ListT *list = List_new(0, sizeof(char *));
+
+    for (size_t i = 0; i < state->param; i++) {
+        List_push(list, state->names[i % 8], sizeof *state->names);
+    }
+    micro_use(list);
+    micro_free_list(list);
+}
+
+static void
+micro_setup_list_push(MicroStateT *state) {
+    size_t param = state->param;
+
+    state->param = 8;
+    micro_setup_path(state);
+    state->param = param;
+}
+
+/** Formatting prints, to /dev/null while the case runs */
+static void
+micro_setup_format(MicroStateT *state) {
+    int32_t fd_null = open("/dev/null", O_WRONLY);
+
+    micro_setup_list(state);
+    fflush(stdout);
+    state->fd_stdout = dup(STDOUT_FILENO);
+    dup2(fd_null, STDOUT_FILENO);
+    close(fd_null);
+}
+
+static void
+micro_teardown_format(MicroStateT *state) {
+    fflush(stdout);
+    dup2(state->fd_stdout, STDOUT_FILENO);
+    close(state->fd_stdout);
+    micro_teardown_list(state);
+}
+
+static void
+micro_run_format(MicroStateT *state) {
+    char_list_format_columnwise(state->entries, MICRO_SCREEN_WIDTH, "    ");
+}
+
+#define MICRO_PATH_CASES(name, run)                                                   \
+    {name, 1, false, micro_setup_path, run, micro_teardown_path},                     \
+        {name, 4, false, micro_setup_path, run, micro_teardown_path},                 \
+        {name, 16, false, micro_setup_path, run, micro_teardown_path},                \
+        {name, 64, false, micro_setup_path, run, micro_teardown_path}
+
+/** Paths as deep as trees usually get and somewhat deeper, listings from a handful
+ * of entries to a large directory. Formatting is quadratic, so its lists stay
+ * smaller. */
+static const MicroCaseT micro_cases[] = {
+    MICRO_PATH_CASES("path_join", micro_run_path_join),
+    MICRO_PATH_CASES("path_split", micro_run_path_split),
+    MICRO_PATH_CASES("path_replace", micro_run_path_replace),
+    MICRO_PATH_CASES("path_str_shift_left", micro_run_path_shift_left),
+    {"List_push", 16, true, micro_setup_list_push, micro_run_list_push,
+     micro_teardown_path},
+    {"List_push", 1024, true, micro_setup_list_push, micro_run_list_push,
+     micro_teardown_path},
+    {"List_push", 65536, true, micro_setup_list_push, micro_run_list_push,
+     micro_teardown_path},
+    {"char_list_format_columnwise", 16, false, micro_setup_format, micro_run_format,
+     micro_teardown_format},
+    {"char_list_format_columnwise", 128, false, micro_setup_format, micro_run_format,
+     micro_teardown_format},
+    {"char_list_format_columnwise", 512, false, micro_setup_format, micro_run_format,
+     micro_teardown_format},
+};
+
+#define NUM_MICRO_CASES (sizeof micro_cases / sizeof *micro_cases)
+
+static int
+micro_compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/** Warm a case up, size its batch, then time its repetitions. */
+static void
+micro_run_case(const MicroCaseT *micro_case, size_t num_repetitions,
+               MicroResultT *result) {
+    MicroStateT state = {.param = micro_case->param};
+    double ns_ops[MAX_MICRO_REPETITIONS], start, elapsed;
+    size_t num_runs = 0, num_batch, ops_per_run;
+    DbgAllocCountersT before;
+
+    ops_per_run = micro_case->is_per_entry ? micro_case->param : 1;
+    micro_case->setup(&state);
+
+    start = micro_now_ns();
+    do {
+        micro_case->run(&state);
+        num_runs++;
+    } while ((elapsed = micro_now_ns() - start) < MICRO_WARMUP_MS * 1e6);
+    num_batch = MAX(1, MICRO_BATCH_MS * 1e6 * num_runs / elapsed);
+
+    before = dbg_alloc_counters;
+    for (size_t r = 0; r < num_repetitions; r++) {
+        start = micro_now_ns();
+        for (size_t i = 0; i < num_batch; i++) {
+            micro_case->run(&state);
+        }
+        ns_ops[r] = (micro_now_ns() - start) / (num_batch * ops_per_run);
+    }
+    num_runs = num_repetitions * num_batch * ops_per_run;
+    result->allocs =
+        (double)(dbg_alloc_counters.num_allocs - before.num_allocs) / num_runs;
+    result->bytes = (double)(dbg_alloc_counters.num_bytes - before.num_bytes) / num_runs;
+
+    micro_case->teardown(&state);
+
+    qsort(ns_ops, num_repetitions, sizeof *ns_ops, micro_compare_double);
+    result->ns_median = ns_ops[num_repetitions / 2];
+    result->ns_min = ns_ops[0];
+}
+
+static void
+micro_write_json(const char *path_json, const MicroResultT *results,
+                 size_t num_results) {
+    FILE *file = fopen(path_json, "w");
+
+    if (file == NULL) {
+        DBG_ERR("Couldn't write %s: %s", path_json, strerror(errno));
+        return;
+    }
+
+    fprintf(file, "{\"cases\": [\n");
+    for (size_t i = 0; i < num_results; i++) {
+        fprintf(file,
+                "  {\"name\": \"%s\", \"ns_op\": %.2f, \"ns_op_min\": %.2f, "
+                "\"allocs_op\": %.3f, \"bytes_op\": %.1f}%s\n",
+                results[i].name, results[i].ns_median, results[i].ns_min,
+                results[i].allocs, results[i].bytes, i + 1 < num_results ? "," : "");
+    }
+    fprintf(file, "]}\n");
+    fclose(file);
+}
+
+/** Value of ``"key": <number>`` in a line of the JSON results, negative if absent. */
+static double
+micro_json_number(const char *line, const char *key) {
+    char pattern[64];
+    const char *found;
+
+    snprintf(pattern, sizeof pattern, "\"%s\": ", key);
+    found = strstr(line, pattern);
+
+    return found != NULL ? strtod(found + strlen(pattern), NULL) : -1;
+}
+
+/**
+ * Compare with the results of an earlier run. A case regressed when its median got
+ * slower than ``tolerance`` percent or when it allocates more per op, allocations
+ * don't depend on the machine.
+ *
+ * :return: Whether a case regressed.
+ */
+static bool
+micro_compare(const char *path_baseline, double tolerance, const MicroResultT *results,
+              size_t num_results) {
+    FILE *file = fopen(path_baseline, "r");
+    char line[BUF_SIZE_MICRO_LINE], pattern[BUF_SIZE_MICRO_NAME + 16];
+    double ns_before, allocs_before, change;
+    bool is_slower, has_regressed = false;
+
+    if (file == NULL) {
+        DBG_ERR("Couldn't read the baseline %s: %s", path_baseline, strerror(errno));
+        return true;
+    }
+
+    printf("\n%-36s %12s %12s %9s %14s\n", "vs baseline", "ns/op before", "ns/op now",
+           "change", "allocs/op");
+    while (fgets(line, sizeof line, file) != NULL) {
+        for (size_t i = 0; i < num_results; i++) {
+            snprintf(pattern, sizeof pattern, "\"name\": \"%s\"", results[i].name);
+            if (strstr(line, pattern) == NULL) {
+                continue;
+            }
+
+            ns_before = micro_json_number(line, "ns_op");
+            allocs_before = micro_json_number(line, "allocs_op");
+            if (ns_before <= 0) {
+                break;
+            }
+
+            change = 100 * (results[i].ns_median - ns_before) / ns_before;
+            is_slower = change > tolerance || results[i].allocs > allocs_before + 1e-3;
+            printf("%-36s %12.1f %12.1f %+8.1f%% %6.2f -> %6.2f%s\n", results[i].name,
+                   ns_before, results[i].ns_median, change, allocs_before,
+                   results[i].allocs, is_slower ? "  REGRESSION" : "");
+            has_regressed |= is_slower;
+            break;
+        }
+    }
+
+    fclose(file);
+    return has_regressed;
+}
+
+int
+main(int argc, char **argv) {
+    MicroArgsT args = {.num_repetitions = MICRO_DEFAULT_REPETITIONS, .tolerance = 10};
+    struct argp arg_parser = {option_microbench, parse_option_microbench, 0,
+                              doc_microbench,    0,                       0,
+                              0};
+    MicroResultT results[NUM_MICRO_CASES] = {0};
+    size_t num_results = 0;
+    bool has_regressed = false;
+
+    argp_parse(&arg_parser, argc, argv, 0, 0, &args);
+
+    printf("%-36s %12s %12s %10s %10s\n", "case", "ns/op", "min ns/op", "allocs/op",
+           "bytes/op");
+    for (size_t i = 0; i < NUM_MICRO_CASES; i++) {
+        snprintf(results[num_results].name, sizeof results[num_results].name,
+                 "%s/%zu", micro_cases[i].name, micro_cases[i].param);
+        if (args.filter != NULL &&
+            strstr(results[num_results].name, args.filter) == NULL) {
+            continue;
+        }
+
+        micro_run_case(&micro_cases[i], args.num_repetitions, &results[num_results]);
+        printf("%-36s %12.1f %12.1f %10.2f %10.1f\n", results[num_results].name,
+               results[num_results].ns_median, results[num_results].ns_min,
+               results[num_results].allocs, results[num_results].bytes);
+        fflush(stdout);
+        num_results++;
+    }
+
+    if (args.path_json != NULL) {
+        micro_write_json(args.path_json, results, num_results);
+    }
+    if (args.path_baseline != NULL) {
+        has_regressed = micro_compare(args.path_baseline, args.tolerance, results,
+                                      num_results);
+    }
+
+    return has_regressed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
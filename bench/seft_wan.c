@@ -0,0 +1,479 @@
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "seft_debug.h"
+#include "seft_utils.h"
+#include "seft_wan.h"
+
+/** Bytes read from one end, on their way to the other */
+typedef struct WanChunkS {
+    struct WanChunkS *next;
+
+    /** When the chunk has crossed the link and can be written out */
+    uint64_t time_release_ns;
+
+    /** 0 for the end of the stream */
+    size_t length;
+    uint8_t data[];
+} WanChunkT;
+
+typedef struct WanConnS WanConnT;
+
+/** One direction of a connection, read by a thread and written by another */
+typedef struct {
+    WanConnT *conn;
+    int32_t fd_from;
+    int32_t fd_to;
+
+    /** Chunks in the order they were read, which is also the order of release */
+    WanChunkT *head;
+    WanChunkT *tail;
+    size_t num_queued;
+
+    /** When the link is done serializing the chunks queued so far */
+    uint64_t time_link_free_ns;
+    uint64_t time_last_release_ns;
+    uint64_t seed;
+
+    /** Set once the receiving end failed, nothing more is read */
+    bool is_closed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} WanPipeT;
+
+struct WanConnS {
+    WanProxyT *proxy;
+    int32_t fd_client;
+    int32_t fd_server;
+    WanPipeT pipes[2];
+
+    /** Threads of both pipes not done yet, the last one frees the connection */
+    size_t num_threads;
+    WanConnT *next;
+    WanConnT *prev;
+};
+
+struct WanProxyS {
+    WanConfigT config;
+    struct sockaddr_storage address_target;
+    socklen_t len_address_target;
+    int32_t fd_listen;
+    uint32_t port;
+    pthread_t thread_accept;
+
+    /** Connections being forwarded, ``WanProxy_stop`` cuts them and waits */
+    WanConnT *conns;
+    bool is_stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static uint64_t
+wan_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/** Uniform draw in [0, 1) from a xorshift generator. */
+static double
+wan_draw(uint64_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+
+    return (*seed >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+/**
+ * When a chunk of ``length`` bytes read now comes out of the link: after the bytes
+ * queued before it are serialized at the link's rate, the one-way delay and its
+ * jitter, and a retransmission timeout if it's lost. TCP delivers in order, so it
+ * never comes out before the chunk read before it and a loss holds back everything
+ * behind it, as it would on a real link.
+ */
+static uint64_t
+wan_schedule(WanPipeT *pipe, const WanConfigT *config, size_t length) {
+    uint64_t now = wan_now_ns(), release, rto_ms;
+
+    pipe->time_link_free_ns = MAX(pipe->time_link_free_ns, now);
+    if (config->rate) {
+        pipe->time_link_free_ns += length * UINT64_C(1000000000) / config->rate;
+    }
+
+    release = pipe->time_link_free_ns + config->delay_ms * UINT64_C(1000000) +
+              wan_draw(&pipe->seed) * config->jitter_ms * 1e6;
+    if (config->loss > 0 && wan_draw(&pipe->seed) < config->loss) {
+        rto_ms = MAX(WAN_MIN_RTO_MS, 2 * config->delay_ms + 4 * config->jitter_ms);
+        release += rto_ms * UINT64_C(1000000);
+    }
+
+    pipe->time_last_release_ns = MAX(release, pipe->time_last_release_ns);
+    return pipe->time_last_release_ns;
+}
+
+/** Free a connection once the threads of both its directions are done. */
+static void
+wan_conn_release(WanConnT *conn) {
+    WanProxyT *proxy = conn->proxy;
+    WanChunkT *chunk;
+    bool is_last;
+
+    pthread_mutex_lock(&proxy->lock);
+    is_last = !--conn->num_threads;
+    if (is_last) {
+        if (conn->prev != NULL) {
+            conn->prev->next = conn->next;
+        } else {
+            proxy->conns = conn->next;
+        }
+        if (conn->next != NULL) {
+            conn->next->prev = conn->prev;
+        }
+        pthread_cond_broadcast(&proxy->cond);
+    }
+    pthread_mutex_unlock(&proxy->lock);
+
+    if (!is_last) {
+        return;
+    }
+
+    close(conn->fd_client);
+    close(conn->fd_server);
+    for (size_t i = 0; i < 2; i++) {
+        while ((chunk = conn->pipes[i].head) != NULL) {
+            conn->pipes[i].head = chunk->next;
+            DBG_SAFE_FREE(chunk);
+        }
+        pthread_cond_destroy(&conn->pipes[i].cond);
+        pthread_mutex_destroy(&conn->pipes[i].lock);
+    }
+    DBG_SAFE_FREE(conn);
+}
+
+/** Read from the sending end and queue what was read with its release time. */
+static void *
+wan_pipe_read(void *arg) {
+    WanPipeT *pipe = arg;
+    const WanConfigT *config = &pipe->conn->proxy->config;
+    WanChunkT *chunk;
+    ssize_t num_bytes;
+
+    for (;;) {
+        pthread_mutex_lock(&pipe->lock);
+        while (!pipe->is_closed && pipe->num_queued >= WAN_MAX_QUEUED) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+        }
+        if (pipe->is_closed) {
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        chunk = DBG_MALLOC(sizeof *chunk + WAN_CHUNK_SIZE);
+        num_bytes = recv(pipe->fd_from, chunk->data, WAN_CHUNK_SIZE, 0);
+        if (num_bytes < 0 && errno == EINTR) {
+            DBG_SAFE_FREE(chunk);
+            continue;
+        }
+        chunk->next = NULL;
+        chunk->length = num_bytes > 0 ? num_bytes : 0;
+
+        pthread_mutex_lock(&pipe->lock);
+        chunk->time_release_ns = wan_schedule(pipe, config, chunk->length);
+        if (pipe->tail != NULL) {
+            pipe->tail->next = chunk;
+        } else {
+            pipe->head = chunk;
+        }
+        pipe->tail = chunk;
+        pipe->num_queued += chunk->length;
+        pthread_cond_broadcast(&pipe->cond);
+        pthread_mutex_unlock(&pipe->lock);
+
+        /* The chunk may already be written out and freed */
+        if (num_bytes <= 0) {
+            break;
+        }
+    }
+
+    wan_conn_release(pipe->conn);
+    return NULL;
+}
+
+static bool
+wan_send_all(int32_t fd, const uint8_t *data, size_t length) {
+    ssize_t num_bytes;
+
+    while (length) {
+        num_bytes = send(fd, data, length, MSG_NOSIGNAL);
+        if (num_bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (num_bytes <= 0) {
+            return false;
+        }
+        data += num_bytes;
+        length -= num_bytes;
+    }
+
+    return true;
+}
+
+/** Write the queued chunks out to the receiving end as they're released. */
+static void *
+wan_pipe_write(void *arg) {
+    WanPipeT *pipe = arg;
+    WanChunkT *chunk;
+    struct timespec deadline;
+    bool is_sent;
+
+    pthread_mutex_lock(&pipe->lock);
+    for (;;) {
+        if (pipe->head == NULL) {
+            pthread_cond_wait(&pipe->cond, &pipe->lock);
+            continue;
+        }
+
+        chunk = pipe->head;
+        if (wan_now_ns() < chunk->time_release_ns) {
+            deadline = (struct timespec){chunk->time_release_ns / 1000000000,
+                                         chunk->time_release_ns % 1000000000};
+            pthread_cond_timedwait(&pipe->cond, &pipe->lock, &deadline);
+            continue;
+        }
+
+        pipe->head = chunk->next;
+        if (pipe->head == NULL) {
+            pipe->tail = NULL;
+        }
+        pthread_mutex_unlock(&pipe->lock);
+
+        if (!chunk->length) {
+            /* The sender is done, pass its end of stream on */
+            shutdown(pipe->fd_to, SHUT_WR);
+            DBG_SAFE_FREE(chunk);
+            break;
+        }
+
+        is_sent = wan_send_all(pipe->fd_to, chunk->data, chunk->length);
+
+        pthread_mutex_lock(&pipe->lock);
+        pipe->num_queued -= chunk->length;
+        DBG_SAFE_FREE(chunk);
+        if (!is_sent) {
+            /* Wakes the reader up, it stops at the closed pipe */
+            pipe->is_closed = true;
+            shutdown(pipe->fd_from, SHUT_RD);
+            pthread_cond_broadcast(&pipe->cond);
+            pthread_mutex_unlock(&pipe->lock);
+            break;
+        }
+        pthread_cond_broadcast(&pipe->cond);
+    }
+
+    wan_conn_release(pipe->conn);
+    return NULL;
+}
+
+static void
+wan_pipe_init(WanPipeT *pipe, WanConnT *conn, int32_t fd_from, int32_t fd_to,
+              uint64_t seed) {
+    pthread_condattr_t attr;
+
+    *pipe = (WanPipeT){.conn = conn, .fd_from = fd_from, .fd_to = fd_to, .seed = seed};
+    pthread_mutex_init(&pipe->lock, NULL);
+
+    /* Release times are on the monotonic clock */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pipe->cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/** Connect to the target and start forwarding between it and ``fd_client``. */
+static void
+wan_conn_start(WanProxyT *self, int32_t fd_client, uint64_t seed) {
+    void *(*routines[4])(void *) = {wan_pipe_read, wan_pipe_write, wan_pipe_read,
+                                    wan_pipe_write};
+    WanConnT *conn;
+    pthread_t thread;
+    int32_t fd_server, flag = 1;
+
+    fd_server = socket(self->address_target.ss_family, SOCK_STREAM, 0);
+    if (fd_server < 0 || connect(fd_server, (struct sockaddr *)&self->address_target,
+                                 self->len_address_target)) {
+        DBG_ERR("Couldn't connect to the target: %s", strerror(errno));
+        if (fd_server >= 0) {
+            close(fd_server);
+        }
+        close(fd_client);
+        return;
+    }
+
+    /* The link's delays are the only ones wanted, Nagle would add its own */
+    setsockopt(fd_client, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+    setsockopt(fd_server, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof flag);
+
+    conn = DBG_CALLOC(1, sizeof *conn);
+    conn->proxy = self;
+    conn->fd_client = fd_client;
+    conn->fd_server = fd_server;
+    conn->num_threads = 4;
+    wan_pipe_init(&conn->pipes[0], conn, fd_client, fd_server, seed);
+    wan_pipe_init(&conn->pipes[1], conn, fd_server, fd_client, ~seed);
+
+    pthread_mutex_lock(&self->lock);
+    conn->next = self->conns;
+    if (self->conns != NULL) {
+        self->conns->prev = conn;
+    }
+    self->conns = conn;
+    pthread_mutex_unlock(&self->lock);
+
+    for (size_t i = 0; i < 4; i++) {
+        if (pthread_create(&thread, NULL, routines[i], &conn->pipes[i / 2])) {
+            /* Without all four threads the connection can't be forwarded, the
+             * missing ones are released here and the others see it shut down */
+            shutdown(fd_client, SHUT_RDWR);
+            shutdown(fd_server, SHUT_RDWR);
+            for (size_t j = i; j < 4; j++) {
+                wan_conn_release(conn);
+            }
+            return;
+        }
+        pthread_detach(thread);
+    }
+}
+
+static void *
+wan_accept(void *arg) {
+    WanProxyT *self = arg;
+    uint64_t seed = self->config.seed;
+    int32_t fd;
+
+    for (;;) {
+        fd = accept(self->fd_listen, NULL, NULL);
+        pthread_mutex_lock(&self->lock);
+        if (self->is_stopping) {
+            pthread_mutex_unlock(&self->lock);
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        pthread_mutex_unlock(&self->lock);
+
+        if (fd >= 0) {
+            /* Every connection draws its own jitter and losses, reproducibly */
+            wan_conn_start(self, fd, seed++ * 0x9e3779b97f4a7c15u | 1);
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Forward the connections to 127.0.0.1:``port_listen`` (an ephemeral port for 0) to
+ * ``host_target`` through a link emulated in user space, no netem or root needed.
+ *
+ * :return: The proxy, ``NULL`` if the target can't be resolved or the port is taken.
+ */
+WanProxyT *
+WanProxy_start(const char *host_target, uint32_t port_target, uint32_t port_listen,
+               const WanConfigT *config) {
+    WanProxyT *self = DBG_CALLOC(1, sizeof *self);
+    struct sockaddr_in address = {.sin_family = AF_INET,
+                                  .sin_port = htons(port_listen),
+                                  .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len_address = sizeof address;
+    struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *info = NULL;
+    char service[16];
+    int32_t flag = 1;
+
+    self->fd_listen = -1;
+    self->config = *config;
+    self->config.seed = config->seed ? config->seed : 1;
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->cond, NULL);
+
+    snprintf(service, sizeof service, "%u", port_target);
+    if (getaddrinfo(host_target, service, &hints, &info) || info == NULL) {
+        DBG_ERR("Couldn't resolve %s", host_target);
+        goto fail;
+    }
+    memcpy(&self->address_target, info->ai_addr, info->ai_addrlen);
+    self->len_address_target = info->ai_addrlen;
+    freeaddrinfo(info);
+
+    self->fd_listen = socket(AF_INET, SOCK_STREAM, 0);
+    if (self->fd_listen >= 0) {
+        setsockopt(self->fd_listen, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof flag);
+    }
+    if (self->fd_listen < 0 ||
+        bind(self->fd_listen, (struct sockaddr *)&address, sizeof address) ||
+        listen(self->fd_listen, 16) ||
+        getsockname(self->fd_listen, (struct sockaddr *)&address, &len_address)) {
+        DBG_ERR("Couldn't listen on the loopback: %s", strerror(errno));
+        goto fail;
+    }
+    self->port = ntohs(address.sin_port);
+
+    if (pthread_create(&self->thread_accept, NULL, wan_accept, self)) {
+        goto fail;
+    }
+
+    return self;
+
+fail:
+    if (self->fd_listen >= 0) {
+        close(self->fd_listen);
+    }
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+    DBG_SAFE_FREE(self);
+
+    return NULL;
+}
+
+uint32_t
+WanProxy_port(WanProxyT *self) {
+    return self->port;
+}
+
+/** Stop accepting connections, cut the ones still forwarded and wait for them. */
+void
+WanProxy_stop(WanProxyT *self) {
+    pthread_mutex_lock(&self->lock);
+    self->is_stopping = true;
+    pthread_mutex_unlock(&self->lock);
+
+    shutdown(self->fd_listen, SHUT_RDWR);
+    pthread_join(self->thread_accept, NULL);
+    close(self->fd_listen);
+
+    pthread_mutex_lock(&self->lock);
+    for (WanConnT *conn = self->conns; conn != NULL; conn = conn->next) {
+        shutdown(conn->fd_client, SHUT_RDWR);
+        shutdown(conn->fd_server, SHUT_RDWR);
+    }
+    while (self->conns != NULL) {
+        pthread_cond_wait(&self->cond, &self->lock);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+    DBG_SAFE_FREE(self);
+}
@@ -0,0 +1,41 @@
+#ifndef SFTP_WAN_H
+#define SFTP_WAN_H
+
+#include <stdint.h>
+
+/** Most bytes read from a socket at once, the unit delays and losses apply to */
+#define WAN_CHUNK_SIZE (16 * 1024)
+
+/** Bytes a direction holds in flight before it stops reading from its sender */
+#define WAN_MAX_QUEUED (64 * 1024 * 1024)
+
+/** Least time a lost segment takes to be retransmitted, as Linux' minimum RTO */
+#define WAN_MIN_RTO_MS 200
+
+/** Link between the two ends of a ``WanProxyT``, the same both ways */
+typedef struct {
+    /** One-way delay, half the round trip time */
+    uint32_t delay_ms;
+
+    /** Most extra delay, drawn uniformly for every chunk */
+    uint32_t jitter_ms;
+
+    /** Bytes per second of each direction, 0 for no limit */
+    uint64_t rate;
+
+    /** Fraction of chunks lost and retransmitted, from 0 to 1 */
+    double loss;
+
+    /** Seed of the jitter and loss draws, the same seed gives the same link */
+    uint64_t seed;
+} WanConfigT;
+
+/** A TCP proxy on a loopback port, forwarding to a target through an emulated link */
+typedef struct WanProxyS WanProxyT;
+
+WanProxyT *WanProxy_start(const char *host_target, uint32_t port_target,
+                          uint32_t port_listen, const WanConfigT *config);
+uint32_t WanProxy_port(WanProxyT *self);
+void WanProxy_stop(WanProxyT *self);
+
+#endif /* SFTP_WAN_H */
@@ -0,0 +1,131 @@
+/**
+ * Loopback TCP proxy emulating a WAN link, to benchmark against a local SSH server
+ * at the round trip times of real links:
+ *
+ *     seft-wan --to localhost:22 --delay 50 --rate 10M &
+ *     seft connect --subsystem <subsystem> --port <port printed>
+ */
+
+#include <argp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "seft_debug.h"
+#include "seft_limit.h"
+#include "seft_wan.h"
+
+#define BUF_SIZE_WAN_HOST 256
+
+const char *argp_program_version = "seft-wan 0.1";
+
+static char doc_wan[] =
+    "Forward a loopback port to HOST:PORT through an emulated link, until interrupted";
+
+static struct argp_option option_wan[] = {
+    {"to", 'T', "HOST:PORT", 0, "Where connections are forwarded to", 0},
+    {"port", 'p', "PORT", 0, "Loopback port to listen on, an ephemeral one by default",
+     0},
+    {"delay", 'd', "MS", 0, "One-way delay, half the round trip time", 0},
+    {"jitter", 'j', "MS", 0, "Most extra delay, drawn for every chunk", 0},
+    {"rate", 'r', "RATE", 0, "Bandwidth of each direction, e.g. 10M (bytes/s)", 0},
+    {"loss", 'l', "PCT", 0, "Percentage of chunks lost and retransmitted", 0},
+    {"seed", 's', "N", 0, "Seed of the jitter and losses", 0},
+    {0},
+};
+
+typedef struct {
+    char host[BUF_SIZE_WAN_HOST];
+    uint32_t port_target;
+    uint32_t port_listen;
+    WanConfigT config;
+} WanArgsT;
+
+static error_t
+parse_option_wan(int32_t key, char *arg, struct argp_state *state) {
+    WanArgsT *args = state->input;
+    char *colon;
+
+    switch (key) {
+        case 'T':
+            colon = strrchr(arg, ':');
+            if (colon == NULL) {
+                argp_error(state, "--to takes HOST:PORT");
+                return EINVAL;
+            }
+            snprintf(args->host, sizeof args->host, "%.*s", (int)(colon - arg), arg);
+            args->port_target = strtoul(colon + 1, NULL, 10);
+            break;
+        case 'p':
+            args->port_listen = strtoul(arg, NULL, 10);
+            break;
+        case 'd':
+            args->config.delay_ms = strtoul(arg, NULL, 10);
+            break;
+        case 'j':
+            args->config.jitter_ms = strtoul(arg, NULL, 10);
+            break;
+        case 'r':
+            if (!limit_rate_parse(arg, &args->config.rate)) {
+                argp_error(state, "Invalid rate: %s", arg);
+                return EINVAL;
+            }
+            break;
+        case 'l':
+            args->config.loss = strtod(arg, NULL) / 100;
+            break;
+        case 's':
+            args->config.seed = strtoull(arg, NULL, 10);
+            break;
+        case ARGP_KEY_END:
+            if (!args->port_target) {
+                argp_error(state, "--to is required");
+                return EINVAL;
+            }
+            break;
+        default:
+            return ARGP_ERR_UNKNOWN;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char **argv) {
+    WanArgsT args = {0};
+    struct argp arg_parser = {option_wan, parse_option_wan, 0, doc_wan, 0, 0, 0};
+    WanProxyT *proxy;
+    sigset_t signals;
+    int32_t signal_caught;
+
+    argp_parse(&arg_parser, argc, argv, 0, 0, &args);
+
+    /* Blocked before the proxy's threads start, so they inherit the mask and the
+     * signals are left to sigwait */
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    proxy = WanProxy_start(args.host, args.port_target, args.port_listen, &args.config);
+    if (proxy == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    printf("Forwarding 127.0.0.1:%u to %s:%u, %u ms +%u ms one way, ",
+           WanProxy_port(proxy), args.host, args.port_target, args.config.delay_ms,
+           args.config.jitter_ms);
+    if (args.config.rate) {
+        printf("%.2f MiB/s, ", args.config.rate / (1024.0 * 1024.0));
+    }
+    printf("%.2f%% loss\n", args.config.loss * 100);
+    fflush(stdout);
+
+    sigwait(&signals, &signal_caught);
+    WanProxy_stop(proxy);
+
+    return EXIT_SUCCESS;
+}
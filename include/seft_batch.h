@@ -0,0 +1,65 @@
+#ifndef SFTP_BATCH_H
+#define SFTP_BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_commands.h"
+
+/** Maximum length of a line of a batch script */
+#define BUF_SIZE_BATCH_LINE 4096
+
+/** Maximum number of arguments of a batch command */
+#define MAX_BATCH_ARGS 128
+
+/** Number of commands of a batch running at once unless told otherwise */
+#define BATCH_DEFAULT_JOBS 4
+
+/** Upper bound of commands of a batch running at once */
+#define MAX_BATCH_JOBS 64
+
+/** How far past the oldest unfinished command workers look for one to start */
+#define BATCH_LOOKAHEAD 256
+
+/** Callbacks a batch uses to run its commands */
+typedef struct {
+    /** Runs a command, on a worker thread for concurrent commands */
+    CommandStatusE (*dispatch)(char **arg_vec, uint32_t length);
+
+    /**
+     * Describes what a command writes to. Commands writing to overlapping paths run
+     * in the order of the script.
+     *
+     * :return: A ``local:<path>`` or ``remote:<path>`` string allocated with
+     *     ``DBG_MALLOC``, an empty one for commands that don't write, ``NULL`` for
+     *     commands that have to run alone, like ``connect``.
+     */
+    char *(*target)(char **arg_vec, uint32_t length);
+
+    /**
+     * Describes what a command reads. A command reading where an earlier unfinished
+     * command writes waits for it, and so does a command writing where an earlier
+     * one reads.
+     *
+     * :return: A string like those of ``target``, an empty string for commands that
+     *     don't read, ``NULL`` for commands that have to run alone.
+     */
+    char *(*source)(char **arg_vec, uint32_t length);
+
+    /**
+     * Gets the sessions workers open their channels on.
+     *
+     * :return: false if commands can't run on worker threads, e.g. while attached to
+     *     a master, they then run one after another.
+     */
+    bool (*sessions)(ssh_session *session_ssh, sftp_session *session_sftp);
+} BatchHooksT;
+
+CommandStatusE batch_run(FILE *script, size_t num_jobs, BatchHooksT *hooks);
+
+#endif /* SFTP_BATCH_H */
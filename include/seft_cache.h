@@ -0,0 +1,25 @@
+#ifndef SFTP_CACHE_H
+#define SFTP_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "seft_loop.h"
+
+/** Seconds a remote listing or stat is answered from memory without ``--cache-ttl`` */
+#define CACHE_DEFAULT_TTL 30
+
+/** Paths remembered at once, the expired ones are dropped when it's reached and
+ * everything if none is */
+#define CACHE_MAX_ENTRIES 8192
+
+void cache_set_ttl(uint32_t ttl_s);
+bool cache_get_stat(const char *path, LoopAttrT *attr);
+void cache_put_stat(const char *path, const LoopAttrT *attr);
+bool cache_get_listing(const char *path, LoopNameT **names, uint32_t *num_names);
+void cache_put_listing(const char *path, const LoopNameT *names, uint32_t num_names);
+void cache_free_names(LoopNameT *names, uint32_t num_names);
+void cache_invalidate(const char *path);
+void cache_clear(void);
+
+#endif /* SFTP_CACHE_H */
@@ -0,0 +1,78 @@
+#ifndef SFTP_CHECKSUM_H
+#define SFTP_CHECKSUM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "seft_commands.h"
+#include "seft_loop.h"
+
+/** Largest digest of the supported algorithms, SHA-256's */
+#define CHECKSUM_MAX_DIGEST_SIZE 32
+
+/** Bytes hashed at once by SHA-256 */
+#define CHECKSUM_SHA256_BLOCK_SIZE 64
+
+/** Room for the output of the remote ``sha256sum``, the digest comes first */
+#define BUF_SIZE_CHECKSUM_OUTPUT 256
+
+/** Algorithms a copy can be verified with */
+typedef enum {
+    /** Copies aren't verified */
+    CHECKSUM_NONE = 0,
+
+    /** Verified with the ``check-file`` extension or ``sha256sum`` on the server */
+    CHECKSUM_SHA256,
+
+    /** Verified with the ``check-file`` extension only, cheaper to compute */
+    CHECKSUM_CRC32,
+} ChecksumAlgoE;
+
+/** Chunk that arrived ahead of the bytes before it */
+typedef struct {
+    uint64_t offset;
+    uint8_t *data;
+    size_t length;
+} ChecksumChunkT;
+
+/**
+ * Digest of a file computed while it's copied. Chunks may be fed in any order and
+ * more than once, they're hashed once and in order of their offset.
+ */
+typedef struct {
+    ChecksumAlgoE algo;
+
+    union {
+        struct {
+            uint32_t state[8];
+            uint8_t block[CHECKSUM_SHA256_BLOCK_SIZE];
+            size_t len_block;
+        } sha256;
+        uint32_t crc32;
+    } hash;
+
+    /** Bytes hashed so far, chunks starting past it wait in ``chunks`` */
+    uint64_t offset;
+
+    ChecksumChunkT *chunks;
+    size_t num_chunks;
+    size_t chunks_allocated;
+} ChecksumT;
+
+void Checksum_init(ChecksumT *self, ChecksumAlgoE algo);
+void Checksum_feed(ChecksumT *self, uint64_t offset, const uint8_t *data, size_t length);
+void Checksum_feed_zeros(ChecksumT *self, uint64_t offset, uint64_t length);
+size_t Checksum_final(ChecksumT *self, uint8_t *digest);
+void Checksum_free(ChecksumT *self);
+
+ChecksumAlgoE checksum_algo_parse(const char *name);
+const char *checksum_algo_str(ChecksumAlgoE algo);
+void checksum_bind_thread(ChecksumAlgoE algo);
+ChecksumAlgoE checksum_current(void);
+void checksum_to_hex(const uint8_t *digest, size_t length, char *hex);
+bool checksum_from_hex(const char *hex, uint8_t *digest, size_t length);
+CommandStatusE checksum_verify(SftpLoopT *loop, const char *path_remote,
+                               ChecksumT *checksum);
+
+#endif /* SFTP_CHECKSUM_H */
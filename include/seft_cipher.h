@@ -0,0 +1,48 @@
+#ifndef SFTP_CIPHER_H
+#define SFTP_CIPHER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "seft_client.h"
+#include "seft_commands.h"
+
+/** Default amount of data pushed through each cipher while benchmarking */
+#define CIPHER_BENCH_DEFAULT_MIB 32
+
+/** Name of the file in the cache directory holding per host cipher orders */
+#define CIPHER_CACHE_FILE_NAME "ciphers"
+
+/** Result of benchmarking a single cipher/MAC pair */
+typedef struct {
+    /** Cipher used in both directions */
+    const char *cipher;
+
+    /** MAC used in both directions, ``NULL`` for AEAD ciphers which don't need one */
+    const char *hmac;
+
+    /** Whether the server agreed to use this pair */
+    bool is_negotiated;
+
+    /** Key exchange algorithm picked by the server */
+    char kex[BUF_SIZE_FS_NAME];
+
+    /** Time taken by connect, key exchange and authentication in milliseconds */
+    double handshake_ms;
+
+    /** Measured throughput in MiB/s */
+    double throughput;
+} CipherBenchT;
+
+size_t cipher_bench_run(ConnectOptionsT *options, size_t num_bytes,
+                        CipherBenchT **results);
+void cipher_bench_print(CipherBenchT *results, size_t num_results);
+void cipher_bench_order(CipherBenchT *results, size_t num_results, char **ciphers,
+                        char **hmacs);
+CommandStatusE cipher_cache_load(char *host_name, uint32_t port_id, char **ciphers,
+                                 char **hmacs);
+CommandStatusE cipher_cache_store(char *host_name, uint32_t port_id, char *ciphers,
+                                  char *hmacs);
+CommandStatusE cipher_select_auto(ConnectOptionsT *options);
+
+#endif /* SFTP_CIPHER_H */
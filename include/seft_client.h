@@ -7,6 +7,8 @@
 #include <libssh/libssh.h>
 
 #include "seft_commands.h"
+#include "seft_loop.h"
+#include "seft_path.h"
 
 
 #define FLAG_LIST_BIT_POS_ALL 0x0
@@ -21,18 +23,91 @@
 
 #define FLAG_LIST_BIT_POS_SORT_REVERSE 0x5
 
+#define FLAG_LIST_BIT_POS_INDEX 0x6
+
+/** Seconds without an answer before a keepalive is sent unless told otherwise */
+#define CONNECT_DEFAULT_KEEPALIVE 15
+
+/** Seconds without an answer before the peer counts as dead unless told otherwise */
+#define CONNECT_DEFAULT_DEAD_TIMEOUT 60
+
+/** Attempts at connecting again once the connection is found dead */
+#define RECONNECT_MAX_ATTEMPTS 3
+
+/** Seconds before the second attempt, doubled for every further one */
+#define RECONNECT_BACKOFF_S 1
+
+/** Times a copy picks up again after its connection was lost */
+#define TRANSFER_MAX_RESUMES 3
+
+/** Blocks of zeros this large are left as holes in downloaded files */
+#define TRANSFER_HOLE_BLOCK_SIZE 4096
+
+/** SSH transport compression modes */
+typedef enum {
+    /** Never compress */
+    COMPRESSION_NO = 0,
+
+    /** Compress everything */
+    COMPRESSION_YES,
+
+    /** Decide per file by sampling its contents, see ``seft_compress.h`` */
+    COMPRESSION_AUTO,
+} CompressionModeE;
+
+/** Parameters used to establish an ssh session, kept around so that more sessions
+ * to the same host can be opened without asking the user again. */
+typedef struct {
+    /** Host name to connect to */
+    char *host_name;
+
+    /** Port number to connect to */
+    uint32_t port_id;
+
+    /** Comma separated list of preferred ciphers, ``NULL`` for libssh defaults */
+    char *ciphers;
+
+    /** Comma separated list of preferred MACs, ``NULL`` for libssh defaults */
+    char *hmacs;
+
+    /** Whether the transport is compressed, ``COMPRESSION_AUTO`` sessions are opened
+     * uncompressed and get a compressed sibling session on demand */
+    CompressionModeE compression;
+
+    /** Seconds without an answer before a keepalive is sent, 0 to never send one */
+    uint32_t keepalive_interval;
+
+    /** Seconds without an answer before the peer counts as dead and the session is
+     * reconnected, 0 to wait forever */
+    uint32_t dead_timeout;
+
+    /** Passphrase of the first successful authentication, empty until then */
+    char passphrase[BUF_SIZE_PASSPHRASE];
+} ConnectOptionsT;
+
 /** SSH FUNCTIONS */
 ssh_session do_ssh_init(char *host_name, uint32_t port_id);
+ssh_session do_ssh_init_options(ConnectOptionsT *options);
+ssh_session try_ssh_init(ConnectOptionsT *options);
+CommandStatusE try_ssh_reconnect(ssh_session session, ConnectOptionsT *options);
+void clean_connect_options(ConnectOptionsT *options);
 void clean_ssh_session(ssh_session session);
 void clean_sftp_session(sftp_session session);
 
 sftp_session do_sftp_init(ssh_session session_ssh);
 CommandStatusE list_remote_dir(ssh_session session_ssh, sftp_session session_sftp,
                                char *directory, uint8_t flag);
+void list_print_names(LoopNameT *names, uint32_t num_names, uint8_t flag);
 CommandStatusE create_remote_file(ssh_session session_ssh, sftp_session session_sftp,
                                   char *abs_file_path);
 CommandStatusE create_remote_dir(ssh_session session_ssh, sftp_session session_sftp,
                                  char *abs_dir_path);
+CommandStatusE copy_file_from_remote_to_local(ssh_session session_ssh,
+                                              sftp_session session_sftp,
+                                              char *abs_path_remote, char *abs_path_local);
+CommandStatusE copy_file_from_local_to_remote(ssh_session session_ssh,
+                                              sftp_session session_sftp,
+                                              char *abs_path_local, char *abs_path_remote);
 CommandStatusE copy_from_remote_to_local(ssh_session session_ssh,
                                          sftp_session session_sftp, char *abs_path_remote,
                                          char *abs_path_local);
@@ -0,0 +1,30 @@
+#ifndef SFTP_COMPRESS_H
+#define SFTP_COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_client.h"
+
+/** Number of bytes from the start of a file used to decide whether it compresses */
+#define COMPRESS_SAMPLE_SIZE (4 * BUF_SIZE_FILE_CONTENTS)
+
+/** Files with less bits of entropy per byte than this go through the compressed
+ * session. Text and logs sit around 4-5, compressed archives and media close to 8. */
+#define COMPRESS_ENTROPY_THRESHOLD 7.0
+
+/** Files smaller than this are never worth routing to another session */
+#define COMPRESS_MIN_FILE_SIZE 4096
+
+double compress_sample_entropy(const uint8_t *buf, size_t length);
+bool compress_is_compressible(const uint8_t *buf, size_t length);
+void compress_set_mode(ConnectOptionsT *options);
+bool compress_is_routing(void);
+ssh_session compress_route(ssh_session session_ssh, const uint8_t *sample, size_t length);
+void compress_clean(void);
+
+#endif /* SFTP_COMPRESS_H */
@@ -3,6 +3,8 @@
 #ifndef DEBUG_H
 #define DEBUG_H
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #ifdef D
 #define DBG_STATUS 1
@@ -13,28 +15,68 @@
 #include <stdio.h>
 
 #include "seft_ansi_colors.h"
-
-enum DBG_LEVELS {
-    DBG_LEVEL_DEBUG,
-    DBG_LEVEL_INFO,
-    DBG_LEVEL_CRITICAL,
-};
-
-static size_t allocated = 0;
-
-/** Simple logger macro
+#include "seft_log.h"
+
+/** ``make ALLOC_PROF=1`` records every allocation of the ``DBG_*`` macros by call
+ * site and prints a report at exit. Without it, or debug logs, or the per-thread
+ * counters, the macros are plain ``malloc`` and ``free``. */
+#ifndef SEFT_ALLOC_PROF
+#define SEFT_ALLOC_PROF 0
+#endif
+
+/** Only the per-thread counters, for the microbench */
+#ifndef SEFT_ALLOC_COUNT
+#define SEFT_ALLOC_COUNT SEFT_ALLOC_PROF
+#endif
+
+#define DBG_ALLOC_IS_ON (SEFT_ALLOC_PROF || SEFT_ALLOC_COUNT || DBG_STATUS)
+
+/** Sites listed in each table of the report */
+#define DBG_PROF_TOP_SITES 20
+
+/** Allocations made through the ``DBG_*`` macros by the calling thread, e.g. to count
+ * the allocations of an operation as the difference before and after it */
+typedef struct {
+    size_t num_allocs;
+    size_t num_bytes;
+} DbgAllocCountersT;
+
+extern __thread DbgAllocCountersT dbg_alloc_counters;
+
+/** A call of a ``DBG_*`` allocator macro, one static instance per call */
+typedef struct DbgAllocSiteS {
+    const char *file;
+    int line;
+    const char *func;
+
+    /** Next site in the list of the report, sites join it on their first call */
+    struct DbgAllocSiteS *next;
+    atomic_bool is_listed;
+
+    atomic_uint_fast64_t num_allocs;
+    atomic_uint_fast64_t num_bytes;
+    atomic_uint_fast64_t num_live;
+    atomic_uint_fast64_t live_bytes;
+} DbgAllocSiteT;
+
+void dbg_prof_alloc(DbgAllocSiteT *site, void *ptr, size_t size);
+void dbg_prof_free(void *ptr);
+void dbg_prof_report(FILE *file, size_t num_top);
+
+/** Simple logger macro, the message is formatted by the calling thread and written
+ * by the writer thread of ``seft_log.c``, errors before the call returns. Debug and
+ * info messages are logged if the level of the subsystem allows them: ``SEFT_LOG``
+ * and the ``log`` command set it, builds with ``D`` start at debug.
  *
  * .. note:: Currently requires you to pass in variadic args to it
  * */
-#define LOG(level, file, line, func, prompt, ...)                                        \
-    do {                                                                                 \
-        if (level == DBG_LEVEL_CRITICAL) {                                               \
-            fprintf(stderr, "[%s]::" prompt "\n", dbg_level_to_str(level), __VA_ARGS__); \
-        }                                                                                \
-        else if (DBG_STATUS) {                                                                \
-            fprintf(stderr, "[%s]:%s:%d:%s: " prompt "\n", dbg_level_to_str(level),      \
-                    file, line, func, __VA_ARGS__);                                      \
-        }                                                                                \
+#define LOG(level, file, line, func, prompt, ...)                                   \
+    do {                                                                            \
+        /* Not designated, ``file`` is a parameter */                               \
+        static LogSiteT log_site = {__FILE__, -1, 0, 0, 0};                         \
+        if (log_is_enabled(&log_site, level)) {                                     \
+            log_write(&log_site, level, file, line, func, prompt, __VA_ARGS__);     \
+        }                                                                           \
     } while (0)
 
 #define DBG_ERR(prompt, ...) \
@@ -44,78 +86,81 @@ static size_t allocated = 0;
 #define DBG_DEBUG(prompt, ...) \
     LOG(DBG_LEVEL_DEBUG, __FILE__, __LINE__, __func__, prompt, __VA_ARGS__)
 
-#define DBG_MALLOC(size) dbg_malloc(size, __FILE__, __LINE__, __func__)
+#if DBG_ALLOC_IS_ON
+
+/* A statement expression gives every call its own static site */
+#define DBG_ALLOC_AT_SITE(call)                                                         \
+    __extension__({                                                                     \
+        static DbgAllocSiteT dbg_site = {                                               \
+            .file = __FILE__, .line = __LINE__, .func = __func__};                      \
+        call;                                                                          \
+    })
+
+#define DBG_MALLOC(size) DBG_ALLOC_AT_SITE(dbg_malloc(size, &dbg_site))
 #define DBG_CALLOC(num_bytes, type_size) \
-    dbg_calloc(num_bytes, type_size, __FILE__, __LINE__, __func__)
+    DBG_ALLOC_AT_SITE(dbg_calloc(num_bytes, type_size, &dbg_site))
 #define DBG_REALLOC(ptr, new_size) \
-    dbg_realloc(ptr, new_size, __FILE__, __LINE__, __func__)
+    DBG_ALLOC_AT_SITE(dbg_realloc(ptr, new_size, &dbg_site))
 #define DBG_SAFE_FREE(ptr) dbg_safe_free(ptr, __FILE__, __LINE__, __func__)
 
-static inline char*
-dbg_level_to_str(enum DBG_LEVELS level) {
-    switch (level) {
-        case DBG_LEVEL_DEBUG:
-            return ANSI_FG_GREEN "DEBUG" ANSI_RESET;
-        case DBG_LEVEL_INFO:
-            return ANSI_FG_CYAN "INFO" ANSI_RESET;
-        case DBG_LEVEL_CRITICAL:
-            return ANSI_FG_RED "CRITICAL" ANSI_RESET;
+/** Count, profile and log an allocation of ``size`` bytes at ``ptr`` */
+static inline void
+dbg_alloc_done(DbgAllocSiteT* site, void* ptr, size_t size, const char* action) {
+    dbg_alloc_counters.num_allocs++;
+    dbg_alloc_counters.num_bytes += size;
+    if (SEFT_ALLOC_PROF) {
+        dbg_prof_alloc(site, ptr, size);
     }
 
-    return "";
+    LOG(DBG_LEVEL_DEBUG, site->file, site->line, site->func,
+        ANSI_FG_GREEN "%s: " ANSI_RESET ANSI_FG_BLUE "%zu" ANSI_RESET " bytes", action,
+        size);
 }
 
 /** Log the size and *malloc* memory */
 static inline void*
-dbg_malloc(size_t size, char const* file, int line, char const* func) {
+dbg_malloc(size_t size, DbgAllocSiteT* site) {
     void* ptr = malloc(size);
 
     if (ptr == NULL) {
         DBG_ERR("Unable to allocate %zu bytes of memory", size);
         return NULL;
     }
-    allocated += size;
-
-    LOG(DBG_LEVEL_DEBUG, file, line, func,
-        ANSI_FG_GREEN "Allocated: " ANSI_RESET ANSI_FG_BLUE "%zu" ANSI_RESET " bytes",
-        size);
+    dbg_alloc_done(site, ptr, size, "Allocated");
 
     return ptr;
 }
 
 /** Log the size and *calloc* memory */
 static inline void*
-dbg_calloc(size_t num_bytes, size_t type_size, char const* file, int line,
-           char const* func) {
+dbg_calloc(size_t num_bytes, size_t type_size, DbgAllocSiteT* site) {
     void* ptr = calloc(num_bytes, type_size);
 
     if (ptr == NULL) {
         DBG_ERR("Unable to allocate %zu bytes of memory", num_bytes * type_size);
         return NULL;
     }
-    allocated += num_bytes * type_size;
-
-    LOG(DBG_LEVEL_DEBUG, file, line, func,
-        ANSI_FG_GREEN "Allocated: " ANSI_RESET ANSI_FG_BLUE "%zu" ANSI_RESET " bytes",
-        num_bytes * type_size);
+    dbg_alloc_done(site, ptr, num_bytes * type_size, "Allocated");
 
     return ptr;
 }
 
 /** Log the size and *relloc* memory for the pointer */
 static inline void*
-dbg_realloc(void* ptr, size_t new_size, char const* file, int line, char const* func) {
-    void* new_allocated = realloc(ptr, new_size);
+dbg_realloc(void* ptr, size_t new_size, DbgAllocSiteT* site) {
+    void* new_allocated;
+
+    /* Forgotten first, another thread may get the address once it's freed */
+    if (SEFT_ALLOC_PROF && ptr != NULL) {
+        dbg_prof_free(ptr);
+    }
 
+    new_allocated = realloc(ptr, new_size);
     if (new_allocated == NULL) {
         DBG_ERR("Unable to reallocate memory for pointer %p", ptr);
         return NULL;
     }
-    allocated += new_size;
-
-    LOG(DBG_LEVEL_DEBUG, file, line, func,
-        ANSI_FG_GREEN "Reallocated: " ANSI_RESET ANSI_FG_BLUE "%zu" ANSI_RESET " bytes",
-        new_size);
+    dbg_alloc_done(site, new_allocated, new_size, "Reallocated");
 
     return new_allocated;
 }
@@ -128,9 +173,21 @@ dbg_safe_free(void* ptr, char const* file, int line, char const* func) {
         return;
     }
 
+    if (SEFT_ALLOC_PROF) {
+        dbg_prof_free(ptr);
+    }
     free(ptr);
     LOG(DBG_LEVEL_DEBUG, file, line, func,
         ANSI_FG_GREEN "Freed: " ANSI_RESET ANSI_FG_BLUE "%p" ANSI_RESET, ptr);
 }
 
+#else
+
+#define DBG_MALLOC(size) malloc(size)
+#define DBG_CALLOC(num_bytes, type_size) calloc(num_bytes, type_size)
+#define DBG_REALLOC(ptr, new_size) realloc(ptr, new_size)
+#define DBG_SAFE_FREE(ptr) free(ptr)
+
+#endif /* DBG_ALLOC_IS_ON */
+
 #endif /* DEBUG_H */
@@ -0,0 +1,38 @@
+#ifndef SFTP_DEDUP_H
+#define SFTP_DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "seft_commands.h"
+#include "seft_loop.h"
+
+/** Name of the manifest kept in the root directory of deduplicated uploads */
+#define DEDUP_MANIFEST_NAME ".seft-manifest"
+
+/** First line of a manifest, lines after it are ``<sha256> <size> <mtime> <path>`` */
+#define DEDUP_MANIFEST_HEADER "# seft manifest v1"
+
+/** Most threads hashing local files ahead of an upload */
+#define MAX_DEDUP_HASH_THREADS 16
+
+/** Bytes read at once while hashing a local file */
+#define BUF_SIZE_DEDUP_READ (1 << 20)
+
+/** Content hashes of the files uploaded under a remote root, and where they are */
+typedef struct DedupS DedupT;
+
+DedupT *Dedup_open(SftpLoopT *loop, const char *root_remote);
+void Dedup_hash_tree(DedupT *self, const char *path_local, size_t num_threads);
+CommandStatusE Dedup_link(DedupT *self, SftpLoopT *loop, const char *path_local,
+                          const char *path_remote);
+void Dedup_add(DedupT *self, SftpLoopT *loop, const char *path_local,
+               const char *path_remote);
+void Dedup_unlink(DedupT *self, SftpLoopT *loop, const char *path_remote);
+CommandStatusE Dedup_close(DedupT *self, SftpLoopT *loop);
+
+void dedup_bind_thread(DedupT *dedup);
+DedupT *dedup_current(void);
+
+#endif /* SFTP_DEDUP_H */
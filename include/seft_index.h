@@ -0,0 +1,82 @@
+#ifndef SFTP_INDEX_H
+#define SFTP_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "seft_commands.h"
+#include "seft_loop.h"
+
+/** First bytes of an index file, the number is its format version */
+#define INDEX_MAGIC "SEFTIDX1"
+
+/** Directories read at once while building an index */
+#define INDEX_WINDOW 32
+
+/** A directory changed less than this many seconds before the previous build may
+ * have changed again within the same second, it's read again whatever its mtime */
+#define INDEX_RACY_S 2
+
+/**
+ * Layout of an index file, mapped as is:
+ *
+ * - the header,
+ * - the directories, sorted by their path relative to the root (``""`` for the root
+ *   itself), so that a subtree is a contiguous run of them,
+ * - the entries, those of a directory next to each other and sorted by name,
+ * - the strings, NUL terminated and referred to by their offset.
+ *
+ * Integers are in the byte order of the machine that wrote it.
+ */
+typedef struct {
+    char magic[8];
+    uint32_t num_dirs;
+    uint32_t root;
+    uint64_t num_entries;
+    uint64_t offset_dirs;
+    uint64_t offset_entries;
+    uint64_t offset_strings;
+    uint64_t size_strings;
+
+    /** Unix time the build started at */
+    int64_t time_built;
+} IndexHeaderT;
+
+typedef struct {
+    uint32_t path;
+
+    /** 0 if the directory couldn't be read, it's read again by the next refresh */
+    uint32_t mtime;
+    uint64_t first_entry;
+    uint32_t num_entries;
+    uint32_t reserved;
+} IndexDirT;
+
+typedef struct {
+    uint64_t size;
+    uint32_t name;
+    uint32_t mtime;
+    uint32_t permissions;
+
+    /** ``SSH_FILEXFER_TYPE_*`` */
+    uint8_t type;
+    uint8_t reserved[3];
+} IndexEntryT;
+
+typedef struct IndexS IndexT;
+
+IndexT *Index_open(const char *path);
+void Index_close(IndexT *self);
+const char *Index_root(IndexT *self);
+const char *Index_string(IndexT *self, uint32_t offset);
+const IndexDirT *Index_find_dir(IndexT *self, const char *path);
+
+char *index_path_for(const char *host_name, uint32_t port_id, const char *root);
+CommandStatusE index_build(SftpLoopT *loop, const char *host_name, uint32_t port_id,
+                           const char *root, const char *path_index, bool is_refresh);
+CommandStatusE index_list(const char *host_name, uint32_t port_id, const char *dir,
+                          uint8_t flag);
+CommandStatusE index_find(const char *host_name, uint32_t port_id, const char *dir,
+                          const char *pattern, const char *path_index);
+
+#endif /* SFTP_INDEX_H */
@@ -0,0 +1,43 @@
+#ifndef SFTP_JOBS_H
+#define SFTP_JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_commands.h"
+
+/** Maximum number of background jobs alive at the same time */
+#define MAX_JOBS 32
+
+/** Maximum length of the command line remembered for ``jobs`` */
+#define BUF_SIZE_JOB_COMMAND 256
+
+/** How often ``fg`` and ``wait`` check on a job and for an interrupt */
+#define JOB_WAIT_POLL_MS 50
+
+/** Token that sends a command to the background when it ends the line */
+#define JOB_BACKGROUND_TOKEN "&"
+
+typedef struct JobS JobT;
+
+/** Runs the command of a job on the job's thread */
+typedef CommandStatusE (*JobRunT)(char **arg_vec, uint32_t length);
+
+CommandStatusE job_start(ssh_session session_ssh, sftp_session session_sftp,
+                         char **arg_vec, uint32_t length, JobRunT run);
+CommandStatusE job_wait(uint32_t id);
+CommandStatusE job_fg(uint32_t id);
+CommandStatusE job_cancel(uint32_t id);
+void jobs_print(void);
+void jobs_report_finished(void);
+size_t jobs_num_running(void);
+void jobs_clean(void);
+JobT *job_current(void);
+void job_bind_thread(JobT *job);
+bool job_is_cancelled(void);
+
+#endif /* SFTP_JOBS_H */
@@ -0,0 +1,42 @@
+#ifndef SFTP_LIMIT_H
+#define SFTP_LIMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Tokens a stream can save up while it's slower than its share, in ms of the share */
+#define LIMIT_BURST_MS 100
+
+/** A stream that didn't ask for tokens for this long gives its share to the others */
+#define LIMIT_IDLE_MS 250
+
+/** Longest sleep of a throttled transfer, a new limit or a cancel applies this fast */
+#define LIMIT_MAX_WAIT_MS 100
+
+/** Weight of the transfers of a copy started without ``--weight`` */
+#define LIMIT_DEFAULT_WEIGHT 1
+
+/** A transfer taking its share of the bandwidth limit */
+typedef struct LimitStreamS LimitStreamT;
+
+/** Cap on the bytes per second of one copy, shared by the transfers of its files */
+typedef struct LimitCapS LimitCapT;
+
+bool limit_rate_parse(const char *str, uint64_t *rate);
+void limit_set_rate(uint64_t rate);
+uint64_t limit_rate(void);
+void limit_print(void);
+void limit_bind_thread(uint32_t weight);
+uint32_t limit_current_weight(void);
+void limit_bind_cap(LimitCapT *cap);
+LimitCapT *limit_current_cap(void);
+
+LimitCapT *LimitCap_new(uint64_t rate);
+void LimitCap_free(LimitCapT *self);
+
+LimitStreamT *LimitStream_new(uint32_t weight, LimitCapT *cap);
+void LimitStream_free(LimitStreamT *self);
+bool LimitStream_take(LimitStreamT *self, uint32_t length, uint32_t *wait_ms);
+
+#endif /* SFTP_LIMIT_H */
@@ -0,0 +1,74 @@
+#ifndef SFTP_LOG_H
+#define SFTP_LOG_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+enum DBG_LEVELS {
+    DBG_LEVEL_DEBUG,
+    DBG_LEVEL_INFO,
+    DBG_LEVEL_CRITICAL,
+};
+
+/** Subsystems get a level of their own, they are named after the file of the call
+ * (``src/seft_loop.c`` logs as ``loop``) */
+#define LOG_MAX_SUBSYSTEMS 64
+#define LOG_SUBSYSTEM_NAME_SIZE 32
+
+/** Messages a thread can have waiting for the writer thread, more are dropped */
+#define LOG_RING_SIZE 256
+
+/** Longer messages are cut */
+#define LOG_MESSAGE_SIZE 256
+
+/** Messages a call can log per second, those past it are counted and reported with
+ * the next one that goes through. Errors are never held back. */
+#define LOG_RATE_LIMIT 20
+
+/** Milliseconds between two drains of the rings by the writer thread */
+#define LOG_DRAIN_INTERVAL_MS 50
+
+/** A ``LOG`` call, one static instance per call */
+typedef struct {
+    /** File of the call, naming its subsystem */
+    const char *file;
+
+    /** Index of the subsystem in ``log_levels``, -1 until the first call */
+    atomic_int subsystem;
+
+    /** Second of the monotonic clock the messages of ``num_in_window`` were logged in */
+    atomic_uint_fast64_t window_s;
+    atomic_uint_fast32_t num_in_window;
+    atomic_uint_fast32_t num_suppressed;
+} LogSiteT;
+
+/** Least level logged, by subsystem */
+extern atomic_int log_levels[LOG_MAX_SUBSYSTEMS];
+
+int log_resolve_site(LogSiteT *site);
+void log_write(LogSiteT *site, enum DBG_LEVELS level, const char *file, int line,
+               const char *func, const char *prompt, ...)
+    __attribute__((format(printf, 6, 7)));
+void log_flush(void);
+bool log_configure(const char *spec);
+void log_print_levels(void);
+
+/** Whether ``site`` logs messages of ``level``, a load and a comparison once the
+ * site has its subsystem */
+static inline bool
+log_is_enabled(LogSiteT *site, enum DBG_LEVELS level) {
+    int subsystem = atomic_load_explicit(&site->subsystem, memory_order_relaxed);
+
+    if (level == DBG_LEVEL_CRITICAL) {
+        return true;
+    }
+    if (subsystem < 0) {
+        subsystem = log_resolve_site(site);
+    }
+
+    return (int)level >=
+           atomic_load_explicit(&log_levels[subsystem], memory_order_relaxed);
+}
+
+#endif /* SFTP_LOG_H */
@@ -0,0 +1,196 @@
+#ifndef SFTP_LOOP_H
+#define SFTP_LOOP_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_commands.h"
+#include "seft_list.h"
+
+/** SFTP protocol version spoken by the loop */
+#define LOOP_SFTP_VERSION 3
+
+/** Size of READ and WRITE requests issued by transfers */
+#define LOOP_CHUNK_SIZE 32768
+
+/** Number of READ or WRITE requests a transfer keeps in flight */
+#define LOOP_WINDOW 64
+
+/** Bytes of READ and WRITE requests a loop keeps in flight */
+#define LOOP_BULK_WINDOW (LOOP_WINDOW * LOOP_CHUNK_SIZE)
+
+/** Bulk bytes in flight while interactive requests wait on the same connection */
+#define LOOP_BULK_WINDOW_CONTENDED (8 * LOOP_CHUNK_SIZE)
+
+/** SFTP handles are at most 256 bytes long (draft-ietf-secsh-filexfer-02, 6.2) */
+#define LOOP_MAX_HANDLE_SIZE 256
+
+/** Maximum number of server extensions remembered from the VERSION packet */
+#define LOOP_MAX_EXTENSIONS 32
+
+/** Largest packet accepted from the server, OpenSSH caps its own at 256 KiB */
+#define LOOP_MAX_PACKET_SIZE (256 * 1024 + 1024)
+
+/** Maximum number of connections known to the loop registry */
+#define MAX_LOOP_SESSIONS 8
+
+/** Poll timeout when the connection isn't shared with other threads */
+#define LOOP_POLL_MS 1000
+
+/** Poll timeout when other threads may read our data off the shared socket */
+#define LOOP_SHARED_POLL_MS 10
+
+/** Path probed by the keepalive of an idle connection */
+#define LOOP_KEEPALIVE_PATH "."
+
+/** Operations the loop can run. READ and WRITE are bulk requests, every other
+ * operation is interactive and written ahead of queued bulk requests. */
+typedef enum {
+    LOOP_OP_OPEN,
+    LOOP_OP_CLOSE,
+    LOOP_OP_READ,
+    LOOP_OP_WRITE,
+    LOOP_OP_OPENDIR,
+    LOOP_OP_READDIR,
+    LOOP_OP_STAT,
+    LOOP_OP_SETSTAT,
+    LOOP_OP_MKDIR,
+    LOOP_OP_REMOVE,
+    LOOP_OP_EXTENDED,
+    LOOP_NUM_OPS,
+} LoopOpE;
+
+/** An opaque SFTP file or directory handle */
+typedef struct {
+    uint8_t bytes[LOOP_MAX_HANDLE_SIZE];
+    uint32_t length;
+} LoopHandleT;
+
+/** SFTP v3 file attributes */
+typedef struct {
+    /** ``SSH_FILEXFER_ATTR_*`` bits telling which fields are valid */
+    uint32_t flags;
+
+    uint64_t size;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t permissions;
+    uint32_t atime;
+    uint32_t mtime;
+
+    /** ``SSH_FILEXFER_TYPE_*`` derived from ``permissions`` */
+    uint8_t type;
+} LoopAttrT;
+
+/** A directory entry returned by READDIR */
+typedef struct {
+    char *name;
+
+    /** ``ls -l`` style line of the entry, the only place v3 servers put the owner */
+    char *longname;
+
+    LoopAttrT attr;
+} LoopNameT;
+
+/** Outcome of an operation, valid only during the completion callback */
+typedef struct {
+    /** Id the operation was submitted with */
+    uint32_t id;
+
+    LoopOpE op;
+
+    /** ``SSH_FX_*`` status, ``SSH_FX_OK`` if the operation succeeded */
+    uint32_t status;
+
+    /** Offset and length the READ or WRITE was submitted with */
+    uint64_t offset;
+    uint32_t length;
+
+    /** Handle returned by OPEN and OPENDIR */
+    LoopHandleT handle;
+
+    /** Data returned by READ and by EXTENDED requests with a reply */
+    const uint8_t *data;
+    uint32_t len_data;
+
+    /** Attributes returned by STAT */
+    LoopAttrT attr;
+
+    /** Entries returned by READDIR */
+    LoopNameT *names;
+    uint32_t num_names;
+} LoopResultT;
+
+typedef struct SftpLoopS SftpLoopT;
+
+/** Called once an operation completes, it may submit more operations */
+typedef void (*LoopCallbackT)(SftpLoopT *loop, LoopResultT *result, void *user_data);
+
+/**
+ * Connects a dead connection of the registry again, called with the connection's
+ * lock held. It has to disconnect ``session_ssh``, which frees every channel on it,
+ * and connect and authenticate the same session object without prompting.
+ *
+ * :return: true if the connection is back.
+ */
+typedef bool (*LoopReconnectT)(ssh_session session_ssh, void *user_data);
+
+/** Told about a request once it completed, ``latency_ns`` after it was submitted */
+typedef void (*LoopObserverT)(LoopOpE op, uint32_t status, uint32_t length,
+                              uint64_t latency_ns, void *user_data);
+
+SftpLoopT *SftpLoop_new(ssh_session session_ssh, pthread_mutex_t *lock);
+void SftpLoop_free(SftpLoopT *self);
+pthread_mutex_t *SftpLoop_session_lock(ssh_session session_ssh);
+SftpLoopT *SftpLoop_for_session(ssh_session session_ssh);
+void SftpLoop_forget_session(ssh_session session_ssh);
+void SftpLoop_set_reconnect(ssh_session session_ssh, LoopReconnectT reconnect,
+                            void *user_data);
+void SftpLoop_set_keepalive(ssh_session session_ssh, uint32_t keepalive_interval,
+                            uint32_t dead_timeout);
+void SftpLoop_set_observer(LoopObserverT observer, void *user_data);
+void SftpLoop_bind_thread(SftpLoopT *self);
+void SftpLoop_set_bulk(SftpLoopT *self, bool is_bulk);
+bool SftpLoop_has_extension(SftpLoopT *self, const char *name);
+bool SftpLoop_is_dead(SftpLoopT *self);
+size_t SftpLoop_num_pending(SftpLoopT *self);
+CommandStatusE SftpLoop_run(SftpLoopT *self);
+
+uint32_t SftpLoop_open(SftpLoopT *self, const char *path, uint32_t pflags,
+                       uint32_t permissions, LoopCallbackT callback, void *user_data);
+uint32_t SftpLoop_close(SftpLoopT *self, LoopHandleT *handle, LoopCallbackT callback,
+                        void *user_data);
+uint32_t SftpLoop_read(SftpLoopT *self, LoopHandleT *handle, uint64_t offset,
+                       uint32_t length, LoopCallbackT callback, void *user_data);
+uint32_t SftpLoop_write(SftpLoopT *self, LoopHandleT *handle, uint64_t offset,
+                        const void *data, uint32_t length, LoopCallbackT callback,
+                        void *user_data);
+uint32_t SftpLoop_opendir(SftpLoopT *self, const char *path, LoopCallbackT callback,
+                          void *user_data);
+uint32_t SftpLoop_readdir(SftpLoopT *self, LoopHandleT *handle, LoopCallbackT callback,
+                          void *user_data);
+uint32_t SftpLoop_stat(SftpLoopT *self, const char *path, LoopCallbackT callback,
+                       void *user_data);
+uint32_t SftpLoop_setstat(SftpLoopT *self, const char *path, LoopAttrT *attr,
+                          LoopCallbackT callback, void *user_data);
+uint32_t SftpLoop_mkdir(SftpLoopT *self, const char *path, uint32_t permissions,
+                        LoopCallbackT callback, void *user_data);
+uint32_t SftpLoop_remove(SftpLoopT *self, const char *path, LoopCallbackT callback,
+                         void *user_data);
+uint32_t SftpLoop_extended(SftpLoopT *self, const char *request, const void *payload,
+                           uint32_t len_payload, LoopCallbackT callback,
+                           void *user_data);
+
+void SftpLoop_store_result(SftpLoopT *self, LoopResultT *result, void *user_data);
+const char *SftpLoop_status_str(uint32_t status);
+const char *SftpLoop_op_str(LoopOpE op);
+ListT *SftpLoop_read_dir(SftpLoopT *self, char *path, uint32_t *status);
+CommandStatusE SftpLoop_exec(SftpLoopT *self, const char *command, char *output,
+                             size_t size, int32_t *exit_status);
+
+#endif /* SFTP_LOOP_H */
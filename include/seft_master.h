@@ -0,0 +1,41 @@
+#ifndef SFTP_MASTER_H
+#define SFTP_MASTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "seft_client.h"
+#include "seft_commands.h"
+
+/** Seconds an idle master stays alive without any attached client */
+#define MASTER_DEFAULT_PERSIST 600
+
+/** Maximum number of clients attached to a master at the same time */
+#define MAX_MASTER_CLIENTS 64
+
+/** Maximum size of a single forwarded command line */
+#define BUF_SIZE_MASTER_REQUEST 8192
+
+/** Name of the command handled by the master itself instead of the dispatcher */
+#define MASTER_COMMAND "master"
+
+/** Callbacks the master process uses to run commands on the sessions it holds */
+typedef struct {
+    /** Opens the sessions, called once in the master before it starts serving */
+    void (*open_sessions)(void);
+
+    /** Closes the sessions, called once before the master exits */
+    void (*close_sessions)(void);
+
+    /** Runs a command on the held sessions */
+    CommandStatusE (*dispatch)(char **arg_vec, uint32_t length);
+} MasterHooksT;
+
+CommandStatusE master_socket_path(char *host_name, uint32_t port_id, char *path_buf,
+                                  size_t length);
+int master_attach(char *host_name, uint32_t port_id);
+int master_spawn(ConnectOptionsT *options, uint32_t persist, MasterHooksT *hooks);
+CommandStatusE master_forward(int master_fd, char **arg_vec, uint32_t length);
+void master_detach(int master_fd);
+
+#endif /* SFTP_MASTER_H */
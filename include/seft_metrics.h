@@ -0,0 +1,32 @@
+#ifndef SFTP_METRICS_H
+#define SFTP_METRICS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "seft_commands.h"
+#include "seft_loop.h"
+
+/** Buckets per power of two of a latency histogram, 8 keep its error under 12.5% */
+#define METRICS_SUB_BUCKET_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BUCKET_BITS)
+
+/** Latencies are told apart up to 2^40 ns (18 minutes), longer ones share a bucket */
+#define METRICS_MAX_EXPONENT 40
+
+#define METRICS_NUM_BUCKETS \
+    ((METRICS_MAX_EXPONENT - METRICS_SUB_BUCKET_BITS + 2) * METRICS_SUB_BUCKETS)
+
+/** Seconds between two writes of the metrics file without ``--metrics-interval`` */
+#define METRICS_DEFAULT_INTERVAL 15
+
+void metrics_request_submitted(LoopOpE op);
+void metrics_request_done(LoopOpE op, uint32_t status, uint64_t latency_ns,
+                          uint64_t num_bytes);
+
+void metrics_print(FILE *file);
+CommandStatusE metrics_write_prometheus(const char *path);
+void metrics_start_writer(const char *path, uint32_t interval_s);
+void metrics_stop_writer(void);
+
+#endif /* SFTP_METRICS_H */
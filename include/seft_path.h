@@ -51,6 +51,7 @@ typedef struct {
 } FileSystemT;
 
 char *path_str_slice(const char *path_str, size_t start, size_t stop);
+void path_str_shift_left(char *path_str, size_t num_shifts);
 void path_remove_prefix(char *path_str);
 void path_remove_suffix(char *path_str);
 void path_join(char *path_buf, size_t num_paths, ...);
@@ -61,6 +62,8 @@ ListT *path_split(const char *path_str, size_t length);
 void path_replace_grandparent(char *path_str, char *grandparent);
 void path_replace(char *path_str, char *path_head_to_replace, char *path_head_replacement,
                   size_t max_count);
+char *path_replace_dup(const char *path_str, char *path_head_to_replace,
+                       char *path_head_replacement);
 ListT *path_read_local_dir(char *dir_path);
 ListT *path_read_remote_dir(ssh_session session_ssh, sftp_session session_sftp,
                             char *dir_path);
@@ -68,5 +71,6 @@ void path_buf_clear_copy(char *path_dest, size_t dest_length, char *path_to_copy
                          size_t copy_length);
 void FileSystem_free(FileSystemT *self);
 void FileSystem_list_free(ListT *self);
+void FileSystem_list_push(ListT *self, FileSystemT *fs);
 
 #endif /* ifndef SFTP_PATH_H */
@@ -0,0 +1,73 @@
+#ifndef SFTP_POOL_H
+#define SFTP_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_client.h"
+#include "seft_commands.h"
+#include "seft_loop.h"
+
+/** Maximum number of parallel jobs of a single command */
+#define MAX_POOL_SLOTS 64
+
+/** How parallel jobs reach the server */
+typedef enum {
+    /** Several SFTP channels multiplexed over the already authenticated connection */
+    POOL_MODE_CHANNELS = 0,
+
+    /** One connection per job, each with its own key exchange and authentication */
+    POOL_MODE_CONNECTIONS,
+} PoolModeE;
+
+/** An SFTP channel of the pool */
+typedef struct {
+    /** Connection the channel belongs to */
+    ssh_session session_ssh;
+
+    /** Blocking SFTP session of the connection, not used by transfers */
+    sftp_session session_sftp;
+
+    /** Event loop the worker of the slot runs its requests on */
+    SftpLoopT *loop;
+
+    /** Lock of ``session_ssh``. libssh sessions are not thread safe, so every call on
+     * a connection shared by several channels has to hold it. Slots on an existing
+     * connection use its ``SftpLoop_session_lock``. */
+    pthread_mutex_t *lock;
+
+    /** Whether the pool opened ``session_ssh`` and has to close it */
+    bool is_owner_ssh;
+} PoolSlotT;
+
+/** A set of SFTP channels parallel jobs are scheduled on */
+typedef struct {
+    /** How the slots were opened */
+    PoolModeE mode;
+
+    /** Channels of the pool */
+    PoolSlotT slots[MAX_POOL_SLOTS];
+
+    /** Number of usable channels in ``slots`` */
+    size_t num_slots;
+
+    /** One lock per connection */
+    pthread_mutex_t locks[MAX_POOL_SLOTS];
+} SessionPoolT;
+
+SessionPoolT *SessionPool_new(ConnectOptionsT *options, ssh_session session_ssh,
+                              sftp_session session_sftp, size_t num_slots,
+                              PoolModeE mode);
+void SessionPool_free(SessionPoolT *self);
+void SessionPool_bind_thread(PoolSlotT *slot);
+void session_lock(void);
+void session_unlock(void);
+bool session_is_pooled(void);
+CommandStatusE SessionPool_copy(SessionPoolT *self, char *abs_path_source,
+                                char *abs_path_dest, bool is_remote_source);
+
+#endif /* SFTP_POOL_H */
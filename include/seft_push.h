@@ -0,0 +1,25 @@
+#ifndef SFTP_PUSH_H
+#define SFTP_PUSH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "seft_client.h"
+#include "seft_commands.h"
+#include "seft_loop.h"
+
+/** Chunks read from the local files and not yet sent to every host. The fastest host
+ * runs at most that many chunks ahead of the slowest one. */
+#define PUSH_RING_SLOTS 256
+
+/** Most hosts a single push writes to */
+#define MAX_PUSH_HOSTS 64
+
+/** Port of the hosts whose line of the hosts file names none and when not connected */
+#define PUSH_DEFAULT_PORT 22
+
+CommandStatusE push_run(const ConnectOptionsT *options, const char *path_hosts,
+                        char *path_local, const char *path_remote);
+
+#endif /* SFTP_PUSH_H */
@@ -0,0 +1,20 @@
+#ifndef SFTP_REMOTE_H
+#define SFTP_REMOTE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "seft_commands.h"
+#include "seft_loop.h"
+
+/** Bytes read from the source host and not yet written to the destination host, the
+ * faster host waits for the slower one once that many are held */
+#define REMOTE_STREAM_BUDGET (2 * LOOP_BULK_WINDOW)
+
+uint32_t remote_copy_data(SftpLoopT *loop, const char *path_source,
+                          const char *path_dest);
+CommandStatusE copy_from_remote_to_remote(SftpLoopT *loop_source, SftpLoopT *loop_dest,
+                                          char *path_source, char *path_dest);
+
+#endif /* SFTP_REMOTE_H */
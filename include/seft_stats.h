@@ -0,0 +1,45 @@
+#ifndef SFTP_STATS_H
+#define SFTP_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "seft_commands.h"
+#include "seft_loop.h"
+
+/** Files at least this long get a record of their own in the JSON report */
+#define STATS_MIN_FILE_SIZE (16 * 1024 * 1024)
+
+/** Where the threads of a copy spend the time they don't spend computing */
+typedef enum {
+    /** Waiting for the server's answers, in ``poll`` */
+    STATS_TIME_NETWORK,
+
+    /** Reading and writing local files */
+    STATS_TIME_DISK,
+
+    /** Sleeping for the bandwidth limit */
+    STATS_TIME_THROTTLE,
+
+    STATS_NUM_TIMES,
+} StatsTimeE;
+
+/** Counters of a copy, shared by the threads copying for it */
+typedef struct StatsS StatsT;
+
+StatsT *Stats_new(uint64_t min_file_size);
+void Stats_free(StatsT *self);
+void Stats_print(StatsT *self, FILE *file);
+CommandStatusE Stats_write_json(StatsT *self, const char *path_json);
+
+void stats_bind_thread(StatsT *stats);
+StatsT *stats_current(void);
+uint64_t stats_clock(void);
+void stats_add_time(StatsTimeE kind, uint64_t time_start_ns);
+void stats_count_request(LoopOpE op);
+void stats_count_retry(void);
+void stats_file_done(const char *path, uint64_t size, uint64_t num_bytes,
+                     uint64_t time_start_ns, uint32_t num_resumes, bool is_ok);
+
+#endif /* SFTP_STATS_H */
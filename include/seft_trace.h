@@ -0,0 +1,55 @@
+#ifndef SFTP_TRACE_H
+#define SFTP_TRACE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "seft_commands.h"
+
+/** Built with ``make TRACE=0`` the probes compile to nothing and ``--trace`` fails */
+#ifndef SEFT_TRACE
+#define SEFT_TRACE 1
+#endif
+
+/** Spans a thread records before it takes another block of them */
+#define TRACE_BLOCK_SIZE 4096
+
+/** Spans of the threads of a copy, in the Chrome trace-event format once written */
+typedef struct TraceS TraceT;
+
+TraceT *Trace_new(void);
+CommandStatusE Trace_write(TraceT *self, const char *path_json);
+void Trace_free(TraceT *self);
+
+void trace_bind_thread(TraceT *trace);
+TraceT *trace_current(void);
+uint64_t trace_clock(void);
+void trace_span(const char *name, const void *session, uint64_t time_start_ns,
+                uint64_t value, uint32_t status);
+
+#if SEFT_TRACE
+
+/** Declare ``start`` and read the clock into it, if the thread is tracing */
+#define TRACE_START(start) uint64_t start = trace_clock()
+
+/** Record a local filesystem call, ``value`` is the bytes it moved or the entries it
+ * listed */
+#define TRACE_FS(name, start, value) trace_span(name, NULL, start, value, 0)
+
+/** Record an SFTP request on ``session`` from its submission on */
+#define TRACE_SFTP(name, session, start, length, status) \
+    trace_span(name, session, start, length, status)
+
+#define TRACE_IS_ON() (trace_current() != NULL)
+
+#else
+
+#define TRACE_START(start)
+#define TRACE_FS(name, start, value) ((void)0)
+/* ``sizeof`` doesn't evaluate ``session``, it only keeps it from being unused */
+#define TRACE_SFTP(name, session, start, length, status) ((void)sizeof(session))
+#define TRACE_IS_ON() false
+
+#endif /* SEFT_TRACE */
+
+#endif /* SFTP_TRACE_H */
@@ -1,6 +1,8 @@
 #ifndef SFTP_UTILS_H
 #define SFTP_UTILS_H
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "seft_list.h"
@@ -21,6 +23,14 @@
 /** Macro to get the ceiling of a division */
 #define CEIL(dividend, divisor) ((dividend) / (divisor) + (dividend) % (divisor))
 
+/** Macros to get the smaller and the larger of two values */
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
 /** Macro to check if ``__VA_ARGS__`` passed to a macro is empty */
 #define VA_ARGS_IS_EMPTY(...) (sizeof((char[]){#__VA_ARGS__}) == 1)
 
@@ -32,5 +42,9 @@ void char_list_format_columnwise(ListT *self, size_t width_screen, char *delimit
 bool check_show_hidden(char *path_str, size_t length, uint8_t flag);
 bool check_path_type(char *path_str, size_t length, bool is_dir, uint8_t flag);
 char *get_non_whitespace_word(char *str, size_t len, size_t start);
+double get_time_monotonic(void);
+char *get_cache_path(const char *file_name);
+bool buf_is_zero(const void *buf, size_t length);
+bool shell_quote(const char *str, char *quoted, size_t size);
 
 #endif /* ifndef SFTP_UTILS_H */
@@ -1,8 +1,11 @@
 #include <argp.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <libssh/sftp.h>
 
@@ -10,7 +13,25 @@
 #include "config.h"
 #include "seft_debug.h"
 #include "seft_ansi_colors.h"
+#include "seft_batch.h"
+#include "seft_cache.h"
+#include "seft_checksum.h"
+#include "seft_cipher.h"
 #include "seft_client.h"
+#include "seft_compress.h"
+#include "seft_dedup.h"
+#include "seft_index.h"
+#include "seft_jobs.h"
+#include "seft_limit.h"
+#include "seft_log.h"
+#include "seft_loop.h"
+#include "seft_master.h"
+#include "seft_metrics.h"
+#include "seft_pool.h"
+#include "seft_push.h"
+#include "seft_remote.h"
+#include "seft_stats.h"
+#include "seft_trace.h"
 #include "seft_utils.h"
 
 #define MAX_NUM_COMMANDS 128
@@ -24,6 +45,57 @@ static struct argp_option option_connect[] = {
     {"subsystem", 's', "SUBSYSTEM", 0, "Specify the server subsystem to connect to",
     0},
     {"port", 'p', "PORT", 0, "Port number of the server", 0},
+    {"ciphers", 'c', "CIPHERS", 0,
+     "Comma separated cipher preference, `auto` to use the fastest measured ones", 0},
+    {"compression", 'z', "MODE", 0,
+     "Transport compression: `no`, `yes` or `auto` to decide per file by sampling it", 0},
+    {"master", 'm', 0, 0,
+     "Keep the session in a background master process that later invocations attach to",
+     0},
+    {"persist", 'P', "SECONDS", 0,
+     "Seconds an idle master stays alive, 0 to keep it until `master --stop`", 0},
+    {"keepalive", 'k', "SECONDS", 0,
+     "Send a keepalive after SECONDS without an answer and probe an idle session, 0 "
+     "to never send one",
+     0},
+    {"timeout", 't', "SECONDS", 0,
+     "Reconnect and resume transfers after SECONDS without an answer, 0 to wait "
+     "forever",
+     0},
+    {"metrics", 'M', "FILE", 0,
+     "Write request latencies, requests in flight and bytes to FILE in the Prometheus "
+     "text format, every --metrics-interval seconds",
+     0},
+    {"metrics-interval", 'I', "SECONDS", 0, "Seconds between two writes of --metrics",
+     0},
+    {"cache-ttl", 'T', "SECONDS", 0,
+     "Answer listings and stats read less than SECONDS ago from memory, 30 by default "
+     "and 0 to always ask the server",
+     0},
+    {0},
+};
+
+static char doc_header_batch[] =
+    "Run the commands of a script, one per line, concurrently where they don't write "
+    "to the same paths";
+static char doc_batch[] = "--batch <FILE|-> [OPTIONS]";
+static struct argp_option option_batch[] = {
+    {"batch", 'b', "FILE", 0, "Script to run, `-` to read it from stdin", 0},
+    {"jobs", 'j', "N", 0, "Run up to N commands at once", 0},
+    {"metrics", 'M', "FILE", 0,
+     "Write request latencies, requests in flight and bytes to FILE in the Prometheus "
+     "text format, every --metrics-interval seconds",
+     0},
+    {"metrics-interval", 'I', "SECONDS", 0, "Seconds between two writes of --metrics",
+     0},
+    {0},
+};
+
+static char doc_header_bench_ciphers[] =
+    "Measure the throughput of every cipher/MAC pair the server accepts";
+static char doc_bench_ciphers[] = "[OPTIONS]";
+static struct argp_option option_bench_ciphers[] = {
+    {"size", 'n', "MIB", 0, "Amount of data in MiB to send with each cipher", 0},
     {0},
 };
 
@@ -38,16 +110,75 @@ static struct argp_option option_list[] = {
     0},
     {"reverse", 'r', "REVERSE", OPTION_ARG_OPTIONAL, "Display in reverse order", 0},
     {"sort", 's', "SORT", OPTION_ARG_OPTIONAL, "Sort by specified field", 0},
+    {"index", 'x', 0, 0,
+     "Answer from the index of the tree holding <dir> (see `index build`) instead of "
+     "the server",
+     0},
     {"help", 'h', "HELP", OPTION_ARG_OPTIONAL, "Show help documentation", 0},
     {0},
 };
 
+static char doc_header_index[] =
+    "Keep an index of a remote tree on disk, to list and search it without asking the "
+    "server";
+static char doc_index[] =
+    "build|refresh <dir> [OPTIONS]\nfind <dir> [<pattern>] [OPTIONS]";
+static struct argp_option option_index[] = {
+    {"file", 'F', "FILE", 0,
+     "Index file to use, the one of <dir> in the cache directory by default", 0},
+    {0},
+};
+
 static char doc_header_copy[] =
     "Synchronize filesystem bidirectionally between remote and local destinations.";
 static char doc_copy[] = "[OPTIONS]";
 static struct argp_option option_copy[] = {
     {"local", 'l', 0, 0, "Copy filesystem object to the local computer", 0},
     {"remote", 'r', 0, 0, "Copy filesystem object to the remote server", 0},
+    {"jobs", 'j', "N", 0, "Copy a directory tree with N parallel jobs", 0},
+    {"over", 'o', "MODE", 0,
+     "Run parallel jobs over `channels` of the current connection (default) or over "
+     "separate `connections`",
+     0},
+    {"verify", 'v', "ALGO", OPTION_ARG_OPTIONAL,
+     "Check each file copied against the server's `sha256` (default) or `crc32` digest",
+     0},
+    {"limit", 'L', "RATE", 0,
+     "Cap the bandwidth of this copy at RATE bytes/s (K, M and G suffixes), on top of "
+     "the limit shared by all",
+     0},
+    {"weight", 'w', "N", 0,
+     "Give the files of this copy N shares of the bandwidth limit, 1 by default", 0},
+    {"dedup", 'D', "ROOT", OPTION_ARG_OPTIONAL,
+     "Link files whose content is already under the remote ROOT (the destination's "
+     "parent by default) instead of sending them",
+     0},
+    {"server", 's', 0, 0,
+     "Copy between two remote paths, on the server when it can (copy-data or cp)", 0},
+    {"to", 't', "HOST[:PORT]", 0,
+     "Copy between two remote paths, the destination being on HOST. The data is "
+     "streamed between the hosts without touching the local disk",
+     0},
+    {"stats", 'S', "FILE", OPTION_ARG_OPTIONAL,
+     "Print throughput, requests and time blocked on network and disk once the copy "
+     "is done, and write them to FILE as JSON",
+     0},
+    {"stats-min-size", 'M', "SIZE", 0,
+     "Give files of at least SIZE bytes (K, M and G suffixes) a record of their own "
+     "in the JSON report, 16M by default",
+     0},
+    {"trace", 'T', "FILE", 0,
+     "Record every SFTP request and local filesystem call of the copy to FILE, in the "
+     "Chrome trace-event format (chrome://tracing, Perfetto)",
+     0},
+    {0},
+};
+
+static char doc_header_push[] =
+    "Push a local file or tree to several hosts at once, reading it only once";
+static char doc_push[] = "--hosts <FILE> <local> <remote>";
+static struct argp_option option_push[] = {
+    {"hosts", 'H', "FILE", 0, "Hosts to push to, one `host[:port]` per line", 0},
     {0},
 };
 
@@ -62,23 +193,86 @@ static struct argp_option option_create[] = {
 };
 
 typedef struct {
+#define FLAG_CONNECT_BIT_POS_MASTER 0x0
+    uint8_t flag;
     char *host;
     uint32_t port;
+    char *ciphers;
+    CompressionModeE compression;
+    uint32_t persist;
+    uint32_t keepalive_interval;
+    uint32_t dead_timeout;
+
+    /** Metrics file written in the background, ``NULL`` for none */
+    char *metrics_path;
+    uint32_t metrics_interval;
+
+    uint32_t cache_ttl;
 } ConnectArgsT;
 
+typedef struct {
+    char *path;
+    size_t num_jobs;
+    char *metrics_path;
+    uint32_t metrics_interval;
+} BatchArgsT;
+
+typedef struct {
+    size_t size_mib;
+} BenchCiphersArgsT;
+
 typedef struct {
     char *dir;
     uint8_t flag;
 } ListArgsT;
 
+typedef struct {
+    char *action;
+    char *dir;
+
+    /** Shell pattern ``find`` matches names against, ``NULL`` for every name */
+    char *pattern;
+    char *path_index;
+} IndexArgsT;
+
 typedef struct {
 #define FLAG_COPY_BIT_POS_IS_SET 0x0
 #define FLAG_COPY_BIT_POS_IS_REMOTE 0x1
     uint8_t flag;
     char *source;
     char *dest;
+    uint32_t num_jobs;
+    PoolModeE pool_mode;
+    ChecksumAlgoE checksum;
+
+    /** Cap on the bandwidth of this copy alone, ``UINT64_MAX`` for none */
+    uint64_t limit;
+    uint32_t weight;
+
+    /** Deduplicate uploads against the manifest of ``dedup_root``, ``NULL`` for the
+     * destination's parent */
+    bool is_dedup;
+    char *dedup_root;
+
+    /** Both paths are remote, the destination on ``to_host`` unless it's ``NULL`` */
+    bool is_server;
+    char *to_host;
+
+    /** Summarize the copy, and report it to ``stats_path`` unless it's ``NULL`` */
+    bool is_stats;
+    char *stats_path;
+    uint64_t stats_min_size;
+
+    /** Timeline of the copy is written there, ``NULL`` if it isn't traced */
+    char *trace_path;
 } CopyArgsT;
 
+typedef struct {
+    char *hosts;
+    char *source;
+    char *dest;
+} PushArgsT;
+
 typedef struct {
 #define FLAG_CREATE_BIT_POS_IS_SET 0x0
 #define FLAG_CREATE_BIT_POS_IS_REMOTE 0x1
@@ -89,6 +283,10 @@ typedef struct {
 
 static ssh_session session_ssh = NULL;
 static sftp_session session_sftp = NULL;
+static ConnectOptionsT connect_options = {0};
+
+/** Connection to the master holding the session, ``-1`` if the session is local */
+static int master_fd = -1;
 
 char **
 get_arg_vec(char *input, int32_t *length) {
@@ -125,6 +323,9 @@ parse_option_list(int32_t key, char *arg, struct argp_state *state) {
         case 's':
             BIT_SET(args->flag, FLAG_LIST_BIT_POS_SORT);
             break;
+        case 'x':
+            BIT_SET(args->flag, FLAG_LIST_BIT_POS_INDEX);
+            break;
         case 'h':
             argp_state_help(state, stdout,
                             ARGP_HELP_DOC | ARGP_HELP_USAGE | ARGP_HELP_LONG);
@@ -143,6 +344,35 @@ parse_option_list(int32_t key, char *arg, struct argp_state *state) {
     return 0;
 }
 
+static error_t
+parse_option_index(int32_t key, char *arg, struct argp_state *state) {
+    IndexArgsT *args = state->input;
+
+    switch (key) {
+        case 'F':
+            free(args->path_index);
+            args->path_index = strdup(arg);
+            break;
+        case ARGP_KEY_END:
+            if (state->argc < 2) {
+                argp_state_help(state, stdout,
+                                ARGP_HELP_DOC | ARGP_HELP_LONG | ARGP_HELP_USAGE);
+            }
+            break;
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0) {
+                args->action = strdup(arg);
+            } else if (state->arg_num == 1) {
+                args->dir = strdup(arg);
+            } else if (state->arg_num == 2) {
+                args->pattern = strdup(arg);
+            }
+            break;
+    }
+
+    return 0;
+}
+
 static error_t
 parse_option_copy(int32_t key, char *arg, struct argp_state *state) {
     CopyArgsT *args = state->input;
@@ -164,6 +394,64 @@ parse_option_copy(int32_t key, char *arg, struct argp_state *state) {
         case 'f':
             BIT_CLEAR(args->flag, FLAG_CREATE_BIT_POS_IS_DIR);
             break;
+        case 'j':
+            args->num_jobs = strtoul(arg, NULL, 10);
+            break;
+        case 'o':
+            if (!strcmp(arg, "connections")) {
+                args->pool_mode = POOL_MODE_CONNECTIONS;
+            } else if (!strcmp(arg, "channels")) {
+                args->pool_mode = POOL_MODE_CHANNELS;
+            } else {
+                DBG_ERR("Invalid parallel mode: %s", arg);
+            }
+            break;
+        case 'v':
+            args->checksum = arg == NULL ? CHECKSUM_SHA256 : checksum_algo_parse(arg);
+            if (args->checksum == CHECKSUM_NONE) {
+                DBG_ERR("Invalid checksum algorithm: %s", arg);
+            }
+            break;
+        case 'L':
+            if (!limit_rate_parse(arg, &args->limit)) {
+                DBG_ERR("Invalid bandwidth limit: %s", arg);
+                args->limit = UINT64_MAX;
+            }
+            break;
+        case 'w':
+            args->weight = strtoul(arg, NULL, 10);
+            break;
+        case 'D':
+            args->is_dedup = true;
+            args->dedup_root = arg == NULL ? NULL : strdup(arg);
+            break;
+        case 's':
+            args->is_server = true;
+            break;
+        case 't':
+            args->is_server = true;
+            free(args->to_host);
+            args->to_host = strdup(arg);
+            break;
+        case 'S':
+            args->is_stats = true;
+            free(args->stats_path);
+            args->stats_path = arg == NULL ? NULL : strdup(arg);
+            break;
+        case 'M':
+            if (!limit_rate_parse(arg, &args->stats_min_size)) {
+                DBG_ERR("Invalid size: %s", arg);
+                args->stats_min_size = STATS_MIN_FILE_SIZE;
+            }
+            break;
+        case 'T':
+#if SEFT_TRACE
+            free(args->trace_path);
+            args->trace_path = strdup(arg);
+#else
+            DBG_ERR("Built without tracing (TRACE=0), not tracing to %s", arg);
+#endif
+            break;
         case 'h':
             argp_state_help(state, stdout,
                             ARGP_HELP_DOC | ARGP_HELP_LONG | ARGP_HELP_USAGE);
@@ -190,6 +478,33 @@ parse_option_copy(int32_t key, char *arg, struct argp_state *state) {
     return 0;
 }
 
+static error_t
+parse_option_push(int32_t key, char *arg, struct argp_state *state) {
+    PushArgsT *args = state->input;
+
+    switch (key) {
+        case 'H':
+            free(args->hosts);
+            args->hosts = strdup(arg);
+            break;
+        case ARGP_KEY_END:
+            if (state->argc < 2) {
+                argp_state_help(state, stdout,
+                                ARGP_HELP_DOC | ARGP_HELP_LONG | ARGP_HELP_USAGE);
+            }
+            break;
+        case ARGP_KEY_ARG:
+            if (state->arg_num == 0) {
+                args->source = strdup(arg);
+            } else if (state->arg_num == 1) {
+                args->dest = strdup(arg);
+            }
+            break;
+    }
+
+    return 0;
+}
+
 static error_t
 parse_option_create(int32_t key, char *arg, struct argp_state *state) {
     CreateArgsT *args = state->input;
@@ -236,6 +551,41 @@ parse_option_connect(int32_t key, char *arg, struct argp_state *state) {
         case 'p':
             args->port = atoi(arg);
             break;
+        case 'c':
+            args->ciphers = strdup(arg);
+            break;
+        case 'm':
+            BIT_SET(args->flag, FLAG_CONNECT_BIT_POS_MASTER);
+            break;
+        case 'P':
+            args->persist = strtoul(arg, NULL, 10);
+            break;
+        case 'k':
+            args->keepalive_interval = strtoul(arg, NULL, 10);
+            break;
+        case 't':
+            args->dead_timeout = strtoul(arg, NULL, 10);
+            break;
+        case 'M':
+            args->metrics_path = arg;
+            break;
+        case 'I':
+            args->metrics_interval = strtoul(arg, NULL, 10);
+            break;
+        case 'T':
+            args->cache_ttl = strtoul(arg, NULL, 10);
+            break;
+        case 'z':
+            if (!strcmp(arg, "auto")) {
+                args->compression = COMPRESSION_AUTO;
+            } else if (!strcmp(arg, "yes")) {
+                args->compression = COMPRESSION_YES;
+            } else if (!strcmp(arg, "no")) {
+                args->compression = COMPRESSION_NO;
+            } else {
+                DBG_ERR("Invalid compression mode: %s", arg);
+            }
+            break;
         case 'h':
             argp_state_help(state, stdout,
                             ARGP_HELP_DOC | ARGP_HELP_LONG | ARGP_HELP_USAGE);
@@ -251,22 +601,272 @@ parse_option_connect(int32_t key, char *arg, struct argp_state *state) {
     return 0;
 }
 
+static error_t
+parse_option_batch(int32_t key, char *arg, struct argp_state *state) {
+    BatchArgsT *args = state->input;
+
+    switch (key) {
+        case 'b':
+            args->path = arg;
+            break;
+        case 'j':
+            args->num_jobs = strtoul(arg, NULL, 10);
+            break;
+        case 'M':
+            args->metrics_path = arg;
+            break;
+        case 'I':
+            args->metrics_interval = strtoul(arg, NULL, 10);
+            break;
+    }
+
+    return 0;
+}
+
+static error_t
+parse_option_bench_ciphers(int32_t key, char *arg, struct argp_state *state) {
+    BenchCiphersArgsT *args = state->input;
+
+    switch (key) {
+        case 'n':
+            args->size_mib = strtoul(arg, NULL, 10);
+            break;
+        case 'h':
+            argp_state_help(state, stdout,
+                            ARGP_HELP_DOC | ARGP_HELP_LONG | ARGP_HELP_USAGE);
+            break;
+    }
+
+    return 0;
+}
+
+/**
+ * Bring ``session_ssh`` back once the event loop finds it dead, called with the
+ * connection's lock held. The blocking SFTP session goes away with the connection
+ * and is opened again on the new one, other threads read it with ``current_sftp``
+ * under the same lock.
+ */
+static bool
+reconnect_sessions(ssh_session session, void *user_data) {
+    (void)user_data;
+
+    if (session_sftp != NULL) {
+        clean_sftp_session(session_sftp);
+        session_sftp = NULL;
+    }
+
+    if (try_ssh_reconnect(session, &connect_options) != CMD_OK) {
+        return false;
+    }
+
+    session_sftp = sftp_new(session);
+    if (session_sftp != NULL && sftp_init(session_sftp) != SSH_OK) {
+        DBG_ERR("Couldn't initialize SFTP session: Error Code %d",
+                sftp_get_error(session_sftp));
+        clean_sftp_session(session_sftp);
+        session_sftp = NULL;
+    }
+
+    return session_sftp != NULL;
+}
+
+/** Read ``session_sftp``, which a reconnect may swap from the thread whose loop found
+ * the connection dead. */
+static sftp_session
+current_sftp(void) {
+    pthread_mutex_t *lock =
+        session_ssh != NULL ? SftpLoop_session_lock(session_ssh) : NULL;
+    sftp_session session;
+
+    if (lock != NULL) {
+        pthread_mutex_lock(lock);
+    }
+    session = session_sftp;
+    if (lock != NULL) {
+        pthread_mutex_unlock(lock);
+    }
+
+    return session;
+}
+
+/** Start writing the metrics of a ``connect`` that succeeded. The writer outlives the
+ * connection, a later ``connect`` only changes the file. */
+static void
+connect_start_metrics(ConnectArgsT *args) {
+    if (args->metrics_path != NULL) {
+        metrics_start_writer(args->metrics_path, args->metrics_interval);
+    }
+}
+
+/** Open the sessions described by ``connect_options``. */
+static void
+open_sessions(void) {
+    session_ssh = do_ssh_init_options(&connect_options);
+    session_sftp = do_sftp_init(session_ssh);
+    compress_set_mode(&connect_options);
+
+    SftpLoop_set_reconnect(session_ssh, reconnect_sessions, NULL);
+    SftpLoop_set_keepalive(session_ssh, connect_options.keepalive_interval,
+                           connect_options.dead_timeout);
+}
+
+/** Close the sessions opened by ``open_sessions``. */
+static void
+close_sessions(void) {
+    compress_clean();
+    cache_clear();
+
+    if (session_ssh != NULL) {
+        DBG_INFO("Cleaning up ssh and sftp sessions: %s", "");
+
+        /* Stops the keepalive first, it may reconnect and reopen ``session_sftp`` */
+        SftpLoop_forget_session(session_ssh);
+        if (session_sftp != NULL) {
+            clean_sftp_session(session_sftp);
+        }
+        clean_ssh_session(session_ssh);
+    }
+    session_sftp = NULL;
+    session_ssh = NULL;
+}
+
+/** Load the manifest an upload is deduplicated against and hash the files to send,
+ * ``NULL`` if there's no connection to read it with. */
+static DedupT *
+copy_dedup_open(CopyArgsT *args) {
+    SftpLoopT *loop = session_ssh != NULL ? SftpLoop_for_session(session_ssh) : NULL;
+    char *root = args->dedup_root != NULL ? strdup(args->dedup_root) : strdup(args->dest);
+    char *separator = strrchr(root, '/');
+    long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    DedupT *dedup;
+
+    if (loop == NULL) {
+        DBG_ERR("Not connected, can't deduplicate against %s", root);
+        free(root);
+        return NULL;
+    }
+
+    /* The destination's parent, unless a root was given */
+    if (args->dedup_root == NULL) {
+        if (separator == NULL) {
+            strcpy(root, ".");
+        } else {
+            separator[separator == root] = '\0';
+        }
+    }
+
+    dedup = Dedup_open(loop, root);
+    Dedup_hash_tree(dedup, args->source, MAX(args->num_jobs, (size_t)MAX(num_cpus, 1)));
+    free(root);
+
+    return dedup;
+}
+
+/** Copy between two remote paths of the current connection, the server copies the
+ * data itself. */
+static CommandStatusE
+copy_remote_on_server(SftpLoopT *loop, CopyArgsT *args) {
+    CommandStatusE result =
+        copy_from_remote_to_remote(loop, loop, args->source, args->dest);
+
+    /* Written through, even if it failed half way */
+    cache_invalidate(args->dest);
+    return result;
+}
+
+/** Copy between two remote paths, opening a connection to the destination host if
+ * it isn't the current one. */
+static CommandStatusE
+copy_remote_to_remote(CopyArgsT *args) {
+    ConnectOptionsT options_dest = {.port_id = connect_options.port_id,
+                                    .compression = connect_options.compression,
+                                    .keepalive_interval =
+                                        connect_options.keepalive_interval,
+                                    .dead_timeout = connect_options.dead_timeout};
+    SftpLoopT *loop = session_ssh != NULL ? SftpLoop_for_session(session_ssh) : NULL;
+    SftpLoopT *loop_dest;
+    ssh_session session_dest;
+    CommandStatusE result;
+    char *port;
+
+    if (loop == NULL) {
+        DBG_ERR("Not connected, can't copy %s", args->source);
+        return CMD_INTERNAL_ERROR;
+    } else if (args->to_host == NULL) {
+        return copy_remote_on_server(loop, args);
+    }
+
+    port = strrchr(args->to_host, ':');
+    if (port != NULL) {
+        *port++ = '\0';
+        options_dest.port_id = strtoul(port, NULL, 10);
+    }
+    options_dest.host_name = strdup(args->to_host);
+
+    /* The current host is copied on as without ``--to``, by the server itself */
+    if (!strcmp(options_dest.host_name, connect_options.host_name) &&
+        options_dest.port_id == connect_options.port_id) {
+        clean_connect_options(&options_dest);
+        return copy_remote_on_server(loop, args);
+    }
+
+    /* The same credentials are tried on the same host, another host asks for its own */
+    if (!strcmp(options_dest.host_name, connect_options.host_name)) {
+        memcpy(options_dest.passphrase, connect_options.passphrase,
+               sizeof options_dest.passphrase);
+    }
+
+    session_dest = try_ssh_init(&options_dest);
+    if (session_dest == NULL) {
+        clean_connect_options(&options_dest);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    loop_dest = SftpLoop_for_session(session_dest);
+    if (loop_dest == NULL) {
+        DBG_ERR("Couldn't open an SFTP channel to %s", options_dest.host_name);
+        result = CMD_INTERNAL_ERROR;
+    } else {
+        result = copy_from_remote_to_remote(loop, loop_dest, args->source, args->dest);
+    }
+    clean_ssh_session(session_dest);
+    clean_connect_options(&options_dest);
+
+    return result;
+}
+
+static CommandStatusE subcommand_dispatcher(char **arg_vec, uint32_t length);
+
+static MasterHooksT master_hooks = {open_sessions, close_sessions, subcommand_dispatcher};
+
 static CommandStatusE
 subcommand_dispatcher(char **arg_vec, uint32_t length) {
     char *subcommand;
     struct argp arg_parser;
+    CommandStatusE result = CMD_OK;
 
     if (length < 1) {
         return CMD_INVALID_ARGS_COUNT;
     }
 
     subcommand = arg_vec[0];
+
+    /* Everything but connecting somewhere else runs in the master */
+    if (master_fd >= 0 && strcmp(subcommand, "connect")) {
+        result = master_forward(master_fd, arg_vec, length);
+        if (result == CMD_NOT_EXECUTED) {
+            master_detach(master_fd);
+            master_fd = -1;
+        }
+        return result;
+    }
+
     if (!strcmp(subcommand, "list")) {
         ListArgsT list_args = {NULL, 0};
 
         arg_parser = (struct argp){
             option_list, parse_option_list, doc_list, doc_header_list, 0, 0, 0};
-        argp_parse(&arg_parser, length, arg_vec, 0, 0, &list_args);
+        argp_parse(&arg_parser, length, arg_vec, ARGP_NO_EXIT, 0, &list_args);
 
         /* Print help message and continue */
         if (length == 1) {
@@ -276,16 +876,34 @@ subcommand_dispatcher(char **arg_vec, uint32_t length) {
         if (list_args.dir == NULL) {
             return CMD_INVALID_ARGS_TYPE;
         }
-        list_remote_dir(session_ssh, session_sftp, list_args.dir, list_args.flag);
+        if (!BIT_MATCH(list_args.flag, FLAG_LIST_BIT_POS_INDEX)) {
+            result = list_remote_dir(session_ssh, current_sftp(), list_args.dir,
+                                     list_args.flag);
+        } else if (connect_options.host_name == NULL) {
+            DBG_ERR("Not connected, run `connect` first %s", "");
+            result = CMD_NOT_EXECUTED;
+        } else {
+            result = index_list(connect_options.host_name, connect_options.port_id,
+                                list_args.dir, list_args.flag);
+        }
 
         free(list_args.dir);
 
     } else if (!strcmp(subcommand, "copy")) {
-        CopyArgsT copy_args = {0, NULL, NULL};
+        CopyArgsT copy_args = {.num_jobs = 1,
+                               .pool_mode = POOL_MODE_CHANNELS,
+                               .checksum = CHECKSUM_NONE,
+                               .limit = UINT64_MAX,
+                               .weight = LIMIT_DEFAULT_WEIGHT,
+                               .stats_min_size = STATS_MIN_FILE_SIZE};
+        LimitCapT *cap = NULL;
+        DedupT *dedup = NULL;
+        StatsT *stats = NULL;
+        TraceT *trace = NULL;
 
         arg_parser = (struct argp){
             option_copy, parse_option_copy, doc_copy, doc_header_copy, 0, 0, 0};
-        argp_parse(&arg_parser, length, arg_vec, 0, 0, &copy_args);
+        argp_parse(&arg_parser, length, arg_vec, ARGP_NO_EXIT, 0, &copy_args);
 
         /* Print help message and continue */
         if (length == 1) {
@@ -293,19 +911,158 @@ subcommand_dispatcher(char **arg_vec, uint32_t length) {
         }
 
         if (copy_args.source == NULL || copy_args.dest == NULL) {
+            free(copy_args.to_host);
+            free(copy_args.stats_path);
+            free(copy_args.trace_path);
             return CMD_INVALID_ARGS_TYPE;
         }
 
-        if (BIT_MATCH(copy_args.flag, FLAG_COPY_BIT_POS_IS_REMOTE)) {
-            copy_from_remote_to_local(session_ssh, session_sftp, copy_args.source,
-                                      copy_args.dest);
+        /* Neither side is local, none of the transfer options apply */
+        if (copy_args.is_server) {
+            result = copy_remote_to_remote(&copy_args);
+            free(copy_args.source);
+            free(copy_args.dest);
+            free(copy_args.dedup_root);
+            free(copy_args.to_host);
+            free(copy_args.stats_path);
+            free(copy_args.trace_path);
+            return result;
+        }
+
+        /* Files copied by this thread, or by pool workers it starts, are verified */
+        checksum_bind_thread(copy_args.checksum);
+        limit_bind_thread(copy_args.weight);
+        if (copy_args.limit != UINT64_MAX) {
+            cap = LimitCap_new(copy_args.limit);
+            limit_bind_cap(cap);
+        }
+        if (copy_args.is_dedup &&
+            !BIT_MATCH(copy_args.flag, FLAG_COPY_BIT_POS_IS_REMOTE)) {
+            dedup = copy_dedup_open(&copy_args);
+            dedup_bind_thread(dedup);
+        }
+
+        /* Started after the hashing of a deduplicated upload, it only times the copy */
+        if (copy_args.is_stats) {
+            stats = Stats_new(copy_args.stats_min_size);
+            stats_bind_thread(stats);
+        }
+        if (copy_args.trace_path != NULL) {
+            trace = Trace_new();
+            trace_bind_thread(trace);
+        }
+        if (copy_args.num_jobs > 1) {
+            SessionPoolT *pool =
+                SessionPool_new(&connect_options, session_ssh, current_sftp(),
+                                copy_args.num_jobs, copy_args.pool_mode);
+            result =
+                SessionPool_copy(pool, copy_args.source, copy_args.dest,
+                                 BIT_MATCH(copy_args.flag, FLAG_COPY_BIT_POS_IS_REMOTE));
+            SessionPool_free(pool);
+        } else if (BIT_MATCH(copy_args.flag, FLAG_COPY_BIT_POS_IS_REMOTE)) {
+            result = copy_from_remote_to_local(session_ssh, current_sftp(),
+                                               copy_args.source, copy_args.dest);
         } else {
-            copy_from_local_to_remote(session_ssh, session_sftp, copy_args.source,
-                                      copy_args.dest);
+            result = copy_from_local_to_remote(session_ssh, current_sftp(),
+                                               copy_args.source, copy_args.dest);
+        }
+        checksum_bind_thread(CHECKSUM_NONE);
+        limit_bind_thread(LIMIT_DEFAULT_WEIGHT);
+        limit_bind_cap(NULL);
+        dedup_bind_thread(NULL);
+        stats_bind_thread(NULL);
+        trace_bind_thread(NULL);
+
+        /* Written through, even if it failed half way */
+        if (!BIT_MATCH(copy_args.flag, FLAG_COPY_BIT_POS_IS_REMOTE)) {
+            cache_invalidate(copy_args.dest);
+            if (copy_args.dedup_root != NULL) {
+                cache_invalidate(copy_args.dedup_root);
+            }
+        }
+        if (trace != NULL) {
+            if (Trace_write(trace, copy_args.trace_path) != CMD_OK && result == CMD_OK) {
+                result = CMD_INTERNAL_ERROR;
+            }
+            Trace_free(trace);
+        }
+        if (stats != NULL) {
+            Stats_print(stats, stdout);
+            if (copy_args.stats_path != NULL &&
+                Stats_write_json(stats, copy_args.stats_path) != CMD_OK &&
+                result == CMD_OK) {
+                result = CMD_INTERNAL_ERROR;
+            }
+            Stats_free(stats);
+        }
+        if (dedup != NULL) {
+            Dedup_close(dedup, SftpLoop_for_session(session_ssh));
         }
+        LimitCap_free(cap);
 
         free(copy_args.source);
         free(copy_args.dest);
+        free(copy_args.dedup_root);
+        free(copy_args.stats_path);
+        free(copy_args.trace_path);
+
+    } else if (!strcmp(subcommand, "push")) {
+        PushArgsT push_args = {NULL, NULL, NULL};
+
+        arg_parser = (struct argp){
+            option_push, parse_option_push, doc_push, doc_header_push, 0, 0, 0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_NO_EXIT, 0, &push_args);
+
+        /* Every host gets a connection of its own, none is needed beforehand */
+        if (push_args.hosts == NULL || push_args.source == NULL ||
+            push_args.dest == NULL) {
+            result = length == 1 ? CMD_OK : CMD_INVALID_ARGS_COUNT;
+        } else {
+            result = push_run(&connect_options, push_args.hosts, push_args.source,
+                              push_args.dest);
+
+            /* The current host may be one of the hosts, written through as copy */
+            cache_invalidate(push_args.dest);
+        }
+
+        free(push_args.hosts);
+        free(push_args.source);
+        free(push_args.dest);
+
+    } else if (!strcmp(subcommand, "index")) {
+        IndexArgsT index_args = {NULL, NULL, NULL, NULL};
+
+        arg_parser = (struct argp){
+            option_index, parse_option_index, doc_index, doc_header_index, 0, 0, 0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_NO_EXIT, 0, &index_args);
+
+        /* Index files are named after the host, even those given with --file are
+         * only built over the current connection */
+        if (index_args.action == NULL || index_args.dir == NULL) {
+            result = length == 1 ? CMD_OK : CMD_INVALID_ARGS_COUNT;
+        } else if (connect_options.host_name == NULL) {
+            DBG_ERR("Not connected, run `connect` first %s", "");
+            result = CMD_NOT_EXECUTED;
+        } else if (!strcmp(index_args.action, "build") ||
+                   !strcmp(index_args.action, "refresh")) {
+            result = index_build(SftpLoop_for_session(session_ssh),
+                                 connect_options.host_name, connect_options.port_id,
+                                 index_args.dir, index_args.path_index,
+                                 !strcmp(index_args.action, "refresh"));
+        } else if (!strcmp(index_args.action, "find")) {
+            result = index_find(connect_options.host_name, connect_options.port_id,
+                                index_args.dir, index_args.pattern,
+                                index_args.path_index);
+        } else {
+            DBG_ERR("Unknown index action, expected build, refresh or find: %s",
+                    index_args.action);
+            result = CMD_INVALID_ARGS_TYPE;
+        }
+
+        free(index_args.action);
+        free(index_args.dir);
+        free(index_args.pattern);
+        free(index_args.path_index);
 
     } else if (!strcmp(subcommand, "create")) {
         CreateArgsT create_args = {0, NULL};
@@ -313,7 +1070,7 @@ subcommand_dispatcher(char **arg_vec, uint32_t length) {
         arg_parser = (struct argp){
             option_create, parse_option_create, doc_create, doc_header_create, 0, 0,
             0};
-        argp_parse(&arg_parser, length, arg_vec, 0, 0, &create_args);
+        argp_parse(&arg_parser, length, arg_vec, ARGP_NO_EXIT, 0, &create_args);
 
         /* Print help message and continue */
         if (length == 1) {
@@ -326,9 +1083,11 @@ subcommand_dispatcher(char **arg_vec, uint32_t length) {
 
         if (BIT_MATCH(create_args.flag, FLAG_CREATE_BIT_POS_IS_REMOTE)) {
             if (BIT_MATCH(create_args.flag, FLAG_CREATE_BIT_POS_IS_DIR)) {
-                create_remote_dir(session_ssh, session_sftp, create_args.filesystem);
+                result = create_remote_dir(session_ssh, current_sftp(),
+                                           create_args.filesystem);
             } else {
-                create_remote_file(session_ssh, session_sftp, create_args.filesystem);
+                result = create_remote_file(session_ssh, current_sftp(),
+                                            create_args.filesystem);
             }
         } else { /* TODO */
         }
@@ -336,7 +1095,17 @@ subcommand_dispatcher(char **arg_vec, uint32_t length) {
         free(create_args.filesystem);
 
     } else if (!strcmp(subcommand, "connect")) {
-        ConnectArgsT connect_args = {NULL, 0};
+        ConnectArgsT connect_args = {0,
+                                     NULL,
+                                     0,
+                                     NULL,
+                                     COMPRESSION_NO,
+                                     MASTER_DEFAULT_PERSIST,
+                                     CONNECT_DEFAULT_KEEPALIVE,
+                                     CONNECT_DEFAULT_DEAD_TIMEOUT,
+                                     NULL,
+                                     METRICS_DEFAULT_INTERVAL,
+                                     CACHE_DEFAULT_TTL};
 
         arg_parser = (struct argp){option_connect,
                                    parse_option_connect,
@@ -345,7 +1114,7 @@ subcommand_dispatcher(char **arg_vec, uint32_t length) {
                                    0,
                                    0,
                                    0};
-        argp_parse(&arg_parser, length, arg_vec, 0, 0, &connect_args);
+        argp_parse(&arg_parser, length, arg_vec, ARGP_NO_EXIT, 0, &connect_args);
 
         /* Print help message and continue */
         if (length == 1) {
@@ -353,17 +1122,370 @@ subcommand_dispatcher(char **arg_vec, uint32_t length) {
         }
 
         if (connect_args.host == NULL) {
+            free(connect_args.ciphers);
             return CMD_INVALID_ARGS_TYPE;
         }
 
-        session_ssh = do_ssh_init(connect_args.host, connect_args.port);
-        session_sftp = do_sftp_init(session_ssh);
+        /* Jobs run on channels of the current connection */
+        if (jobs_num_running()) {
+            DBG_ERR("Wait for or cancel the %zu running jobs first", jobs_num_running());
+            free(connect_args.host);
+            free(connect_args.ciphers);
+            return CMD_NOT_EXECUTED;
+        }
+
+        master_detach(master_fd);
+        close_sessions();
+        clean_connect_options(&connect_options);
+        connect_options.host_name = connect_args.host;
+        connect_options.port_id = connect_args.port;
+        connect_options.compression = connect_args.compression;
+        connect_options.keepalive_interval = connect_args.keepalive_interval;
+        connect_options.dead_timeout = connect_args.dead_timeout;
+        cache_set_ttl(connect_args.cache_ttl);
+
+        /* A running master makes connecting instant */
+        master_fd = master_attach(connect_args.host, connect_args.port);
+        if (master_fd >= 0) {
+            free(connect_args.ciphers);
+            connect_start_metrics(&connect_args);
+            return CMD_OK;
+        }
+
+        if (connect_args.ciphers != NULL && !strcmp(connect_args.ciphers, "auto")) {
+            cipher_select_auto(&connect_options);
+            free(connect_args.ciphers);
+        } else {
+            connect_options.ciphers = connect_args.ciphers;
+        }
+
+        if (BIT_MATCH(connect_args.flag, FLAG_CONNECT_BIT_POS_MASTER)) {
+            master_fd =
+                master_spawn(&connect_options, connect_args.persist, &master_hooks);
+            if (master_fd >= 0) {
+                connect_start_metrics(&connect_args);
+                return CMD_OK;
+            }
+            DBG_ERR("Falling back to a local session for %s", connect_args.host);
+        }
+
+        open_sessions();
+        if (session_ssh != NULL) {
+            connect_start_metrics(&connect_args);
+        }
+
+    } else if (!strcmp(subcommand, "bench-ciphers")) {
+        BenchCiphersArgsT bench_args = {CIPHER_BENCH_DEFAULT_MIB};
+        CipherBenchT *results;
+        size_t num_results;
+        char *ciphers, *hmacs;
+
+        arg_parser = (struct argp){option_bench_ciphers,
+                                   parse_option_bench_ciphers,
+                                   doc_bench_ciphers,
+                                   doc_header_bench_ciphers,
+                                   0,
+                                   0,
+                                   0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_NO_EXIT, 0, &bench_args);
+
+        if (connect_options.host_name == NULL) {
+            DBG_ERR("Not connected, run `connect` first %s", "");
+            return CMD_NOT_EXECUTED;
+        }
+
+        num_results = cipher_bench_run(&connect_options, bench_args.size_mib << 20,
+                                       &results);
+        cipher_bench_print(results, num_results);
+
+        cipher_bench_order(results, num_results, &ciphers, &hmacs);
+        if (ciphers != NULL) {
+            cipher_cache_store(connect_options.host_name, connect_options.port_id,
+                               ciphers, hmacs);
+        }
 
-        free(connect_args.host);
+        free(ciphers);
+        free(hmacs);
+        DBG_SAFE_FREE(results);
+    } else if (!strcmp(subcommand, "limit")) {
+        uint64_t rate;
+
+        /* Copies running in the background follow the new limit right away */
+        if (length > 1) {
+            if (!limit_rate_parse(arg_vec[1], &rate)) {
+                DBG_ERR("Invalid bandwidth limit: %s", arg_vec[1]);
+                return CMD_INVALID_ARGS_TYPE;
+            }
+            limit_set_rate(rate);
+        }
+        limit_print();
+    } else if (!strcmp(subcommand, "stats")) {
+        metrics_print(stdout);
+    } else if (!strcmp(subcommand, "log")) {
+        char spec[1024] = "";
+
+        /* Levels of the form ``info`` or ``loop=debug``, applied in order and only
+         * if they are all valid */
+        for (uint32_t i = 1; i < length; i++) {
+            strncat(spec, arg_vec[i], sizeof spec - strlen(spec) - 2);
+            strcat(spec, ",");
+        }
+        if (length > 1 && !log_configure(spec)) {
+            DBG_ERR("Invalid log levels: %s", spec);
+            return CMD_INVALID_ARGS_TYPE;
+        }
+        log_print_levels();
+    } else if (!strcmp(subcommand, MASTER_COMMAND)) {
+        DBG_ERR("Not attached to a master, use `connect --master` %s", "");
+        return CMD_NOT_EXECUTED;
     } else {
         return CMD_INVALID_COMMAND;
     }
-    return CMD_OK;
+    return result;
+}
+
+/**
+ * Run a line of the REPL. A trailing ``&`` starts the command as a background
+ * job on its own channel, the job control commands are handled here since they
+ * only make sense in the process that owns the jobs.
+ */
+static CommandStatusE
+repl_dispatcher(char **arg_vec, uint32_t length) {
+    bool is_background = false;
+    char *last;
+
+    if (length > 0) {
+        last = arg_vec[length - 1];
+        if (!strcmp(last, JOB_BACKGROUND_TOKEN)) {
+            is_background = true;
+            length--;
+        } else if (strlen(last) > 1 && last[strlen(last) - 1] == '&') {
+            is_background = true;
+            last[strlen(last) - 1] = '\0';
+        }
+    }
+
+    if (length < 1) {
+        return CMD_INVALID_ARGS_COUNT;
+    }
+
+    if (!strcmp(arg_vec[0], "jobs")) {
+        jobs_print();
+        return CMD_OK;
+    } else if (!strcmp(arg_vec[0], "wait")) {
+        return job_wait(length > 1 ? strtoul(arg_vec[1], NULL, 10) : 0);
+    } else if (!strcmp(arg_vec[0], "fg")) {
+        return job_fg(length > 1 ? strtoul(arg_vec[1], NULL, 10) : 0);
+    } else if (!strcmp(arg_vec[0], "cancel")) {
+        if (length < 2) {
+            return CMD_INVALID_ARGS_COUNT;
+        }
+        return job_cancel(strtoul(arg_vec[1], NULL, 10));
+    }
+
+    if (!is_background) {
+        return subcommand_dispatcher(arg_vec, length);
+    }
+
+    if (strcmp(arg_vec[0], "copy") && strcmp(arg_vec[0], "list") &&
+        strcmp(arg_vec[0], "create")) {
+        DBG_ERR("Only copy, list and create can run in the background, not %s",
+                arg_vec[0]);
+        return CMD_NOT_EXECUTED;
+    }
+
+    if (master_fd >= 0) {
+        DBG_ERR("Background jobs aren't supported while attached to a master %s", "");
+        return CMD_NOT_EXECUTED;
+    }
+
+    if (session_ssh == NULL) {
+        DBG_ERR("Not connected, run `connect` first %s", "");
+        return CMD_NOT_EXECUTED;
+    }
+
+    return job_start(session_ssh, current_sftp(), arg_vec, length, subcommand_dispatcher);
+}
+
+/** The ``BatchHooksT.target`` of a command that doesn't write, or doesn't read. */
+static char *
+batch_target_none(void) {
+    return DBG_CALLOC(1, sizeof(char));
+}
+
+/** Build a ``BatchHooksT.target`` string out of a side and a path. */
+static char *
+batch_target_path(bool is_remote, char *path) {
+    char *target;
+
+    if (path == NULL) {
+        return NULL;
+    }
+
+    target = DBG_MALLOC(strlen(path) + sizeof "remote:");
+    sprintf(target, "%s:%s", is_remote ? "remote" : "local", path);
+    free(path);
+
+    return target;
+}
+
+/** Find what a batch command writes to, see ``BatchHooksT.target``. */
+static char *
+batch_target(char **arg_vec, uint32_t length) {
+    struct argp arg_parser;
+    bool is_remote_dest;
+
+    if (!strcmp(arg_vec[0], "list")) {
+        return batch_target_none();
+    } else if (!strcmp(arg_vec[0], "copy")) {
+        CopyArgsT copy_args = {.num_jobs = 1,
+                               .pool_mode = POOL_MODE_CHANNELS,
+                               .checksum = CHECKSUM_NONE,
+                               .limit = UINT64_MAX,
+                               .weight = LIMIT_DEFAULT_WEIGHT,
+                               .stats_min_size = STATS_MIN_FILE_SIZE};
+
+        arg_parser = (struct argp){
+            option_copy, parse_option_copy, doc_copy, doc_header_copy, 0, 0, 0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_SILENT, 0, &copy_args);
+
+        free(copy_args.source);
+        free(copy_args.dedup_root);
+        free(copy_args.to_host);
+        free(copy_args.stats_path);
+        free(copy_args.trace_path);
+        is_remote_dest = copy_args.is_server ||
+                         !BIT_MATCH(copy_args.flag, FLAG_COPY_BIT_POS_IS_REMOTE);
+        return batch_target_path(is_remote_dest, copy_args.dest);
+    } else if (!strcmp(arg_vec[0], "create")) {
+        CreateArgsT create_args = {0, NULL};
+
+        arg_parser = (struct argp){
+            option_create, parse_option_create, doc_create, doc_header_create, 0, 0,
+            0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_SILENT, 0, &create_args);
+
+        return batch_target_path(
+            BIT_MATCH(create_args.flag, FLAG_CREATE_BIT_POS_IS_REMOTE),
+            create_args.filesystem);
+    } else if (!strcmp(arg_vec[0], "push")) {
+        PushArgsT push_args = {NULL, NULL, NULL};
+
+        arg_parser = (struct argp){
+            option_push, parse_option_push, doc_push, doc_header_push, 0, 0, 0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_SILENT, 0, &push_args);
+
+        /* The current host may be one of the hosts */
+        free(push_args.hosts);
+        free(push_args.source);
+        return batch_target_path(true, push_args.dest);
+    }
+
+    return NULL;
+}
+
+/** Find what a batch command reads, see ``BatchHooksT.source``. */
+static char *
+batch_source(char **arg_vec, uint32_t length) {
+    struct argp arg_parser;
+    char *source = NULL;
+    bool is_remote_source = false;
+
+    if (!strcmp(arg_vec[0], "list")) {
+        ListArgsT list_args = {NULL, 0};
+
+        arg_parser = (struct argp){
+            option_list, parse_option_list, doc_list, doc_header_list, 0, 0, 0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_SILENT, 0, &list_args);
+
+        source = list_args.dir;
+        is_remote_source = true;
+    } else if (!strcmp(arg_vec[0], "copy")) {
+        CopyArgsT copy_args = {.num_jobs = 1,
+                               .pool_mode = POOL_MODE_CHANNELS,
+                               .checksum = CHECKSUM_NONE,
+                               .limit = UINT64_MAX,
+                               .weight = LIMIT_DEFAULT_WEIGHT,
+                               .stats_min_size = STATS_MIN_FILE_SIZE};
+
+        arg_parser = (struct argp){
+            option_copy, parse_option_copy, doc_copy, doc_header_copy, 0, 0, 0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_SILENT, 0, &copy_args);
+
+        free(copy_args.dest);
+        free(copy_args.dedup_root);
+        free(copy_args.to_host);
+        free(copy_args.stats_path);
+        free(copy_args.trace_path);
+        source = copy_args.source;
+        is_remote_source = copy_args.is_server ||
+                           BIT_MATCH(copy_args.flag, FLAG_COPY_BIT_POS_IS_REMOTE);
+    } else if (!strcmp(arg_vec[0], "push")) {
+        PushArgsT push_args = {NULL, NULL, NULL};
+
+        arg_parser = (struct argp){
+            option_push, parse_option_push, doc_push, doc_header_push, 0, 0, 0};
+        argp_parse(&arg_parser, length, arg_vec, ARGP_SILENT, 0, &push_args);
+
+        free(push_args.hosts);
+        free(push_args.dest);
+        source = push_args.source;
+    } else if (strcmp(arg_vec[0], "create")) {
+        return NULL;
+    }
+
+    return source != NULL ? batch_target_path(is_remote_source, source)
+                          : batch_target_none();
+}
+
+/** Hand the local sessions to batch workers, commands forwarded to a master run one
+ * after another. */
+static bool
+batch_sessions(ssh_session *session_ssh_out, sftp_session *session_sftp_out) {
+    *session_ssh_out = session_ssh;
+    *session_sftp_out = current_sftp();
+
+    return master_fd < 0 && session_ssh != NULL;
+}
+
+static BatchHooksT batch_hooks = {subcommand_dispatcher, batch_target, batch_source,
+                                  batch_sessions};
+
+/** Run ``seft --batch <file>``, the exit status tells if every command succeeded. */
+static int
+run_batch(int length, char *arg_vec[]) {
+    BatchArgsT batch_args = {NULL, BATCH_DEFAULT_JOBS, NULL, METRICS_DEFAULT_INTERVAL};
+    struct argp arg_parser = {
+        option_batch, parse_option_batch, doc_batch, doc_header_batch, 0, 0, 0};
+    CommandStatusE result;
+    FILE *script;
+
+    if (argp_parse(&arg_parser, length, arg_vec, 0, 0, &batch_args) ||
+        batch_args.path == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    script = strcmp(batch_args.path, "-") ? fopen(batch_args.path, "r") : stdin;
+    if (script == NULL) {
+        DBG_ERR("Couldn't open batch script %s", batch_args.path);
+        return EXIT_FAILURE;
+    }
+
+    if (batch_args.metrics_path != NULL) {
+        metrics_start_writer(batch_args.metrics_path, batch_args.metrics_interval);
+    }
+
+    result = batch_run(script, batch_args.num_jobs, &batch_hooks);
+    if (script != stdin) {
+        fclose(script);
+    }
+    metrics_stop_writer();
+
+    master_detach(master_fd);
+    close_sessions();
+    clean_connect_options(&connect_options);
+
+    return result == CMD_OK ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
 int
@@ -371,12 +1493,19 @@ main(int length, char *arg_vec[]) {
     char input[4096];
     CommandStatusE result;
 
+    /* ``--batch FILE`` or ``--batch=FILE``, not any option starting with it */
+    if (length > 1 && (!strcmp(arg_vec[1], "-b") ||
+                       (!strncmp(arg_vec[1], "--batch", 7) &&
+                        (arg_vec[1][7] == '\0' || arg_vec[1][7] == '=')))) {
+        return run_batch(length, arg_vec);
+    }
+
     /* Skipping file name */
     arg_vec++;
     length--;
 
     for (;;) {
-        result = subcommand_dispatcher(arg_vec, length);
+        result = repl_dispatcher(arg_vec, length);
 
         if (result == CMD_INVALID_ARGS_COUNT) {
             DBG_ERR("Invalid number of arguments provided: %d", length);
@@ -387,6 +1516,8 @@ main(int length, char *arg_vec[]) {
             arg_vec[0]);
         }
 
+        jobs_report_finished();
+        log_flush();
         printf(REPL_PROMPT);
         if (fgets(input, sizeof(input), stdin) == NULL) {
             break;
@@ -397,11 +1528,11 @@ main(int length, char *arg_vec[]) {
         arg_vec = get_arg_vec(input, &length);
     }
 
-    if (session_sftp != NULL && session_ssh != NULL) {
-        DBG_INFO("Cleaning up ssh and sftp sessions: %s", "");
-        clean_sftp_session(session_sftp);
-        clean_ssh_session(session_ssh);
-    }
+    jobs_clean();
+    metrics_stop_writer();
+    master_detach(master_fd);
+    close_sessions();
+    clean_connect_options(&connect_options);
 
     return 0;
 }
@@ -0,0 +1,357 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "seft_batch.h"
+#include "seft_commands.h"
+#include "seft_debug.h"
+#include "seft_jobs.h"
+#include "seft_loop.h"
+#include "seft_pool.h"
+#include "seft_utils.h"
+
+typedef enum {
+    BATCH_PENDING = 0,
+    BATCH_RUNNING,
+    BATCH_FINISHED,
+} BatchStateE;
+
+/** A command of the script */
+typedef struct {
+    /** Line of the script the command is on, for the summary */
+    size_t line;
+
+    /** The line as written, without the trailing newline */
+    char *command;
+
+    char **arg_vec;
+    uint32_t length;
+
+    /** What the command writes to and reads, see ``BatchHooksT`` */
+    char *target;
+    char *source;
+
+    BatchStateE state;
+    CommandStatusE status;
+} BatchCommandT;
+
+/** State shared by the workers of a run of concurrent commands */
+typedef struct {
+    BatchHooksT *hooks;
+    BatchCommandT *commands;
+
+    /** Oldest unfinished command of the run */
+    size_t first;
+
+    /** End of the run, the next command has to run alone */
+    size_t end;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} BatchRunT;
+
+typedef struct {
+    BatchRunT *run;
+    PoolSlotT slot;
+} BatchWorkerT;
+
+static const char *
+batch_status_str(CommandStatusE status) {
+    switch (status) {
+        case CMD_OK:
+            return "ok";
+        case CMD_INVALID_COMMAND:
+            return "invalid";
+        case CMD_INVALID_ARGS_COUNT:
+        case CMD_INVALID_ARGS_TYPE:
+            return "bad-args";
+        case CMD_INTERNAL_ERROR:
+            return "failed";
+        case CMD_NOT_EXECUTED:
+            return "skipped";
+    }
+
+    return "unknown";
+}
+
+/** Split a line into arguments, a trailing ``&`` is dropped as every command of a
+ * batch may run in the background anyway. */
+static uint32_t
+batch_split(char *line, char ***arg_vec) {
+    char *tokens[MAX_BATCH_ARGS];
+    char *save;
+    uint32_t length = 0;
+
+    for (char *token = strtok_r(line, " \t", &save);
+         token != NULL && length < MAX_BATCH_ARGS; token = strtok_r(NULL, " \t", &save)) {
+        tokens[length++] = token;
+    }
+
+    if (length && !strcmp(tokens[length - 1], JOB_BACKGROUND_TOKEN)) {
+        length--;
+    }
+
+    *arg_vec = DBG_CALLOC(length + 1, sizeof **arg_vec);
+    for (uint32_t i = 0; i < length; i++) {
+        (*arg_vec)[i] = strdup(tokens[i]);
+    }
+
+    return length;
+}
+
+/** Read every command of the script, blank lines and ``#`` comments are skipped. */
+static size_t
+batch_read(FILE *script, BatchHooksT *hooks, BatchCommandT **commands) {
+    char line[BUF_SIZE_BATCH_LINE];
+    size_t num_commands = 0, allocated = 0, num_lines = 0;
+    BatchCommandT *command;
+    char *start;
+    void *grown;
+
+    *commands = NULL;
+    while (fgets(line, sizeof line, script) != NULL) {
+        num_lines++;
+        line[strcspn(line, "\r\n")] = '\0';
+        start = line + strspn(line, " \t");
+        if (*start == '\0' || *start == '#') {
+            continue;
+        }
+
+        if (num_commands == allocated) {
+            allocated = allocated ? allocated * 2 : 64;
+            grown = DBG_REALLOC(*commands, allocated * sizeof **commands);
+            if (grown == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            *commands = grown;
+        }
+
+        command = &(*commands)[num_commands];
+        *command = (BatchCommandT){.line = num_lines, .command = strdup(start)};
+        command->length = batch_split(start, &command->arg_vec);
+        if (!command->length) {
+            free(command->command);
+            DBG_SAFE_FREE(command->arg_vec);
+            continue;
+        }
+        num_commands++;
+
+        command->target = strcmp(command->arg_vec[0], "wait")
+                              ? hooks->target(command->arg_vec, command->length)
+                              : NULL;
+        command->source = command->target != NULL
+                              ? hooks->source(command->arg_vec, command->length)
+                              : NULL;
+        if (command->source == NULL) {
+            DBG_SAFE_FREE(command->target);
+            command->target = NULL;
+        }
+    }
+
+    return num_commands;
+}
+
+/** Check if two targets overlap, a directory overlaps everything below it. */
+static bool
+batch_targets_conflict(const char *target_a, const char *target_b) {
+    size_t len_a = strlen(target_a), len_b = strlen(target_b);
+    size_t len_common = MIN(len_a, len_b);
+    const char *longer = len_a > len_b ? target_a : target_b;
+
+    if (!len_a || !len_b || strncmp(target_a, target_b, len_common)) {
+        return false;
+    }
+
+    return longer[len_common] == '\0' || longer[len_common] == '/' ||
+           longer[len_common - 1] == '/';
+}
+
+/** Find a command that may start now: pending, and neither writing where an earlier
+ * unfinished command writes or reads, nor reading where it writes. Must be called
+ * with the run's lock held.
+ *
+ * :return: Index of the command or ``SIZE_MAX`` if none may start yet. */
+static size_t
+batch_pick(BatchRunT *run) {
+    BatchCommandT *commands = run->commands;
+    size_t end;
+    bool is_blocked;
+
+    while (run->first < run->end && commands[run->first].state == BATCH_FINISHED) {
+        run->first++;
+    }
+    end = MIN(run->end, run->first + BATCH_LOOKAHEAD);
+
+    for (size_t i = run->first; i < end; i++) {
+        if (commands[i].state != BATCH_PENDING) {
+            continue;
+        }
+
+        is_blocked = false;
+        for (size_t j = run->first; j < i && !is_blocked; j++) {
+            is_blocked =
+                commands[j].state != BATCH_FINISHED &&
+                (batch_targets_conflict(commands[i].target, commands[j].target) ||
+                 batch_targets_conflict(commands[i].source, commands[j].target) ||
+                 batch_targets_conflict(commands[i].target, commands[j].source));
+        }
+        if (!is_blocked) {
+            return i;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+static void *
+batch_worker(void *arg) {
+    BatchWorkerT *worker = arg;
+    BatchRunT *run = worker->run;
+    BatchCommandT *command;
+    CommandStatusE status;
+    size_t index;
+
+    SessionPool_bind_thread(&worker->slot);
+
+    pthread_mutex_lock(&run->lock);
+    for (;;) {
+        index = batch_pick(run);
+        if (index == SIZE_MAX) {
+            if (run->first == run->end) {
+                break;
+            }
+            pthread_cond_wait(&run->cond, &run->lock);
+            continue;
+        }
+
+        command = &run->commands[index];
+        command->state = BATCH_RUNNING;
+        pthread_mutex_unlock(&run->lock);
+
+        status = run->hooks->dispatch(command->arg_vec, command->length);
+
+        pthread_mutex_lock(&run->lock);
+        command->status = status;
+        command->state = BATCH_FINISHED;
+        pthread_cond_broadcast(&run->cond);
+    }
+    pthread_cond_broadcast(&run->cond);
+    pthread_mutex_unlock(&run->lock);
+
+    SessionPool_bind_thread(NULL);
+    return NULL;
+}
+
+/** Run commands ``[start, end)`` of the script, which may run concurrently, with up
+ * to ``num_jobs`` workers each on its own channel. */
+static void
+batch_run_concurrent(BatchHooksT *hooks, BatchCommandT *commands, size_t start,
+                     size_t end, size_t num_jobs) {
+    BatchRunT run = {.hooks = hooks, .commands = commands, .first = start, .end = end};
+    BatchWorkerT workers[MAX_BATCH_JOBS];
+    pthread_t threads[MAX_BATCH_JOBS];
+    size_t num_workers = 0;
+    ssh_session session_ssh;
+    sftp_session session_sftp;
+    pthread_mutex_t *lock;
+
+    num_jobs = MIN(num_jobs, end - start);
+    if (num_jobs > 1 && hooks->sessions(&session_ssh, &session_sftp) &&
+        (lock = SftpLoop_session_lock(session_ssh)) != NULL) {
+        pthread_mutex_init(&run.lock, NULL);
+        pthread_cond_init(&run.cond, NULL);
+
+        for (size_t i = 0; i < num_jobs; i++) {
+            workers[num_workers] = (BatchWorkerT){
+                &run, {session_ssh, session_sftp, SftpLoop_new(session_ssh, lock), lock,
+                       false}};
+            if (workers[num_workers].slot.loop == NULL) {
+                break;
+            }
+            SftpLoop_set_bulk(workers[num_workers].slot.loop, true);
+
+            if (pthread_create(&threads[num_workers], NULL, batch_worker,
+                               &workers[num_workers])) {
+                DBG_ERR("Couldn't start batch worker %zu", i);
+                SftpLoop_free(workers[num_workers].slot.loop);
+                break;
+            }
+            num_workers++;
+        }
+
+        for (size_t i = 0; i < num_workers; i++) {
+            pthread_join(threads[i], NULL);
+            SftpLoop_free(workers[i].slot.loop);
+        }
+
+        pthread_cond_destroy(&run.cond);
+        pthread_mutex_destroy(&run.lock);
+    }
+
+    /* Whatever no worker got to runs here, one command after another */
+    for (size_t i = start; i < end; i++) {
+        if (commands[i].state == BATCH_PENDING) {
+            commands[i].status = hooks->dispatch(commands[i].arg_vec, commands[i].length);
+            commands[i].state = BATCH_FINISHED;
+        }
+    }
+}
+
+/**
+ * Run a script of REPL commands. Commands writing to distinct paths run
+ * concurrently unless one reads what another writes, commands that have to run
+ * alone (``connect``, ``bench-ciphers``, ``wait``, ...) wait for everything before
+ * them and hold back everything after.
+ *
+ * :param script: Script with one command per line.
+ * :param num_jobs: Maximum number of commands running at once.
+ * :param hooks: Callbacks running the commands.
+ *
+ * :return: ``CMD_OK`` if every command succeeded, ``CMD_INTERNAL_ERROR`` otherwise.
+ */
+CommandStatusE
+batch_run(FILE *script, size_t num_jobs, BatchHooksT *hooks) {
+    BatchCommandT *commands;
+    size_t num_commands = batch_read(script, hooks, &commands);
+    size_t num_failed = 0, end;
+
+    num_jobs = MAX(1, MIN(num_jobs, MAX_BATCH_JOBS));
+
+    for (size_t start = 0; start < num_commands; start = end) {
+        if (commands[start].target == NULL) {
+            commands[start].status =
+                strcmp(commands[start].arg_vec[0], "wait")
+                    ? hooks->dispatch(commands[start].arg_vec, commands[start].length)
+                    : CMD_OK;
+            commands[start].state = BATCH_FINISHED;
+            end = start + 1;
+            continue;
+        }
+
+        for (end = start; end < num_commands && commands[end].target != NULL; end++) {
+        }
+        batch_run_concurrent(hooks, commands, start, end, num_jobs);
+    }
+
+    printf("%-6s %-9s %s\n", "LINE", "STATUS", "COMMAND");
+    for (size_t i = 0; i < num_commands; i++) {
+        printf("%-6zu %-9s %s\n", commands[i].line, batch_status_str(commands[i].status),
+               commands[i].command);
+        num_failed += commands[i].status != CMD_OK;
+
+        for (uint32_t j = 0; j < commands[i].length; j++) {
+            free(commands[i].arg_vec[j]);
+        }
+        DBG_SAFE_FREE(commands[i].arg_vec);
+        free(commands[i].command);
+        DBG_SAFE_FREE(commands[i].target);
+        DBG_SAFE_FREE(commands[i].source);
+    }
+    printf("%zu commands, %zu failed\n", num_commands, num_failed);
+
+    DBG_SAFE_FREE(commands);
+    return num_failed ? CMD_INTERNAL_ERROR : CMD_OK;
+}
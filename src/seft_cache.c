@@ -0,0 +1,350 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libssh/sftp.h>
+
+#include "seft_cache.h"
+#include "seft_debug.h"
+#include "seft_loop.h"
+#include "seft_path.h"
+#include "seft_utils.h"
+
+#define CACHE_NUM_CHAINS 1024
+
+/** What is known of a remote path, its stat, its listing or both */
+typedef struct CacheEntryS {
+    struct CacheEntryS *next;
+    char *path;
+
+    /** When the stat was read, 0 if it wasn't */
+    double time_stat;
+    LoopAttrT attr;
+
+    /** When the listing was read, 0 if it wasn't. It answers the stat of the entries
+     * in it too. */
+    double time_listing;
+    LoopNameT *names;
+    uint32_t num_names;
+} CacheEntryT;
+
+static CacheEntryT *cache_chains[CACHE_NUM_CHAINS];
+static size_t cache_num_entries = 0;
+static double cache_ttl_s = CACHE_DEFAULT_TTL;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** ``path`` without its trailing separators, the key of its entry. */
+static void
+cache_key(const char *path, char *key) {
+    size_t length = strlen(path);
+
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+    length = MIN(length, BUF_SIZE_FS_PATH - 1);
+
+    memcpy(key, path, length);
+    key[length] = '\0';
+}
+
+/** Key of the directory holding ``key`` and the name in it, false for the root. */
+static bool
+cache_parent_key(const char *key, char *parent, const char **name) {
+    const char *separator = strrchr(key, '/');
+
+    if (separator == NULL) {
+        strcpy(parent, ".");
+        *name = key;
+        return true;
+    }
+    if (separator[1] == '\0') {
+        return false;
+    }
+
+    /* The parent of ``/a`` is ``/`` */
+    cache_key(key, parent);
+    parent[MAX(separator - key, 1)] = '\0';
+    *name = separator + 1;
+    return true;
+}
+
+static size_t
+cache_chain(const char *key) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *key; key++) {
+        hash = (hash ^ (uint8_t)*key) * 0x100000001b3ULL;
+    }
+
+    return hash % CACHE_NUM_CHAINS;
+}
+
+static bool
+cache_is_fresh(double time, double now) {
+    return time > 0 && now - time < cache_ttl_s;
+}
+
+void
+cache_free_names(LoopNameT *names, uint32_t num_names) {
+    for (uint32_t i = 0; i < num_names; i++) {
+        free(names[i].name);
+        free(names[i].longname);
+    }
+    DBG_SAFE_FREE(names);
+}
+
+static LoopNameT *
+cache_copy_names(const LoopNameT *names, uint32_t num_names) {
+    LoopNameT *copy = DBG_CALLOC(MAX(num_names, 1), sizeof *copy);
+
+    for (uint32_t i = 0; copy != NULL && i < num_names; i++) {
+        copy[i] = (LoopNameT){.name = strdup(names[i].name),
+                              .longname = strdup(names[i].longname),
+                              .attr = names[i].attr};
+    }
+
+    return copy;
+}
+
+static void
+cache_entry_free(CacheEntryT *entry) {
+    cache_free_names(entry->names, entry->num_names);
+    free(entry->path);
+    DBG_SAFE_FREE(entry);
+}
+
+/** Drop the entries ``should_drop`` picks. Must be called with the lock held. */
+static void
+cache_drop_if(bool (*should_drop)(const CacheEntryT *, const void *), const void *arg) {
+    CacheEntryT **link, *entry;
+
+    for (size_t i = 0; i < CACHE_NUM_CHAINS; i++) {
+        for (link = &cache_chains[i]; (entry = *link) != NULL;) {
+            if (!should_drop(entry, arg)) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            cache_entry_free(entry);
+            cache_num_entries--;
+        }
+    }
+}
+
+static bool
+cache_is_expired(const CacheEntryT *entry, const void *now) {
+    return !cache_is_fresh(entry->time_stat, *(const double *)now) &&
+           !cache_is_fresh(entry->time_listing, *(const double *)now);
+}
+
+static bool
+cache_is_any(const CacheEntryT *entry, const void *arg) {
+    (void)entry, (void)arg;
+    return true;
+}
+
+/** A path being invalidated and the directory it's in */
+typedef struct {
+    const char *key;
+    size_t length;
+    char parent[BUF_SIZE_FS_PATH];
+    bool has_parent;
+} CacheStaleT;
+
+/** The path itself, what is under it, and the directory it's in */
+static bool
+cache_is_stale(const CacheEntryT *entry, const void *arg) {
+    const CacheStaleT *stale = arg;
+
+    if (!strncmp(entry->path, stale->key, stale->length) &&
+        (entry->path[stale->length] == '\0' || entry->path[stale->length] == '/' ||
+         !strcmp(stale->key, "/"))) {
+        return true;
+    }
+
+    return stale->has_parent && !strcmp(entry->path, stale->parent);
+}
+
+/** Entry of ``key``, added if ``is_adding``. Must be called with the lock held. */
+static CacheEntryT *
+cache_find(const char *key, bool is_adding) {
+    size_t chain = cache_chain(key);
+    CacheEntryT *entry;
+    double now;
+
+    for (entry = cache_chains[chain]; entry != NULL; entry = entry->next) {
+        if (!strcmp(entry->path, key)) {
+            return entry;
+        }
+    }
+    if (!is_adding) {
+        return NULL;
+    }
+
+    if (cache_num_entries >= CACHE_MAX_ENTRIES) {
+        now = get_time_monotonic();
+        cache_drop_if(cache_is_expired, &now);
+    }
+    if (cache_num_entries >= CACHE_MAX_ENTRIES) {
+        cache_drop_if(cache_is_any, NULL);
+    }
+
+    entry = DBG_CALLOC(1, sizeof *entry);
+    if (entry == NULL) {
+        return NULL;
+    }
+    entry->path = strdup(key);
+    entry->next = cache_chains[chain];
+    cache_chains[chain] = entry;
+    cache_num_entries++;
+
+    return entry;
+}
+
+/** Answer listings and stats from memory for ``ttl_s`` seconds after reading them,
+ * 0 to always ask the server. */
+void
+cache_set_ttl(uint32_t ttl_s) {
+    pthread_mutex_lock(&cache_lock);
+    cache_ttl_s = ttl_s;
+    if (!ttl_s) {
+        cache_drop_if(cache_is_any, NULL);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Copy the attributes of ``path`` to ``attr`` if they were read less than the TTL
+ * ago, from a stat of it or from the listing of its directory.
+ *
+ * :return: Whether they were.
+ */
+bool
+cache_get_stat(const char *path, LoopAttrT *attr) {
+    char key[BUF_SIZE_FS_PATH], parent[BUF_SIZE_FS_PATH];
+    double now = get_time_monotonic();
+    const char *name;
+    CacheEntryT *entry;
+    bool is_found = false;
+
+    cache_key(path, key);
+
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_find(key, false);
+    if (entry != NULL && cache_is_fresh(entry->time_stat, now)) {
+        *attr = entry->attr;
+        is_found = true;
+    }
+
+    /* Entries without permissions have no type, they don't answer */
+    entry = !is_found && cache_parent_key(key, parent, &name) ? cache_find(parent, false)
+                                                               : NULL;
+    if (entry != NULL && cache_is_fresh(entry->time_listing, now)) {
+        for (uint32_t i = 0; i < entry->num_names; i++) {
+            if (!strcmp(entry->names[i].name, name) &&
+                entry->names[i].attr.flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+                *attr = entry->names[i].attr;
+                is_found = true;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return is_found;
+}
+
+void
+cache_put_stat(const char *path, const LoopAttrT *attr) {
+    char key[BUF_SIZE_FS_PATH];
+    CacheEntryT *entry;
+
+    cache_key(path, key);
+
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_ttl_s > 0 ? cache_find(key, true) : NULL;
+    if (entry != NULL) {
+        entry->attr = *attr;
+        entry->time_stat = get_time_monotonic();
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Copy the entries of the directory ``path`` if they were read less than the TTL
+ * ago, to be freed with ``cache_free_names``.
+ *
+ * :return: Whether they were.
+ */
+bool
+cache_get_listing(const char *path, LoopNameT **names, uint32_t *num_names) {
+    char key[BUF_SIZE_FS_PATH];
+    CacheEntryT *entry;
+    bool is_found = false;
+
+    cache_key(path, key);
+
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_find(key, false);
+    if (entry != NULL && cache_is_fresh(entry->time_listing, get_time_monotonic())) {
+        *names = cache_copy_names(entry->names, entry->num_names);
+        *num_names = entry->num_names;
+        is_found = *names != NULL;
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    return is_found;
+}
+
+/** Remember every entry of the directory ``path``, e.g. all the READDIR answers of a
+ * listing. */
+void
+cache_put_listing(const char *path, const LoopNameT *names, uint32_t num_names) {
+    char key[BUF_SIZE_FS_PATH];
+    CacheEntryT *entry;
+    LoopNameT *copy;
+
+    cache_key(path, key);
+
+    pthread_mutex_lock(&cache_lock);
+    entry = cache_ttl_s > 0 ? cache_find(key, true) : NULL;
+    copy = entry != NULL ? cache_copy_names(names, num_names) : NULL;
+    if (copy != NULL) {
+        cache_free_names(entry->names, entry->num_names);
+        entry->names = copy;
+        entry->num_names = num_names;
+        entry->time_listing = get_time_monotonic();
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * Forget ``path``, what is under it and the listing of its directory, after
+ * creating, writing or removing it. Paths are compared as given, another spelling
+ * of the same path stays until its TTL runs out.
+ */
+void
+cache_invalidate(const char *path) {
+    char key[BUF_SIZE_FS_PATH];
+    CacheStaleT stale = {.key = key};
+    const char *name;
+
+    cache_key(path, key);
+    stale.length = strlen(key);
+    stale.has_parent = cache_parent_key(key, stale.parent, &name);
+
+    pthread_mutex_lock(&cache_lock);
+    cache_drop_if(cache_is_stale, &stale);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/** Forget everything, e.g. when connecting somewhere else. */
+void
+cache_clear(void) {
+    pthread_mutex_lock(&cache_lock);
+    cache_drop_if(cache_is_any, NULL);
+    pthread_mutex_unlock(&cache_lock);
+}
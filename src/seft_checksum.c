@@ -0,0 +1,631 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define CHECKSUM_HAS_SHA_NI 1
+#endif
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_checksum.h"
+#include "seft_debug.h"
+#include "seft_loop.h"
+#include "seft_path.h"
+#include "seft_utils.h"
+
+/** Reflected polynomial of the CRC-32 used by zlib and the ``check-file`` extension */
+#define CHECKSUM_CRC32_POLYNOMIAL 0xEDB88320
+
+typedef void (*Sha256CompressT)(uint32_t state[8], const uint8_t *data,
+                                size_t num_blocks);
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4,
+    0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe,
+    0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f,
+    0x4a7484aa, 0x5cb0a9dc, 0x76f988da, 0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc,
+    0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070, 0x19a4c116,
+    0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7,
+    0xc67178f2,
+};
+
+static const uint32_t sha256_initial_state[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+/** Slicing-by-8 tables, ``crc32_table[0]`` is the classic byte-at-a-time one */
+static uint32_t crc32_table[8][256];
+
+/** Fastest SHA-256 block function the CPU runs */
+static Sha256CompressT sha256_compress = NULL;
+
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+/** Algorithm copies made by the calling thread are verified with */
+static __thread ChecksumAlgoE thread_algo = CHECKSUM_NONE;
+
+static uint32_t
+rotr32(uint32_t value, uint32_t count) {
+    return value >> count | value << (32 - count);
+}
+
+static uint32_t
+load_be32(const uint8_t *buf) {
+    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 |
+           buf[3];
+}
+
+static uint32_t
+load_le32(const uint8_t *buf) {
+    return (uint32_t)buf[3] << 24 | (uint32_t)buf[2] << 16 | (uint32_t)buf[1] << 8 |
+           buf[0];
+}
+
+static void
+store_be32(uint8_t *buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+static void
+sha256_compress_generic(uint32_t state[8], const uint8_t *data, size_t num_blocks) {
+    uint32_t w[64], s[8], t1, t2;
+
+    for (; num_blocks--; data += CHECKSUM_SHA256_BLOCK_SIZE) {
+        for (size_t i = 0; i < 16; i++) {
+            w[i] = load_be32(data + 4 * i);
+        }
+        for (size_t i = 16; i < 64; i++) {
+            w[i] = w[i - 16] + w[i - 7] +
+                   (rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ w[i - 15] >> 3) +
+                   (rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ w[i - 2] >> 10);
+        }
+
+        memcpy(s, state, sizeof s);
+        for (size_t i = 0; i < 64; i++) {
+            t1 = s[7] + (rotr32(s[4], 6) ^ rotr32(s[4], 11) ^ rotr32(s[4], 25)) +
+                 ((s[4] & s[5]) ^ (~s[4] & s[6])) + sha256_k[i] + w[i];
+            t2 = (rotr32(s[0], 2) ^ rotr32(s[0], 13) ^ rotr32(s[0], 22)) +
+                 ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+            memmove(s + 1, s, 7 * sizeof *s);
+            s[4] += t1;
+            s[0] = t1 + t2;
+        }
+
+        for (size_t i = 0; i < 8; i++) {
+            state[i] += s[i];
+        }
+    }
+}
+
+#ifdef CHECKSUM_HAS_SHA_NI
+/** SHA-256 on the SHA extensions, four rounds per pair of ``sha256rnds2``. */
+__attribute__((target("sha,ssse3,sse4.1"))) static void
+sha256_compress_sha_ni(uint32_t state[8], const uint8_t *data, size_t num_blocks) {
+    const __m128i mask_be =
+        _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state_abef, state_cdgh, saved_abef, saved_cdgh, msg, tmp, w[4];
+
+    /* The instructions keep the state as ABEF and CDGH */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);
+    state_cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B);
+    state_abef = _mm_alignr_epi8(tmp, state_cdgh, 8);
+    state_cdgh = _mm_blend_epi16(state_cdgh, tmp, 0xF0);
+
+    for (; num_blocks--; data += CHECKSUM_SHA256_BLOCK_SIZE) {
+        saved_abef = state_abef;
+        saved_cdgh = state_cdgh;
+
+        for (size_t i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(
+                    _mm_loadu_si128((const __m128i *)(data + 16 * i)), mask_be);
+            } else {
+                /* w[i % 4] holds the words 16 rounds back, w[(i + 3) % 4] the last */
+                tmp = _mm_alignr_epi8(w[(i + 3) % 4], w[(i + 2) % 4], 4);
+                w[i % 4] = _mm_sha256msg2_epu32(
+                    _mm_add_epi32(_mm_sha256msg1_epu32(w[i % 4], w[(i + 1) % 4]), tmp),
+                    w[(i + 3) % 4]);
+            }
+
+            msg = _mm_add_epi32(w[i % 4],
+                                _mm_loadu_si128((const __m128i *)&sha256_k[4 * i]));
+            state_cdgh = _mm_sha256rnds2_epu32(state_cdgh, state_abef, msg);
+            state_abef = _mm_sha256rnds2_epu32(state_abef, state_cdgh,
+                                               _mm_shuffle_epi32(msg, 0x0E));
+        }
+
+        state_abef = _mm_add_epi32(state_abef, saved_abef);
+        state_cdgh = _mm_add_epi32(state_cdgh, saved_cdgh);
+    }
+
+    tmp = _mm_shuffle_epi32(state_abef, 0x1B);
+    state_cdgh = _mm_shuffle_epi32(state_cdgh, 0xB1);
+    _mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(tmp, state_cdgh, 0xF0));
+    _mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(state_cdgh, tmp, 8));
+}
+
+/** Check for the SHA extensions and the SSSE3/SSE4.1 shuffles they're used with. */
+static bool
+checksum_cpu_has_sha_ni(void) {
+    uint32_t eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_SSSE3) ||
+        !(ecx & bit_SSE4_1)) {
+        return false;
+    }
+
+    /* Leaf 7, EBX bit 29 */
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ebx & (1u << 29));
+}
+#endif
+
+static void
+checksum_init_once(void) {
+    uint32_t crc;
+
+    for (uint32_t i = 0; i < 256; i++) {
+        crc = i;
+        for (size_t k = 0; k < 8; k++) {
+            crc = crc & 1 ? crc >> 1 ^ CHECKSUM_CRC32_POLYNOMIAL : crc >> 1;
+        }
+        crc32_table[0][i] = crc;
+    }
+    for (size_t i = 0; i < 256; i++) {
+        for (size_t slice = 1; slice < 8; slice++) {
+            crc32_table[slice][i] = crc32_table[slice - 1][i] >> 8 ^
+                                    crc32_table[0][crc32_table[slice - 1][i] & 0xff];
+        }
+    }
+
+    sha256_compress = sha256_compress_generic;
+#ifdef CHECKSUM_HAS_SHA_NI
+    if (checksum_cpu_has_sha_ni()) {
+        DBG_DEBUG("Hashing with the SHA extensions %s", "");
+        sha256_compress = sha256_compress_sha_ni;
+    }
+#endif
+}
+
+/** CRC-32 eight bytes at a time, ``crc`` is kept inverted between calls. */
+static uint32_t
+crc32_update(uint32_t crc, const uint8_t *data, size_t length) {
+    uint32_t low, high;
+
+    for (; length >= 8; data += 8, length -= 8) {
+        low = load_le32(data) ^ crc;
+        high = load_le32(data + 4);
+        crc = crc32_table[7][low & 0xff] ^ crc32_table[6][low >> 8 & 0xff] ^
+              crc32_table[5][low >> 16 & 0xff] ^ crc32_table[4][low >> 24] ^
+              crc32_table[3][high & 0xff] ^ crc32_table[2][high >> 8 & 0xff] ^
+              crc32_table[1][high >> 16 & 0xff] ^ crc32_table[0][high >> 24];
+    }
+    while (length--) {
+        crc = crc >> 8 ^ crc32_table[0][(crc ^ *data++) & 0xff];
+    }
+
+    return crc;
+}
+
+static void
+sha256_update(ChecksumT *self, const uint8_t *data, size_t length) {
+    size_t num_bytes;
+
+    if (self->hash.sha256.len_block) {
+        num_bytes = MIN(length, CHECKSUM_SHA256_BLOCK_SIZE - self->hash.sha256.len_block);
+        memcpy(self->hash.sha256.block + self->hash.sha256.len_block, data, num_bytes);
+        self->hash.sha256.len_block += num_bytes;
+        data += num_bytes;
+        length -= num_bytes;
+
+        if (self->hash.sha256.len_block < CHECKSUM_SHA256_BLOCK_SIZE) {
+            return;
+        }
+        sha256_compress(self->hash.sha256.state, self->hash.sha256.block, 1);
+        self->hash.sha256.len_block = 0;
+    }
+
+    /* Whole blocks are hashed straight from the chunk */
+    sha256_compress(self->hash.sha256.state, data, length / CHECKSUM_SHA256_BLOCK_SIZE);
+    data += length - length % CHECKSUM_SHA256_BLOCK_SIZE;
+    length %= CHECKSUM_SHA256_BLOCK_SIZE;
+
+    memcpy(self->hash.sha256.block, data, length);
+    self->hash.sha256.len_block = length;
+}
+
+/** Hash the part of a chunk past what's already hashed. */
+static void
+checksum_hash(ChecksumT *self, uint64_t offset, const uint8_t *data, size_t length) {
+    size_t num_skipped;
+
+    if (offset + length <= self->offset) {
+        return;
+    }
+
+    num_skipped = self->offset - offset;
+    data += num_skipped;
+    length -= num_skipped;
+
+    if (self->algo == CHECKSUM_SHA256) {
+        sha256_update(self, data, length);
+    } else if (self->algo == CHECKSUM_CRC32) {
+        self->hash.crc32 = crc32_update(self->hash.crc32, data, length);
+    }
+    self->offset += length;
+}
+
+/**
+ * Start a digest.
+ *
+ * :param algo: Algorithm to hash with, ``CHECKSUM_NONE`` makes every other call a
+ *     no-op.
+ */
+void
+Checksum_init(ChecksumT *self, ChecksumAlgoE algo) {
+    pthread_once(&checksum_once, checksum_init_once);
+
+    memset(self, 0, sizeof *self);
+    self->algo = algo;
+    if (algo == CHECKSUM_SHA256) {
+        memcpy(self->hash.sha256.state, sha256_initial_state,
+               sizeof sha256_initial_state);
+    } else if (algo == CHECKSUM_CRC32) {
+        self->hash.crc32 = UINT32_MAX;
+    }
+}
+
+/**
+ * Hash the bytes ``[offset, offset + length)`` of the file. A chunk past the bytes
+ * hashed so far is copied and waits for the ones before it, bytes already hashed
+ * are skipped, e.g. when a transfer resumes.
+ */
+void
+Checksum_feed(ChecksumT *self, uint64_t offset, const uint8_t *data, size_t length) {
+    ChecksumChunkT *chunk;
+    void *grown;
+    bool is_progress = true;
+
+    if (self->algo == CHECKSUM_NONE || !length) {
+        return;
+    }
+
+    if (offset > self->offset) {
+        if (self->num_chunks == self->chunks_allocated) {
+            self->chunks_allocated = self->chunks_allocated ? self->chunks_allocated * 2
+                                                            : LOOP_WINDOW;
+            grown = DBG_REALLOC(self->chunks,
+                                self->chunks_allocated * sizeof *self->chunks);
+            if (grown == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            self->chunks = grown;
+        }
+
+        chunk = &self->chunks[self->num_chunks++];
+        *chunk = (ChecksumChunkT){offset, DBG_MALLOC(length), length};
+        memcpy(chunk->data, data, length);
+        return;
+    }
+
+    checksum_hash(self, offset, data, length);
+
+    /* Chunks that were waiting for these bytes */
+    while (is_progress) {
+        is_progress = false;
+        for (size_t i = 0; i < self->num_chunks && !is_progress; i++) {
+            chunk = &self->chunks[i];
+            if (chunk->offset > self->offset) {
+                continue;
+            }
+
+            checksum_hash(self, chunk->offset, chunk->data, chunk->length);
+            DBG_SAFE_FREE(chunk->data);
+            *chunk = self->chunks[--self->num_chunks];
+            is_progress = true;
+        }
+    }
+}
+
+/** Hash the zeros of a hole ``[offset, offset + length)`` that wasn't copied. */
+void
+Checksum_feed_zeros(ChecksumT *self, uint64_t offset, uint64_t length) {
+    static const uint8_t zeros[LOOP_CHUNK_SIZE];
+    size_t num_bytes;
+
+    if (self->algo == CHECKSUM_NONE) {
+        return;
+    }
+
+    for (; length; offset += num_bytes, length -= num_bytes) {
+        num_bytes = MIN(length, sizeof zeros);
+        Checksum_feed(self, offset, zeros, num_bytes);
+    }
+}
+
+/**
+ * Finish the digest.
+ *
+ * :param digest: Filled with at most ``CHECKSUM_MAX_DIGEST_SIZE`` bytes.
+ *
+ * :return: Length of the digest, 0 if bytes are missing between the chunks fed.
+ */
+size_t
+Checksum_final(ChecksumT *self, uint8_t *digest) {
+    uint8_t padding[2 * CHECKSUM_SHA256_BLOCK_SIZE] = {0x80};
+    size_t len_padding;
+    uint64_t num_bits = self->offset * 8;
+
+    if (self->num_chunks) {
+        return 0;
+    }
+
+    switch (self->algo) {
+        case CHECKSUM_SHA256:
+            /* 0x80, zeros up to 8 bytes short of a block, then the length in bits */
+            len_padding = CHECKSUM_SHA256_BLOCK_SIZE - self->hash.sha256.len_block;
+            if (len_padding < 9) {
+                len_padding += CHECKSUM_SHA256_BLOCK_SIZE;
+            }
+            store_be32(padding + len_padding - 8, num_bits >> 32);
+            store_be32(padding + len_padding - 4, num_bits);
+            sha256_update(self, padding, len_padding);
+
+            for (size_t i = 0; i < 8; i++) {
+                store_be32(digest + 4 * i, self->hash.sha256.state[i]);
+            }
+            return 32;
+        case CHECKSUM_CRC32:
+            store_be32(digest, ~self->hash.crc32);
+            return 4;
+        case CHECKSUM_NONE:
+            break;
+    }
+
+    return 0;
+}
+
+/** Free the chunks still waiting, the digest can be started again afterwards. */
+void
+Checksum_free(ChecksumT *self) {
+    for (size_t i = 0; i < self->num_chunks; i++) {
+        DBG_SAFE_FREE(self->chunks[i].data);
+    }
+    DBG_SAFE_FREE(self->chunks);
+    self->chunks = NULL;
+    self->num_chunks = self->chunks_allocated = 0;
+}
+
+/** Parse an algorithm name, ``CHECKSUM_NONE`` if it's unknown. */
+ChecksumAlgoE
+checksum_algo_parse(const char *name) {
+    if (!strcmp(name, "sha256")) {
+        return CHECKSUM_SHA256;
+    } else if (!strcmp(name, "crc32")) {
+        return CHECKSUM_CRC32;
+    }
+
+    return CHECKSUM_NONE;
+}
+
+/** Name of an algorithm, as used by the ``check-file`` extension. */
+const char *
+checksum_algo_str(ChecksumAlgoE algo) {
+    switch (algo) {
+        case CHECKSUM_SHA256:
+            return "sha256";
+        case CHECKSUM_CRC32:
+            return "crc32";
+        case CHECKSUM_NONE:
+            break;
+    }
+
+    return "none";
+}
+
+/** Verify copies made by the calling thread with ``algo``, pool workers inherit it
+ * from the thread that started the copy. */
+void
+checksum_bind_thread(ChecksumAlgoE algo) {
+    thread_algo = algo;
+}
+
+/** Algorithm copies made by the calling thread are verified with. */
+ChecksumAlgoE
+checksum_current(void) {
+    return thread_algo;
+}
+
+/** Write ``digest`` as ``2 * length`` hex digits, ``hex`` is NUL-terminated. */
+void
+checksum_to_hex(const uint8_t *digest, size_t length, char *hex) {
+    for (size_t i = 0; i < length; i++) {
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    }
+    hex[2 * length] = '\0';
+}
+
+/** Decode ``2 * length`` hex digits, false if ``hex`` is shorter or not hex. */
+bool
+checksum_from_hex(const char *hex, uint8_t *digest, size_t length) {
+    uint32_t byte;
+
+    for (size_t i = 0; i < length; i++) {
+        if (sscanf(hex + 2 * i, "%2x", &byte) != 1) {
+            return false;
+        }
+        digest[i] = byte;
+    }
+
+    return true;
+}
+
+static void
+put_u32(uint8_t *buf, size_t *length, uint32_t value) {
+    store_be32(buf + *length, value);
+    *length += 4;
+}
+
+/** Reply of a ``check-file-name`` request */
+typedef struct {
+    uint32_t status;
+    ChecksumAlgoE algo;
+    uint8_t digest[CHECKSUM_MAX_DIGEST_SIZE];
+    size_t len_digest;
+} CheckFileT;
+
+/** Parse ``string "check-file", string algorithm, byte[] hash``. */
+static void
+check_file_callback(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    CheckFileT *check_file = user_data;
+    const uint8_t *data = result->data;
+    size_t length = result->len_data, len_field;
+    char algo[BUF_SIZE_FS_NAME];
+
+    (void)loop;
+    check_file->status = result->status;
+    if (result->status != SSH_FX_OK) {
+        return;
+    }
+
+    for (size_t field = 0; field < 2; field++) {
+        len_field = length >= 4 ? load_be32(data) : SIZE_MAX;
+        if (len_field > length - 4 || len_field >= sizeof algo) {
+            check_file->status = SSH_FX_BAD_MESSAGE;
+            return;
+        }
+        memcpy(algo, data + 4, len_field);
+        algo[len_field] = '\0';
+        data += 4 + len_field;
+        length -= 4 + len_field;
+    }
+
+    check_file->algo = checksum_algo_parse(algo);
+    check_file->len_digest = MIN(length, CHECKSUM_MAX_DIGEST_SIZE);
+    memcpy(check_file->digest, data, check_file->len_digest);
+}
+
+/** Ask the server for the digest of a whole file with the ``check-file`` extension. */
+static CommandStatusE
+checksum_remote_check_file(SftpLoopT *loop, const char *path, ChecksumAlgoE algo,
+                           uint8_t *digest, size_t *len_digest) {
+    CheckFileT check_file = {.status = SSH_FX_NO_CONNECTION};
+    const char *name = checksum_algo_str(algo);
+    size_t len_path = strlen(path), len_name = strlen(name), length = 0;
+    uint8_t *payload = DBG_MALLOC(len_path + len_name + 28);
+
+    /* string path, string algorithms, uint64 offset, uint64 length, uint32 block */
+    put_u32(payload, &length, len_path);
+    memcpy(payload + length, path, len_path);
+    length += len_path;
+    put_u32(payload, &length, len_name);
+    memcpy(payload + length, name, len_name);
+    length += len_name;
+    memset(payload + length, 0, 20);
+    length += 20;
+
+    if (SftpLoop_extended(loop, "check-file-name", payload, length, check_file_callback,
+                          &check_file)) {
+        SftpLoop_run(loop);
+    }
+    DBG_SAFE_FREE(payload);
+
+    if (check_file.status != SSH_FX_OK || check_file.algo != algo) {
+        DBG_DEBUG("check-file of %s failed: %s", path,
+                  SftpLoop_status_str(check_file.status));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    memcpy(digest, check_file.digest, check_file.len_digest);
+    *len_digest = check_file.len_digest;
+    return CMD_OK;
+}
+
+/** Run ``sha256sum`` on the server, for servers without ``check-file``. */
+static CommandStatusE
+checksum_remote_exec(SftpLoopT *loop, const char *path, uint8_t *digest,
+                     size_t *len_digest) {
+    char quoted[2 * BUF_SIZE_FS_PATH], command[2 * BUF_SIZE_FS_PATH + 32];
+    char output[BUF_SIZE_CHECKSUM_OUTPUT];
+    int32_t exit_status = -1;
+
+    if (!shell_quote(path, quoted, sizeof quoted)) {
+        return CMD_INVALID_ARGS_TYPE;
+    }
+    snprintf(command, sizeof command, "sha256sum -- %s", quoted);
+
+    if (SftpLoop_exec(loop, command, output, sizeof output, &exit_status) != CMD_OK ||
+        exit_status != 0 || !checksum_from_hex(output, digest, 32)) {
+        DBG_DEBUG("sha256sum of %s failed with status %d", path, exit_status);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    *len_digest = 32;
+    return CMD_OK;
+}
+
+/**
+ * Compare the digest of a copy with the server's digest of the remote file and
+ * print whether the file is verified.
+ *
+ * :param loop: Loop of the connection the file was copied over.
+ * :param path_remote: Remote side of the copy.
+ * :param checksum: Digest of the bytes copied.
+ *
+ * :return: ``CMD_INTERNAL_ERROR`` if the digests differ, ``CMD_OK`` otherwise, even
+ *     if the server couldn't compute its digest.
+ */
+CommandStatusE
+checksum_verify(SftpLoopT *loop, const char *path_remote, ChecksumT *checksum) {
+    uint8_t digest_local[CHECKSUM_MAX_DIGEST_SIZE];
+    uint8_t digest_remote[CHECKSUM_MAX_DIGEST_SIZE];
+    char hex_local[2 * CHECKSUM_MAX_DIGEST_SIZE + 1];
+    char hex_remote[2 * CHECKSUM_MAX_DIGEST_SIZE + 1];
+    size_t len_local = Checksum_final(checksum, digest_local), len_remote = 0;
+    const char *algo = checksum_algo_str(checksum->algo);
+    CommandStatusE status = CMD_INTERNAL_ERROR;
+
+    if (!len_local) {
+        printf("%-10s %-6s %s\n", "unverified", algo, path_remote);
+        return CMD_OK;
+    }
+
+    if (SftpLoop_has_extension(loop, "check-file")) {
+        status = checksum_remote_check_file(loop, path_remote, checksum->algo,
+                                            digest_remote, &len_remote);
+    }
+    if (status != CMD_OK && checksum->algo == CHECKSUM_SHA256) {
+        status = checksum_remote_exec(loop, path_remote, digest_remote, &len_remote);
+    }
+
+    if (status != CMD_OK) {
+        printf("%-10s %-6s %s\n", "unverified", algo, path_remote);
+        return CMD_OK;
+    }
+
+    if (len_local != len_remote || memcmp(digest_local, digest_remote, len_local)) {
+        checksum_to_hex(digest_local, len_local, hex_local);
+        checksum_to_hex(digest_remote, len_remote, hex_remote);
+        DBG_ERR("%s of %s differs: copied %s, server has %s", algo, path_remote,
+                hex_local, hex_remote);
+        printf("%-10s %-6s %s\n", "FAILED", algo, path_remote);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    printf("%-10s %-6s %s\n", "verified", algo, path_remote);
+    return CMD_OK;
+}
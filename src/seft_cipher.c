@@ -0,0 +1,435 @@
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_ansi_colors.h"
+#include "seft_cipher.h"
+#include "seft_client.h"
+#include "seft_commands.h"
+#include "seft_debug.h"
+#include "seft_list.h"
+#include "seft_path.h"
+#include "seft_utils.h"
+
+#define BUF_SIZE_CIPHER_LIST 512
+#define BUF_SIZE_CACHE_LINE 1280
+
+#define BYTES_PER_MIB (1024.0 * 1024.0)
+
+/** Cipher/MAC pairs tried by the benchmark. AEAD ciphers carry their own integrity
+ * check, so they are only tried once without an explicit MAC. */
+static const struct {
+    const char *cipher;
+    const char *hmac;
+} cipher_candidates[] = {
+    {"aes128-gcm@openssh.com", NULL},
+    {"aes256-gcm@openssh.com", NULL},
+    {"chacha20-poly1305@openssh.com", NULL},
+    {"aes128-ctr", "hmac-sha2-256-etm@openssh.com"},
+    {"aes128-ctr", "hmac-sha2-512-etm@openssh.com"},
+    {"aes128-ctr", "hmac-sha1"},
+    {"aes256-ctr", "hmac-sha2-256-etm@openssh.com"},
+    {"aes256-ctr", "hmac-sha2-512-etm@openssh.com"},
+};
+
+#define NUM_CIPHER_CANDIDATES (sizeof cipher_candidates / sizeof *cipher_candidates)
+
+/**
+ * Measure throughput by streaming ``num_bytes`` into ``cat > /dev/null`` on the remote.
+ * This keeps the server's disk out of the measurement.
+ *
+ * :return: Throughput in MiB/s or a negative value if the server refuses ``exec``.
+ */
+static double
+cipher_measure_exec(ssh_session session, size_t num_bytes) {
+    char buf[BUF_SIZE_FILE_CONTENTS] = {0};
+    ssh_channel channel = ssh_channel_new(session);
+    size_t num_bytes_sent = 0;
+    int32_t result;
+    double start, elapsed;
+
+    if (channel == NULL) {
+        return -1;
+    }
+
+    if (ssh_channel_open_session(channel) != SSH_OK) {
+        ssh_channel_free(channel);
+        return -1;
+    }
+
+    if (ssh_channel_request_exec(channel, "cat > /dev/null") != SSH_OK) {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        return -1;
+    }
+
+    start = get_time_monotonic();
+    while (num_bytes_sent < num_bytes) {
+        result = ssh_channel_write(channel, buf, sizeof buf);
+        if (result == SSH_ERROR) {
+            ssh_channel_close(channel);
+            ssh_channel_free(channel);
+            return -1;
+        }
+        num_bytes_sent += result;
+    }
+
+    /* Wait for the remote end to drain everything and close the channel */
+    ssh_channel_send_eof(channel);
+    while (ssh_channel_read(channel, buf, sizeof buf, 0) > 0) {
+    }
+    elapsed = get_time_monotonic() - start;
+
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+
+    return num_bytes_sent / BYTES_PER_MIB / elapsed;
+}
+
+/**
+ * Measure throughput by writing ``num_bytes`` to a scratch file over SFTP.
+ * Used for servers which only allow the sftp subsystem.
+ *
+ * :return: Throughput in MiB/s or a negative value on failure.
+ */
+static double
+cipher_measure_sftp(ssh_session session, size_t num_bytes) {
+    char buf[BUF_SIZE_FILE_CONTENTS] = {0};
+    char path_buf[BUF_SIZE_FS_NAME];
+    size_t num_bytes_sent = 0;
+    ssize_t result;
+    double start, elapsed;
+    sftp_file file;
+    sftp_session session_sftp = sftp_new(session);
+
+    if (session_sftp == NULL) {
+        return -1;
+    }
+
+    if (sftp_init(session_sftp) != SSH_OK) {
+        sftp_free(session_sftp);
+        return -1;
+    }
+
+    snprintf(path_buf, BUF_SIZE_FS_NAME, ".seft-cipher-bench-%d", getpid());
+    file = sftp_open(session_sftp, path_buf, O_CREAT | O_WRONLY | O_TRUNC,
+                     S_IRUSR | S_IWUSR);
+    if (file == NULL) {
+        DBG_ERR("Couldn't create benchmark file %s: %s", path_buf,
+                ssh_get_error(session));
+        sftp_free(session_sftp);
+        return -1;
+    }
+
+    start = get_time_monotonic();
+    while (num_bytes_sent < num_bytes) {
+        result = sftp_write(file, buf, sizeof buf);
+        if (result < 0) {
+            break;
+        }
+        num_bytes_sent += result;
+    }
+    sftp_close(file);
+    elapsed = get_time_monotonic() - start;
+
+    sftp_unlink(session_sftp, path_buf);
+    sftp_free(session_sftp);
+
+    if (num_bytes_sent < num_bytes) {
+        return -1;
+    }
+
+    return num_bytes_sent / BYTES_PER_MIB / elapsed;
+}
+
+/** Connect with a single cipher/MAC pair and measure it. */
+static void
+cipher_bench_pair(ConnectOptionsT *options, size_t num_bytes, CipherBenchT *result) {
+    ssh_session session;
+    double start = get_time_monotonic();
+    ConnectOptionsT pair_options = *options;
+
+    pair_options.ciphers = (char *)result->cipher;
+    if (result->hmac != NULL) {
+        pair_options.hmacs = (char *)result->hmac;
+    }
+
+    session = try_ssh_init(&pair_options);
+
+    /* The first successful authentication prompts for the passphrase */
+    memcpy(options->passphrase, pair_options.passphrase, BUF_SIZE_PASSPHRASE);
+    memset(pair_options.passphrase, 0, BUF_SIZE_PASSPHRASE);
+
+    if (session == NULL) {
+        DBG_INFO("Cipher %s is not negotiable", result->cipher);
+        return;
+    }
+
+    result->is_negotiated = true;
+    result->handshake_ms = (get_time_monotonic() - start) * 1e3;
+    snprintf(result->kex, BUF_SIZE_FS_NAME, "%s", ssh_get_kex_algo(session));
+
+    result->throughput = cipher_measure_exec(session, num_bytes);
+    if (result->throughput < 0) {
+        DBG_INFO("Exec refused, falling back to sftp for %s", result->cipher);
+        result->throughput = cipher_measure_sftp(session, num_bytes);
+    }
+
+    clean_ssh_session(session);
+}
+
+/** Sort helper: fastest first, pairs which failed go last. */
+static int
+cipher_bench_compare(const void *a, const void *b) {
+    const CipherBenchT *lhs = a;
+    const CipherBenchT *rhs = b;
+    double lhs_throughput = lhs->is_negotiated ? lhs->throughput : -1;
+    double rhs_throughput = rhs->is_negotiated ? rhs->throughput : -1;
+
+    return (lhs_throughput < rhs_throughput) - (lhs_throughput > rhs_throughput);
+}
+
+/**
+ * Benchmark every candidate cipher/MAC pair against the server in ``options``.
+ * Each pair gets its own connection, so the passphrase is asked at most once.
+ *
+ * :param options: Options of the current connection.
+ * :param num_bytes: Amount of data to push through each pair.
+ * :param results: Set to an array of results sorted by throughput, fastest first.
+ *     It must be freed by the caller.
+ *
+ * :return: Number of entries in ``results``.
+ */
+size_t
+cipher_bench_run(ConnectOptionsT *options, size_t num_bytes, CipherBenchT **results) {
+    CipherBenchT *bench = DBG_CALLOC(NUM_CIPHER_CANDIDATES, sizeof *bench);
+
+    for (size_t i = 0; i < NUM_CIPHER_CANDIDATES; i++) {
+        bench[i].cipher = cipher_candidates[i].cipher;
+        bench[i].hmac = cipher_candidates[i].hmac;
+        printf("Benchmarking %s %s\n", bench[i].cipher,
+               bench[i].hmac == NULL ? "" : bench[i].hmac);
+        cipher_bench_pair(options, num_bytes, &bench[i]);
+    }
+
+    qsort(bench, NUM_CIPHER_CANDIDATES, sizeof *bench, cipher_bench_compare);
+    *results = bench;
+
+    return NUM_CIPHER_CANDIDATES;
+}
+
+/** Print the benchmark results as a table. */
+void
+cipher_bench_print(CipherBenchT *results, size_t num_results) {
+    printf(ANSI_BOLD "%-30s %-30s %-32s %12s %12s\n" ANSI_RESET, "cipher", "mac", "kex",
+           "handshake", "MiB/s");
+
+    for (size_t i = 0; i < num_results; i++) {
+        if (!results[i].is_negotiated) {
+            printf("%-30s %-30s " ANSI_FG_RED "%s" ANSI_RESET "\n", results[i].cipher,
+                   results[i].hmac == NULL ? "(aead)" : results[i].hmac,
+                   "not negotiable");
+            continue;
+        }
+
+        printf("%-30s %-30s %-32s %10.1fms %12.1f\n", results[i].cipher,
+               results[i].hmac == NULL ? "(aead)" : results[i].hmac, results[i].kex,
+               results[i].handshake_ms, results[i].throughput);
+    }
+}
+
+/** Append ``name`` to the comma separated ``list`` unless it's already in it. */
+static void
+cipher_list_append_unique(char *list, const char *name) {
+    size_t len_name = strlen(name);
+
+    for (char *found = strstr(list, name); found != NULL;
+         found = strstr(found + 1, name)) {
+        if ((found == list || found[-1] == ',') &&
+            (found[len_name] == ',' || found[len_name] == '\0')) {
+            return;
+        }
+    }
+
+    if (strlen(list) + len_name + 2 > BUF_SIZE_CIPHER_LIST) {
+        return;
+    }
+
+    if (*list) {
+        strcat(list, ",");
+    }
+    strcat(list, name);
+}
+
+/**
+ * Build libssh preference lists out of sorted benchmark results.
+ *
+ * :param ciphers: Set to the negotiable ciphers, fastest first, or ``NULL``.
+ * :param hmacs: Set to the negotiable MACs, fastest first, or ``NULL``.
+ *
+ * .. note:: Both strings must be freed by the caller.
+ */
+void
+cipher_bench_order(CipherBenchT *results, size_t num_results, char **ciphers,
+                   char **hmacs) {
+    char cipher_list[BUF_SIZE_CIPHER_LIST] = {0};
+    char hmac_list[BUF_SIZE_CIPHER_LIST] = {0};
+
+    for (size_t i = 0; i < num_results; i++) {
+        if (!results[i].is_negotiated || results[i].throughput < 0) {
+            continue;
+        }
+
+        cipher_list_append_unique(cipher_list, results[i].cipher);
+        if (results[i].hmac != NULL) {
+            cipher_list_append_unique(hmac_list, results[i].hmac);
+        }
+    }
+
+    *ciphers = *cipher_list ? strdup(cipher_list) : NULL;
+    *hmacs = *hmac_list ? strdup(hmac_list) : NULL;
+}
+
+/**
+ * Look up the cached cipher order of a host.
+ *
+ * :param ciphers: Set to the cached cipher list, must be freed by the caller.
+ * :param hmacs: Set to the cached MAC list or ``NULL``, must be freed by the caller.
+ *
+ * :return: ``CMD_OK`` if the host was found, ``CMD_NOT_EXECUTED`` otherwise.
+ */
+CommandStatusE
+cipher_cache_load(char *host_name, uint32_t port_id, char **ciphers, char **hmacs) {
+    char line[BUF_SIZE_CACHE_LINE];
+    char cached_host[BUF_SIZE_FS_NAME];
+    char cached_ciphers[BUF_SIZE_CIPHER_LIST];
+    char cached_hmacs[BUF_SIZE_CIPHER_LIST];
+    uint32_t cached_port;
+    CommandStatusE status = CMD_NOT_EXECUTED;
+    char *cache_path = get_cache_path(CIPHER_CACHE_FILE_NAME);
+    FILE *cache_file;
+
+    if (cache_path == NULL) {
+        return CMD_NOT_EXECUTED;
+    }
+
+    cache_file = fopen(cache_path, "r");
+    DBG_SAFE_FREE(cache_path);
+    if (cache_file == NULL) {
+        return CMD_NOT_EXECUTED;
+    }
+
+    while (fgets(line, sizeof line, cache_file) != NULL) {
+        if (sscanf(line, "%127s %u %511s %511s", cached_host, &cached_port,
+                   cached_ciphers, cached_hmacs) != 4) {
+            continue;
+        }
+
+        if (strcmp(cached_host, host_name) || cached_port != port_id) {
+            continue;
+        }
+
+        *ciphers = strdup(cached_ciphers);
+        *hmacs = strcmp(cached_hmacs, "-") ? strdup(cached_hmacs) : NULL;
+        status = CMD_OK;
+        break;
+    }
+
+    fclose(cache_file);
+    return status;
+}
+
+/**
+ * Store the cipher order of a host, replacing any older entry for it.
+ * The cache is rewritten into a temporary file and renamed over the old one.
+ */
+CommandStatusE
+cipher_cache_store(char *host_name, uint32_t port_id, char *ciphers, char *hmacs) {
+    char line[BUF_SIZE_CACHE_LINE];
+    char tmp_path[BUF_SIZE_FS_PATH];
+    char cached_host[BUF_SIZE_FS_NAME];
+    uint32_t cached_port;
+    char *cache_path = get_cache_path(CIPHER_CACHE_FILE_NAME);
+    FILE *cache_file, *tmp_file;
+
+    if (cache_path == NULL || ciphers == NULL) {
+        DBG_SAFE_FREE(cache_path);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    snprintf(tmp_path, BUF_SIZE_FS_PATH, "%s.%d", cache_path, getpid());
+    tmp_file = fopen(tmp_path, "w");
+    if (tmp_file == NULL) {
+        DBG_ERR("Couldn't write cipher cache: %s", tmp_path);
+        DBG_SAFE_FREE(cache_path);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    cache_file = fopen(cache_path, "r");
+    if (cache_file != NULL) {
+        while (fgets(line, sizeof line, cache_file) != NULL) {
+            if (sscanf(line, "%127s %u", cached_host, &cached_port) == 2 &&
+                !strcmp(cached_host, host_name) && cached_port == port_id) {
+                continue;
+            }
+            fputs(line, tmp_file);
+        }
+        fclose(cache_file);
+    }
+
+    fprintf(tmp_file, "%s %u %s %s\n", host_name, port_id, ciphers,
+            hmacs == NULL ? "-" : hmacs);
+    fclose(tmp_file);
+
+    if (rename(tmp_path, cache_path)) {
+        DBG_ERR("Couldn't replace cipher cache: %s", cache_path);
+        unlink(tmp_path);
+        DBG_SAFE_FREE(cache_path);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    DBG_SAFE_FREE(cache_path);
+    return CMD_OK;
+}
+
+/**
+ * Put the fastest ciphers first in ``options``. The order is taken from the cache
+ * if the host was benchmarked before, otherwise the benchmark is run and cached.
+ */
+CommandStatusE
+cipher_select_auto(ConnectOptionsT *options) {
+    size_t num_results;
+    CipherBenchT *results;
+    char *ciphers = NULL;
+    char *hmacs = NULL;
+
+    if (cipher_cache_load(options->host_name, options->port_id, &ciphers, &hmacs) !=
+        CMD_OK) {
+        num_results = cipher_bench_run(options, CIPHER_BENCH_DEFAULT_MIB * BYTES_PER_MIB,
+                                       &results);
+        cipher_bench_print(results, num_results);
+        cipher_bench_order(results, num_results, &ciphers, &hmacs);
+        DBG_SAFE_FREE(results);
+
+        if (ciphers == NULL) {
+            DBG_ERR("No cipher could be negotiated with %s", options->host_name);
+            return CMD_INTERNAL_ERROR;
+        }
+        cipher_cache_store(options->host_name, options->port_id, ciphers, hmacs);
+    }
+
+    DBG_INFO("Using ciphers %s", ciphers);
+    DBG_SAFE_FREE(options->ciphers);
+    DBG_SAFE_FREE(options->hmacs);
+    options->ciphers = ciphers;
+    options->hmacs = hmacs;
+
+    return CMD_OK;
+}
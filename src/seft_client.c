@@ -1,20 +1,36 @@
+/* SEEK_DATA and SEEK_HOLE */
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include <libssh/libssh.h>
 #include <libssh/sftp.h>
 
 #include "seft_commands.h"
 #include "seft_debug.h"
+#include "seft_dedup.h"
+#include "seft_jobs.h"
+#include "seft_limit.h"
 #include "seft_ansi_colors.h"
+#include "seft_cache.h"
+#include "seft_checksum.h"
 #include "seft_client.h"
+#include "seft_compress.h"
 #include "seft_list.h"
+#include "seft_loop.h"
 #include "seft_path.h"
+#include "seft_stats.h"
+#include "seft_trace.h"
 #include "seft_utils.h"
 #include "config.h"
 
@@ -33,40 +49,164 @@
  */
 ssh_session
 do_ssh_init(char *host_name, uint32_t port_id) {
+    ssh_session session;
+    ConnectOptionsT options = {.host_name = host_name, .port_id = port_id};
+
+    session = do_ssh_init_options(&options);
+    memset(options.passphrase, 0, BUF_SIZE_PASSPHRASE);
+
+    return session;
+}
+
+/**
+ * Same as ``do_ssh_init`` but takes the full set of connection options.
+ *
+ * :param options: Connection options, ``options->passphrase`` is filled in
+ *     after the user is prompted for it.
+ *
+ * .. note:: This function will exit the program if any error occurs.
+ */
+ssh_session
+do_ssh_init_options(ConnectOptionsT *options) {
+    ssh_session session = try_ssh_init(options);
+
+    if (session == NULL) {
+        exit(EXIT_FAILURE);
+    }
+
+    return session;
+}
+
+/** Apply the connection options to a session before it connects. */
+static void
+ssh_set_connect_options(ssh_session session, ConnectOptionsT *options) {
+    long timeout = options->dead_timeout;
+
+    ssh_options_set(session, SSH_OPTIONS_HOST, options->host_name);
+    ssh_options_set(session, SSH_OPTIONS_PORT, &options->port_id);
+
+    if (options->ciphers != NULL) {
+        ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, options->ciphers);
+        ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, options->ciphers);
+    }
+
+    if (options->hmacs != NULL) {
+        ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, options->hmacs);
+        ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, options->hmacs);
+    }
+
+    ssh_options_set(session, SSH_OPTIONS_COMPRESSION,
+                    options->compression == COMPRESSION_YES ? "yes" : "no");
+
+    /* Blocking calls give up on a dead peer after the same time the loop does */
+    if (timeout) {
+        ssh_options_set(session, SSH_OPTIONS_TIMEOUT, &timeout);
+    }
+}
+
+/**
+ * Function to initialize ssh session without exiting on failure.
+ *
+ * :param options: Connection options. If ``options->passphrase`` is empty the user
+ *     is asked for it, and it is stored back so later sessions don't prompt again.
+ *
+ * :return: ssh_session object or ``NULL`` if connection or authentication failed.
+ */
+ssh_session
+try_ssh_init(ConnectOptionsT *options) {
     int8_t result;
     ssh_session session;
-    char passphrase[BUF_SIZE_PASSPHRASE] = {0};
 
     ssh_init();
 
     session = ssh_new();
     if (session == NULL) {
         DBG_ERR("Couldn't create new ssh session: %s", ssh_get_error(session));
-        exit(EXIT_FAILURE);
+        ssh_finalize();
+        return NULL;
     }
 
-    ssh_options_set(session, SSH_OPTIONS_HOST, host_name);
-    ssh_options_set(session, SSH_OPTIONS_PORT, &port_id);
+    ssh_set_connect_options(session, options);
 
     result = ssh_connect(session);
     if (result != SSH_OK) {
         DBG_ERR("Connection error: %s", ssh_get_error(session));
         clean_ssh_session(session);
-        exit(EXIT_FAILURE);
+        return NULL;
+    }
+
+    if (!*options->passphrase) {
+        printf((ANSI_FG_GREEN "%s's passphrase: " ANSI_RESET), options->host_name);
+        ssh_getpass("", options->passphrase, BUF_SIZE_PASSPHRASE, 0, 0);
     }
 
-    printf((ANSI_FG_GREEN "%s's passphrase: " ANSI_RESET), host_name);
-    ssh_getpass("", passphrase, BUF_SIZE_PASSPHRASE, 0, 0);
-    result = ssh_userauth_password(session, NULL, passphrase);
+    result = ssh_userauth_password(session, NULL, options->passphrase);
     if (result != SSH_AUTH_SUCCESS) {
         DBG_ERR("Authentication error: %s", ssh_get_error(session));
+        memset(options->passphrase, 0, BUF_SIZE_PASSPHRASE);
         clean_ssh_session(session);
-        exit(EXIT_FAILURE);
+        return NULL;
     }
 
     return session;
 }
 
+/**
+ * Connect a session again after its connection died, with the passphrase stored by
+ * the first authentication. Never prompts, so it may run on any thread.
+ *
+ * :param session: Session to disconnect and connect again, its channels are freed.
+ * :param options: Options the session was opened with.
+ *
+ * :return: ``CMD_OK`` once connected and authenticated, ``CMD_NOT_EXECUTED`` if no
+ *     passphrase is stored, ``CMD_INTERNAL_ERROR`` if every attempt failed.
+ */
+CommandStatusE
+try_ssh_reconnect(ssh_session session, ConnectOptionsT *options) {
+    uint32_t backoff = RECONNECT_BACKOFF_S;
+
+    if (!*options->passphrase) {
+        ssh_disconnect(session);
+        DBG_ERR("No stored credentials to reconnect to %s", options->host_name);
+        return CMD_NOT_EXECUTED;
+    }
+
+    for (size_t attempt = 0; attempt < RECONNECT_MAX_ATTEMPTS; attempt++) {
+        if (attempt) {
+            sleep(backoff);
+            backoff *= 2;
+        }
+
+        /* Resets the session, a failed attempt leaves it unusable otherwise */
+        ssh_disconnect(session);
+        ssh_set_connect_options(session, options);
+        if (ssh_connect(session) != SSH_OK) {
+            DBG_ERR("Reconnection error: %s", ssh_get_error(session));
+            continue;
+        }
+
+        if (ssh_userauth_password(session, NULL, options->passphrase) ==
+            SSH_AUTH_SUCCESS) {
+            DBG_INFO("Reconnected to %s", options->host_name);
+            return CMD_OK;
+        }
+
+        DBG_ERR("Authentication error: %s", ssh_get_error(session));
+    }
+
+    ssh_disconnect(session);
+    return CMD_INTERNAL_ERROR;
+}
+
+/** Free the attributes of ``ConnectOptionsT`` and wipe the stored passphrase. */
+void
+clean_connect_options(ConnectOptionsT *options) {
+    DBG_SAFE_FREE(options->host_name);
+    DBG_SAFE_FREE(options->ciphers);
+    DBG_SAFE_FREE(options->hmacs);
+    memset(options, 0, sizeof *options);
+}
+
 /**
  * Function to clean ssh session.
  *
@@ -98,8 +238,136 @@ do_sftp_init(ssh_session session_ssh) {
     return session_sftp;
 }
 
+/** Directory listing filled in as READDIR responses come in */
+typedef struct {
+    LoopHandleT handle;
+    LoopNameT *names;
+    uint32_t num_names;
+    uint32_t names_allocated;
+    uint32_t status;
+} ListDirT;
+
+/** Copy the owner, third field of an ``ls -l`` style line, to ``owner``. */
+static void
+list_owner_from_longname(const char *longname, char *owner, size_t length) {
+    size_t len_owner;
+
+    for (size_t i = 0; i < 2 && *longname; i++) {
+        longname += strcspn(longname, " ");
+        longname += strspn(longname, " ");
+    }
+
+    len_owner = MIN(strcspn(longname, " "), length - 1);
+    memcpy(owner, longname, len_owner);
+    owner[len_owner] = '\0';
+}
+
+static void
+list_remote_dir_callback(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    ListDirT *list_dir = user_data;
+    LoopNameT *grown;
+
+    if (result->status != SSH_FX_OK) {
+        list_dir->status = result->status;
+        return;
+    }
+
+    if (list_dir->num_names + result->num_names > list_dir->names_allocated) {
+        list_dir->names_allocated =
+            MAX(list_dir->names_allocated * 2, list_dir->num_names + result->num_names);
+        grown = DBG_REALLOC(list_dir->names,
+                            list_dir->names_allocated * sizeof *list_dir->names);
+        if (grown == NULL) {
+            list_dir->status = SSH_FX_FAILURE;
+            return;
+        }
+        list_dir->names = grown;
+    }
+
+    /* The names of the result only live until the callback returns */
+    for (uint32_t i = 0; i < result->num_names; i++) {
+        list_dir->names[list_dir->num_names++] =
+            (LoopNameT){.name = strdup(result->names[i].name),
+                        .longname = strdup(result->names[i].longname),
+                        .attr = result->names[i].attr};
+    }
+
+    if (!SftpLoop_readdir(loop, &list_dir->handle, list_remote_dir_callback, list_dir)) {
+        list_dir->status = SSH_FX_CONNECTION_LOST;
+    }
+}
+
+/** Read every entry of ``directory`` into ``list_dir``, its status is ``SSH_FX_EOF``
+ * if they all came. */
+static void
+list_remote_dir_read(SftpLoopT *loop, const char *directory, ListDirT *list_dir) {
+    LoopResultT result = {.status = SSH_FX_NO_CONNECTION};
+
+    if (loop != NULL &&
+        SftpLoop_opendir(loop, directory, SftpLoop_store_result, &result)) {
+        SftpLoop_run(loop);
+    }
+
+    if (result.status != SSH_FX_OK) {
+        list_dir->status = result.status;
+        return;
+    }
+
+    list_dir->handle = result.handle;
+    if (SftpLoop_readdir(loop, &list_dir->handle, list_remote_dir_callback, list_dir)) {
+        SftpLoop_run(loop);
+    }
+    SftpLoop_close(loop, &list_dir->handle, NULL, NULL);
+    SftpLoop_run(loop);
+}
+
+/** Print the entries matching ``flag``, one per line in list view, in columns
+ * otherwise. */
+void
+list_print_names(LoopNameT *names, uint32_t num_names, uint8_t flag) {
+    ListT *formatted_contents = List_new(1, sizeof(char *));
+    char filename[BUF_SIZE_FS_NAME + sizeof(COLOR_FOLDER ICON_FOLDER " " ANSI_RESET)];
+    char owner[BUF_SIZE_FS_NAME];
+    LoopNameT *entry;
+    bool is_dir;
+
+    for (uint32_t i = 0; i < num_names; i++) {
+        entry = &names[i];
+        is_dir = entry->attr.type == SSH_FILEXFER_TYPE_DIRECTORY;
+        if (!check_path_type(entry->name, strlen(entry->name), is_dir, flag)) {
+            continue;
+        }
+
+        if (BIT_MATCH(flag, FLAG_LIST_BIT_POS_LONG_LIST)) /* list view */ {
+            list_owner_from_longname(entry->longname, owner, sizeof owner);
+            printf("%-25s %-10s %" PRIu64 "\n", entry->name, owner, entry->attr.size);
+            continue;
+        }
+
+        if (is_dir) {
+            snprintf(filename, sizeof filename,
+                     (COLOR_FOLDER ICON_FOLDER " %s" ANSI_RESET), entry->name);
+        } else {
+            snprintf(filename, sizeof filename, (COLOR_FILE ICON_FILE " %s" ANSI_RESET),
+                     entry->name);
+        }
+        List_push(formatted_contents, filename, strlen(filename) + 1);
+    }
+
+    if (List_length(formatted_contents)) {
+        char_list_format_columnwise(formatted_contents, get_window_column_length(),
+                                    "    ");
+    }
+
+    for (size_t i = 0; i < List_length(formatted_contents); i++) {
+        DBG_SAFE_FREE(List_get(formatted_contents, i));
+    }
+    List_free(formatted_contents);
+}
+
 /**
- * Helper function to print files/directories in list view.
+ * Helper function to print files/directories in list view. A listing read less
+ * than the cache TTL ago is printed from memory.
  *
  * :param session_ssh: ssh_session object.
  * :param session_sftp: sftp_session object.
@@ -112,52 +380,27 @@ do_sftp_init(ssh_session session_ssh) {
 CommandStatusE
 list_remote_dir(ssh_session session_ssh, sftp_session session_sftp, char *directory,
                 uint8_t flag) {
-    sftp_dir dir;
-    sftp_attributes attr;
-    FileSystemT *fs;
-    ListT *dir_contents;
-    ListT *formatted_contents = List_new(1, sizeof(char *));
-    char *filename = DBG_CALLOC(BUF_SIZE_FS_NAME, sizeof *filename);
-    size_t width_screen = get_window_column_length();
+    ListDirT list_dir = {.status = SSH_FX_EOF};
 
-    dir = sftp_opendir(session_sftp, directory);
-    if (dir == NULL) {
-        DBG_ERR("Couldn't open directory: %s\n", ssh_get_error(session_ssh));
-        return CMD_INTERNAL_ERROR;
-    }
-
-    if (BIT_MATCH(flag, FLAG_LIST_BIT_POS_LONG_LIST)) /* list view */ {
-        while ((attr = sftp_readdir(session_sftp, dir)) != NULL) {
-            if (check_path_type(attr->name, strlen(attr->name),
-                                attr->type == SSH_FILEXFER_TYPE_DIRECTORY, flag)) {
-                printf("%-25s %-10s %zu\n", attr->name, attr->owner, attr->size);
-            }
+    (void)session_sftp;
+    if (!cache_get_listing(directory, &list_dir.names, &list_dir.num_names)) {
+        list_remote_dir_read(SftpLoop_for_session(session_ssh), directory, &list_dir);
+        if (list_dir.status == SSH_FX_EOF) {
+            cache_put_listing(directory, list_dir.names, list_dir.num_names);
         }
-        return CMD_OK;
     }
 
-    sftp_closedir(dir);
-
-    dir_contents = path_read_remote_dir(session_ssh, session_sftp, directory);
-    for (size_t i = 0; i < dir_contents->length; i++) {
-        fs = List_get(dir_contents, i);
-        if (fs->type == FS_DIRECTORY) {
-            sprintf(filename, (COLOR_FOLDER ICON_FOLDER " %s" ANSI_RESET), fs->name);
-        } else {
-            sprintf(filename, (COLOR_FILE ICON_FILE " %s" ANSI_RESET), fs->name);
-        }
-        if (check_path_type(fs->name, strlen(fs->name), fs->type == FS_DIRECTORY, flag)) {
-            List_push(formatted_contents, filename, strlen(filename) + 1);
-        }
+    if (list_dir.status == SSH_FX_EOF) {
+        list_print_names(list_dir.names, list_dir.num_names, flag);
     }
+    cache_free_names(list_dir.names, list_dir.num_names);
 
-    if (List_length(formatted_contents)) {
-        char_list_format_columnwise(formatted_contents, width_screen, "    ");
+    if (list_dir.status != SSH_FX_EOF) {
+        DBG_ERR("Couldn't read directory %s: %s", directory,
+                SftpLoop_status_str(list_dir.status));
+        return CMD_INTERNAL_ERROR;
     }
 
-    FileSystem_list_free(dir_contents);
-    List_free(formatted_contents);
-    DBG_SAFE_FREE(filename);
     return CMD_OK;
 }
 
@@ -171,16 +414,28 @@ list_remote_dir(ssh_session session_ssh, sftp_session session_sftp, char *direct
 CommandStatusE
 create_remote_file(ssh_session session_ssh, sftp_session session_sftp,
                    char *abs_file_path) {
-    sftp_file file =
-        sftp_open(session_sftp, abs_file_path, O_CREAT | O_WRONLY, FS_CREATE_PERM);
+    LoopResultT result = {.status = SSH_FX_NO_CONNECTION};
+    SftpLoopT *loop = SftpLoop_for_session(session_ssh);
+
+    (void)session_sftp;
+    if (loop == NULL || !SftpLoop_open(loop, abs_file_path, SSH_FXF_CREAT | SSH_FXF_WRITE,
+                                       FS_CREATE_PERM, SftpLoop_store_result, &result)) {
+        DBG_ERR("Couldn't create file %s: %s", abs_file_path,
+                SftpLoop_status_str(result.status));
+        return CMD_INTERNAL_ERROR;
+    }
+    SftpLoop_run(loop);
 
-    if (file == NULL) {
-        DBG_ERR("Couldn't create file %s: %s", abs_file_path, ssh_get_error(session_ssh));
+    if (result.status != SSH_FX_OK) {
+        DBG_ERR("Couldn't create file %s: %s", abs_file_path,
+                SftpLoop_status_str(result.status));
         return CMD_INTERNAL_ERROR;
     }
 
     DBG_INFO("Created file: %s", abs_file_path);
-    sftp_close(file);
+    SftpLoop_close(loop, &result.handle, NULL, NULL);
+    SftpLoop_run(loop);
+    cache_invalidate(abs_file_path);
     return CMD_OK;
 }
 
@@ -194,10 +449,19 @@ create_remote_file(ssh_session session_ssh, sftp_session session_sftp,
 CommandStatusE
 create_remote_dir(ssh_session session_ssh, sftp_session session_sftp,
                   char *abs_dir_path) {
-    int8_t result = sftp_mkdir(session_sftp, abs_dir_path, FS_CREATE_PERM);
+    LoopResultT result = {.status = SSH_FX_NO_CONNECTION};
+    SftpLoopT *loop = SftpLoop_for_session(session_ssh);
+
+    (void)session_sftp;
+    if (loop != NULL &&
+        SftpLoop_mkdir(loop, abs_dir_path, FS_CREATE_PERM, SftpLoop_store_result,
+                       &result)) {
+        SftpLoop_run(loop);
+    }
 
-    switch (result) {
+    switch (result.status) {
         case SSH_FX_OK:
+            cache_invalidate(abs_dir_path);
             return CMD_OK;
         case SSH_FX_FILE_ALREADY_EXISTS:
             DBG_INFO("Directory %s already exists", abs_dir_path);
@@ -206,141 +470,740 @@ create_remote_dir(ssh_session session_ssh, sftp_session session_sftp,
             DBG_ERR("Permission Denied: directory %s could not be created", abs_dir_path);
             return CMD_INTERNAL_ERROR;
         default:
-            DBG_ERR("Error: %s\n", ssh_get_error(session_ssh));
+            DBG_ERR("Error: %s", SftpLoop_status_str(result.status));
             return CMD_INTERNAL_ERROR;
     }
 }
 
+/** ``user_data`` is a copy of the path of the directory, freed here */
+static void
+create_parents_remote_callback(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    (void)loop;
+
+    /* SFTP v3 servers report existing directories as a plain failure */
+    switch (result->status) {
+        case SSH_FX_OK:
+            cache_invalidate(user_data);
+            break;
+        case SSH_FX_PERMISSION_DENIED:
+            DBG_ERR("Permission Denied: directory %s could not be created",
+                    (char *)user_data);
+            break;
+        default:
+            DBG_INFO("Parent directory %s not created: %s", (char *)user_data,
+                     SftpLoop_status_str(result->status));
+            break;
+    }
+    free(user_data);
+}
+
+/** Create a remote directory and its parents, every MKDIR goes out in one round trip. */
 static CommandStatusE
 create_parents_remote(ssh_session session_ssh, sftp_session session_sftp,
                       char *path_str) {
-    char *path_buf = DBG_MALLOC(BUF_SIZE_FS_PATH);
-    ListT *path_list = path_split(path_str, strlen(path_str));
-    int8_t result;
+    char path_buf[BUF_SIZE_FS_PATH], *path_dir;
+    size_t length = MIN(strlen(path_str), BUF_SIZE_FS_PATH - 1);
+    SftpLoopT *loop = SftpLoop_for_session(session_ssh);
+
+    (void)session_sftp;
+    if (loop == NULL) {
+        return CMD_INTERNAL_ERROR;
+    }
+
+    memcpy(path_buf, path_str, length);
+    path_buf[length] = '\0';
 
-    path_buf = List_get(path_list, 0);
-    for (size_t i = 0; i < path_list->length; i++) {
-        if (i) {
-            FS_JOIN_PATH(path_buf, List_get(path_list, i));
+    for (size_t i = 1; i <= length; i++) {
+        if (i < length && path_buf[i] != PATH_SEPARATOR) {
+            continue;
+        }
+
+        path_buf[i] = '\0';
+        path_dir = strdup(path_buf);
+        if (!SftpLoop_mkdir(loop, path_buf, FS_CREATE_PERM,
+                            create_parents_remote_callback, path_dir)) {
+            free(path_dir);
         }
+        path_buf[i] = i < length ? PATH_SEPARATOR : '\0';
+    }
+
+    return SftpLoop_run(loop);
+}
+
+/** A file being copied with a window of READ or WRITE requests in flight */
+typedef struct {
+    SftpLoopT *loop;
+    char *path_remote;
+    LoopHandleT handle;
+    bool is_open;
+
+    /** Descriptor of the local side of the copy */
+    int fd_local;
+
+    /** Size of the file when the copy started */
+    uint64_t size;
+
+    /** Offset of the next chunk to request */
+    uint64_t offset_next;
+
+    /** Chunks aren't requested at or past this offset */
+    uint64_t offset_stop;
+
+    /** Upload: end of the local data extent ``offset_next`` is in, the hole after it
+     * isn't sent. Download: end of the data received, zeros aren't written. */
+    uint64_t offset_hole;
+
+    /** Set once a hole was skipped, the file's size has to be set separately */
+    bool is_sparse;
+
+    size_t num_in_flight;
+
+    /** Lowest offset of a request lost with the connection, a resume starts there */
+    uint64_t offset_resume;
+
+    /** Times the copy picked up again after the connection was lost */
+    uint32_t num_resumes;
+
+    /** Bytes sent or received, chunks sent again after a resume included */
+    uint64_t num_bytes;
+
+    /** When the copy started, from ``stats_clock`` */
+    uint64_t time_start_ns;
+
+    /** First failure, ``SSH_FX_OK`` while the copy goes well */
+    uint32_t status;
+
+    /** Set if the failure was on the local side */
+    bool is_local_error;
+
+    /** ``errno`` of a local failure, read right after the call that failed */
+    int32_t error_local;
+
+    /** Digest of the bytes copied, checked against the server's once the copy is done */
+    ChecksumT checksum;
+
+    /** Share of the bandwidth limit the copy takes */
+    LimitStreamT *limit;
+
+    /** Chunk being written, or sample of the file while picking its session */
+    uint8_t buf[MAX(LOOP_CHUNK_SIZE, COMPRESS_SAMPLE_SIZE)];
+} TransferT;
+
+static void
+transfer_fail(TransferT *self, uint32_t status, bool is_local_error) {
+    if (self->status == SSH_FX_OK) {
+        self->status = status;
+        self->is_local_error = is_local_error;
+    }
+}
+
+/** Fail the copy with the ``errno`` of a local call, taken before anything else can
+ * overwrite it. */
+static void
+transfer_fail_local(TransferT *self, int32_t error) {
+    if (self->status == SSH_FX_OK) {
+        self->error_local = error;
+    }
+    transfer_fail(self, SSH_FX_FAILURE, true);
+}
 
-        result = sftp_mkdir(session_sftp, path_buf, FS_CREATE_PERM);
-        if (!result) {
+/** Fail the copy with the status of a READ or WRITE, remembering where to resume if
+ * the request was lost with the connection. */
+static void
+transfer_fail_request(TransferT *self, LoopResultT *result) {
+    if (result->status == SSH_FX_CONNECTION_LOST) {
+        self->offset_resume = MIN(self->offset_resume, result->offset);
+    }
+    transfer_fail(self, result->status, false);
+}
+
+/** Open the remote side of the copy on ``loop``. */
+static CommandStatusE
+transfer_open(TransferT *self, SftpLoopT *loop, uint32_t pflags) {
+    LoopResultT result = {.status = SSH_FX_NO_CONNECTION};
+
+    if (SftpLoop_open(loop, self->path_remote, pflags, FS_CREATE_PERM,
+                      SftpLoop_store_result, &result)) {
+        SftpLoop_run(loop);
+    }
+
+    if (result.status != SSH_FX_OK) {
+        DBG_ERR("Couldn't open remote file %s: %s", self->path_remote,
+                SftpLoop_status_str(result.status));
+        transfer_fail(self, result.status, false);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    self->loop = loop;
+    self->handle = result.handle;
+    self->is_open = true;
+    return CMD_OK;
+}
+
+/** Close the remote side, a failed CLOSE fails the copy as writes may be lost. */
+static void
+transfer_close(TransferT *self) {
+    LoopResultT result = {.status = SSH_FX_NO_CONNECTION};
+
+    if (!self->is_open) {
+        return;
+    }
+
+    self->is_open = false;
+    if (SftpLoop_close(self->loop, &self->handle, SftpLoop_store_result, &result)) {
+        SftpLoop_run(self->loop);
+    }
+
+    if (result.status != SSH_FX_OK) {
+        transfer_fail(self, result.status, false);
+    }
+}
+
+/**
+ * Open the local side of the copy.
+ *
+ * :param file_stat: Filled with the attributes of the file if not ``NULL``.
+ *
+ * :return: The descriptor, negative if the file couldn't be opened.
+ */
+static int
+transfer_open_local(const char *path, int flags, struct stat *file_stat) {
+    int fd;
+    TRACE_START(time_trace_ns);
+
+    fd = open(path, flags, 0666);
+    if (fd >= 0 && file_stat != NULL && fstat(fd, file_stat)) {
+        close(fd);
+        fd = -1;
+    }
+    TRACE_FS("open", time_trace_ns, 0);
+
+    return fd;
+}
+
+static void
+transfer_close_local(TransferT *self) {
+    TRACE_START(time_trace_ns);
+
+    close(self->fd_local);
+    TRACE_FS("close", time_trace_ns, 0);
+}
+
+/**
+ * Pick a copy up again once its loop reconnected: reopen the remote file and go on
+ * from the first chunk that wasn't acknowledged.
+ *
+ * :param pflags: Flags to reopen the file with, uploads must not truncate it.
+ *
+ * :return: true if the copy goes on and the loop has to run again.
+ */
+static bool
+transfer_resume(TransferT *self, uint32_t pflags) {
+    if (self->status != SSH_FX_CONNECTION_LOST || SftpLoop_is_dead(self->loop) ||
+        job_is_cancelled() || self->num_resumes == TRANSFER_MAX_RESUMES) {
+        return false;
+    }
+
+    self->num_resumes++;
+    self->offset_next = MIN(self->offset_next, self->offset_resume);
+    self->offset_resume = UINT64_MAX;
+    self->status = SSH_FX_OK;
+    if (pflags & SSH_FXF_WRITE) {
+        self->offset_hole = 0;
+    }
+
+    /* The handle went away with the old channel */
+    self->is_open = false;
+
+    DBG_INFO("Resuming %s at byte %" PRIu64, self->path_remote, self->offset_next);
+    return transfer_open(self, self->loop, pflags) == CMD_OK ||
+           self->status == SSH_FX_CONNECTION_LOST;
+}
+
+/**
+ * Take bandwidth for a chunk of ``length`` bytes. Over the limit with requests in
+ * flight the window just shrinks, their answers call back in here. With none in
+ * flight the copy sleeps until it has bandwidth again.
+ *
+ * :return: false if the chunk can't be requested yet.
+ */
+static bool
+transfer_throttle(TransferT *self, uint32_t length) {
+    uint32_t wait_ms;
+    uint64_t time_sleep_ns;
+
+    while (!LimitStream_take(self->limit, length, &wait_ms)) {
+        if (job_is_cancelled()) {
+            transfer_fail(self, SSH_FX_FAILURE, false);
+            return false;
+        } else if (self->num_in_flight) {
+            return false;
+        }
+        time_sleep_ns = stats_clock();
+        usleep(wait_ms * 1000);
+        stats_add_time(STATS_TIME_THROTTLE, time_sleep_ns);
+    }
+
+    return true;
+}
+
+static void download_on_read(SftpLoopT *loop, LoopResultT *result, void *user_data);
+
+/** Keep ``LOOP_WINDOW`` reads in flight. Past the expected size only a single read
+ * probes for the end of the file, in case it grew. */
+static void
+download_fill_window(TransferT *self) {
+    /* A cancelled job drains the requests in flight and gives up */
+    if (job_is_cancelled()) {
+        transfer_fail(self, SSH_FX_FAILURE, false);
+        return;
+    }
+
+    while (self->status == SSH_FX_OK && self->num_in_flight < LOOP_WINDOW &&
+           self->offset_next < self->offset_stop &&
+           !(self->offset_next >= self->size && self->num_in_flight)) {
+        if (!transfer_throttle(self, MIN(LOOP_CHUNK_SIZE,
+                                         self->offset_stop - self->offset_next))) {
+            break;
+        }
+
+        if (!SftpLoop_read(self->loop, &self->handle, self->offset_next,
+                           MIN(LOOP_CHUNK_SIZE, self->offset_stop - self->offset_next),
+                           download_on_read, self)) {
+            transfer_fail(self, SSH_FX_CONNECTION_LOST, false);
+            break;
+        }
+
+        self->offset_next += MIN(LOOP_CHUNK_SIZE, self->offset_stop - self->offset_next);
+        self->num_in_flight++;
+    }
+}
+
+/** Write a chunk to the local file, whole blocks of zeros are skipped so that they
+ * stay holes. */
+static bool
+download_write(TransferT *self, const uint8_t *data, uint64_t offset, size_t length) {
+    ssize_t num_bytes_written;
+    size_t start = 0, len_block;
+    int32_t error;
+    uint64_t time_write_ns = stats_clock();
+
+    for (size_t i = 0; i <= length; i += len_block) {
+        len_block = MIN(TRANSFER_HOLE_BLOCK_SIZE, length - i);
+        if (i < length && !buf_is_zero(data + i, len_block)) {
             continue;
         }
 
+        /* Write the data before the block of zeros, or before the end */
+        for (; start < i; start += num_bytes_written) {
+            TRACE_START(time_trace_ns);
+            num_bytes_written = pwrite(self->fd_local, data + start, i - start,
+                                       offset + start);
+            error = errno;
+            TRACE_FS("pwrite", time_trace_ns, MAX(num_bytes_written, 0));
+            if (num_bytes_written < 0) {
+                stats_add_time(STATS_TIME_DISK, time_write_ns);
+                transfer_fail_local(self, error);
+                return false;
+            }
+        }
+        self->is_sparse |= i < length;
+        start = i + len_block;
 
-        switch (sftp_get_error(session_sftp)) {
-            case SSH_FX_FILE_ALREADY_EXISTS:
-                DBG_INFO("Directory %s already exists", path_buf);
-                break;
-            case SSH_FX_PERMISSION_DENIED:
-                DBG_ERR("Permission Denied: directory %s could not be created", path_buf);
-                break;
-            default:
-                DBG_ERR("Error while creating parent:%s:: %s\n", path_buf,
-                        ssh_get_error(session_ssh));
-                break;
+        if (i == length) {
+            break;
         }
     }
 
-    DBG_SAFE_FREE(path_buf);
-    List_free(path_list);
+    self->offset_hole = MAX(self->offset_hole, offset + length);
+    stats_add_time(STATS_TIME_DISK, time_write_ns);
+    return true;
+}
 
-    return CMD_OK;
+static void
+download_on_read(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    TransferT *self = user_data;
+
+    self->num_in_flight--;
+
+    if (result->status == SSH_FX_EOF ||
+        (result->status == SSH_FX_OK && !result->len_data)) {
+        self->offset_stop = MIN(self->offset_stop, result->offset);
+        return;
+    } else if (result->status != SSH_FX_OK) {
+        transfer_fail_request(self, result);
+        return;
+    }
+
+    /* Responses can come back in any order, each chunk goes to its own offset */
+    if (!download_write(self, result->data, result->offset, result->len_data)) {
+        return;
+    }
+    Checksum_feed(&self->checksum, result->offset, result->data, result->len_data);
+    self->num_bytes += result->len_data;
+
+    /* Short read, ask for the rest of the chunk before moving on */
+    if (result->len_data < result->length) {
+        if (!SftpLoop_read(loop, &self->handle, result->offset + result->len_data,
+                           result->length - result->len_data, download_on_read, self)) {
+            transfer_fail(self, SSH_FX_CONNECTION_LOST, false);
+            return;
+        }
+        self->num_in_flight++;
+    }
+
+    download_fill_window(self);
 }
 
 /**
- * Helper function to copy a file from local to remote server.
+ * Helper function to copy a file from remote to local server.
  *
  * :param session_ssh: ssh_session object.
  * :param session_sftp: sftp_session object.
- * :param abs_path_local: Absolute path of the file on local machine.
  * :param abs_path_remote: Absolute path of the file on remote machine.
+ * :param abs_path_local: Absolute path of the file on local machine.
+ *
+ * .. note:: Reads are pipelined on the event loop of ``session_ssh``, up to
+ *    ``LOOP_WINDOW`` of them are in flight at a time.
  */
-static CommandStatusE
+CommandStatusE
 copy_file_from_remote_to_local(ssh_session session_ssh, sftp_session session_sftp,
                                char *abs_path_remote, char *abs_path_local) {
-    int32_t num_bytes_read;
-    char file_buf[BUF_SIZE_FILE_CONTENTS + 1];
-    sftp_file from_file = sftp_open(session_sftp, abs_path_remote, O_RDONLY, 0);
-    FILE *to_file = fopen(abs_path_local, "w");
-
-    if (from_file == NULL) {
-        DBG_ERR("Couldn't open file: %s", ssh_get_error(session_ssh));
+    TransferT *transfer;
+    LoopResultT result_stat = {.status = SSH_FX_NO_CONNECTION};
+    ssh_session session_route;
+    ssize_t num_bytes_sample;
+    SftpLoopT *loop = SftpLoop_for_session(session_ssh);
+    CommandStatusE status;
+
+    (void)session_sftp;
+    if (loop == NULL) {
         return CMD_INTERNAL_ERROR;
     }
 
-    if (to_file == NULL) {
+    transfer = DBG_CALLOC(1, sizeof *transfer);
+    *transfer = (TransferT){.path_remote = abs_path_remote,
+                            .offset_stop = UINT64_MAX,
+                            .offset_resume = UINT64_MAX,
+                            .time_start_ns = stats_clock()};
+    Checksum_init(&transfer->checksum, checksum_current());
+
+    /* Read as well, the first blocks are read back to pick the session */
+    transfer->fd_local =
+        transfer_open_local(abs_path_local, O_RDWR | O_CREAT | O_TRUNC, NULL);
+    if (transfer->fd_local < 0) {
         DBG_ERR("Couldn't create file: %s", abs_path_local);
+        stats_file_done(abs_path_remote, 0, 0, transfer->time_start_ns, 0, false);
+        DBG_SAFE_FREE(transfer);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    /* The STAT rides along with the OPEN, both answers come in one round trip */
+    SftpLoop_stat(loop, abs_path_remote, SftpLoop_store_result, &result_stat);
+    if (transfer_open(transfer, loop, SSH_FXF_READ) != CMD_OK) {
+        close(transfer->fd_local);
+        stats_file_done(abs_path_remote, 0, 0, transfer->time_start_ns, 0, false);
+        DBG_SAFE_FREE(transfer);
         return CMD_INTERNAL_ERROR;
     }
+    transfer->size = result_stat.status == SSH_FX_OK ? result_stat.attr.size : 0;
+    transfer->limit = LimitStream_new(limit_current_weight(), limit_current_cap());
+
+    /* The first blocks decide which session the rest of the file goes through */
+    if (compress_is_routing() && transfer->size >= COMPRESS_MIN_FILE_SIZE) {
+        transfer->offset_stop = COMPRESS_SAMPLE_SIZE;
+        download_fill_window(transfer);
+        SftpLoop_run(loop);
+
+        num_bytes_sample = pread(transfer->fd_local, transfer->buf,
+                                 MIN(transfer->offset_next, COMPRESS_SAMPLE_SIZE), 0);
+        session_route = compress_route(session_ssh, transfer->buf,
+                                       num_bytes_sample > 0 ? num_bytes_sample : 0);
+        if (transfer->status == SSH_FX_OK &&
+            transfer->offset_stop == COMPRESS_SAMPLE_SIZE &&
+            session_route != session_ssh &&
+            (loop = SftpLoop_for_session(session_route)) != NULL) {
+            DBG_DEBUG("Routing %s through compressed session", abs_path_remote);
+            transfer_close(transfer);
+            transfer_open(transfer, loop, SSH_FXF_READ);
+        }
 
-    while ((num_bytes_read = sftp_read(from_file, file_buf, BUF_SIZE_FILE_CONTENTS)) >
-           0) {
-        fwrite(file_buf, sizeof *file_buf, num_bytes_read, to_file);
+        if (transfer->offset_stop == COMPRESS_SAMPLE_SIZE) {
+            transfer->offset_stop = UINT64_MAX;
+        }
     }
 
-    if (num_bytes_read < 0) {
-        DBG_ERR("Couldn't read remote file: Error Code: %d",
-                sftp_get_error(session_sftp));
-        return CMD_INTERNAL_ERROR;
+    /* A connection lost on the way comes back and the copy goes on where it was */
+    do {
+        download_fill_window(transfer);
+        SftpLoop_run(transfer->loop);
+    } while (transfer_resume(transfer, SSH_FXF_READ));
+    transfer_close(transfer);
+
+    /* Zeros at the end of the file weren't written */
+    if (transfer->is_sparse && transfer->status == SSH_FX_OK) {
+        TRACE_START(time_truncate_ns);
+        if (ftruncate(transfer->fd_local, transfer->offset_hole)) {
+            transfer_fail_local(transfer, errno);
+        }
+        TRACE_FS("ftruncate", time_truncate_ns, 0);
+    }
+    transfer_close_local(transfer);
+
+    status = CMD_OK;
+    if (transfer->status != SSH_FX_OK) {
+        DBG_ERR("Couldn't %s %s: %s",
+                transfer->is_local_error ? "write local file" : "read",
+                transfer->is_local_error ? abs_path_local : abs_path_remote,
+                transfer->is_local_error ? strerror(transfer->error_local)
+                                         : SftpLoop_status_str(transfer->status));
+        status = CMD_INTERNAL_ERROR;
+    } else if (transfer->checksum.algo != CHECKSUM_NONE) {
+        status = checksum_verify(transfer->loop, abs_path_remote, &transfer->checksum);
     }
+    stats_file_done(abs_path_remote, transfer->size, transfer->num_bytes,
+                    transfer->time_start_ns, transfer->num_resumes, status == CMD_OK);
 
-    sftp_close(from_file);
-    fclose(to_file);
+    Checksum_free(&transfer->checksum);
+    LimitStream_free(transfer->limit);
+    DBG_SAFE_FREE(transfer);
+    return status;
+}
 
-    return CMD_OK;
+static void upload_on_write(SftpLoopT *loop, LoopResultT *result, void *user_data);
+
+/** Move ``offset_next`` past a hole of the local file, to the next data extent. Files
+ * on filesystems without ``SEEK_DATA`` are sent whole. */
+static void
+upload_skip_hole(TransferT *self) {
+#ifdef SEEK_DATA
+    off_t offset_data, offset_hole;
+
+    if (self->offset_next < self->offset_hole) {
+        return;
+    }
+
+    offset_data = lseek(self->fd_local, self->offset_next, SEEK_DATA);
+    if (offset_data < 0) {
+        /* Nothing but a hole up to the end of the file */
+        offset_data = errno == ENXIO ? (off_t)self->size : (off_t)self->offset_next;
+        offset_hole = errno == ENXIO ? (off_t)self->size : -1;
+    } else {
+        offset_hole = lseek(self->fd_local, offset_data, SEEK_HOLE);
+    }
+
+    offset_data = MIN((uint64_t)offset_data, self->size);
+    self->offset_hole = offset_hole < 0 ? UINT64_MAX : (uint64_t)offset_hole;
+    if ((uint64_t)offset_data > self->offset_next) {
+        Checksum_feed_zeros(&self->checksum, self->offset_next,
+                            offset_data - self->offset_next);
+        self->offset_next = offset_data;
+        self->is_sparse = true;
+    }
+#else
+    self->offset_hole = UINT64_MAX;
+#endif
 }
 
-static CommandStatusE
+/** Keep ``LOOP_WINDOW`` writes in flight. */
+static void
+upload_fill_window(TransferT *self) {
+    ssize_t num_bytes_read;
+    int32_t error;
+    uint64_t time_read_ns;
+
+    /* A cancelled job drains the requests in flight and gives up */
+    if (job_is_cancelled()) {
+        transfer_fail(self, SSH_FX_FAILURE, false);
+        return;
+    }
+
+    while (self->status == SSH_FX_OK && self->num_in_flight < LOOP_WINDOW &&
+           self->offset_next < self->size) {
+        upload_skip_hole(self);
+        if (self->offset_next == self->size ||
+            !transfer_throttle(self, MIN(LOOP_CHUNK_SIZE,
+                                         MIN(self->size, self->offset_hole) -
+                                             self->offset_next))) {
+            break;
+        }
+
+        time_read_ns = stats_clock();
+        TRACE_START(time_trace_ns);
+        num_bytes_read = pread(
+            self->fd_local, self->buf,
+            MIN(LOOP_CHUNK_SIZE, MIN(self->size, self->offset_hole) - self->offset_next),
+            self->offset_next);
+        error = errno;
+        TRACE_FS("pread", time_trace_ns, MAX(num_bytes_read, 0));
+        stats_add_time(STATS_TIME_DISK, time_read_ns);
+        if (num_bytes_read <= 0) {
+            /* Shrunk while being copied, what was there is already on its way */
+            if (num_bytes_read < 0) {
+                transfer_fail_local(self, error);
+            }
+            self->size = self->offset_next;
+            break;
+        }
+
+        if (!SftpLoop_write(self->loop, &self->handle, self->offset_next, self->buf,
+                            num_bytes_read, upload_on_write, self)) {
+            transfer_fail(self, SSH_FX_CONNECTION_LOST, false);
+            break;
+        }
+        Checksum_feed(&self->checksum, self->offset_next, self->buf, num_bytes_read);
+
+        self->offset_next += num_bytes_read;
+        self->num_bytes += num_bytes_read;
+        self->num_in_flight++;
+    }
+}
+
+static void
+upload_on_write(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    TransferT *self = user_data;
+
+    (void)loop;
+    self->num_in_flight--;
+
+    if (result->status != SSH_FX_OK) {
+        transfer_fail_request(self, result);
+        return;
+    }
+
+    upload_fill_window(self);
+}
+
+/** Extend the remote file to the size of the local one. */
+static void
+upload_set_size(TransferT *self) {
+    LoopAttrT attr = {.flags = SSH_FILEXFER_ATTR_SIZE, .size = self->size};
+    LoopResultT result = {.status = SSH_FX_NO_CONNECTION};
+
+    if (SftpLoop_setstat(self->loop, self->path_remote, &attr, SftpLoop_store_result,
+                         &result)) {
+        SftpLoop_run(self->loop);
+    }
+
+    if (result.status != SSH_FX_OK) {
+        transfer_fail(self, result.status, false);
+    }
+}
+
+/**
+ * Helper function to copy a file from local to remote server.
+ *
+ * :param session_ssh: ssh_session object.
+ * :param session_sftp: sftp_session object.
+ * :param abs_path_local: Absolute path of the file on local machine.
+ * :param abs_path_remote: Absolute path of the file on remote machine.
+ *
+ * .. note:: Writes are pipelined on the event loop of ``session_ssh``, up to
+ *    ``LOOP_WINDOW`` of them are in flight at a time.
+ */
+CommandStatusE
 copy_file_from_local_to_remote(ssh_session session_ssh, sftp_session session_sftp,
                                char *abs_path_local, char *abs_path_remote) {
-    int32_t num_bytes_read;
-    char file_buf[BUF_SIZE_FILE_CONTENTS + 1] = {0};
+    TransferT *transfer;
     struct stat from_file_stat;
-    FILE *from_file;
-    sftp_file to_file;
-
-    stat(abs_path_local, &from_file_stat);
-
-    /* Not really sure why this is needed but, it doesn't work without it
-     * so  ¯\_(ツ)_/¯ */
-    if (!from_file_stat.st_size) {
-        DBG_INFO("File with 0 size: %s", abs_path_local);
-        create_remote_file(session_ssh, session_sftp, abs_path_remote);
+    ssize_t num_bytes_sample;
+    SftpLoopT *loop;
+    DedupT *dedup;
+    CommandStatusE status;
+
+    (void)session_sftp;
+    dedup = dedup_current();
+    if (dedup != NULL && Dedup_link(dedup, SftpLoop_for_session(session_ssh),
+                                    abs_path_local, abs_path_remote) == CMD_OK) {
+        /* Linked on the server, nothing went over the wire */
+        stats_file_done(abs_path_local, 0, 0, stats_clock(), 0, true);
         return CMD_OK;
     }
 
-    from_file = fopen(abs_path_local, "r");
-    to_file =
-        sftp_open(session_sftp, abs_path_remote, O_CREAT | O_WRONLY, FS_CREATE_PERM);
+    transfer = DBG_CALLOC(1, sizeof *transfer);
+    *transfer = (TransferT){.path_remote = abs_path_remote,
+                            .offset_stop = UINT64_MAX,
+                            .offset_resume = UINT64_MAX,
+                            .time_start_ns = stats_clock()};
+    Checksum_init(&transfer->checksum, checksum_current());
 
-    if (from_file == NULL) {
+    transfer->fd_local = transfer_open_local(abs_path_local, O_RDONLY, &from_file_stat);
+    if (transfer->fd_local < 0) {
         DBG_ERR("Couldn't open file: %s", abs_path_local);
+        stats_file_done(abs_path_local, 0, 0, transfer->time_start_ns, 0, false);
+        DBG_SAFE_FREE(transfer);
         return CMD_INTERNAL_ERROR;
     }
+    transfer->size = from_file_stat.st_size;
+
+    /* The first blocks decide which session the file goes through */
+    if (compress_is_routing()) {
+        num_bytes_sample =
+            pread(transfer->fd_local, transfer->buf, COMPRESS_SAMPLE_SIZE, 0);
+        session_ssh = compress_route(session_ssh, transfer->buf,
+                                     num_bytes_sample > 0 ? num_bytes_sample : 0);
+    }
 
-    if (to_file == NULL) {
-        DBG_ERR("Couldn't create file: %s: %s", abs_path_remote,
-                ssh_get_error(session_ssh));
+    loop = SftpLoop_for_session(session_ssh);
+    if (dedup != NULL && loop != NULL) {
+        Dedup_unlink(dedup, loop, abs_path_remote);
+    }
+    if (loop == NULL ||
+        transfer_open(transfer, loop, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC) !=
+            CMD_OK) {
+        close(transfer->fd_local);
+        stats_file_done(abs_path_local, transfer->size, 0, transfer->time_start_ns, 0,
+                        false);
+        DBG_SAFE_FREE(transfer);
         return CMD_INTERNAL_ERROR;
     }
+    transfer->limit = LimitStream_new(limit_current_weight(), limit_current_cap());
+
+    do {
+        upload_fill_window(transfer);
+        SftpLoop_run(transfer->loop);
+    } while (transfer_resume(transfer, SSH_FXF_WRITE | SSH_FXF_CREAT));
 
-    while ((num_bytes_read = fread(file_buf, sizeof *file_buf, BUF_SIZE_FILE_CONTENTS,
-                                   from_file)) > 0) {
-        sftp_write(to_file, file_buf, num_bytes_read);
+    /* A hole at the end of the file wasn't written */
+    if (transfer->is_sparse && transfer->status == SSH_FX_OK) {
+        upload_set_size(transfer);
+    }
+    transfer_close(transfer);
+    transfer_close_local(transfer);
+
+    status = CMD_OK;
+    if (transfer->status != SSH_FX_OK) {
+        DBG_ERR("Couldn't %s %s: %s",
+                transfer->is_local_error ? "read local file" : "write",
+                transfer->is_local_error ? abs_path_local : abs_path_remote,
+                transfer->is_local_error ? strerror(transfer->error_local)
+                                         : SftpLoop_status_str(transfer->status));
+        status = CMD_INTERNAL_ERROR;
+    } else if (transfer->checksum.algo != CHECKSUM_NONE) {
+        status = checksum_verify(transfer->loop, abs_path_remote, &transfer->checksum);
     }
 
-    if (num_bytes_read < 0) {
-        DBG_ERR("Couldn't read local file: Error Code: %d", errno);
-        return CMD_INTERNAL_ERROR;
+    if (dedup != NULL && status == CMD_OK) {
+        Dedup_add(dedup, transfer->loop, abs_path_local, abs_path_remote);
     }
+    stats_file_done(abs_path_local, transfer->size, transfer->num_bytes,
+                    transfer->time_start_ns, transfer->num_resumes, status == CMD_OK);
 
-    fclose(from_file);
-    sftp_close(to_file);
+    Checksum_free(&transfer->checksum);
+    LimitStream_free(transfer->limit);
+    DBG_SAFE_FREE(transfer);
+    return status;
+}
 
-    return CMD_OK;
+/** Free the directories a cancelled walk didn't get to, and the stack. */
+static void
+copy_free_dir_stack(ListT *sub_dir_path_stack) {
+    char *dir_path;
+
+    while ((dir_path = List_pop(sub_dir_path_stack)) != NULL) {
+        DBG_SAFE_FREE(dir_path);
+    }
+    List_free(sub_dir_path_stack);
 }
 
 /**
@@ -354,44 +1217,69 @@ copy_file_from_local_to_remote(ssh_session session_ssh, sftp_session session_sft
 static CommandStatusE
 copy_remote_dir_recursively(ssh_session session_ssh, sftp_session session_sftp,
                             char *abs_path_remote, char *abs_path_local) {
-    ListT *sub_dir_path_stack = List_new(1, sizeof(char *));
+    SftpLoopT *loop = SftpLoop_for_session(session_ssh);
+    ListT *sub_dir_path_stack;
     ListT *remote_dir;
     FileSystemT *filesystem;
     char *dir_path_remote = NULL;
     char *dir_path_local = NULL;
     char *file_path_local = NULL;
+    uint32_t status_read = SSH_FX_OK;
+    CommandStatusE status = CMD_OK;
+    CommandStatusE status_file;
+
+    if (loop == NULL) {
+        return CMD_INTERNAL_ERROR;
+    }
 
+    sub_dir_path_stack = List_new(1, sizeof(char *));
     do {
         if (dir_path_remote == NULL || dir_path_local == NULL) {
             dir_path_remote = abs_path_remote;
             dir_path_local = abs_path_local;
         } else {
             dir_path_remote = List_pop(sub_dir_path_stack);
-            dir_path_local = dir_path_remote;
-            path_replace(dir_path_local, abs_path_remote, abs_path_local, 1);
+            dir_path_local =
+                path_replace_dup(dir_path_remote, abs_path_remote, abs_path_local);
         }
 
         path_mkdir_parents(dir_path_local, strlen(dir_path_local));
-        remote_dir = path_read_remote_dir(session_ssh, session_sftp, dir_path_remote);
+        remote_dir = SftpLoop_read_dir(loop, dir_path_remote, &status_read);
+
+        /* A listing cut short by a reconnect is read again on the new channel, a
+         * missing or forbidden directory isn't */
+        if (remote_dir == NULL && !SftpLoop_is_dead(loop) &&
+            (status_read == SSH_FX_CONNECTION_LOST ||
+             status_read == SSH_FX_NO_CONNECTION)) {
+            stats_count_retry();
+            remote_dir = SftpLoop_read_dir(loop, dir_path_remote, NULL);
+        }
         if (remote_dir == NULL) {
-            return CMD_INTERNAL_ERROR;
+            /* The rest of the tree is still copied, the copy fails */
+            stats_file_done(dir_path_remote, 0, 0, stats_clock(), 0, false);
+            status = status == CMD_OK ? CMD_INTERNAL_ERROR : status;
         }
 
-        for (size_t i = 0; i < remote_dir->length; i++) {
+        for (size_t i = 0;
+             remote_dir != NULL && i < remote_dir->length && !job_is_cancelled(); i++) {
             filesystem = List_get(remote_dir, i);
 
-            puts(filesystem->name);
             if (path_is_dotted(filesystem->name, strlen(filesystem->name))) {
                 continue;
             }
 
             switch (filesystem->type) {
                 case FS_REG_FILE:
-                    file_path_local = strdup(filesystem->relative_path);
-                    path_replace(file_path_local, abs_path_remote, abs_path_local, 1);
-                    copy_from_remote_to_local(session_ssh, session_sftp,
-                                              filesystem->relative_path, file_path_local);
-
+                    file_path_local = path_replace_dup(filesystem->relative_path,
+                                                       abs_path_remote, abs_path_local);
+                    status_file = copy_from_remote_to_local(session_ssh, session_sftp,
+                                                            filesystem->relative_path,
+                                                            file_path_local);
+                    /* The tree goes on after a failed file, the copy still fails */
+                    if (status == CMD_OK) {
+                        status = status_file;
+                    }
+                    DBG_SAFE_FREE(file_path_local);
                     break;
                 case FS_DIRECTORY:
                     List_push(sub_dir_path_stack, filesystem->relative_path,
@@ -405,11 +1293,18 @@ copy_remote_dir_recursively(ssh_session session_ssh, sftp_session session_sftp,
             }
         }
 
-        DBG_SAFE_FREE(file_path_local);
+        if (remote_dir != NULL) {
+            FileSystem_list_free(remote_dir);
+        }
+        if (dir_path_local != abs_path_local) {
+            DBG_SAFE_FREE(dir_path_remote);
+            DBG_SAFE_FREE(dir_path_local);
+        }
 
-    } while (!List_is_empty(sub_dir_path_stack));
+    } while (!List_is_empty(sub_dir_path_stack) && !job_is_cancelled());
 
-    return CMD_OK;
+    copy_free_dir_stack(sub_dir_path_stack);
+    return status;
 }
 
 static CommandStatusE
@@ -421,6 +1316,8 @@ copy_local_dir_recursively(ssh_session session_ssh, sftp_session session_sftp,
     char *dir_path_remote = NULL;
     char *dir_path_local = NULL;
     char *file_path_remote = NULL;
+    CommandStatusE status = CMD_OK;
+    CommandStatusE status_file;
 
     do {
         if (dir_path_remote == NULL || dir_path_local == NULL) {
@@ -428,17 +1325,19 @@ copy_local_dir_recursively(ssh_session session_ssh, sftp_session session_sftp,
             dir_path_local = abs_path_local;
         } else {
             dir_path_local = List_pop(sub_dir_path_stack);
-            dir_path_remote = strdup(dir_path_local);
-            path_replace(dir_path_remote, abs_path_local, abs_path_remote, 1);
+            dir_path_remote =
+                path_replace_dup(dir_path_local, abs_path_local, abs_path_remote);
         }
 
         create_parents_remote(session_ssh, session_sftp, dir_path_remote);
         local_dir = path_read_local_dir(dir_path_local);
         if (local_dir == NULL) {
-            return CMD_INTERNAL_ERROR;
+            stats_file_done(dir_path_local, 0, 0, stats_clock(), 0, false);
+            status = status == CMD_OK ? CMD_INTERNAL_ERROR : status;
         }
 
-        for (size_t i = 0; i < local_dir->length; i++) {
+        for (size_t i = 0;
+             local_dir != NULL && i < local_dir->length && !job_is_cancelled(); i++) {
             filesystem = List_get(local_dir, i);
 
             if (path_is_dotted(filesystem->name, strlen(filesystem->name))) {
@@ -447,12 +1346,15 @@ copy_local_dir_recursively(ssh_session session_ssh, sftp_session session_sftp,
 
             switch (filesystem->type) {
                 case FS_REG_FILE:
-                    file_path_remote = strdup(filesystem->relative_path);
-                    path_replace(file_path_remote, abs_path_local, abs_path_remote, 1);
-                    copy_from_local_to_remote(session_ssh, session_sftp,
-                                              filesystem->relative_path,
-                                              file_path_remote);
-
+                    file_path_remote = path_replace_dup(filesystem->relative_path,
+                                                        abs_path_local, abs_path_remote);
+                    status_file = copy_from_local_to_remote(session_ssh, session_sftp,
+                                                            filesystem->relative_path,
+                                                            file_path_remote);
+                    if (status == CMD_OK) {
+                        status = status_file;
+                    }
+                    DBG_SAFE_FREE(file_path_remote);
                     break;
                 case FS_DIRECTORY:
                     List_push(sub_dir_path_stack, filesystem->relative_path,
@@ -465,11 +1367,18 @@ copy_local_dir_recursively(ssh_session session_ssh, sftp_session session_sftp,
                     DBG_ERR("Unknown type %d", filesystem->type);
             }
         }
-        DBG_SAFE_FREE(file_path_remote);
+        if (local_dir != NULL) {
+            FileSystem_list_free(local_dir);
+        }
+        if (dir_path_remote != abs_path_remote) {
+            DBG_SAFE_FREE(dir_path_local);
+            DBG_SAFE_FREE(dir_path_remote);
+        }
 
-    } while (!List_is_empty(sub_dir_path_stack));
+    } while (!List_is_empty(sub_dir_path_stack) && !job_is_cancelled());
 
-    return CMD_OK;
+    copy_free_dir_stack(sub_dir_path_stack);
+    return status;
 }
 
 /**
@@ -483,19 +1392,31 @@ copy_local_dir_recursively(ssh_session session_ssh, sftp_session session_sftp,
 CommandStatusE
 copy_from_remote_to_local(ssh_session session_ssh, sftp_session session_sftp,
                           char *abs_path_remote, char *abs_path_local) {
-    sftp_attributes from = sftp_stat(session_sftp, abs_path_remote);
+    LoopResultT from = {.status = SSH_FX_NO_CONNECTION};
+    SftpLoopT *loop = SftpLoop_for_session(session_ssh);
+
+    /* Only the type is used, a stat or listing read within the TTL tells it */
+    if (cache_get_stat(abs_path_remote, &from.attr)) {
+        from.status = SSH_FX_OK;
+    } else if (loop != NULL &&
+               SftpLoop_stat(loop, abs_path_remote, SftpLoop_store_result, &from)) {
+        SftpLoop_run(loop);
+        if (from.status == SSH_FX_OK) {
+            cache_put_stat(abs_path_remote, &from.attr);
+        }
+    }
 
-    if (from == NULL) {
+    if (from.status != SSH_FX_OK) {
         DBG_ERR("Failed to get attributes for %s: %s", abs_path_remote,
-                ssh_get_error(session_ssh));
+                SftpLoop_status_str(from.status));
         return CMD_INTERNAL_ERROR;
     }
 
-    if (from->type == SSH_FILEXFER_TYPE_DIRECTORY) {
+    if (from.attr.type == SSH_FILEXFER_TYPE_DIRECTORY) {
         DBG_DEBUG("Copying dir from %s to %s", abs_path_remote, abs_path_local);
         return copy_remote_dir_recursively(session_ssh, session_sftp, abs_path_remote,
                                            abs_path_local);
-    } else if (from->type == SSH_FILEXFER_TYPE_REGULAR) {
+    } else if (from.attr.type == SSH_FILEXFER_TYPE_REGULAR) {
         DBG_DEBUG("Copying file from %s to %s", abs_path_remote, abs_path_local);
         return copy_file_from_remote_to_local(session_ssh, session_sftp, abs_path_remote,
                                               abs_path_local);
@@ -508,7 +1429,10 @@ CommandStatusE
 copy_from_local_to_remote(ssh_session session_ssh, sftp_session session_sftp,
                           char *abs_path_local, char *abs_path_remote) {
     struct stat from;
+    TRACE_START(time_trace_ns);
+
     stat(abs_path_local, &from);
+    TRACE_FS("stat", time_trace_ns, 0);
 
     if (S_ISDIR(from.st_mode)) {
         DBG_DEBUG("Copying dir from %s to %s", abs_path_local, abs_path_remote);
@@ -531,6 +1455,8 @@ void
 clean_ssh_session(ssh_session session) {
     DBG_DEBUG("Freeing session: %p", (void *)session);
 
+    SftpLoop_forget_session(session);
+
     if (ssh_is_connected(session)) {
         ssh_disconnect(session);
     }
@@ -0,0 +1,137 @@
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_client.h"
+#include "seft_compress.h"
+#include "seft_debug.h"
+#include "seft_pool.h"
+
+/** Options of the connection files are routed for, ``NULL`` unless mode is auto */
+static ConnectOptionsT *compress_options = NULL;
+
+/** Compressed sibling of the main session, opened on the first compressible file */
+static ssh_session session_ssh_compressed = NULL;
+
+/**
+ * Estimate the Shannon entropy of a buffer.
+ *
+ * :param buf: Sample of the file.
+ * :param length: Number of bytes in ``buf``.
+ *
+ * :return: Entropy in bits per byte, between 0 (constant) and 8 (random).
+ */
+double
+compress_sample_entropy(const uint8_t *buf, size_t length) {
+    size_t histogram[256] = {0};
+    double probability, entropy = 0;
+
+    if (!length) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        histogram[buf[i]]++;
+    }
+
+    for (size_t i = 0; i < 256; i++) {
+        if (!histogram[i]) {
+            continue;
+        }
+        probability = (double)histogram[i] / length;
+        entropy -= probability * log2(probability);
+    }
+
+    return entropy;
+}
+
+/** Check if a file starting with ``buf`` is worth compressing. */
+bool
+compress_is_compressible(const uint8_t *buf, size_t length) {
+    double entropy;
+
+    if (length < COMPRESS_MIN_FILE_SIZE) {
+        return false;
+    }
+
+    entropy = compress_sample_entropy(buf, length);
+    DBG_DEBUG("Sample of %zu bytes has %.2f bits/byte of entropy", length, entropy);
+
+    return entropy < COMPRESS_ENTROPY_THRESHOLD;
+}
+
+/**
+ * Enable or disable per file routing for a connection.
+ *
+ * :param options: Options of the connection, routing is enabled only if
+ *     ``options->compression`` is ``COMPRESSION_AUTO``. The pointer is kept, so it
+ *     must outlive the connection.
+ */
+void
+compress_set_mode(ConnectOptionsT *options) {
+    compress_clean();
+
+    if (options->compression == COMPRESSION_AUTO) {
+        compress_options = options;
+    }
+}
+
+/** Open the compressed sibling session, keeps ``NULL`` if it couldn't be opened. */
+static void
+compress_open_session(void) {
+    ConnectOptionsT options = *compress_options;
+
+    options.compression = COMPRESSION_YES;
+    session_ssh_compressed = try_ssh_init(&options);
+    memset(options.passphrase, 0, BUF_SIZE_PASSPHRASE);
+    if (session_ssh_compressed == NULL) {
+        DBG_ERR("Couldn't open compressed session to %s", compress_options->host_name);
+        compress_clean();
+    }
+}
+
+/** Check if files may be routed to another session, so a sample is worth taking. */
+bool
+compress_is_routing(void) {
+    /* The compressed session isn't shared with pool workers */
+    return compress_options != NULL && !session_is_pooled();
+}
+
+/**
+ * Pick the connection a file should be transferred through.
+ *
+ * :param session_ssh: The uncompressed connection.
+ * :param sample: First bytes of the file.
+ * :param length: Number of bytes in ``sample``.
+ *
+ * :return: The compressed connection if routing is enabled and the sample
+ *     compresses well, ``session_ssh`` otherwise.
+ */
+ssh_session
+compress_route(ssh_session session_ssh, const uint8_t *sample, size_t length) {
+    if (!compress_is_routing() || !compress_is_compressible(sample, length)) {
+        return session_ssh;
+    }
+
+    if (session_ssh_compressed == NULL) {
+        compress_open_session();
+    }
+
+    return session_ssh_compressed == NULL ? session_ssh : session_ssh_compressed;
+}
+
+/** Close the compressed sibling session and disable routing. */
+void
+compress_clean(void) {
+    if (session_ssh_compressed != NULL) {
+        clean_ssh_session(session_ssh_compressed);
+        session_ssh_compressed = NULL;
+    }
+
+    compress_options = NULL;
+}
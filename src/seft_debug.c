@@ -0,0 +1,251 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "seft_debug.h"
+
+__thread DbgAllocCountersT dbg_alloc_counters = {0};
+
+#if SEFT_ALLOC_PROF
+
+/* The profiler's own memory comes from plain malloc, it isn't profiled */
+
+/** Live allocations are found by address in a table of chains, each chain guarded
+ * by one of ``DBG_PROF_NUM_LOCKS`` locks */
+#define DBG_PROF_CHAIN_BITS 16
+#define DBG_PROF_NUM_CHAINS (1 << DBG_PROF_CHAIN_BITS)
+#define DBG_PROF_NUM_LOCKS 256
+
+/** A live allocation, from its ``DBG_*`` allocation to its ``DBG_SAFE_FREE`` */
+typedef struct DbgProfLiveS {
+    struct DbgProfLiveS *next;
+    void *ptr;
+    size_t size;
+    DbgAllocSiteT *site;
+} DbgProfLiveT;
+
+static DbgProfLiveT *dbg_prof_chains[DBG_PROF_NUM_CHAINS];
+static pthread_mutex_t dbg_prof_locks[DBG_PROF_NUM_LOCKS];
+static pthread_once_t dbg_prof_once = PTHREAD_ONCE_INIT;
+
+/** Sites called at least once, newest first */
+static _Atomic(DbgAllocSiteT *) dbg_prof_sites = NULL;
+
+static atomic_uint_fast64_t dbg_prof_live_bytes = 0;
+static atomic_uint_fast64_t dbg_prof_peak_bytes = 0;
+
+static size_t
+dbg_prof_chain(const void *ptr) {
+    /* Allocations are aligned to 16 bytes, the low bits carry nothing */
+    uint64_t key = (uintptr_t)ptr >> 4;
+
+    return (key * 0x9E3779B97F4A7C15ull) >> (64 - DBG_PROF_CHAIN_BITS);
+}
+
+static void
+dbg_prof_report_at_exit(void) {
+    dbg_prof_report(stderr, DBG_PROF_TOP_SITES);
+}
+
+static void
+dbg_prof_init(void) {
+    for (size_t i = 0; i < DBG_PROF_NUM_LOCKS; i++) {
+        pthread_mutex_init(&dbg_prof_locks[i], NULL);
+    }
+    atexit(dbg_prof_report_at_exit);
+}
+
+/** Take the allocation at ``ptr`` out of the table, ``NULL`` if it isn't in it. */
+static DbgProfLiveT *
+dbg_prof_remove(void *ptr) {
+    size_t chain = dbg_prof_chain(ptr);
+    pthread_mutex_t *lock = &dbg_prof_locks[chain % DBG_PROF_NUM_LOCKS];
+    DbgProfLiveT **link, *live = NULL;
+
+    pthread_mutex_lock(lock);
+    for (link = &dbg_prof_chains[chain]; *link != NULL; link = &(*link)->next) {
+        if ((*link)->ptr == ptr) {
+            live = *link;
+            *link = live->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(lock);
+
+    return live;
+}
+
+static void
+dbg_prof_forget(DbgProfLiveT *live) {
+    atomic_fetch_sub_explicit(&live->site->num_live, 1, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&live->site->live_bytes, live->size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&dbg_prof_live_bytes, live->size, memory_order_relaxed);
+    free(live);
+}
+
+/**
+ * Record an allocation of ``size`` bytes at ``ptr`` made at ``site``. Called by the
+ * ``DBG_*`` macros in builds with ``SEFT_ALLOC_PROF``.
+ */
+void
+dbg_prof_alloc(DbgAllocSiteT *site, void *ptr, size_t size) {
+    DbgProfLiveT *live = malloc(sizeof *live), *stale;
+    size_t chain = dbg_prof_chain(ptr);
+    uint64_t live_bytes, peak_bytes;
+
+    pthread_once(&dbg_prof_once, dbg_prof_init);
+    if (!atomic_exchange(&site->is_listed, true)) {
+        site->next = atomic_load(&dbg_prof_sites);
+        while (!atomic_compare_exchange_weak(&dbg_prof_sites, &site->next, site)) {
+        }
+    }
+
+    atomic_fetch_add_explicit(&site->num_allocs, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->num_bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->num_live, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&site->live_bytes, size, memory_order_relaxed);
+
+    live_bytes = atomic_fetch_add_explicit(&dbg_prof_live_bytes, size,
+                                           memory_order_relaxed) + size;
+    peak_bytes = atomic_load_explicit(&dbg_prof_peak_bytes, memory_order_relaxed);
+    while (live_bytes > peak_bytes &&
+           !atomic_compare_exchange_weak(&dbg_prof_peak_bytes, &peak_bytes, live_bytes)) {
+    }
+
+    if (live == NULL) {
+        return;
+    }
+
+    /* Still in the table if it was freed with a plain ``free`` */
+    stale = dbg_prof_remove(ptr);
+    if (stale != NULL) {
+        dbg_prof_forget(stale);
+    }
+
+    *live = (DbgProfLiveT){.ptr = ptr, .size = size, .site = site};
+    pthread_mutex_lock(&dbg_prof_locks[chain % DBG_PROF_NUM_LOCKS]);
+    live->next = dbg_prof_chains[chain];
+    dbg_prof_chains[chain] = live;
+    pthread_mutex_unlock(&dbg_prof_locks[chain % DBG_PROF_NUM_LOCKS]);
+}
+
+/** Record that ``ptr`` is freed. Memory that didn't come from the ``DBG_*`` macros,
+ * e.g. from ``strdup``, isn't in the table and is let go. */
+void
+dbg_prof_free(void *ptr) {
+    DbgProfLiveT *live;
+
+    pthread_once(&dbg_prof_once, dbg_prof_init);
+    live = dbg_prof_remove(ptr);
+    if (live != NULL) {
+        dbg_prof_forget(live);
+    }
+}
+
+static int
+dbg_prof_cmp_allocs(const void *left, const void *right) {
+    uint64_t num_left = atomic_load(&(*(DbgAllocSiteT *const *)left)->num_allocs);
+    uint64_t num_right = atomic_load(&(*(DbgAllocSiteT *const *)right)->num_allocs);
+
+    return (num_left < num_right) - (num_left > num_right);
+}
+
+static int
+dbg_prof_cmp_bytes(const void *left, const void *right) {
+    uint64_t num_left = atomic_load(&(*(DbgAllocSiteT *const *)left)->num_bytes);
+    uint64_t num_right = atomic_load(&(*(DbgAllocSiteT *const *)right)->num_bytes);
+
+    return (num_left < num_right) - (num_left > num_right);
+}
+
+/** Most live bytes first, then most live allocations so that empty ones count */
+static int
+dbg_prof_cmp_live(const void *left, const void *right) {
+    DbgAllocSiteT *site_left = *(DbgAllocSiteT *const *)left;
+    DbgAllocSiteT *site_right = *(DbgAllocSiteT *const *)right;
+    uint64_t bytes_left = atomic_load(&site_left->live_bytes);
+    uint64_t bytes_right = atomic_load(&site_right->live_bytes);
+    uint64_t num_left = atomic_load(&site_left->num_live);
+    uint64_t num_right = atomic_load(&site_right->num_live);
+
+    if (bytes_left != bytes_right) {
+        return (bytes_left < bytes_right) - (bytes_left > bytes_right);
+    }
+    return (num_left < num_right) - (num_left > num_right);
+}
+
+static void
+dbg_prof_print_sites(FILE *file, const char *title, DbgAllocSiteT **sites,
+                     size_t num_sites, size_t num_top) {
+    DbgAllocSiteT *site;
+
+    fprintf(file, "%s\n%10s %12s %8s %12s  %s\n", title, "allocs", "bytes", "live",
+            "live bytes", "site");
+    for (size_t i = 0; i < num_sites && i < num_top; i++) {
+        site = sites[i];
+        fprintf(file,
+                "%10" PRIuFAST64 " %12" PRIuFAST64 " %8" PRIuFAST64 " %12" PRIuFAST64
+                "  %s:%d %s\n",
+                atomic_load(&site->num_allocs), atomic_load(&site->num_bytes),
+                atomic_load(&site->num_live), atomic_load(&site->live_bytes), site->file,
+                site->line, site->func);
+    }
+}
+
+/**
+ * Print the totals of the ``DBG_*`` allocations, the peak of the bytes live at
+ * once, the ``num_top`` sites allocating most often and most bytes, and the sites
+ * whose allocations are still live, i.e. leaks when called at exit.
+ *
+ * .. note:: Builds with ``SEFT_ALLOC_PROF`` print it to stderr at exit.
+ */
+void
+dbg_prof_report(FILE *file, size_t num_top) {
+    DbgAllocSiteT *site, **sites;
+    size_t num_sites = 0, num_leaking = 0;
+    uint64_t num_allocs = 0, num_bytes = 0, num_live = 0;
+
+    for (site = atomic_load(&dbg_prof_sites); site != NULL; site = site->next) {
+        num_sites++;
+    }
+    sites = malloc((num_sites ? num_sites : 1) * sizeof *sites);
+    if (sites == NULL) {
+        return;
+    }
+
+    num_sites = 0;
+    for (site = atomic_load(&dbg_prof_sites); site != NULL; site = site->next) {
+        sites[num_sites++] = site;
+        num_allocs += atomic_load(&site->num_allocs);
+        num_bytes += atomic_load(&site->num_bytes);
+        num_live += atomic_load(&site->num_live);
+    }
+
+    fprintf(file,
+            "Allocations: %" PRIu64 " (%" PRIu64 " bytes) from %zu sites, peak live "
+            "%" PRIuFAST64 " bytes, still live %" PRIu64 " (%" PRIuFAST64 " bytes)\n",
+            num_allocs, num_bytes, num_sites, atomic_load(&dbg_prof_peak_bytes), num_live,
+            atomic_load(&dbg_prof_live_bytes));
+
+    qsort(sites, num_sites, sizeof *sites, dbg_prof_cmp_allocs);
+    dbg_prof_print_sites(file, "Most allocations:", sites, num_sites, num_top);
+    qsort(sites, num_sites, sizeof *sites, dbg_prof_cmp_bytes);
+    dbg_prof_print_sites(file, "Most bytes:", sites, num_sites, num_top);
+
+    /* Every site with live allocations, they sort first */
+    qsort(sites, num_sites, sizeof *sites, dbg_prof_cmp_live);
+    while (num_leaking < num_sites && atomic_load(&sites[num_leaking]->num_live)) {
+        num_leaking++;
+    }
+    if (num_leaking) {
+        dbg_prof_print_sites(file, "Still live:", sites, num_leaking, num_leaking);
+    }
+
+    free(sites);
+}
+
+#endif /* SEFT_ALLOC_PROF */
@@ -0,0 +1,807 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_checksum.h"
+#include "seft_debug.h"
+#include "seft_dedup.h"
+#include "seft_loop.h"
+#include "seft_path.h"
+#include "seft_remote.h"
+#include "seft_utils.h"
+
+/** A file of the manifest */
+typedef struct {
+    uint8_t digest[CHECKSUM_MAX_DIGEST_SIZE];
+    uint64_t size;
+
+    /** Modification time of the remote file when it was recorded, a file that
+     * changed since doesn't hold the content any more */
+    uint32_t mtime;
+
+    char *path;
+
+    /** Replaced or found stale, left out of the manifest written back */
+    bool is_removed;
+} DedupEntryT;
+
+/** A local file hashed ahead of the upload */
+typedef struct {
+    char *path;
+    uint64_t size;
+    time_t mtime;
+    uint8_t digest[CHECKSUM_MAX_DIGEST_SIZE];
+    bool is_hashed;
+} DedupFileT;
+
+struct DedupS {
+    char *path_manifest;
+
+    DedupEntryT *entries;
+    size_t num_entries;
+    size_t entries_allocated;
+
+    /** Open addressing tables of indices into ``entries``, by content and by path */
+    size_t *by_digest;
+    size_t *by_path;
+    size_t num_slots;
+
+    /** Local files hashed by ``Dedup_hash_tree``, sorted by path */
+    DedupFileT *files;
+    size_t num_files;
+
+    /** Set if the manifest changed and has to be written back */
+    bool is_dirty;
+
+    /** Set if the manifest couldn't be read, writing it would lose its entries */
+    bool is_broken;
+
+    size_t num_linked;
+    size_t num_uploaded;
+    uint64_t num_bytes_saved;
+
+    pthread_mutex_t lock;
+};
+
+/** State shared by the threads hashing local files */
+typedef struct {
+    DedupT *dedup;
+    atomic_size_t next;
+} DedupHashRunT;
+
+/** Remote file read whole into memory */
+typedef struct {
+    char *data;
+    uint64_t size;
+    LoopHandleT handle;
+    uint32_t status;
+} DedupReadT;
+
+/** Manifest the calling thread's uploads are deduplicated against */
+static __thread DedupT *thread_dedup = NULL;
+
+static uint64_t
+dedup_hash_digest(const uint8_t *digest) {
+    uint64_t hash;
+
+    memcpy(&hash, digest, sizeof hash);
+    return hash;
+}
+
+/** FNV-1a */
+static uint64_t
+dedup_hash_path(const char *path) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (; *path; path++) {
+        hash = (hash ^ (uint8_t)*path) * 0x100000001b3ULL;
+    }
+
+    return hash;
+}
+
+static void
+dedup_table_insert(size_t *table, size_t num_slots, uint64_t hash, size_t index) {
+    size_t slot = hash & (num_slots - 1);
+
+    while (table[slot] != SIZE_MAX) {
+        slot = (slot + 1) & (num_slots - 1);
+    }
+    table[slot] = index;
+}
+
+/** Double the tables and index every entry again. */
+static void
+dedup_grow(DedupT *self) {
+    DedupEntryT *entry;
+
+    self->num_slots = self->num_slots ? self->num_slots * 2 : 64;
+    DBG_SAFE_FREE(self->by_digest);
+    DBG_SAFE_FREE(self->by_path);
+    self->by_digest = DBG_MALLOC(self->num_slots * sizeof *self->by_digest);
+    self->by_path = DBG_MALLOC(self->num_slots * sizeof *self->by_path);
+    memset(self->by_digest, 0xff, self->num_slots * sizeof *self->by_digest);
+    memset(self->by_path, 0xff, self->num_slots * sizeof *self->by_path);
+
+    for (size_t i = 0; i < self->num_entries; i++) {
+        entry = &self->entries[i];
+        dedup_table_insert(self->by_digest, self->num_slots,
+                           dedup_hash_digest(entry->digest), i);
+        dedup_table_insert(self->by_path, self->num_slots, dedup_hash_path(entry->path),
+                           i);
+    }
+}
+
+/** Index of the entry of ``path``, ``SIZE_MAX`` if there's none. */
+static size_t
+dedup_find_path(DedupT *self, const char *path) {
+    size_t slot, index;
+
+    if (!self->num_slots) {
+        return SIZE_MAX;
+    }
+
+    slot = dedup_hash_path(path) & (self->num_slots - 1);
+    for (; (index = self->by_path[slot]) != SIZE_MAX;
+         slot = (slot + 1) & (self->num_slots - 1)) {
+        if (!self->entries[index].is_removed &&
+            !strcmp(self->entries[index].path, path)) {
+            return index;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+/** Index of an entry holding the content, ``SIZE_MAX`` if there's none. */
+static size_t
+dedup_find_content(DedupT *self, const uint8_t *digest, uint64_t size) {
+    DedupEntryT *entry;
+    size_t slot, index;
+
+    if (!self->num_slots) {
+        return SIZE_MAX;
+    }
+
+    slot = dedup_hash_digest(digest) & (self->num_slots - 1);
+    for (; (index = self->by_digest[slot]) != SIZE_MAX;
+         slot = (slot + 1) & (self->num_slots - 1)) {
+        entry = &self->entries[index];
+        if (!entry->is_removed && entry->size == size &&
+            !memcmp(entry->digest, digest, sizeof entry->digest)) {
+            return index;
+        }
+    }
+
+    return SIZE_MAX;
+}
+
+/** Record that ``path`` holds the content, replacing what it held before. Must be
+ * called with the lock held. */
+static void
+dedup_record(DedupT *self, const uint8_t *digest, uint64_t size, uint32_t mtime,
+             const char *path) {
+    size_t index = dedup_find_path(self, path);
+    DedupEntryT *entry;
+    void *grown;
+
+    if (index != SIZE_MAX) {
+        self->entries[index].is_removed = true;
+    }
+
+    if (self->num_entries == self->entries_allocated) {
+        self->entries_allocated =
+            self->entries_allocated ? self->entries_allocated * 2 : 64;
+        grown =
+            DBG_REALLOC(self->entries, self->entries_allocated * sizeof *self->entries);
+        if (grown == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        self->entries = grown;
+    }
+
+    entry = &self->entries[self->num_entries++];
+    *entry = (DedupEntryT){.size = size, .mtime = mtime, .path = strdup(path)};
+    memcpy(entry->digest, digest, sizeof entry->digest);
+
+    if (self->num_entries * 2 > self->num_slots) {
+        dedup_grow(self);
+    } else {
+        dedup_table_insert(self->by_digest, self->num_slots, dedup_hash_digest(digest),
+                           self->num_entries - 1);
+        dedup_table_insert(self->by_path, self->num_slots, dedup_hash_path(path),
+                           self->num_entries - 1);
+    }
+    self->is_dirty = true;
+}
+
+/** Forget ``path``, its content changed behind our back. */
+static void
+dedup_forget(DedupT *self, const char *path) {
+    size_t index;
+
+    pthread_mutex_lock(&self->lock);
+    index = dedup_find_path(self, path);
+    if (index != SIZE_MAX) {
+        self->entries[index].is_removed = true;
+        self->is_dirty = true;
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+/** Parse the lines of a manifest, malformed ones are skipped. */
+static void
+dedup_parse(DedupT *self, char *text) {
+    uint8_t digest[CHECKSUM_MAX_DIGEST_SIZE];
+    char hex[2 * CHECKSUM_MAX_DIGEST_SIZE + 1];
+    uint64_t size;
+    uint32_t mtime;
+    int32_t len_prefix;
+    char *save;
+
+    for (char *line = strtok_r(text, "\n", &save); line != NULL;
+         line = strtok_r(NULL, "\n", &save)) {
+        len_prefix = 0;
+        if (*line == '#' ||
+            sscanf(line, "%64s %" SCNu64 " %" SCNu32 " %n", hex, &size, &mtime,
+                   &len_prefix) != 3 ||
+            !len_prefix || line[len_prefix] == '\0' || strlen(hex) != sizeof hex - 1 ||
+            !checksum_from_hex(hex, digest, sizeof digest)) {
+            continue;
+        }
+
+        dedup_record(self, digest, size, mtime, line + len_prefix);
+    }
+}
+
+static void
+dedup_on_status(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    uint32_t *status = user_data;
+
+    (void)loop;
+    if (*status == SSH_FX_OK) {
+        *status = result->status;
+    }
+}
+
+static void
+dedup_on_read(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    DedupReadT *read = user_data;
+
+    if (result->status == SSH_FX_EOF) {
+        return;
+    } else if (result->status != SSH_FX_OK) {
+        dedup_on_status(loop, result, &read->status);
+        return;
+    }
+
+    memcpy(read->data + result->offset, result->data,
+           MIN(result->len_data, read->size - result->offset));
+
+    /* Short read, ask for the rest of the chunk */
+    if (result->len_data && result->len_data < result->length &&
+        !SftpLoop_read(loop, &read->handle, result->offset + result->len_data,
+                       result->length - result->len_data, dedup_on_read, read)) {
+        read->status = SSH_FX_CONNECTION_LOST;
+    }
+}
+
+/** Read the manifest, a missing one is an empty one. */
+static void
+dedup_read_manifest(DedupT *self, SftpLoopT *loop) {
+    LoopResultT attr = {.status = SSH_FX_NO_CONNECTION};
+    LoopResultT opened = {.status = SSH_FX_NO_CONNECTION};
+    DedupReadT read = {.status = SSH_FX_OK};
+    uint32_t status_close = SSH_FX_OK;
+
+    /* The STAT rides along with the OPEN */
+    SftpLoop_stat(loop, self->path_manifest, SftpLoop_store_result, &attr);
+    if (SftpLoop_open(loop, self->path_manifest, SSH_FXF_READ, 0, SftpLoop_store_result,
+                      &opened)) {
+        SftpLoop_run(loop);
+    }
+
+    if (opened.status == SSH_FX_NO_SUCH_FILE) {
+        DBG_INFO("No manifest at %s yet", self->path_manifest);
+        return;
+    } else if (opened.status != SSH_FX_OK || attr.status != SSH_FX_OK) {
+        DBG_ERR("Couldn't read manifest %s: %s", self->path_manifest,
+                SftpLoop_status_str(opened.status != SSH_FX_OK ? opened.status
+                                                               : attr.status));
+        self->is_broken = true;
+        if (opened.status == SSH_FX_OK) {
+            SftpLoop_close(loop, &opened.handle, NULL, NULL);
+            SftpLoop_run(loop);
+        }
+        return;
+    }
+
+    read.handle = opened.handle;
+    read.size = attr.attr.size;
+    read.data = DBG_CALLOC(read.size + 1, sizeof *read.data);
+    for (uint64_t offset = 0; offset < read.size; offset += LOOP_CHUNK_SIZE) {
+        if (!SftpLoop_read(loop, &read.handle, offset,
+                           MIN(LOOP_CHUNK_SIZE, read.size - offset), dedup_on_read,
+                           &read)) {
+            read.status = SSH_FX_CONNECTION_LOST;
+            break;
+        }
+    }
+
+    /* A CLOSE would be sent ahead of the READs still queued */
+    SftpLoop_run(loop);
+    SftpLoop_close(loop, &read.handle, dedup_on_status, &status_close);
+    SftpLoop_run(loop);
+
+    if (read.status != SSH_FX_OK) {
+        DBG_ERR("Couldn't read manifest %s: %s", self->path_manifest,
+                SftpLoop_status_str(read.status));
+        self->is_broken = true;
+    } else {
+        dedup_parse(self, read.data);
+    }
+
+    DBG_SAFE_FREE(read.data);
+    self->is_dirty = false;
+}
+
+/** Write the manifest back, without the entries found stale. */
+static CommandStatusE
+dedup_write_manifest(DedupT *self, SftpLoopT *loop) {
+    LoopResultT opened = {.status = SSH_FX_NO_CONNECTION};
+    char hex[2 * CHECKSUM_MAX_DIGEST_SIZE + 1];
+    uint32_t status = SSH_FX_OK;
+    size_t length = 0, allocated = BUF_SIZE_FS_PATH, len_line;
+    char *text = DBG_MALLOC(allocated);
+    DedupEntryT *entry;
+    void *grown;
+
+    length = snprintf(text, allocated, "%s\n", DEDUP_MANIFEST_HEADER);
+    for (size_t i = 0; i < self->num_entries; i++) {
+        entry = &self->entries[i];
+        if (entry->is_removed || strchr(entry->path, '\n') != NULL) {
+            continue;
+        }
+
+        len_line = sizeof hex + 2 * 24 + strlen(entry->path) + 1;
+        if (length + len_line >= allocated) {
+            allocated = 2 * (allocated + len_line);
+            grown = DBG_REALLOC(text, allocated);
+            if (grown == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            text = grown;
+        }
+
+        checksum_to_hex(entry->digest, sizeof entry->digest, hex);
+        length += snprintf(text + length, allocated - length,
+                           "%s %" PRIu64 " %" PRIu32 " %s\n", hex, entry->size,
+                           entry->mtime, entry->path);
+    }
+
+    if (SftpLoop_open(loop, self->path_manifest,
+                      SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
+                      FS_CREATE_PERM & 0666, SftpLoop_store_result, &opened)) {
+        SftpLoop_run(loop);
+    }
+    status = opened.status;
+
+    if (status == SSH_FX_OK) {
+        for (size_t offset = 0; offset < length; offset += LOOP_CHUNK_SIZE) {
+            if (!SftpLoop_write(loop, &opened.handle, offset, text + offset,
+                                MIN(LOOP_CHUNK_SIZE, length - offset), dedup_on_status,
+                                &status)) {
+                status = SSH_FX_CONNECTION_LOST;
+                break;
+            }
+        }
+        SftpLoop_run(loop);
+        SftpLoop_close(loop, &opened.handle, dedup_on_status, &status);
+        SftpLoop_run(loop);
+    }
+
+    DBG_SAFE_FREE(text);
+    if (status != SSH_FX_OK) {
+        DBG_ERR("Couldn't write manifest %s: %s", self->path_manifest,
+                SftpLoop_status_str(status));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    return CMD_OK;
+}
+
+/** Hash a local file, false if it couldn't be read. */
+static bool
+dedup_hash_file(DedupFileT *file, uint8_t *buf) {
+    ChecksumT checksum;
+    struct stat attr;
+    ssize_t num_bytes_read;
+    uint64_t offset = 0;
+    int fd = open(file->path, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &attr)) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return false;
+    }
+
+    Checksum_init(&checksum, CHECKSUM_SHA256);
+    while ((num_bytes_read = read(fd, buf, BUF_SIZE_DEDUP_READ)) > 0) {
+        Checksum_feed(&checksum, offset, buf, num_bytes_read);
+        offset += num_bytes_read;
+    }
+    Checksum_final(&checksum, file->digest);
+    Checksum_free(&checksum);
+    close(fd);
+
+    file->size = offset;
+    file->mtime = attr.st_mtime;
+    return num_bytes_read == 0 && offset == (uint64_t)attr.st_size;
+}
+
+static void *
+dedup_hash_worker(void *arg) {
+    DedupHashRunT *run = arg;
+    DedupT *dedup = run->dedup;
+    uint8_t *buf = DBG_MALLOC(BUF_SIZE_DEDUP_READ);
+    size_t index;
+
+    while ((index = atomic_fetch_add(&run->next, 1)) < dedup->num_files) {
+        dedup->files[index].is_hashed = dedup_hash_file(&dedup->files[index], buf);
+    }
+
+    DBG_SAFE_FREE(buf);
+    return NULL;
+}
+
+/** List the regular files of a local tree, hidden and dotted entries are skipped
+ * like the copy does. */
+static void
+dedup_collect(DedupT *self, const char *path, size_t *allocated) {
+    char buf_path[BUF_SIZE_FS_PATH];
+    FileSystemT *filesystem;
+    struct stat attr;
+    ListT *local_dir;
+    void *grown;
+
+    if (stat(path, &attr)) {
+        return;
+    }
+
+    if (S_ISREG(attr.st_mode)) {
+        if (self->num_files == *allocated) {
+            *allocated = *allocated ? *allocated * 2 : 256;
+            grown = DBG_REALLOC(self->files, *allocated * sizeof *self->files);
+            if (grown == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            self->files = grown;
+        }
+        self->files[self->num_files++] = (DedupFileT){.path = strdup(path)};
+        return;
+    } else if (!S_ISDIR(attr.st_mode)) {
+        return;
+    }
+
+    snprintf(buf_path, sizeof buf_path, "%s", path);
+    local_dir = path_read_local_dir(buf_path);
+    if (local_dir == NULL) {
+        return;
+    }
+
+    for (size_t i = 0; i < local_dir->length; i++) {
+        filesystem = List_get(local_dir, i);
+        if (!path_is_dotted(filesystem->name, strlen(filesystem->name))) {
+            dedup_collect(self, filesystem->relative_path, allocated);
+        }
+    }
+    FileSystem_list_free(local_dir);
+}
+
+static int
+dedup_compare_files(const void *file_a, const void *file_b) {
+    return strcmp(((const DedupFileT *)file_a)->path, ((const DedupFileT *)file_b)->path);
+}
+
+/** Digest of a local file, from ``Dedup_hash_tree`` unless it changed since. */
+static bool
+dedup_local_digest(DedupT *self, const char *path, DedupFileT *file) {
+    DedupFileT key = {.path = (char *)path};
+    DedupFileT *hashed =
+        self->num_files ? bsearch(&key, self->files, self->num_files, sizeof *self->files,
+                                  dedup_compare_files)
+                        : NULL;
+    struct stat attr;
+    uint8_t *buf;
+    bool is_hashed;
+
+    if (hashed != NULL && hashed->is_hashed && !stat(path, &attr) &&
+        (uint64_t)attr.st_size == hashed->size && attr.st_mtime == hashed->mtime) {
+        *file = *hashed;
+        return true;
+    }
+
+    buf = DBG_MALLOC(BUF_SIZE_DEDUP_READ);
+    *file = key;
+    is_hashed = dedup_hash_file(file, buf);
+    DBG_SAFE_FREE(buf);
+
+    return is_hashed;
+}
+
+static void
+dedup_put_string(uint8_t *buf, size_t *length, const void *data, uint32_t len_data) {
+    buf[(*length)++] = len_data >> 24;
+    buf[(*length)++] = len_data >> 16;
+    buf[(*length)++] = len_data >> 8;
+    buf[(*length)++] = len_data;
+    memcpy(buf + *length, data, len_data);
+    *length += len_data;
+}
+
+/** Link ``path_remote`` to the file holding the content with ``hardlink@openssh.com``,
+ * replacing whatever is there. */
+static uint32_t
+dedup_hardlink(SftpLoopT *loop, const char *path_source, const char *path_remote) {
+    size_t len_source = strlen(path_source), len_remote = strlen(path_remote),
+           length = 0;
+    uint8_t *payload = DBG_MALLOC(len_source + len_remote + 8);
+    uint32_t status = SSH_FX_OK, status_remove = SSH_FX_OK;
+
+    dedup_put_string(payload, &length, path_source, len_source);
+    dedup_put_string(payload, &length, path_remote, len_remote);
+
+    /* The server handles requests in order, the link comes after the removal */
+    SftpLoop_remove(loop, path_remote, dedup_on_status, &status_remove);
+    if (SftpLoop_extended(loop, "hardlink@openssh.com", payload, length,
+                          dedup_on_status, &status)) {
+        SftpLoop_run(loop);
+    } else {
+        status = SSH_FX_CONNECTION_LOST;
+    }
+
+    DBG_SAFE_FREE(payload);
+    return status;
+}
+
+/**
+ * Load the manifest of a remote root, ``DEDUP_MANIFEST_NAME`` in it.
+ *
+ * :param loop: Loop to read the manifest with.
+ * :param root_remote: Directory the deduplicated uploads go under.
+ */
+DedupT *
+Dedup_open(SftpLoopT *loop, const char *root_remote) {
+    DedupT *self = DBG_CALLOC(1, sizeof *self);
+
+    self->path_manifest = DBG_CALLOC(BUF_SIZE_FS_PATH, sizeof *self->path_manifest);
+    snprintf(self->path_manifest, BUF_SIZE_FS_PATH, "%s%s%s", root_remote,
+             root_remote[strlen(root_remote) - 1] == PATH_SEPARATOR ? "" : "/",
+             DEDUP_MANIFEST_NAME);
+    pthread_mutex_init(&self->lock, NULL);
+
+    dedup_read_manifest(self, loop);
+    DBG_INFO("Manifest %s lists %zu files", self->path_manifest, self->num_entries);
+
+    return self;
+}
+
+/**
+ * Hash the files of a local tree ahead of the upload, ``num_threads`` files at a
+ * time. Files the upload finds changed since are hashed again.
+ */
+void
+Dedup_hash_tree(DedupT *self, const char *path_local, size_t num_threads) {
+    DedupHashRunT run = {.dedup = self};
+    pthread_t threads[MAX_DEDUP_HASH_THREADS];
+    size_t allocated = 0, num_started = 0;
+
+    dedup_collect(self, path_local, &allocated);
+    if (!self->num_files) {
+        return;
+    }
+    qsort(self->files, self->num_files, sizeof *self->files, dedup_compare_files);
+
+    num_threads = MAX(1, MIN(MIN(num_threads, MAX_DEDUP_HASH_THREADS), self->num_files));
+    for (; num_started < num_threads; num_started++) {
+        if (pthread_create(&threads[num_started], NULL, dedup_hash_worker, &run)) {
+            break;
+        }
+    }
+
+    /* Whatever the threads didn't get to is hashed here */
+    dedup_hash_worker(&run);
+    for (size_t i = 0; i < num_started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+/**
+ * Create ``path_remote`` on the server out of a file already holding the same
+ * content, without sending it. A hard link is made if the server has
+ * ``hardlink@openssh.com``, a copy if it has ``copy-data``.
+ *
+ * :return: ``CMD_OK`` if the file is in place, ``CMD_NOT_EXECUTED`` if it has to be
+ *     uploaded.
+ */
+CommandStatusE
+Dedup_link(DedupT *self, SftpLoopT *loop, const char *path_local,
+           const char *path_remote) {
+    LoopResultT attr = {.status = SSH_FX_NO_CONNECTION};
+    DedupFileT file;
+    DedupEntryT entry;
+    char *path_source = NULL;
+    size_t index;
+    uint32_t status;
+
+    /* An empty file costs nothing to send, a link would only tie it to another */
+    if (!dedup_local_digest(self, path_local, &file) || !file.size) {
+        return CMD_NOT_EXECUTED;
+    }
+
+    /* Entries whose file changed or went away since they were recorded are dropped */
+    for (;;) {
+        pthread_mutex_lock(&self->lock);
+        index = dedup_find_content(self, file.digest, file.size);
+        if (index != SIZE_MAX) {
+            entry = self->entries[index];
+            path_source = strdup(entry.path);
+        }
+        pthread_mutex_unlock(&self->lock);
+
+        if (index == SIZE_MAX) {
+            return CMD_NOT_EXECUTED;
+        }
+
+        attr.status = SSH_FX_NO_CONNECTION;
+        if (SftpLoop_stat(loop, path_source, SftpLoop_store_result, &attr)) {
+            SftpLoop_run(loop);
+        }
+        if (attr.status == SSH_FX_OK && attr.attr.size == entry.size &&
+            attr.attr.mtime == entry.mtime) {
+            break;
+        }
+
+        DBG_DEBUG("Manifest entry %s is stale", path_source);
+        dedup_forget(self, path_source);
+        free(path_source);
+        if (attr.status == SSH_FX_CONNECTION_LOST || SftpLoop_is_dead(loop)) {
+            return CMD_NOT_EXECUTED;
+        }
+    }
+
+    if (!strcmp(path_source, path_remote)) {
+        /* Uploaded before and unchanged since */
+        status = SSH_FX_OK;
+    } else if (SftpLoop_has_extension(loop, "hardlink@openssh.com")) {
+        status = dedup_hardlink(loop, path_source, path_remote);
+    } else if (SftpLoop_has_extension(loop, "copy-data")) {
+        status = remote_copy_data(loop, path_source, path_remote);
+
+        /* The copy is a file of its own, with a modification time of its own */
+        attr.status = SSH_FX_NO_CONNECTION;
+        if (status == SSH_FX_OK &&
+            SftpLoop_stat(loop, path_remote, SftpLoop_store_result, &attr)) {
+            SftpLoop_run(loop);
+        }
+        status = status == SSH_FX_OK ? attr.status : status;
+    } else {
+        status = SSH_FX_OP_UNSUPPORTED;
+    }
+
+    if (status != SSH_FX_OK) {
+        DBG_DEBUG("Couldn't create %s out of %s: %s", path_remote, path_source,
+                  SftpLoop_status_str(status));
+        free(path_source);
+        return CMD_NOT_EXECUTED;
+    }
+
+    DBG_INFO("%s has the content of %s, not sending it", path_remote, path_source);
+    pthread_mutex_lock(&self->lock);
+    dedup_record(self, file.digest, file.size, attr.attr.mtime, path_remote);
+    self->num_linked++;
+    self->num_bytes_saved += file.size;
+    pthread_mutex_unlock(&self->lock);
+
+    free(path_source);
+    return CMD_OK;
+}
+
+/** Record a file uploaded in full, later uploads of its content are linked to it. */
+void
+Dedup_add(DedupT *self, SftpLoopT *loop, const char *path_local,
+          const char *path_remote) {
+    LoopResultT attr = {.status = SSH_FX_NO_CONNECTION};
+    DedupFileT file;
+
+    pthread_mutex_lock(&self->lock);
+    self->num_uploaded++;
+    pthread_mutex_unlock(&self->lock);
+
+    if (SftpLoop_stat(loop, path_remote, SftpLoop_store_result, &attr)) {
+        SftpLoop_run(loop);
+    }
+
+    /* Hashed again if it changed while it was sent, it's recorded as it was hashed */
+    if (attr.status != SSH_FX_OK || !dedup_local_digest(self, path_local, &file) ||
+        !file.size || file.size != attr.attr.size) {
+        dedup_forget(self, path_remote);
+        return;
+    }
+
+    pthread_mutex_lock(&self->lock);
+    dedup_record(self, file.digest, file.size, attr.attr.mtime, path_remote);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Remove ``path_remote`` before it's uploaded in full. It may be a hard link made by
+ * an earlier upload, opening it with ``SSH_FXF_TRUNC`` would rewrite the files
+ * sharing its content. The upload creates a file of its own instead.
+ */
+void
+Dedup_unlink(DedupT *self, SftpLoopT *loop, const char *path_remote) {
+    uint32_t status = SSH_FX_OK;
+
+    dedup_forget(self, path_remote);
+    if (SftpLoop_remove(loop, path_remote, dedup_on_status, &status)) {
+        SftpLoop_run(loop);
+    }
+    if (status != SSH_FX_OK && status != SSH_FX_NO_SUCH_FILE) {
+        DBG_DEBUG("Couldn't remove %s before writing it: %s", path_remote,
+                  SftpLoop_status_str(status));
+    }
+}
+
+/** Write the manifest back if it changed, print what was saved and free it. */
+CommandStatusE
+Dedup_close(DedupT *self, SftpLoopT *loop) {
+    CommandStatusE status = CMD_OK;
+
+    if (self->is_dirty && !self->is_broken && loop != NULL) {
+        status = dedup_write_manifest(self, loop);
+    }
+
+    printf("Deduplicated %zu of %zu files, %.1f MiB not sent\n", self->num_linked,
+           self->num_linked + self->num_uploaded, self->num_bytes_saved / 1048576.0);
+
+    for (size_t i = 0; i < self->num_entries; i++) {
+        free(self->entries[i].path);
+    }
+    for (size_t i = 0; i < self->num_files; i++) {
+        free(self->files[i].path);
+    }
+    DBG_SAFE_FREE(self->entries);
+    DBG_SAFE_FREE(self->files);
+    DBG_SAFE_FREE(self->by_digest);
+    DBG_SAFE_FREE(self->by_path);
+    DBG_SAFE_FREE(self->path_manifest);
+    pthread_mutex_destroy(&self->lock);
+    DBG_SAFE_FREE(self);
+
+    return status;
+}
+
+/** Deduplicate the uploads of the calling thread against ``dedup``, ``NULL`` to
+ * stop. Pool workers inherit it from the thread that started the copy. */
+void
+dedup_bind_thread(DedupT *dedup) {
+    thread_dedup = dedup;
+}
+
+DedupT *
+dedup_current(void) {
+    return thread_dedup;
+}
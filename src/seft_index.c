@@ -0,0 +1,1003 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libssh/sftp.h>
+
+#include "seft_client.h"
+#include "seft_debug.h"
+#include "seft_index.h"
+#include "seft_loop.h"
+#include "seft_path.h"
+#include "seft_utils.h"
+
+/** Slots of the string table's hash when a build starts, doubled as it fills */
+#define INDEX_STRINGS_MIN_SLOTS 1024
+
+/** An index file mapped in memory, see ``IndexHeaderT`` */
+struct IndexS {
+    uint8_t *map;
+    size_t size;
+    const IndexHeaderT *header;
+    const IndexDirT *dirs;
+    const IndexEntryT *entries;
+    const char *strings;
+};
+
+/** ``path`` without its leading ``./`` and trailing separators, ``.`` if that leaves
+ * nothing. */
+static void
+index_normalize(const char *path, char *normalized) {
+    size_t length;
+
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2 + strspn(path + 2, "/");
+    }
+    length = MIN(strlen(path), BUF_SIZE_FS_PATH - 1);
+    while (length > 1 && path[length - 1] == '/') {
+        length--;
+    }
+
+    memcpy(normalized, length ? path : ".", MAX(length, 1));
+    normalized[MAX(length, 1)] = '\0';
+}
+
+/** Path of ``path`` relative to ``root``, both normalized, ``NULL`` if it isn't under
+ * it. */
+static const char *
+index_relative(const char *root, const char *path) {
+    size_t length = strlen(root);
+
+    if (!strcmp(root, path)) {
+        return path + length;
+    }
+    if (!strcmp(root, "/")) {
+        return path[0] == '/' ? path + 1 : NULL;
+    }
+    if (!strcmp(root, ".")) {
+        return path[0] != '/' ? path : NULL;
+    }
+
+    return !strncmp(root, path, length) && path[length] == '/' ? path + length + 1
+                                                                : NULL;
+}
+
+/** Remote path of ``relative`` under ``root``, false if it doesn't fit. */
+static bool
+index_join(const char *root, const char *relative, char *path, size_t size) {
+    int length;
+
+    if (!*relative) {
+        length = snprintf(path, size, "%s", root);
+    } else if (!strcmp(root, ".")) {
+        length = snprintf(path, size, "%s", relative);
+    } else {
+        length = snprintf(path, size, "%s%s%s", root, strcmp(root, "/") ? "/" : "",
+                          relative);
+    }
+
+    return length >= 0 && (size_t)length < size;
+}
+
+/** Whether ``count`` records of ``size`` bytes at ``offset`` lie in the file. */
+static bool
+index_fits(const IndexT *self, uint64_t offset, uint64_t count, size_t size) {
+    return offset % 8 == 0 && offset <= self->size &&
+           count <= (self->size - offset) / size;
+}
+
+/** Check that every offset of the file points inside it, so that a truncated or
+ * corrupt file can't make a lookup read past the mapping. */
+static bool
+index_is_valid(IndexT *self) {
+    const IndexHeaderT *header = (const IndexHeaderT *)self->map;
+    uint64_t size_strings = header->size_strings;
+
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof header->magic) ||
+        !index_fits(self, header->offset_dirs, header->num_dirs, sizeof(IndexDirT)) ||
+        !index_fits(self, header->offset_entries, header->num_entries,
+                    sizeof(IndexEntryT)) ||
+        header->offset_strings > self->size || !size_strings ||
+        size_strings > self->size - header->offset_strings) {
+        return false;
+    }
+
+    self->header = header;
+    self->dirs = (const IndexDirT *)(self->map + header->offset_dirs);
+    self->entries = (const IndexEntryT *)(self->map + header->offset_entries);
+    self->strings = (const char *)(self->map + header->offset_strings);
+    if (self->strings[size_strings - 1] != '\0' || header->root >= size_strings) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < header->num_dirs; i++) {
+        if (self->dirs[i].path >= size_strings ||
+            self->dirs[i].first_entry > header->num_entries ||
+            self->dirs[i].num_entries > header->num_entries - self->dirs[i].first_entry) {
+            return false;
+        }
+    }
+    for (uint64_t i = 0; i < header->num_entries; i++) {
+        if (self->entries[i].name >= size_strings) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/**
+ * Map the index file at ``path``, read only. The mapping stays valid when a build
+ * replaces the file, it then holds the previous index.
+ *
+ * :return: The index, or ``NULL`` if there's no valid index there.
+ */
+IndexT *
+Index_open(const char *path) {
+    struct stat file_stat;
+    IndexT *self;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0) {
+        return NULL;
+    }
+    if (fstat(fd, &file_stat) || (size_t)file_stat.st_size < sizeof(IndexHeaderT)) {
+        close(fd);
+        return NULL;
+    }
+
+    self = DBG_CALLOC(1, sizeof *self);
+    self->size = file_stat.st_size;
+    self->map = mmap(NULL, self->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (self->map == MAP_FAILED) {
+        DBG_ERR("Couldn't map %s: %s", path, strerror(errno));
+        DBG_SAFE_FREE(self);
+        return NULL;
+    }
+
+    if (!index_is_valid(self)) {
+        DBG_ERR("Not a valid index file, build it again: %s", path);
+        Index_close(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+void
+Index_close(IndexT *self) {
+    if (self == NULL) {
+        return;
+    }
+    munmap(self->map, self->size);
+    DBG_SAFE_FREE(self);
+}
+
+/** Remote directory the index is of, normalized. */
+const char *
+Index_root(IndexT *self) {
+    return self->strings + self->header->root;
+}
+
+const char *
+Index_string(IndexT *self, uint32_t offset) {
+    return self->strings + offset;
+}
+
+/** Position of the first directory whose path isn't before ``path``. */
+static uint32_t
+index_lower_bound(IndexT *self, const char *path) {
+    uint32_t low = 0, high = self->header->num_dirs, middle;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        if (strcmp(Index_string(self, self->dirs[middle].path), path) < 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/** Directory at ``path``, relative to the root, ``NULL`` if the index hasn't any. */
+const IndexDirT *
+Index_find_dir(IndexT *self, const char *path) {
+    uint32_t i = index_lower_bound(self, path);
+
+    if (i < self->header->num_dirs &&
+        !strcmp(Index_string(self, self->dirs[i].path), path)) {
+        return &self->dirs[i];
+    }
+
+    return NULL;
+}
+
+/**
+ * Path of the index of ``root`` on a host, in the cache directory.
+ *
+ * :return: The path, to be freed with ``DBG_SAFE_FREE``, or ``NULL`` if there's no
+ *     cache directory.
+ */
+char *
+index_path_for(const char *host_name, uint32_t port_id, const char *root) {
+    char normalized[BUF_SIZE_FS_PATH], file_name[BUF_SIZE_FS_NAME];
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    index_normalize(root, normalized);
+    for (const char *c = normalized; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+    }
+
+    snprintf(file_name, sizeof file_name, "index-%.64s-%" PRIu32 "-%016" PRIx64 ".idx",
+             host_name, port_id, hash);
+
+    return get_cache_path(file_name);
+}
+
+/** Open the index of ``dir``, normalized, or of its closest ancestor that has one.
+ * ``relative`` is set to the path of ``dir`` in it. */
+static IndexT *
+index_open_for(const char *host_name, uint32_t port_id, const char *dir,
+               const char **relative) {
+    char ancestor[BUF_SIZE_FS_PATH];
+    char *path_index, *separator;
+    IndexT *self;
+
+    strcpy(ancestor, dir);
+    for (;;) {
+        path_index = index_path_for(host_name, port_id, ancestor);
+        self = path_index != NULL ? Index_open(path_index) : NULL;
+        DBG_SAFE_FREE(path_index);
+
+        /* Another root hashing to the same file doesn't count */
+        *relative = self != NULL ? index_relative(Index_root(self), dir) : NULL;
+        if (*relative != NULL) {
+            return self;
+        }
+        Index_close(self);
+
+        if (!strcmp(ancestor, "/") || !strcmp(ancestor, ".")) {
+            return NULL;
+        }
+        separator = strrchr(ancestor, '/');
+        if (separator == NULL) {
+            strcpy(ancestor, ".");
+        } else {
+            separator[separator == ancestor] = '\0';
+        }
+    }
+}
+
+/** Open the index file ``path_index``, or the one holding ``dir`` if it's ``NULL``,
+ * telling why there's none. */
+static IndexT *
+index_open_dir(const char *host_name, uint32_t port_id, const char *dir,
+               const char *path_index, const char **relative) {
+    IndexT *self;
+
+    if (path_index == NULL) {
+        self = index_open_for(host_name, port_id, dir, relative);
+        if (self == NULL) {
+            DBG_ERR("No index holds %s, run `index build` on it first", dir);
+        }
+        return self;
+    }
+
+    self = Index_open(path_index);
+    if (self == NULL) {
+        DBG_ERR("Couldn't open the index %s", path_index);
+        return NULL;
+    }
+
+    *relative = index_relative(Index_root(self), dir);
+    if (*relative == NULL) {
+        DBG_ERR("%s isn't under %s, the root of %s", dir, Index_root(self), path_index);
+        Index_close(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+static LoopAttrT
+index_entry_attr(const IndexEntryT *entry) {
+    return (LoopAttrT){.flags = SSH_FILEXFER_ATTR_SIZE | SSH_FILEXFER_ATTR_PERMISSIONS |
+                                SSH_FILEXFER_ATTR_ACMODTIME,
+                       .size = entry->size,
+                       .permissions = entry->permissions,
+                       .mtime = entry->mtime,
+                       .type = entry->type};
+}
+
+/**
+ * Print the directory ``dir`` as ``list`` does, from the index holding it instead of
+ * the server. Entries have no owner, an index only keeps names, sizes, mtimes and
+ * types.
+ */
+CommandStatusE
+index_list(const char *host_name, uint32_t port_id, const char *dir, uint8_t flag) {
+    char path[BUF_SIZE_FS_PATH];
+    const IndexDirT *index_dir;
+    const IndexEntryT *entry;
+    const char *relative;
+    LoopNameT *names;
+    IndexT *self;
+
+    index_normalize(dir, path);
+    self = index_open_dir(host_name, port_id, path, NULL, &relative);
+    if (self == NULL) {
+        return CMD_NOT_EXECUTED;
+    }
+
+    index_dir = Index_find_dir(self, relative);
+    if (index_dir == NULL) {
+        DBG_ERR("%s isn't a directory in the index of %s", dir, Index_root(self));
+        Index_close(self);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    /* The names point into the mapping, nothing is copied */
+    names = DBG_CALLOC(MAX(index_dir->num_entries, 1), sizeof *names);
+    for (uint32_t i = 0; i < index_dir->num_entries; i++) {
+        entry = &self->entries[index_dir->first_entry + i];
+        names[i] = (LoopNameT){.name = (char *)Index_string(self, entry->name),
+                               .longname = "",
+                               .attr = index_entry_attr(entry)};
+    }
+    list_print_names(names, index_dir->num_entries, flag);
+
+    DBG_SAFE_FREE(names);
+    Index_close(self);
+    return CMD_OK;
+}
+
+/** Print the entries of the directory ``index_dir`` whose name matches ``pattern``. */
+static size_t
+index_find_in(IndexT *self, const IndexDirT *index_dir, const char *pattern) {
+    char path_dir[BUF_SIZE_FS_PATH];
+    const IndexEntryT *entry;
+    const char *name;
+    size_t num_found = 0;
+
+    if (!index_join(Index_root(self), Index_string(self, index_dir->path), path_dir,
+                    sizeof path_dir)) {
+        return 0;
+    }
+
+    for (uint32_t i = 0; i < index_dir->num_entries; i++) {
+        entry = &self->entries[index_dir->first_entry + i];
+        name = Index_string(self, entry->name);
+        if (pattern == NULL || !fnmatch(pattern, name, 0)) {
+            printf("%s%s%s\n", path_dir, strcmp(path_dir, "/") ? "/" : "", name);
+            num_found++;
+        }
+    }
+
+    return num_found;
+}
+
+/**
+ * Print the path of every entry under ``dir`` whose name matches the shell pattern
+ * ``pattern`` (everything if it's ``NULL``), from the index file ``path_index`` or
+ * the index holding ``dir`` if it's ``NULL``. The subtree is a contiguous run of the
+ * sorted directories, found with a binary search.
+ */
+CommandStatusE
+index_find(const char *host_name, uint32_t port_id, const char *dir,
+           const char *pattern, const char *path_index) {
+    char path[BUF_SIZE_FS_PATH], prefix[BUF_SIZE_FS_PATH + 1];
+    const IndexDirT *index_dir;
+    const char *relative, *path_dir;
+    size_t len_prefix;
+    IndexT *self;
+
+    index_normalize(dir, path);
+    self = index_open_dir(host_name, port_id, path, path_index, &relative);
+    if (self == NULL) {
+        return CMD_NOT_EXECUTED;
+    }
+
+    index_dir = Index_find_dir(self, relative);
+    if (index_dir == NULL) {
+        DBG_ERR("%s isn't a directory in the index of %s", dir, Index_root(self));
+        Index_close(self);
+        return CMD_INTERNAL_ERROR;
+    }
+    index_find_in(self, index_dir, pattern);
+
+    /* ``a-b`` sorts between ``a`` and ``a/b``, the subtree starts at ``a/`` */
+    snprintf(prefix, sizeof prefix, "%s%s", relative, *relative ? "/" : "");
+    len_prefix = strlen(prefix);
+    for (uint32_t i = index_lower_bound(self, prefix); i < self->header->num_dirs; i++) {
+        path_dir = Index_string(self, self->dirs[i].path);
+        if (strncmp(path_dir, prefix, len_prefix)) {
+            break;
+        }
+        if (*path_dir) {
+            index_find_in(self, &self->dirs[i], pattern);
+        }
+    }
+
+    Index_close(self);
+    return CMD_OK;
+}
+
+/** An entry read while building */
+typedef struct {
+    char *name;
+    uint64_t size;
+    uint32_t mtime;
+    uint32_t permissions;
+    uint8_t type;
+} IndexBuildEntryT;
+
+/** A directory to read or reuse while building */
+typedef struct {
+    /** Path relative to the root */
+    char *path;
+
+    /** Known from the listing of the parent, the others are stat'ed first */
+    bool has_mtime;
+    uint32_t mtime;
+
+    IndexBuildEntryT *entries;
+    uint32_t num_entries;
+    uint32_t entries_allocated;
+} IndexBuildDirT;
+
+/** State of a build, directories are read breadth first ``INDEX_WINDOW`` at a time */
+typedef struct {
+    SftpLoopT *loop;
+    char root[BUF_SIZE_FS_PATH];
+
+    /** Index being refreshed, ``NULL`` to read every directory */
+    IndexT *previous;
+
+    IndexBuildDirT *dirs;
+    size_t num_dirs;
+    size_t dirs_allocated;
+
+    /** Directories before it were started */
+    size_t next_dir;
+    uint32_t num_in_flight;
+    bool is_pumping;
+
+    size_t num_read;
+    size_t num_reused;
+    size_t num_failed;
+
+    /** Why the root couldn't be read, ``SSH_FX_OK`` if it could */
+    uint32_t status_root;
+
+    /** The connection was lost, nothing is written */
+    bool is_lost;
+} IndexBuildT;
+
+/** A directory being read */
+typedef struct {
+    IndexBuildT *build;
+    size_t dir;
+    LoopHandleT handle;
+} IndexRequestT;
+
+static void index_build_pump(IndexBuildT *build);
+
+static bool
+index_build_add_dir(IndexBuildT *build, const char *path, bool has_mtime,
+                    uint32_t mtime) {
+    IndexBuildDirT *grown;
+
+    if (build->num_dirs == build->dirs_allocated) {
+        build->dirs_allocated = MAX(build->dirs_allocated * 2, 64);
+        grown = DBG_REALLOC(build->dirs, build->dirs_allocated * sizeof *grown);
+        if (grown == NULL) {
+            return false;
+        }
+        build->dirs = grown;
+    }
+
+    build->dirs[build->num_dirs++] =
+        (IndexBuildDirT){.path = strdup(path), .has_mtime = has_mtime, .mtime = mtime};
+    return true;
+}
+
+/** Add an entry to the directory ``dir``, and the directory it is to the queue. */
+static bool
+index_build_add_entry(IndexBuildT *build, size_t dir, const char *name, uint64_t size,
+                      uint32_t mtime, uint32_t permissions, uint8_t type,
+                      bool has_mtime) {
+    char path[BUF_SIZE_FS_PATH];
+    IndexBuildDirT *self = &build->dirs[dir];
+    IndexBuildEntryT *grown;
+
+    if (self->num_entries == self->entries_allocated) {
+        self->entries_allocated = MAX(self->entries_allocated * 2, 16);
+        grown = DBG_REALLOC(self->entries, self->entries_allocated * sizeof *grown);
+        if (grown == NULL) {
+            return false;
+        }
+        self->entries = grown;
+    }
+    self->entries[self->num_entries++] = (IndexBuildEntryT){
+        .name = strdup(name),
+        .size = size,
+        .mtime = mtime,
+        .permissions = permissions,
+        .type = type,
+    };
+
+    if (type != SSH_FILEXFER_TYPE_DIRECTORY) {
+        return true;
+    }
+    if (snprintf(path, sizeof path, "%s%s%s", self->path, *self->path ? "/" : "", name) >=
+        (int)sizeof path) {
+        DBG_INFO("Path too long, its directory isn't indexed: %s/%s", self->path, name);
+        return true;
+    }
+
+    /* ``self`` moves if the queue grows */
+    return index_build_add_dir(build, path, has_mtime, mtime);
+}
+
+/** The directory of ``request`` is read, reused or given up on. */
+static void
+index_build_done(IndexRequestT *request, uint32_t status) {
+    IndexBuildT *build = request->build;
+
+    if (status == SSH_FX_CONNECTION_LOST || status == SSH_FX_NO_CONNECTION) {
+        build->is_lost = true;
+    } else if (status != SSH_FX_OK && status != SSH_FX_EOF) {
+        /* Kept empty with no mtime, so that the next refresh reads it again */
+        build->dirs[request->dir].mtime = 0;
+        build->num_failed++;
+        if (request->dir == 0) {
+            build->status_root = status;
+        }
+    }
+
+    build->num_in_flight--;
+    DBG_SAFE_FREE(request);
+    index_build_pump(build);
+}
+
+static void
+index_build_on_readdir(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    IndexRequestT *request = user_data;
+    LoopNameT *name;
+    bool is_added = true;
+
+    if (result->status != SSH_FX_OK) {
+        SftpLoop_close(loop, &request->handle, NULL, NULL);
+        request->build->num_read += result->status == SSH_FX_EOF;
+        index_build_done(request, result->status);
+        return;
+    }
+
+    for (uint32_t i = 0; is_added && i < result->num_names; i++) {
+        name = &result->names[i];
+        if (!strcmp(name->name, ".") || !strcmp(name->name, "..")) {
+            continue;
+        }
+        is_added = index_build_add_entry(
+            request->build, request->dir, name->name, name->attr.size, name->attr.mtime,
+            name->attr.permissions, name->attr.type,
+            name->attr.flags & SSH_FILEXFER_ATTR_ACMODTIME);
+    }
+
+    if (!is_added) {
+        SftpLoop_close(loop, &request->handle, NULL, NULL);
+        index_build_done(request, SSH_FX_FAILURE);
+    } else if (!SftpLoop_readdir(loop, &request->handle, index_build_on_readdir,
+                                 request)) {
+        index_build_done(request, SSH_FX_CONNECTION_LOST);
+    }
+}
+
+static void
+index_build_on_opendir(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    IndexRequestT *request = user_data;
+
+    if (result->status != SSH_FX_OK) {
+        index_build_done(request, result->status);
+        return;
+    }
+
+    request->handle = result->handle;
+    if (!SftpLoop_readdir(loop, &request->handle, index_build_on_readdir, request)) {
+        index_build_done(request, SSH_FX_CONNECTION_LOST);
+    }
+}
+
+/** Take the entries of an unchanged directory from the previous index. Its
+ * subdirectories may have changed all the same, their mtime is asked for. */
+static void
+index_build_reuse(IndexRequestT *request, const IndexDirT *previous_dir) {
+    IndexBuildT *build = request->build;
+    const IndexEntryT *entry;
+    bool is_added = true;
+
+    for (uint32_t i = 0; is_added && i < previous_dir->num_entries; i++) {
+        entry = &build->previous->entries[previous_dir->first_entry + i];
+        is_added = index_build_add_entry(
+            build, request->dir, Index_string(build->previous, entry->name), entry->size,
+            entry->mtime, entry->permissions, entry->type, false);
+    }
+
+    build->num_reused += is_added;
+    index_build_done(request, is_added ? SSH_FX_OK : SSH_FX_FAILURE);
+}
+
+/** Reuse the directory of ``request`` if its mtime is the one the previous build saw,
+ * read it otherwise. */
+static void
+index_build_read(IndexRequestT *request) {
+    IndexBuildT *build = request->build;
+    IndexBuildDirT *dir = &build->dirs[request->dir];
+    const IndexDirT *previous_dir = NULL;
+    char path[BUF_SIZE_FS_PATH];
+
+    if (build->previous != NULL && dir->mtime) {
+        previous_dir = Index_find_dir(build->previous, dir->path);
+    }
+    if (previous_dir != NULL && previous_dir->mtime == dir->mtime &&
+        (int64_t)dir->mtime + INDEX_RACY_S < build->previous->header->time_built) {
+        index_build_reuse(request, previous_dir);
+        return;
+    }
+
+    if (!index_join(build->root, dir->path, path, sizeof path)) {
+        index_build_done(request, SSH_FX_FAILURE);
+    } else if (!SftpLoop_opendir(build->loop, path, index_build_on_opendir, request)) {
+        index_build_done(request, SSH_FX_CONNECTION_LOST);
+    }
+}
+
+static void
+index_build_on_stat(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    IndexRequestT *request = user_data;
+    IndexBuildDirT *dir = &request->build->dirs[request->dir];
+
+    (void)loop;
+    if (result->status != SSH_FX_OK) {
+        index_build_done(request, result->status);
+        return;
+    }
+
+    dir->has_mtime = true;
+    dir->mtime =
+        result->attr.flags & SSH_FILEXFER_ATTR_ACMODTIME ? result->attr.mtime : 0;
+    index_build_read(request);
+}
+
+static void
+index_build_start(IndexBuildT *build, size_t dir) {
+    IndexRequestT *request = DBG_MALLOC(sizeof *request);
+    char path[BUF_SIZE_FS_PATH];
+
+    *request = (IndexRequestT){.build = build, .dir = dir};
+    if (build->dirs[dir].has_mtime) {
+        index_build_read(request);
+    } else if (!index_join(build->root, build->dirs[dir].path, path, sizeof path)) {
+        index_build_done(request, SSH_FX_FAILURE);
+    } else if (!SftpLoop_stat(build->loop, path, index_build_on_stat, request)) {
+        index_build_done(request, SSH_FX_CONNECTION_LOST);
+    }
+}
+
+/** Start directories until ``INDEX_WINDOW`` of them are in flight. A directory done
+ * without asking the server calls it again, the nested call returns at once. */
+static void
+index_build_pump(IndexBuildT *build) {
+    if (build->is_pumping) {
+        return;
+    }
+
+    build->is_pumping = true;
+    while (!build->is_lost && build->num_in_flight < INDEX_WINDOW &&
+           build->next_dir < build->num_dirs) {
+        build->num_in_flight++;
+        index_build_start(build, build->next_dir++);
+    }
+    build->is_pumping = false;
+}
+
+static void
+index_build_free(IndexBuildT *build) {
+    for (size_t i = 0; i < build->num_dirs; i++) {
+        for (uint32_t j = 0; j < build->dirs[i].num_entries; j++) {
+            free(build->dirs[i].entries[j].name);
+        }
+        DBG_SAFE_FREE(build->dirs[i].entries);
+        free(build->dirs[i].path);
+    }
+    DBG_SAFE_FREE(build->dirs);
+    Index_close(build->previous);
+}
+
+/** String table being written, each string stored once */
+typedef struct {
+    char *data;
+    uint64_t size;
+    uint64_t allocated;
+
+    /** Offsets plus one of the strings by hash, 0 for a free slot */
+    uint32_t *slots;
+    size_t num_slots;
+    size_t num_used;
+} IndexStringsT;
+
+static size_t
+index_strings_slot(const IndexStringsT *self, const char *str) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    size_t slot;
+
+    for (const char *c = str; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+    }
+
+    for (slot = hash % self->num_slots; self->slots[slot];
+         slot = (slot + 1) % self->num_slots) {
+        if (!strcmp(self->data + self->slots[slot] - 1, str)) {
+            break;
+        }
+    }
+
+    return slot;
+}
+
+static bool
+index_strings_grow_slots(IndexStringsT *self) {
+    uint32_t *slots = self->slots;
+    size_t num_slots = self->num_slots;
+
+    self->num_slots = MAX(num_slots * 2, INDEX_STRINGS_MIN_SLOTS);
+    self->slots = DBG_CALLOC(self->num_slots, sizeof *self->slots);
+    if (self->slots == NULL) {
+        self->slots = slots;
+        self->num_slots = num_slots;
+        return false;
+    }
+
+    for (size_t i = 0; i < num_slots; i++) {
+        if (slots[i]) {
+            self->slots[index_strings_slot(self, self->data + slots[i] - 1)] = slots[i];
+        }
+    }
+    DBG_SAFE_FREE(slots);
+    return true;
+}
+
+/** Offset of ``str`` in the table, added if it isn't there yet. False if the table
+ * would outgrow 32 bit offsets. */
+static bool
+index_strings_add(IndexStringsT *self, const char *str, uint32_t *offset) {
+    size_t length = strlen(str) + 1, slot;
+    char *grown;
+
+    if ((self->num_used + 1) * 2 > self->num_slots && !index_strings_grow_slots(self)) {
+        return false;
+    }
+
+    slot = index_strings_slot(self, str);
+    if (self->slots[slot]) {
+        *offset = self->slots[slot] - 1;
+        return true;
+    }
+
+    if (self->size + length >= UINT32_MAX) {
+        return false;
+    }
+    if (self->size + length > self->allocated) {
+        self->allocated = MAX(self->allocated * 2, self->size + length);
+        grown = DBG_REALLOC(self->data, self->allocated);
+        if (grown == NULL) {
+            return false;
+        }
+        self->data = grown;
+    }
+
+    memcpy(self->data + self->size, str, length);
+    *offset = self->size;
+    self->slots[slot] = *offset + 1;
+    self->size += length;
+    self->num_used++;
+    return true;
+}
+
+static int
+index_compare_dirs(const void *a, const void *b) {
+    return strcmp(((const IndexBuildDirT *)a)->path, ((const IndexBuildDirT *)b)->path);
+}
+
+static int
+index_compare_entries(const void *a, const void *b) {
+    return strcmp(((const IndexBuildEntryT *)a)->name,
+                  ((const IndexBuildEntryT *)b)->name);
+}
+
+/** Lay out the directories read by ``build`` in the index format. */
+static bool
+index_build_layout(IndexBuildT *build, IndexHeaderT *header, IndexDirT *dirs,
+                   IndexEntryT *entries, IndexStringsT *strings) {
+    IndexBuildEntryT *entry;
+    uint64_t num_entries = 0;
+
+    if (!index_strings_add(strings, build->root, &header->root)) {
+        return false;
+    }
+
+    qsort(build->dirs, build->num_dirs, sizeof *build->dirs, index_compare_dirs);
+    for (size_t i = 0; i < build->num_dirs; i++) {
+        if (build->dirs[i].num_entries > 1) {
+            qsort(build->dirs[i].entries, build->dirs[i].num_entries,
+                  sizeof *build->dirs[i].entries, index_compare_entries);
+        }
+
+        dirs[i] = (IndexDirT){.mtime = build->dirs[i].mtime,
+                              .first_entry = num_entries,
+                              .num_entries = build->dirs[i].num_entries};
+        if (!index_strings_add(strings, build->dirs[i].path, &dirs[i].path)) {
+            return false;
+        }
+
+        for (uint32_t j = 0; j < build->dirs[i].num_entries; j++, num_entries++) {
+            entry = &build->dirs[i].entries[j];
+            entries[num_entries] = (IndexEntryT){.size = entry->size,
+                                                 .mtime = entry->mtime,
+                                                 .permissions = entry->permissions,
+                                                 .type = entry->type};
+            if (!index_strings_add(strings, entry->name, &entries[num_entries].name)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/** Write the index of ``build`` next to ``path_index`` and rename it over it, so that
+ * a reader maps either the previous index or the new one. */
+static CommandStatusE
+index_build_write(IndexBuildT *build, const char *path_index, int64_t time_built) {
+    char path_tmp[BUF_SIZE_FS_PATH + 16];
+    IndexHeaderT header = {.time_built = time_built};
+    IndexStringsT strings = {0};
+    IndexDirT *dirs;
+    IndexEntryT *entries;
+    uint64_t num_entries = 0;
+    CommandStatusE status = CMD_INTERNAL_ERROR;
+    FILE *file = NULL;
+
+    for (size_t i = 0; i < build->num_dirs; i++) {
+        num_entries += build->dirs[i].num_entries;
+    }
+
+    dirs = DBG_CALLOC(MAX(build->num_dirs, 1), sizeof *dirs);
+    entries = DBG_CALLOC(MAX(num_entries, 1), sizeof *entries);
+    if (dirs == NULL || entries == NULL || build->num_dirs > UINT32_MAX ||
+        !index_build_layout(build, &header, dirs, entries, &strings)) {
+        DBG_ERR("Tree too large to index: %s", build->root);
+        goto out;
+    }
+
+    memcpy(header.magic, INDEX_MAGIC, sizeof header.magic);
+    header.num_dirs = build->num_dirs;
+    header.num_entries = num_entries;
+    header.offset_dirs = sizeof header;
+    header.offset_entries = header.offset_dirs + build->num_dirs * sizeof *dirs;
+    header.offset_strings = header.offset_entries + num_entries * sizeof *entries;
+    header.size_strings = strings.size;
+
+    snprintf(path_tmp, sizeof path_tmp, "%s.%d", path_index, getpid());
+    file = fopen(path_tmp, "w");
+    if (file == NULL) {
+        DBG_ERR("Couldn't write %s: %s", path_tmp, strerror(errno));
+        goto out;
+    }
+
+    fwrite(&header, sizeof header, 1, file);
+    fwrite(dirs, sizeof *dirs, build->num_dirs, file);
+    fwrite(entries, sizeof *entries, num_entries, file);
+    fwrite(strings.data, 1, strings.size, file);
+    if (ferror(file) | fclose(file) || rename(path_tmp, path_index)) {
+        DBG_ERR("Couldn't write %s: %s", path_index, strerror(errno));
+        unlink(path_tmp);
+        goto out;
+    }
+    status = CMD_OK;
+
+out:
+    DBG_SAFE_FREE(strings.data);
+    DBG_SAFE_FREE(strings.slots);
+    DBG_SAFE_FREE(entries);
+    DBG_SAFE_FREE(dirs);
+    return status;
+}
+
+/**
+ * Read the remote tree at ``root`` into an index file, ``path_index`` or the one
+ * of ``root`` in the cache directory if it's ``NULL``.
+ *
+ * A refresh starts from the index already there and only reads the directories
+ * whose mtime changed since, taking the others from it. Files rewritten in place
+ * don't change the mtime of their directory, their size is updated by the next
+ * ``index build``.
+ *
+ * :param loop: Loop of the session, directories are read ``INDEX_WINDOW`` at once.
+ * :param root: Remote directory to index.
+ * :param is_refresh: Whether to reuse unchanged directories of the previous index.
+ */
+CommandStatusE
+index_build(SftpLoopT *loop, const char *host_name, uint32_t port_id, const char *root,
+            const char *path_index, bool is_refresh) {
+    IndexBuildT build = {.loop = loop, .status_root = SSH_FX_OK};
+    int64_t time_built = time(NULL);
+    double time_start = get_time_monotonic();
+    CommandStatusE status = CMD_INTERNAL_ERROR;
+    char *path_default = NULL;
+    uint64_t num_entries = 0;
+
+    if (loop == NULL) {
+        DBG_ERR("Not connected, run `connect` first %s", "");
+        return CMD_NOT_EXECUTED;
+    }
+    if (path_index == NULL) {
+        path_index = path_default = index_path_for(host_name, port_id, root);
+        if (path_index == NULL) {
+            return CMD_INTERNAL_ERROR;
+        }
+    }
+
+    index_normalize(root, build.root);
+    if (is_refresh) {
+        build.previous = Index_open(path_index);
+        if (build.previous != NULL && strcmp(Index_root(build.previous), build.root)) {
+            DBG_ERR("%s is the index of %s, not %s", path_index,
+                    Index_root(build.previous), build.root);
+            goto out;
+        }
+    }
+
+    if (!index_build_add_dir(&build, "", false, 0)) {
+        goto out;
+    }
+    index_build_pump(&build);
+    SftpLoop_run(loop);
+
+    if (build.is_lost || build.status_root != SSH_FX_OK) {
+        DBG_ERR("Couldn't index %s: %s", build.root,
+                SftpLoop_status_str(build.is_lost ? SSH_FX_CONNECTION_LOST
+                                                  : build.status_root));
+        goto out;
+    }
+
+    status = index_build_write(&build, path_index, time_built);
+    if (status == CMD_OK) {
+        for (size_t i = 0; i < build.num_dirs; i++) {
+            num_entries += build.dirs[i].num_entries;
+        }
+        printf("Indexed %zu directories and %" PRIu64 " entries of %s in %.2fs (%zu "
+               "read, %zu unchanged, %zu unreadable): %s\n",
+               build.num_dirs, num_entries, build.root,
+               get_time_monotonic() - time_start, build.num_read, build.num_reused,
+               build.num_failed, path_index);
+    }
+
+out:
+    index_build_free(&build);
+    DBG_SAFE_FREE(path_default);
+    return status;
+}
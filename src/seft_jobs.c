@@ -0,0 +1,360 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "seft_debug.h"
+#include "seft_jobs.h"
+#include "seft_loop.h"
+#include "seft_pool.h"
+
+/** A command running on its own thread and SFTP channel */
+struct JobS {
+    /** Number the user refers to the job by, its index in ``jobs`` plus one */
+    uint32_t id;
+
+    /** Command line, for ``jobs`` and the completion notice */
+    char command[BUF_SIZE_JOB_COMMAND];
+
+    /** Arguments owned by the job, the REPL reuses its own for the next line */
+    char **arg_vec;
+    uint32_t length;
+
+    JobRunT run;
+    pthread_t thread;
+
+    /** Channel of the job, a sibling of the foreground one on the same connection */
+    PoolSlotT slot;
+
+    atomic_bool is_cancelled;
+    atomic_bool is_finished;
+    CommandStatusE result;
+};
+
+/** Jobs started by the REPL, only ever touched by the REPL's thread */
+static JobT *jobs[MAX_JOBS] = {NULL};
+
+/** Job the calling thread works for, ``NULL`` in the foreground */
+static __thread JobT *current_job = NULL;
+
+/** Set by SIGINT while ``fg`` or ``wait`` blocks */
+static volatile sig_atomic_t is_interrupted = 0;
+
+static void
+job_on_interrupt(int signal_number) {
+    (void)signal_number;
+    is_interrupted = 1;
+}
+
+static void *
+job_thread(void *arg) {
+    JobT *job = arg;
+
+    job_bind_thread(job);
+    SessionPool_bind_thread(&job->slot);
+
+    job->result = job->run(job->arg_vec, job->length);
+
+    SessionPool_bind_thread(NULL);
+    job_bind_thread(NULL);
+
+    SftpLoop_free(job->slot.loop);
+    job->slot.loop = NULL;
+    atomic_store(&job->is_finished, true);
+
+    return NULL;
+}
+
+static void
+job_free(JobT *job) {
+    for (uint32_t i = 0; i < job->length; i++) {
+        free(job->arg_vec[i]);
+    }
+    DBG_SAFE_FREE(job->arg_vec);
+    jobs[job->id - 1] = NULL;
+    DBG_SAFE_FREE(job);
+}
+
+/** Join a finished job, print how it ended and forget it. */
+static CommandStatusE
+job_reap(JobT *job) {
+    CommandStatusE result;
+
+    pthread_join(job->thread, NULL);
+    result = job->result;
+
+    if (atomic_load(&job->is_cancelled)) {
+        printf("[%u] Cancelled  %s\n", job->id, job->command);
+    } else if (result != CMD_OK) {
+        printf("[%u] Failed     %s\n", job->id, job->command);
+    } else {
+        printf("[%u] Done       %s\n", job->id, job->command);
+    }
+
+    job_free(job);
+    return result;
+}
+
+static JobT *
+job_find(uint32_t id) {
+    if (id < 1 || id > MAX_JOBS || jobs[id - 1] == NULL) {
+        DBG_ERR("No such job: %u", id);
+        return NULL;
+    }
+
+    return jobs[id - 1];
+}
+
+/**
+ * Block until ``job`` finishes or the user hits Ctrl-C.
+ *
+ * :param job: Job to wait for.
+ * :param is_cancel_on_interrupt: Cancel the job on Ctrl-C instead of returning.
+ *
+ * :return: true if the job finished, false if the wait was interrupted.
+ */
+static bool
+job_wait_interruptible(JobT *job, bool is_cancel_on_interrupt) {
+    struct timespec delay = {0, JOB_WAIT_POLL_MS * 1000000L};
+    struct sigaction action = {0}, action_old;
+
+    action.sa_handler = job_on_interrupt;
+    sigemptyset(&action.sa_mask);
+    is_interrupted = 0;
+    sigaction(SIGINT, &action, &action_old);
+
+    while (!atomic_load(&job->is_finished)) {
+        if (is_interrupted) {
+            is_interrupted = 0;
+            if (!is_cancel_on_interrupt) {
+                break;
+            }
+            atomic_store(&job->is_cancelled, true);
+        }
+        nanosleep(&delay, NULL);
+    }
+
+    sigaction(SIGINT, &action_old, NULL);
+    return atomic_load(&job->is_finished);
+}
+
+/**
+ * Run a command in the background on a new SFTP channel of ``session_ssh``.
+ *
+ * :param session_ssh: Connection the job shares with the foreground.
+ * :param session_sftp: Blocking SFTP session of the connection.
+ * :param arg_vec: Command to run, copied so the caller may reuse it.
+ * :param length: Number of arguments in ``arg_vec``.
+ * :param run: Runs the command on the job's thread.
+ *
+ * :return: CMD_OK once the job is started.
+ */
+CommandStatusE
+job_start(ssh_session session_ssh, sftp_session session_sftp, char **arg_vec,
+          uint32_t length, JobRunT run) {
+    JobT *job;
+    size_t index, len_command = 0;
+
+    for (index = 0; index < MAX_JOBS && jobs[index] != NULL; index++) {
+    }
+    if (index == MAX_JOBS) {
+        DBG_ERR("Too many jobs, at most %d may run at once", MAX_JOBS);
+        return CMD_NOT_EXECUTED;
+    }
+
+    job = DBG_CALLOC(1, sizeof *job);
+    job->id = index + 1;
+    job->run = run;
+    job->length = length;
+    job->arg_vec = DBG_CALLOC(length + 1, sizeof *job->arg_vec);
+    for (uint32_t i = 0; i < length; i++) {
+        job->arg_vec[i] = strdup(arg_vec[i]);
+        if (len_command < sizeof job->command) {
+            len_command += snprintf(job->command + len_command,
+                                    sizeof job->command - len_command, i ? " %s" : "%s",
+                                    arg_vec[i]);
+        }
+    }
+
+    job->slot = (PoolSlotT){session_ssh, session_sftp, NULL,
+                            SftpLoop_session_lock(session_ssh), false};
+    if (job->slot.lock != NULL) {
+        job->slot.loop = SftpLoop_new(session_ssh, job->slot.lock);
+    }
+    if (job->slot.loop == NULL) {
+        DBG_ERR("Couldn't open a channel for the job %s", job->command);
+        job_free(job);
+        return CMD_INTERNAL_ERROR;
+    }
+    SftpLoop_set_bulk(job->slot.loop, true);
+
+    atomic_init(&job->is_cancelled, false);
+    atomic_init(&job->is_finished, false);
+    jobs[index] = job;
+
+    if (pthread_create(&job->thread, NULL, job_thread, job)) {
+        DBG_ERR("Couldn't start a thread for the job %s", job->command);
+        SftpLoop_free(job->slot.loop);
+        job_free(job);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    printf("[%u] %s\n", job->id, job->command);
+    return CMD_OK;
+}
+
+/**
+ * Wait for a job to finish, Ctrl-C stops waiting but leaves the job running.
+ *
+ * :param id: Job to wait for, 0 to wait for every job.
+ */
+CommandStatusE
+job_wait(uint32_t id) {
+    CommandStatusE result = CMD_OK;
+    JobT *job;
+
+    if (id) {
+        if ((job = job_find(id)) == NULL) {
+            return CMD_INVALID_ARGS_TYPE;
+        }
+        return job_wait_interruptible(job, false) ? job_reap(job) : CMD_NOT_EXECUTED;
+    }
+
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] == NULL) {
+            continue;
+        }
+        if (!job_wait_interruptible(jobs[i], false)) {
+            return CMD_NOT_EXECUTED;
+        }
+        if (job_reap(jobs[i]) != CMD_OK) {
+            result = CMD_INTERNAL_ERROR;
+        }
+    }
+
+    return result;
+}
+
+/**
+ * Bring a job to the foreground, Ctrl-C cancels it.
+ *
+ * :param id: Job to wait for, 0 for the one with the highest number.
+ */
+CommandStatusE
+job_fg(uint32_t id) {
+    JobT *job = NULL;
+
+    if (!id) {
+        for (size_t i = 0; i < MAX_JOBS; i++) {
+            if (jobs[i] != NULL) {
+                job = jobs[i];
+            }
+        }
+        if (job == NULL) {
+            DBG_ERR("No jobs to bring to the foreground %s", "");
+            return CMD_NOT_EXECUTED;
+        }
+    } else if ((job = job_find(id)) == NULL) {
+        return CMD_INVALID_ARGS_TYPE;
+    }
+
+    printf("%s\n", job->command);
+    job_wait_interruptible(job, true);
+    return job_reap(job);
+}
+
+/**
+ * Ask a job to stop. Transfers stop issuing requests and drain the ones in
+ * flight, so the job finishes shortly after.
+ */
+CommandStatusE
+job_cancel(uint32_t id) {
+    JobT *job = job_find(id);
+
+    if (job == NULL) {
+        return CMD_INVALID_ARGS_TYPE;
+    }
+
+    atomic_store(&job->is_cancelled, true);
+    return CMD_OK;
+}
+
+/** Print every job with its state. */
+void
+jobs_print(void) {
+    const char *state;
+
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] == NULL) {
+            continue;
+        }
+
+        if (atomic_load(&jobs[i]->is_finished)) {
+            state = "Finished";
+        } else if (atomic_load(&jobs[i]->is_cancelled)) {
+            state = "Cancelling";
+        } else {
+            state = "Running";
+        }
+        printf("[%u] %-10s %s\n", jobs[i]->id, state, jobs[i]->command);
+    }
+}
+
+/** Report and forget jobs that finished since the last prompt. */
+void
+jobs_report_finished(void) {
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] != NULL && atomic_load(&jobs[i]->is_finished)) {
+            job_reap(jobs[i]);
+        }
+    }
+}
+
+/** Number of jobs that haven't been reaped yet. */
+size_t
+jobs_num_running(void) {
+    size_t num_jobs = 0;
+
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        num_jobs += jobs[i] != NULL;
+    }
+
+    return num_jobs;
+}
+
+/** Cancel every job and wait for them, called before the sessions are closed. */
+void
+jobs_clean(void) {
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] != NULL) {
+            atomic_store(&jobs[i]->is_cancelled, true);
+        }
+    }
+
+    for (size_t i = 0; i < MAX_JOBS; i++) {
+        if (jobs[i] != NULL) {
+            job_reap(jobs[i]);
+        }
+    }
+}
+
+/** Job the calling thread works for, ``NULL`` in the foreground. */
+JobT *
+job_current(void) {
+    return current_job;
+}
+
+/** Make the calling thread work for ``job``, pool workers inherit their job this way. */
+void
+job_bind_thread(JobT *job) {
+    current_job = job;
+}
+
+/** Check if the job of the calling thread was cancelled, false in the foreground. */
+bool
+job_is_cancelled(void) {
+    return current_job != NULL && atomic_load(&current_job->is_cancelled);
+}
@@ -0,0 +1,334 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "seft_debug.h"
+#include "seft_limit.h"
+#include "seft_utils.h"
+
+/** Transfer sharing the limit, tokens are handed out in proportion to the weight */
+struct LimitStreamS {
+    uint32_t weight;
+
+    /** Cap of the copy the stream belongs to, ``NULL`` if it has none */
+    LimitCapT *cap;
+
+    /** Bytes the stream may still send, negative once it took a chunk on credit */
+    double tokens;
+
+    /** Last time the stream asked for tokens, it only gets a share while asking */
+    double last_take;
+
+    LimitStreamT *prev;
+    LimitStreamT *next;
+};
+
+struct LimitCapS {
+    uint64_t bytes_per_s;
+
+    /** Bytes the copy may still send, negative once a chunk was taken on credit */
+    double tokens;
+
+    double last_refill;
+};
+
+/** Bytes per second shared by every transfer of the process, 0 if unlimited */
+static uint64_t limit_bytes_per_s = 0;
+
+/** Last time tokens were handed out */
+static double last_refill = 0;
+
+static LimitStreamT *streams = NULL;
+
+static pthread_mutex_t limit_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Weight of the transfers started by the calling thread */
+static __thread uint32_t thread_weight = LIMIT_DEFAULT_WEIGHT;
+
+/** Cap of the copy run by the calling thread */
+static __thread LimitCapT *thread_cap = NULL;
+
+static bool
+limit_stream_is_active(LimitStreamT *stream, double now) {
+    return now - stream->last_take < LIMIT_IDLE_MS / 1000.0;
+}
+
+/** Hand the tokens earned since the last refill to the active streams by weight, the
+ * share of an idle stream goes to the others. Must be called with the lock held. */
+static void
+limit_refill(double now) {
+    double earned = limit_bytes_per_s * MIN(now - last_refill, 1.0), share;
+    uint64_t total_weight = 0;
+
+    last_refill = now;
+    for (LimitStreamT *stream = streams; stream != NULL; stream = stream->next) {
+        total_weight += limit_stream_is_active(stream, now) ? stream->weight : 0;
+    }
+
+    for (LimitStreamT *stream = streams; stream != NULL && total_weight;
+         stream = stream->next) {
+        if (!limit_stream_is_active(stream, now)) {
+            continue;
+        }
+
+        share = (double)stream->weight / total_weight;
+        stream->tokens = MIN(stream->tokens + earned * share,
+                             limit_bytes_per_s * share * LIMIT_BURST_MS / 1000.0);
+    }
+}
+
+/**
+ * Parse a rate in bytes per second, with an optional ``K``, ``M`` or ``G`` suffix
+ * (powers of 1024). ``0``, ``off`` and ``none`` lift the limit.
+ *
+ * :return: false if ``str`` isn't a rate.
+ */
+bool
+limit_rate_parse(const char *str, uint64_t *rate) {
+    char *end;
+    double value;
+
+    if (!strcmp(str, "off") || !strcmp(str, "none")) {
+        *rate = 0;
+        return true;
+    }
+
+    value = strtod(str, &end);
+    if (end == str || value < 0) {
+        return false;
+    }
+
+    switch (toupper((unsigned char)*end)) {
+        case 'G':
+            value *= 1024;
+            /* fall through */
+        case 'M':
+            value *= 1024;
+            /* fall through */
+        case 'K':
+            value *= 1024;
+            end++;
+            break;
+        case '\0':
+            break;
+        default:
+            return false;
+    }
+
+    /* ``10M``, ``10MB`` and ``10M/s`` all read the same */
+    if (*end != '\0' && strcmp(end, "B") && strcmp(end, "/s") && strcmp(end, "B/s")) {
+        return false;
+    }
+
+    *rate = value;
+    return true;
+}
+
+/** Set the bytes per second shared by every transfer, 0 lifts the limit. Transfers
+ * already running follow the new limit within ``LIMIT_MAX_WAIT_MS``. */
+void
+limit_set_rate(uint64_t rate) {
+    pthread_mutex_lock(&limit_lock);
+    limit_bytes_per_s = rate;
+    pthread_mutex_unlock(&limit_lock);
+}
+
+uint64_t
+limit_rate(void) {
+    uint64_t rate;
+
+    pthread_mutex_lock(&limit_lock);
+    rate = limit_bytes_per_s;
+    pthread_mutex_unlock(&limit_lock);
+
+    return rate;
+}
+
+/** Print the limit and the transfers sharing it. */
+void
+limit_print(void) {
+    double now = get_time_monotonic();
+    size_t num_streams = 0, num_active = 0;
+
+    pthread_mutex_lock(&limit_lock);
+    for (LimitStreamT *stream = streams; stream != NULL; stream = stream->next) {
+        num_streams++;
+        num_active += limit_stream_is_active(stream, now);
+    }
+
+    if (limit_bytes_per_s) {
+        printf("Bandwidth limit: %.2f MiB/s, shared by %zu transfers (%zu active)\n",
+               limit_bytes_per_s / 1048576.0, num_streams, num_active);
+    } else {
+        printf("Bandwidth limit: none\n");
+    }
+    pthread_mutex_unlock(&limit_lock);
+}
+
+/** Give the transfers started by the calling thread ``weight`` shares of the limit,
+ * pool workers inherit it from the thread that started the copy. */
+void
+limit_bind_thread(uint32_t weight) {
+    thread_weight = MAX(weight, 1);
+}
+
+uint32_t
+limit_current_weight(void) {
+    return thread_weight;
+}
+
+/** Cap the transfers started by the calling thread with ``cap``, ``NULL`` to stop.
+ * Pool workers inherit it from the thread that started the copy. */
+void
+limit_bind_cap(LimitCapT *cap) {
+    thread_cap = cap;
+}
+
+LimitCapT *
+limit_current_cap(void) {
+    return thread_cap;
+}
+
+/** Cap a copy at ``rate`` bytes per second, on top of the limit shared by all. */
+LimitCapT *
+LimitCap_new(uint64_t rate) {
+    LimitCapT *self = DBG_CALLOC(1, sizeof *self);
+
+    self->bytes_per_s = rate;
+    self->last_refill = get_time_monotonic();
+
+    return self;
+}
+
+/** Free a cap once no stream of its copy is left. */
+void
+LimitCap_free(LimitCapT *self) {
+    DBG_SAFE_FREE(self);
+}
+
+/** Hand the cap the tokens earned since its last refill. Must be called with the
+ * lock held. */
+static void
+limit_cap_refill(LimitCapT *self, double now) {
+    self->tokens =
+        MIN(self->tokens + self->bytes_per_s * MIN(now - self->last_refill, 1.0),
+            self->bytes_per_s * LIMIT_BURST_MS / 1000.0);
+    self->last_refill = now;
+}
+
+/**
+ * Start a stream taking ``weight`` shares of the limit, one per transfer.
+ *
+ * :param cap: Cap of the copy the transfer belongs to, ``NULL`` for none.
+ */
+LimitStreamT *
+LimitStream_new(uint32_t weight, LimitCapT *cap) {
+    LimitStreamT *self = DBG_CALLOC(1, sizeof *self);
+
+    self->weight = MAX(weight, 1);
+    self->cap = cap != NULL && cap->bytes_per_s ? cap : NULL;
+
+    pthread_mutex_lock(&limit_lock);
+    self->next = streams;
+    if (streams != NULL) {
+        streams->prev = self;
+    }
+    streams = self;
+    pthread_mutex_unlock(&limit_lock);
+
+    return self;
+}
+
+void
+LimitStream_free(LimitStreamT *self) {
+    if (self == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&limit_lock);
+    if (self->prev != NULL) {
+        self->prev->next = self->next;
+    } else {
+        streams = self->next;
+    }
+    if (self->next != NULL) {
+        self->next->prev = self->prev;
+    }
+    pthread_mutex_unlock(&limit_lock);
+
+    DBG_SAFE_FREE(self);
+}
+
+/**
+ * Take tokens for a chunk of ``length`` bytes. A stream with any tokens left takes
+ * the whole chunk, going into debt, so chunks larger than a slow stream's burst
+ * still get through.
+ *
+ * :param wait_ms: Set to the time until the stream has tokens again if it has none.
+ *
+ * :return: true if the chunk may go now.
+ */
+bool
+LimitStream_take(LimitStreamT *self, uint32_t length, uint32_t *wait_ms) {
+    double now, share;
+    uint64_t total_weight = 0;
+    bool is_taken = true;
+
+    if (self == NULL) {
+        return true;
+    }
+
+    pthread_mutex_lock(&limit_lock);
+    now = get_time_monotonic();
+
+    /* The cap of the copy goes first, the shared tokens stay for the others */
+    if (self->cap != NULL) {
+        limit_cap_refill(self->cap, now);
+        if (self->cap->tokens <= 0) {
+            *wait_ms = MIN(LIMIT_MAX_WAIT_MS,
+                           1 + (uint32_t)(-self->cap->tokens * 1000 /
+                                          self->cap->bytes_per_s));
+            pthread_mutex_unlock(&limit_lock);
+            return false;
+        }
+    }
+
+    if (!limit_bytes_per_s) {
+        self->tokens = 0;
+        if (self->cap != NULL) {
+            self->cap->tokens -= length;
+        }
+        pthread_mutex_unlock(&limit_lock);
+        return true;
+    }
+
+    if (!limit_stream_is_active(self, now)) {
+        /* Coming back from idle, tokens saved before don't count */
+        self->tokens = MIN(self->tokens, 0);
+    }
+    self->last_take = now;
+    limit_refill(now);
+
+    if (self->tokens > 0) {
+        self->tokens -= length;
+        if (self->cap != NULL) {
+            self->cap->tokens -= length;
+        }
+    } else {
+        for (LimitStreamT *stream = streams; stream != NULL; stream = stream->next) {
+            total_weight += limit_stream_is_active(stream, now) ? stream->weight : 0;
+        }
+
+        /* The stream's share of the rate, as it stands now */
+        share = (double)limit_bytes_per_s * self->weight / total_weight;
+        *wait_ms = MIN(LIMIT_MAX_WAIT_MS, 1 + (uint32_t)(-self->tokens * 1000 / share));
+        is_taken = false;
+    }
+    pthread_mutex_unlock(&limit_lock);
+
+    return is_taken;
+}
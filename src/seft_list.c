@@ -60,7 +60,7 @@ List_realloc(ListT *self, size_t new_size) {
 void
 List_push(ListT *self, void *other, size_t size) {
     List_realloc(self, self->length + 1);
-    self->list[self->length] = malloc(size);
+    self->list[self->length] = DBG_MALLOC(size);
     memcpy(self->list[self->length++], other, size);
 }
 
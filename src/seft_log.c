@@ -0,0 +1,493 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "seft_debug.h"
+#include "seft_log.h"
+
+/** A message waiting in a ring, formatted by the thread that logged it */
+typedef struct {
+    enum DBG_LEVELS level;
+    const char *file;
+    int line;
+    const char *func;
+    char message[LOG_MESSAGE_SIZE];
+} LogRecordT;
+
+/**
+ * Messages of a thread, only that thread adds to it and only the drain takes from
+ * it, so neither takes a lock. ``head`` and ``tail`` only grow, the record of an
+ * index is at its remainder by ``LOG_RING_SIZE``.
+ */
+typedef struct LogRingS {
+    struct LogRingS *next;
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+
+    /** Messages lost to a full ring since the last drain */
+    atomic_uint_fast64_t num_dropped;
+
+    /** Its thread exited, the drain frees it once it's empty */
+    atomic_bool is_closed;
+
+    LogRecordT records[LOG_RING_SIZE];
+} LogRingT;
+
+atomic_int log_levels[LOG_MAX_SUBSYSTEMS];
+
+/** Names of the subsystems, the index of a name is its index in ``log_levels`` */
+static char log_subsystems[LOG_MAX_SUBSYSTEMS][LOG_SUBSYSTEM_NAME_SIZE];
+static int log_num_subsystems = 0;
+
+/** Level of the subsystems named after ``log_default_level`` was last set */
+static int log_default_level = DBG_STATUS ? DBG_LEVEL_DEBUG : DBG_LEVEL_CRITICAL;
+static pthread_mutex_t log_subsystems_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+
+/** Rings of every thread that logged, newest first */
+static _Atomic(LogRingT *) log_rings = NULL;
+static __thread LogRingT *log_thread_ring = NULL;
+static pthread_key_t log_ring_key;
+
+/** Held while draining, the writer thread and ``log_flush`` take turns */
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct {
+    pthread_t thread;
+    bool is_running;
+    bool is_stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} log_writer = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static const char *
+log_level_to_str(enum DBG_LEVELS level) {
+    switch (level) {
+        case DBG_LEVEL_DEBUG:
+            return ANSI_FG_GREEN "DEBUG" ANSI_RESET;
+        case DBG_LEVEL_INFO:
+            return ANSI_FG_CYAN "INFO" ANSI_RESET;
+        case DBG_LEVEL_CRITICAL:
+            return ANSI_FG_RED "CRITICAL" ANSI_RESET;
+    }
+
+    return "";
+}
+
+static bool
+log_level_parse(const char *name, int *level) {
+    if (!strcasecmp(name, "debug")) {
+        *level = DBG_LEVEL_DEBUG;
+    } else if (!strcasecmp(name, "info")) {
+        *level = DBG_LEVEL_INFO;
+    } else if (!strcasecmp(name, "critical") || !strcasecmp(name, "error")) {
+        *level = DBG_LEVEL_CRITICAL;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+static const char *
+log_level_name(int level) {
+    return level == DBG_LEVEL_DEBUG ? "debug"
+           : level == DBG_LEVEL_INFO ? "info"
+                                     : "critical";
+}
+
+/** Index of the subsystem ``name``, added with the default level if it's new. The
+ * last one takes the names past ``LOG_MAX_SUBSYSTEMS``. */
+static int
+log_subsystem_index(const char *name, size_t length) {
+    int index;
+
+    length = length < LOG_SUBSYSTEM_NAME_SIZE ? length : LOG_SUBSYSTEM_NAME_SIZE - 1;
+
+    pthread_mutex_lock(&log_subsystems_lock);
+    for (index = 0; index < log_num_subsystems; index++) {
+        if (!strncmp(log_subsystems[index], name, length) &&
+            log_subsystems[index][length] == '\0') {
+            break;
+        }
+    }
+    if (index == log_num_subsystems) {
+        if (index == LOG_MAX_SUBSYSTEMS) {
+            index--;
+        } else {
+            memcpy(log_subsystems[index], name, length);
+            log_subsystems[index][length] = '\0';
+            atomic_store(&log_levels[index], log_default_level);
+            log_num_subsystems++;
+        }
+    }
+    pthread_mutex_unlock(&log_subsystems_lock);
+
+    return index;
+}
+
+static bool
+log_apply(const char *spec) {
+    char buffer[1024], *item, *save, *equals;
+    int level;
+
+    /* Checked whole first, so that a typo doesn't leave it half applied */
+    for (int is_applying = 0; is_applying < 2; is_applying++) {
+        snprintf(buffer, sizeof buffer, "%s", spec);
+        for (item = strtok_r(buffer, ", ", &save); item != NULL;
+             item = strtok_r(NULL, ", ", &save)) {
+            equals = strchr(item, '=');
+            if (!log_level_parse(equals != NULL ? equals + 1 : item, &level) ||
+                equals == item) {
+                return false;
+            }
+            if (!is_applying) {
+                continue;
+            }
+
+            if (equals != NULL) {
+                atomic_store(&log_levels[log_subsystem_index(item, equals - item)],
+                             level);
+                continue;
+            }
+
+            pthread_mutex_lock(&log_subsystems_lock);
+            log_default_level = level;
+            for (int i = 0; i < log_num_subsystems; i++) {
+                atomic_store(&log_levels[i], level);
+            }
+            pthread_mutex_unlock(&log_subsystems_lock);
+        }
+    }
+
+    return true;
+}
+
+static void
+log_stop(void) {
+    pthread_mutex_lock(&log_writer.lock);
+    if (!log_writer.is_running) {
+        pthread_mutex_unlock(&log_writer.lock);
+        log_flush();
+        return;
+    }
+    log_writer.is_stopping = true;
+    pthread_cond_signal(&log_writer.cond);
+    pthread_mutex_unlock(&log_writer.lock);
+
+    pthread_join(log_writer.thread, NULL);
+    log_writer.is_running = false;
+    log_flush();
+}
+
+/* A fork copies the rings but not the writer thread: the messages are written before
+ * it, and the child starts a writer of its own on its first message */
+static void
+log_fork_prepare(void) {
+    log_flush();
+    pthread_mutex_lock(&log_subsystems_lock);
+    pthread_mutex_lock(&log_drain_lock);
+}
+
+static void
+log_fork_parent(void) {
+    pthread_mutex_unlock(&log_drain_lock);
+    pthread_mutex_unlock(&log_subsystems_lock);
+}
+
+static void
+log_fork_child(void) {
+    pthread_mutex_unlock(&log_drain_lock);
+    pthread_mutex_unlock(&log_subsystems_lock);
+    pthread_mutex_init(&log_writer.lock, NULL);
+    log_writer.is_running = false;
+    log_writer.is_stopping = false;
+}
+
+static void
+log_ring_close(void *ring) {
+    atomic_store(&((LogRingT *)ring)->is_closed, true);
+}
+
+static void
+log_init(void) {
+    pthread_condattr_t cond_attr;
+    const char *spec = getenv("SEFT_LOG");
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&log_writer.cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    pthread_key_create(&log_ring_key, log_ring_close);
+    pthread_atfork(log_fork_prepare, log_fork_parent, log_fork_child);
+    atexit(log_stop);
+
+    if (spec != NULL && !log_apply(spec)) {
+        fprintf(stderr, "[%s]::Invalid SEFT_LOG: %s\n",
+                log_level_to_str(DBG_LEVEL_CRITICAL), spec);
+    }
+}
+
+/** Give ``site`` the subsystem named after its file, ``seft_`` and the extension
+ * left out. */
+int
+log_resolve_site(LogSiteT *site) {
+    const char *name = strrchr(site->file, '/'), *end;
+    int subsystem;
+
+    pthread_once(&log_once, log_init);
+
+    name = name != NULL ? name + 1 : site->file;
+    if (!strncmp(name, "seft_", 5)) {
+        name += 5;
+    }
+    end = strchr(name, '.');
+
+    subsystem = log_subsystem_index(name, end != NULL ? (size_t)(end - name)
+                                                      : strlen(name));
+    atomic_store(&site->subsystem, subsystem);
+
+    return subsystem;
+}
+
+/**
+ * Set the levels from ``spec``, comma separated: a level alone sets every subsystem
+ * and the default of those to come, ``SUBSYSTEM=LEVEL`` a single one. Levels are
+ * ``debug``, ``info`` and ``critical``, e.g. ``info,loop=debug``.
+ *
+ * :return: Whether ``spec`` was valid, nothing is set if it wasn't.
+ */
+bool
+log_configure(const char *spec) {
+    pthread_once(&log_once, log_init);
+    return log_apply(spec);
+}
+
+/** Print the default level and the level of every subsystem that logged or was
+ * set. */
+void
+log_print_levels(void) {
+    pthread_once(&log_once, log_init);
+
+    pthread_mutex_lock(&log_subsystems_lock);
+    printf("Log level: %s\n", log_level_name(log_default_level));
+    for (int i = 0; i < log_num_subsystems; i++) {
+        printf("  %-12s %s\n", log_subsystems[i],
+               log_level_name(atomic_load(&log_levels[i])));
+    }
+    pthread_mutex_unlock(&log_subsystems_lock);
+}
+
+static void
+log_print_record(const LogRecordT *record) {
+    if (record->level == DBG_LEVEL_CRITICAL) {
+        fprintf(stderr, "[%s]::%s\n", log_level_to_str(record->level), record->message);
+        return;
+    }
+
+    fprintf(stderr, "[%s]:%s:%d:%s: %s\n", log_level_to_str(record->level),
+            record->file, record->line, record->func, record->message);
+}
+
+/** Write the messages of every ring, oldest first within a thread, and free the
+ * rings of the threads that exited. */
+static void
+log_drain(void) {
+    LogRingT *ring, *ring_next, *ring_prev = NULL, *expected;
+    uint64_t tail, head, num_dropped;
+    bool is_closed;
+
+    pthread_mutex_lock(&log_drain_lock);
+    for (ring = atomic_load(&log_rings); ring != NULL; ring = ring_next) {
+        /* Read before the records, a closed ring is then empty once drained */
+        is_closed = atomic_load(&ring->is_closed);
+
+        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        for (; tail != head; tail++) {
+            log_print_record(&ring->records[tail % LOG_RING_SIZE]);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        num_dropped = atomic_exchange(&ring->num_dropped, 0);
+        if (num_dropped) {
+            fprintf(stderr,
+                    "[%s]:log: %" PRIu64 " messages dropped, logged faster than they "
+                    "were written\n",
+                    log_level_to_str(DBG_LEVEL_INFO), num_dropped);
+        }
+
+        /* Only the drain unlinks rings, threads only push theirs at the head. A ring
+         * at the head that lost it to a push is unlinked in the next drain. */
+        ring_next = ring->next;
+        expected = ring;
+        if (!is_closed) {
+            ring_prev = ring;
+        } else if (ring_prev != NULL) {
+            ring_prev->next = ring_next;
+            free(ring);
+        } else if (atomic_compare_exchange_strong(&log_rings, &expected, ring_next)) {
+            free(ring);
+        } else {
+            ring_prev = ring;
+        }
+    }
+    fflush(stderr);
+    pthread_mutex_unlock(&log_drain_lock);
+}
+
+/** Write the messages waiting in the rings now, e.g. before printing the prompt. */
+void
+log_flush(void) {
+    log_drain();
+}
+
+static void *
+log_writer_run(void *arg) {
+    struct timespec deadline;
+
+    (void)arg;
+
+    pthread_mutex_lock(&log_writer.lock);
+    while (!log_writer.is_stopping) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += LOG_DRAIN_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&log_writer.cond, &log_writer.lock, &deadline);
+
+        pthread_mutex_unlock(&log_writer.lock);
+        log_drain();
+        pthread_mutex_lock(&log_writer.lock);
+    }
+    pthread_mutex_unlock(&log_writer.lock);
+
+    return NULL;
+}
+
+static void
+log_start_writer(void) {
+    pthread_mutex_lock(&log_writer.lock);
+    if (!log_writer.is_running && !log_writer.is_stopping &&
+        !pthread_create(&log_writer.thread, NULL, log_writer_run, NULL)) {
+        log_writer.is_running = true;
+    }
+    pthread_mutex_unlock(&log_writer.lock);
+}
+
+static LogRingT *
+log_ring(void) {
+    LogRingT *ring = log_thread_ring;
+
+    if (ring != NULL) {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof *ring);
+    if (ring == NULL) {
+        return NULL;
+    }
+    ring->next = atomic_load(&log_rings);
+    while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {
+    }
+    pthread_setspecific(log_ring_key, ring);
+    log_thread_ring = ring;
+
+    log_start_writer();
+    return ring;
+}
+
+/** Whether the message goes through the rate limit of its call, and how many were
+ * held back before it. */
+static bool
+log_rate_allows(LogSiteT *site, uint32_t *num_suppressed) {
+    struct timespec now;
+    uint64_t now_s, window_s;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    now_s = now.tv_sec;
+    window_s = atomic_load_explicit(&site->window_s, memory_order_relaxed);
+    if (window_s != now_s &&
+        atomic_compare_exchange_strong(&site->window_s, &window_s, now_s)) {
+        atomic_store_explicit(&site->num_in_window, 0, memory_order_relaxed);
+    }
+
+    if (atomic_fetch_add_explicit(&site->num_in_window, 1, memory_order_relaxed) >=
+        LOG_RATE_LIMIT) {
+        atomic_fetch_add_explicit(&site->num_suppressed, 1, memory_order_relaxed);
+        return false;
+    }
+
+    *num_suppressed = atomic_exchange_explicit(&site->num_suppressed, 0,
+                                               memory_order_relaxed);
+    return true;
+}
+
+/**
+ * Format a message into the ring of the calling thread. Use the ``DBG_*`` macros,
+ * which check the level first. Errors are written before it returns, the rest by
+ * the writer thread within ``LOG_DRAIN_INTERVAL_MS``.
+ */
+void
+log_write(LogSiteT *site, enum DBG_LEVELS level, const char *file, int line,
+          const char *func, const char *prompt, ...) {
+    uint32_t num_suppressed = 0;
+    LogRecordT *record, record_direct;
+    LogRingT *ring;
+    uint64_t head;
+    va_list args;
+    int length;
+
+    if (level != DBG_LEVEL_CRITICAL && !log_rate_allows(site, &num_suppressed)) {
+        return;
+    }
+
+    ring = log_ring();
+    head = ring != NULL ? atomic_load_explicit(&ring->head, memory_order_relaxed) : 0;
+    if (ring != NULL &&
+        head - atomic_load_explicit(&ring->tail, memory_order_acquire) < LOG_RING_SIZE) {
+        record = &ring->records[head % LOG_RING_SIZE];
+    } else if (level == DBG_LEVEL_CRITICAL) {
+        /* Errors aren't dropped, they are written from here */
+        record = &record_direct;
+    } else {
+        if (ring != NULL) {
+            atomic_fetch_add_explicit(&ring->num_dropped, 1, memory_order_relaxed);
+        }
+        return;
+    }
+
+    *record = (LogRecordT){.level = level, .file = file, .line = line, .func = func};
+    va_start(args, prompt);
+    length = vsnprintf(record->message, sizeof record->message, prompt, args);
+    va_end(args);
+    if (num_suppressed && length >= 0 && (size_t)length < sizeof record->message) {
+        snprintf(record->message + length, sizeof record->message - length,
+                 " (%" PRIu32 " more held back by the rate limit)", num_suppressed);
+    }
+
+    if (record == &record_direct) {
+        log_flush();
+        pthread_mutex_lock(&log_drain_lock);
+        log_print_record(record);
+        fflush(stderr);
+        pthread_mutex_unlock(&log_drain_lock);
+        return;
+    }
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    if (level == DBG_LEVEL_CRITICAL) {
+        log_flush();
+    }
+}
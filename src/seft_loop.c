@@ -0,0 +1,2028 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_commands.h"
+#include "seft_debug.h"
+#include "seft_list.h"
+#include "seft_loop.h"
+#include "seft_metrics.h"
+#include "seft_path.h"
+#include "seft_stats.h"
+#include "seft_trace.h"
+
+/** An encoded packet waiting to be written to the channel */
+typedef struct {
+    uint8_t *data;
+    size_t length;
+    size_t allocated;
+
+    /** Number of bytes already accepted by the channel */
+    size_t num_sent;
+
+    /** Bytes the request reads or writes if it's a bulk READ or WRITE, 0 otherwise */
+    uint32_t num_bulk_bytes;
+
+    /** Request the packet carries */
+    uint32_t id;
+    LoopOpE op;
+} LoopPacketT;
+
+/** Packets waiting to be written, oldest first starting at ``head`` */
+typedef struct {
+    LoopPacketT **packets;
+    size_t head;
+    size_t length;
+    size_t allocated;
+} LoopQueueT;
+
+/** A request waiting for its response */
+typedef struct {
+    uint32_t id;
+    LoopOpE op;
+    uint64_t offset;
+    uint32_t length;
+    LoopCallbackT callback;
+    void *user_data;
+
+    /** Whether the request counts towards the connection's interactive requests */
+    bool is_interactive;
+
+    /** When the request was submitted in ns */
+    uint64_t time_submit_ns;
+} LoopRequestT;
+
+/** Bounds checked reader over a received packet */
+typedef struct {
+    const uint8_t *data;
+    size_t length;
+    bool is_bad;
+} LoopReaderT;
+
+/** A connection of the registry, shared by every loop opened with its lock */
+typedef struct {
+    ssh_session session_ssh;
+
+    /** Loop shared by threads that don't have one of their own */
+    SftpLoopT *loop;
+
+    /** Held by every user of the connection around libssh calls */
+    pthread_mutex_t lock;
+
+    /** Interactive requests not answered yet on any loop of the connection */
+    atomic_size_t num_interactive;
+
+    /** Bumped whenever the connection is torn down, which frees every channel on
+     * it. Loops whose channel is from an older generation must not touch it. */
+    uint32_t generation;
+
+    /** Set once a reconnect failed, loops on the connection give up from then on */
+    bool is_lost;
+
+    LoopReconnectT reconnect;
+    void *reconnect_data;
+
+    /** Seconds without an answer before a keepalive is sent, 0 to never send one */
+    uint32_t keepalive_interval;
+
+    /** Seconds without an answer before the peer counts as dead, 0 to wait forever */
+    uint32_t dead_timeout;
+
+    /** Probes the connection while it's idle, see ``loop_keepalive_thread`` */
+    pthread_t keepalive_thread;
+    bool is_keepalive_running;
+    bool is_keepalive_stopping;
+    pthread_mutex_t keepalive_lock;
+    pthread_cond_t keepalive_cond;
+} LoopConnT;
+
+struct SftpLoopS {
+    ssh_session session_ssh;
+
+    /** Raw channel running the ``sftp`` subsystem */
+    ssh_channel channel;
+
+    /** Lock of ``session_ssh`` if other threads use the connection, ``NULL`` otherwise */
+    pthread_mutex_t *lock;
+
+    /** Registry entry of the connection if the loop shares its lock, ``NULL`` if the
+     * loop can't be brought back once its channel breaks */
+    LoopConnT *conn;
+
+    /** Generation of ``conn`` the channel was opened in */
+    uint32_t generation;
+
+    uint32_t next_id;
+
+    /** Metadata requests, always written before any queued bulk request */
+    LoopQueueT queue_interactive;
+
+    /** READ and WRITE requests of transfers */
+    LoopQueueT queue_bulk;
+
+    /** Packet partially accepted by the channel, it has to be finished first */
+    LoopPacketT *packet_sending;
+
+    /** Bytes of bulk requests written to the channel and not answered yet */
+    size_t num_bulk_bytes_in_flight;
+
+    /** Interactive requests not answered yet, of every loop on the connection if
+     * it's in the registry, of this loop otherwise */
+    atomic_size_t *num_interactive;
+    atomic_size_t num_interactive_own;
+
+    /** Set for loops of background work, their requests never throttle other loops */
+    bool is_bulk;
+
+    /** Requests waiting for a response */
+    LoopRequestT *pending;
+    size_t num_pending;
+    size_t pending_allocated;
+
+    /** Bytes read off the channel that don't form a whole packet yet */
+    uint8_t *in_buf;
+    size_t in_length;
+    size_t in_allocated;
+
+    /** Names of the extensions announced by the server */
+    char *extensions[LOOP_MAX_EXTENSIONS];
+    size_t num_extensions;
+
+    /** Last time the channel or the connection showed signs of life, in ms */
+    uint64_t last_activity_ms;
+    uint64_t last_keepalive_ms;
+
+    /** Set once the channel failed, the loop opens a new one before going on */
+    bool is_broken;
+
+    /** Set if the channel broke because the peer stopped answering */
+    bool is_timed_out;
+
+    /** Set once the loop gave up on the connection, every later request fails right
+     * away */
+    bool is_dead;
+};
+
+/** Connections known to the loop */
+static LoopConnT loop_registry[MAX_LOOP_SESSIONS];
+static pthread_mutex_t loop_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t loop_registry_once = PTHREAD_ONCE_INIT;
+
+/** Loop bound to the calling thread by ``SftpLoop_bind_thread`` */
+static __thread SftpLoopT *thread_loop = NULL;
+
+/** Told about every completed request, see ``SftpLoop_set_observer`` */
+static LoopObserverT loop_observer = NULL;
+static void *loop_observer_data = NULL;
+
+static void
+be32_put(uint8_t *buf, uint32_t value) {
+    buf[0] = value >> 24;
+    buf[1] = value >> 16;
+    buf[2] = value >> 8;
+    buf[3] = value;
+}
+
+static uint32_t
+be32_get(const uint8_t *buf) {
+    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 |
+           buf[3];
+}
+
+/** Monotonic clock in milliseconds. */
+static uint64_t
+loop_now_ms(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/** Monotonic clock in nanoseconds. */
+static uint64_t
+loop_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+loop_packet_reserve(LoopPacketT *self, size_t length) {
+    uint8_t *data;
+    size_t allocated = self->allocated;
+
+    if (self->length + length <= allocated) {
+        return;
+    }
+
+    while (allocated < self->length + length) {
+        allocated *= 2;
+    }
+
+    data = DBG_REALLOC(self->data, allocated);
+    if (data == NULL) {
+        exit(EXIT_FAILURE);
+    }
+    self->data = data;
+    self->allocated = allocated;
+}
+
+static void
+loop_put_u8(LoopPacketT *self, uint8_t value) {
+    loop_packet_reserve(self, 1);
+    self->data[self->length++] = value;
+}
+
+static void
+loop_put_u32(LoopPacketT *self, uint32_t value) {
+    loop_packet_reserve(self, 4);
+    be32_put(self->data + self->length, value);
+    self->length += 4;
+}
+
+static void
+loop_put_u64(LoopPacketT *self, uint64_t value) {
+    loop_put_u32(self, value >> 32);
+    loop_put_u32(self, value);
+}
+
+static void
+loop_put_bytes(LoopPacketT *self, const void *data, uint32_t length) {
+    loop_put_u32(self, length);
+    loop_packet_reserve(self, length);
+    memcpy(self->data + self->length, data, length);
+    self->length += length;
+}
+
+static void
+loop_put_string(LoopPacketT *self, const char *str) {
+    loop_put_bytes(self, str, strlen(str));
+}
+
+static void
+loop_put_attr(LoopPacketT *self, LoopAttrT *attr) {
+    loop_put_u32(self, attr->flags & ~SSH_FILEXFER_ATTR_EXTENDED);
+    if (attr->flags & SSH_FILEXFER_ATTR_SIZE) {
+        loop_put_u64(self, attr->size);
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_UIDGID) {
+        loop_put_u32(self, attr->uid);
+        loop_put_u32(self, attr->gid);
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+        loop_put_u32(self, attr->permissions);
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+        loop_put_u32(self, attr->atime);
+        loop_put_u32(self, attr->mtime);
+    }
+}
+
+static void
+loop_packet_free(LoopPacketT *self) {
+    DBG_SAFE_FREE(self->data);
+    DBG_SAFE_FREE(self);
+}
+
+static void
+loop_queue_push(LoopQueueT *self, LoopPacketT *packet) {
+    void *grown;
+
+    if (self->length == self->allocated) {
+        /* Reclaim the slots of packets already written before growing */
+        if (self->head) {
+            memmove(self->packets, self->packets + self->head,
+                    (self->length - self->head) * sizeof *self->packets);
+            self->length -= self->head;
+            self->head = 0;
+        }
+        if (self->length == self->allocated) {
+            self->allocated = self->allocated ? self->allocated * 2 : 16;
+            grown = DBG_REALLOC(self->packets, self->allocated * sizeof *self->packets);
+            if (grown == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            self->packets = grown;
+        }
+    }
+    self->packets[self->length++] = packet;
+}
+
+/** Take the oldest packet off the queue, ``NULL`` if it's empty. */
+static LoopPacketT *
+loop_queue_pop(LoopQueueT *self) {
+    LoopPacketT *packet;
+
+    if (self->head == self->length) {
+        return NULL;
+    }
+
+    packet = self->packets[self->head++];
+    if (self->head == self->length) {
+        self->head = self->length = 0;
+    }
+
+    return packet;
+}
+
+static void
+loop_queue_free(LoopQueueT *self) {
+    for (size_t i = self->head; i < self->length; i++) {
+        loop_packet_free(self->packets[i]);
+    }
+    DBG_SAFE_FREE(self->packets);
+}
+
+/** READ and WRITE move file data, everything else is a metadata request someone
+ * is likely waiting on. */
+static bool
+loop_op_is_bulk(LoopOpE op) {
+    return op == LOOP_OP_READ || op == LOOP_OP_WRITE;
+}
+
+/** Requests naming their file by path may go out on another channel than the one
+ * they were queued for, requests carrying a handle are tied to its channel. */
+static bool
+loop_op_is_portable(LoopOpE op) {
+    switch (op) {
+        case LOOP_OP_OPEN:
+        case LOOP_OP_OPENDIR:
+        case LOOP_OP_STAT:
+        case LOOP_OP_SETSTAT:
+        case LOOP_OP_MKDIR:
+        case LOOP_OP_REMOVE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static uint8_t
+loop_get_u8(LoopReaderT *self) {
+    uint8_t value;
+
+    if (self->length < 1) {
+        self->is_bad = true;
+        return 0;
+    }
+
+    value = *self->data;
+    self->data++;
+    self->length--;
+    return value;
+}
+
+static uint32_t
+loop_get_u32(LoopReaderT *self) {
+    uint32_t value;
+
+    if (self->length < 4) {
+        self->is_bad = true;
+        return 0;
+    }
+
+    value = be32_get(self->data);
+    self->data += 4;
+    self->length -= 4;
+    return value;
+}
+
+static uint64_t
+loop_get_u64(LoopReaderT *self) {
+    uint64_t high = loop_get_u32(self);
+
+    return high << 32 | loop_get_u32(self);
+}
+
+/** Read a length prefixed string, ``*data`` points into the packet. */
+static uint32_t
+loop_get_bytes(LoopReaderT *self, const uint8_t **data) {
+    uint32_t length = loop_get_u32(self);
+
+    if (self->is_bad || length > self->length) {
+        self->is_bad = true;
+        *data = NULL;
+        return 0;
+    }
+
+    *data = self->data;
+    self->data += length;
+    self->length -= length;
+    return length;
+}
+
+static void
+loop_get_attr(LoopReaderT *self, LoopAttrT *attr) {
+    const uint8_t *skipped;
+    uint32_t num_extended;
+
+    memset(attr, 0, sizeof *attr);
+    attr->flags = loop_get_u32(self);
+
+    if (attr->flags & SSH_FILEXFER_ATTR_SIZE) {
+        attr->size = loop_get_u64(self);
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_UIDGID) {
+        attr->uid = loop_get_u32(self);
+        attr->gid = loop_get_u32(self);
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS) {
+        attr->permissions = loop_get_u32(self);
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_ACMODTIME) {
+        attr->atime = loop_get_u32(self);
+        attr->mtime = loop_get_u32(self);
+    }
+    if (attr->flags & SSH_FILEXFER_ATTR_EXTENDED) {
+        num_extended = loop_get_u32(self);
+        for (uint32_t i = 0; i < num_extended && !self->is_bad; i++) {
+            loop_get_bytes(self, &skipped);
+            loop_get_bytes(self, &skipped);
+        }
+    }
+
+    /* SFTP v3 has no type field, it is encoded in the permission bits */
+    if (!(attr->flags & SSH_FILEXFER_ATTR_PERMISSIONS)) {
+        attr->type = SSH_FILEXFER_TYPE_UNKNOWN;
+    } else if (S_ISREG(attr->permissions)) {
+        attr->type = SSH_FILEXFER_TYPE_REGULAR;
+    } else if (S_ISDIR(attr->permissions)) {
+        attr->type = SSH_FILEXFER_TYPE_DIRECTORY;
+    } else if (S_ISLNK(attr->permissions)) {
+        attr->type = SSH_FILEXFER_TYPE_SYMLINK;
+    } else {
+        attr->type = SSH_FILEXFER_TYPE_SPECIAL;
+    }
+}
+
+/** Lock the connection and switch it to nonblocking mode for the loop's calls. */
+static void
+loop_enter(SftpLoopT *self) {
+    if (self->lock != NULL) {
+        pthread_mutex_lock(self->lock);
+    }
+    ssh_set_blocking(self->session_ssh, 0);
+}
+
+/** Give the connection back in the blocking mode the rest of libssh's API expects. */
+static void
+loop_leave(SftpLoopT *self) {
+    ssh_set_blocking(self->session_ssh, 1);
+    if (self->lock != NULL) {
+        pthread_mutex_unlock(self->lock);
+    }
+}
+
+/** Check if the connection was torn down since the channel was opened, which freed
+ * the channel. Must be called with the connection's lock held. */
+static bool
+loop_is_stale(SftpLoopT *self) {
+    return self->conn != NULL && self->generation != self->conn->generation;
+}
+
+/** Blocking read of exactly ``length`` bytes, only used during the handshake. */
+static bool
+loop_read_exact(ssh_channel channel, uint8_t *buf, size_t length) {
+    int32_t num_bytes_read;
+
+    for (size_t num_bytes = 0; num_bytes < length; num_bytes += num_bytes_read) {
+        num_bytes_read =
+            ssh_channel_read(channel, buf + num_bytes, length - num_bytes, 0);
+        if (num_bytes_read <= 0) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/** Send INIT and read the server's VERSION along with its extensions. */
+static bool
+loop_handshake(SftpLoopT *self) {
+    uint8_t init[9];
+    uint8_t header[4];
+    uint8_t *version;
+    uint32_t length;
+    const uint8_t *name, *data;
+    uint32_t len_name;
+    LoopReaderT reader;
+
+    be32_put(init, 5);
+    init[4] = SSH_FXP_INIT;
+    be32_put(init + 5, LOOP_SFTP_VERSION);
+    if (ssh_channel_write(self->channel, init, sizeof init) != sizeof init) {
+        return false;
+    }
+
+    if (!loop_read_exact(self->channel, header, sizeof header)) {
+        return false;
+    }
+
+    length = be32_get(header);
+    if (length < 5 || length > LOOP_MAX_PACKET_SIZE) {
+        return false;
+    }
+
+    version = DBG_MALLOC(length);
+    if (!loop_read_exact(self->channel, version, length)) {
+        DBG_SAFE_FREE(version);
+        return false;
+    }
+
+    reader = (LoopReaderT){version, length, false};
+    if (loop_get_u8(&reader) != SSH_FXP_VERSION ||
+        loop_get_u32(&reader) < LOOP_SFTP_VERSION) {
+        DBG_SAFE_FREE(version);
+        return false;
+    }
+
+    while (reader.length && !reader.is_bad) {
+        len_name = loop_get_bytes(&reader, &name);
+        loop_get_bytes(&reader, &data);
+        if (reader.is_bad || self->num_extensions == LOOP_MAX_EXTENSIONS) {
+            break;
+        }
+
+        self->extensions[self->num_extensions] = strndup((const char *)name, len_name);
+        DBG_DEBUG("Server supports %s", self->extensions[self->num_extensions]);
+        self->num_extensions++;
+    }
+
+    DBG_SAFE_FREE(version);
+    return true;
+}
+
+/** Open the loop's channel and run the handshake, with the connection's lock held. */
+static bool
+loop_open_channel(SftpLoopT *self) {
+    for (size_t i = 0; i < self->num_extensions; i++) {
+        DBG_SAFE_FREE(self->extensions[i]);
+    }
+    self->num_extensions = 0;
+
+    self->channel = ssh_channel_new(self->session_ssh);
+    if (self->channel != NULL && ssh_channel_open_session(self->channel) == SSH_OK &&
+        ssh_channel_request_subsystem(self->channel, "sftp") == SSH_OK &&
+        loop_handshake(self)) {
+        return true;
+    }
+
+    DBG_ERR("Couldn't open SFTP channel for the event loop: %s",
+            ssh_get_error(self->session_ssh));
+    if (self->channel != NULL) {
+        ssh_channel_free(self->channel);
+        self->channel = NULL;
+    }
+    return false;
+}
+
+/** Registry entry the lock belongs to, ``NULL`` for a lock of the caller's own. */
+static LoopConnT *
+loop_conn_of_lock(pthread_mutex_t *lock) {
+    for (size_t i = 0; lock != NULL && i < MAX_LOOP_SESSIONS; i++) {
+        if (lock == &loop_registry[i].lock) {
+            return &loop_registry[i];
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * Open a channel running the SFTP subsystem for the event loop.
+ *
+ * :param session_ssh: Connection to open the channel on.
+ * :param lock: Lock held around every call on ``session_ssh``, ``NULL`` if the
+ *     connection isn't shared with other threads.
+ *
+ * :return: The loop or ``NULL`` if the channel couldn't be opened.
+ *
+ * .. note:: The channel is separate from any ``sftp_session`` of the connection,
+ *    so blocking calls made elsewhere don't see the loop's packets.
+ */
+SftpLoopT *
+SftpLoop_new(ssh_session session_ssh, pthread_mutex_t *lock) {
+    SftpLoopT *self = DBG_CALLOC(1, sizeof *self);
+    bool is_ok;
+
+    self->session_ssh = session_ssh;
+    self->lock = lock;
+    self->next_id = 1;
+
+    /* Loops on a connection of the registry share its lock, and with it the count
+     * of interactive requests that throttles their bulk requests and the reconnects
+     * that bring their channels back */
+    self->conn = loop_conn_of_lock(lock);
+    self->num_interactive = self->conn != NULL ? &self->conn->num_interactive
+                                               : &self->num_interactive_own;
+
+    if (lock != NULL) {
+        pthread_mutex_lock(lock);
+    }
+
+    if (self->conn != NULL) {
+        self->generation = self->conn->generation;
+    }
+    is_ok = (self->conn == NULL || !self->conn->is_lost) && loop_open_channel(self);
+
+    if (lock != NULL) {
+        pthread_mutex_unlock(lock);
+    }
+
+    if (!is_ok) {
+        SftpLoop_free(self);
+        return NULL;
+    }
+
+    return self;
+}
+
+/**
+ * Close the channel of the loop and free it.
+ *
+ * .. note:: Callbacks of requests still pending are not called.
+ */
+void
+SftpLoop_free(SftpLoopT *self) {
+    if (self->lock != NULL) {
+        pthread_mutex_lock(self->lock);
+    }
+    /* A reconnect since the channel was opened freed it already */
+    if (self->channel != NULL && !loop_is_stale(self)) {
+        ssh_channel_close(self->channel);
+        ssh_channel_free(self->channel);
+    }
+    if (self->lock != NULL) {
+        pthread_mutex_unlock(self->lock);
+    }
+
+    /* Requests dropped without an answer don't hold back other loops' bulk data */
+    for (size_t i = 0; i < self->num_pending; i++) {
+        if (self->pending[i].is_interactive) {
+            atomic_fetch_sub(self->num_interactive, 1);
+        }
+    }
+
+    loop_queue_free(&self->queue_interactive);
+    loop_queue_free(&self->queue_bulk);
+    if (self->packet_sending != NULL) {
+        loop_packet_free(self->packet_sending);
+    }
+    for (size_t i = 0; i < self->num_extensions; i++) {
+        DBG_SAFE_FREE(self->extensions[i]);
+    }
+
+    if (thread_loop == self) {
+        thread_loop = NULL;
+    }
+
+    DBG_SAFE_FREE(self->pending);
+    DBG_SAFE_FREE(self->in_buf);
+    DBG_SAFE_FREE(self);
+}
+
+static void
+loop_registry_init(void) {
+    pthread_condattr_t cond_attr;
+
+    /* Keepalive intervals are measured on the clock that doesn't jump */
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
+    for (size_t i = 0; i < MAX_LOOP_SESSIONS; i++) {
+        pthread_mutex_init(&loop_registry[i].lock, NULL);
+        pthread_mutex_init(&loop_registry[i].keepalive_lock, NULL);
+        pthread_cond_init(&loop_registry[i].keepalive_cond, &cond_attr);
+    }
+
+    pthread_condattr_destroy(&cond_attr);
+}
+
+/** Find the registry entry of a connection, claiming a free one if it has none.
+ * Must be called with ``loop_registry_lock`` held. */
+static ssize_t
+loop_registry_find(ssh_session session_ssh) {
+    ssize_t free_index = -1;
+
+    pthread_once(&loop_registry_once, loop_registry_init);
+
+    for (size_t i = 0; i < MAX_LOOP_SESSIONS; i++) {
+        if (loop_registry[i].session_ssh == session_ssh) {
+            return i;
+        }
+        if (free_index < 0 && loop_registry[i].session_ssh == NULL) {
+            free_index = i;
+        }
+    }
+
+    if (free_index < 0) {
+        DBG_ERR("More than %d connections with an event loop", MAX_LOOP_SESSIONS);
+        return -1;
+    }
+
+    loop_registry[free_index].session_ssh = session_ssh;
+    return free_index;
+}
+
+/**
+ * Get the lock of a connection. Every thread using the connection, whatever loop
+ * or blocking call it goes through, has to hold it around libssh calls.
+ *
+ * :return: The lock or ``NULL`` if the registry is full.
+ */
+pthread_mutex_t *
+SftpLoop_session_lock(ssh_session session_ssh) {
+    pthread_mutex_t *lock = NULL;
+    ssize_t index;
+
+    pthread_mutex_lock(&loop_registry_lock);
+    index = loop_registry_find(session_ssh);
+    if (index >= 0) {
+        lock = &loop_registry[index].lock;
+    }
+    pthread_mutex_unlock(&loop_registry_lock);
+
+    return lock;
+}
+
+/**
+ * Get the loop of a connection, opening it on first use.
+ *
+ * :return: The loop bound to the calling thread if it runs on ``session_ssh``,
+ *     otherwise the connection's shared loop, ``NULL`` if it couldn't be opened.
+ */
+SftpLoopT *
+SftpLoop_for_session(ssh_session session_ssh) {
+    SftpLoopT *loop = NULL;
+    ssize_t index;
+
+    if (thread_loop != NULL && thread_loop->session_ssh == session_ssh) {
+        return thread_loop;
+    }
+
+    pthread_mutex_lock(&loop_registry_lock);
+    index = loop_registry_find(session_ssh);
+    if (index >= 0) {
+        if (loop_registry[index].loop == NULL) {
+            loop_registry[index].loop =
+                SftpLoop_new(session_ssh, &loop_registry[index].lock);
+        }
+        loop = loop_registry[index].loop;
+    }
+    pthread_mutex_unlock(&loop_registry_lock);
+
+    return loop;
+}
+
+/** Stop the keepalive thread of a connection and wait for it. */
+static void
+loop_keepalive_stop(LoopConnT *conn) {
+    if (!conn->is_keepalive_running) {
+        return;
+    }
+
+    pthread_mutex_lock(&conn->keepalive_lock);
+    conn->is_keepalive_stopping = true;
+    pthread_cond_signal(&conn->keepalive_cond);
+    pthread_mutex_unlock(&conn->keepalive_lock);
+
+    pthread_join(conn->keepalive_thread, NULL);
+    conn->is_keepalive_running = false;
+    conn->is_keepalive_stopping = false;
+}
+
+/** Free the shared loop of a connection, called before the connection is closed. */
+void
+SftpLoop_forget_session(ssh_session session_ssh) {
+    pthread_mutex_lock(&loop_registry_lock);
+    for (size_t i = 0; i < MAX_LOOP_SESSIONS; i++) {
+        if (loop_registry[i].session_ssh != session_ssh) {
+            continue;
+        }
+
+        loop_keepalive_stop(&loop_registry[i]);
+        if (loop_registry[i].loop != NULL) {
+            SftpLoop_free(loop_registry[i].loop);
+        }
+        loop_registry[i].session_ssh = NULL;
+        loop_registry[i].loop = NULL;
+        atomic_store(&loop_registry[i].num_interactive, 0);
+        loop_registry[i].is_lost = false;
+        loop_registry[i].reconnect = NULL;
+        loop_registry[i].reconnect_data = NULL;
+        loop_registry[i].keepalive_interval = 0;
+        loop_registry[i].dead_timeout = 0;
+    }
+    pthread_mutex_unlock(&loop_registry_lock);
+}
+
+/**
+ * Set how a connection comes back once it's found dead. Loops on the connection
+ * then reconnect it, open a new channel and fail only the requests the old one
+ * took with it, with ``SSH_FX_CONNECTION_LOST``.
+ *
+ * :param reconnect: Hook reconnecting the session, ``NULL`` to give up instead.
+ * :param user_data: Passed to ``reconnect``.
+ */
+void
+SftpLoop_set_reconnect(ssh_session session_ssh, LoopReconnectT reconnect,
+                       void *user_data) {
+    ssize_t index;
+
+    pthread_mutex_lock(&loop_registry_lock);
+    index = loop_registry_find(session_ssh);
+    if (index >= 0) {
+        pthread_mutex_lock(&loop_registry[index].lock);
+        loop_registry[index].reconnect = reconnect;
+        loop_registry[index].reconnect_data = user_data;
+        pthread_mutex_unlock(&loop_registry[index].lock);
+    }
+    pthread_mutex_unlock(&loop_registry_lock);
+}
+
+/**
+ * Probe an idle connection every keepalive interval with a STAT on a channel of its
+ * own. The traffic keeps middleboxes from dropping the connection, and a dead peer
+ * is found, and the connection brought back, before the next command runs into it.
+ */
+static void *
+loop_keepalive_thread(void *arg) {
+    LoopConnT *conn = arg;
+    SftpLoopT *loop = NULL;
+    struct timespec deadline;
+    bool is_lost = false;
+
+    pthread_mutex_lock(&conn->keepalive_lock);
+    while (!conn->is_keepalive_stopping && !is_lost) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += conn->keepalive_interval;
+        if (pthread_cond_timedwait(&conn->keepalive_cond, &conn->keepalive_lock,
+                                   &deadline) != ETIMEDOUT) {
+            continue;
+        }
+        pthread_mutex_unlock(&conn->keepalive_lock);
+
+        if (loop == NULL && (loop = SftpLoop_new(conn->session_ssh, &conn->lock))) {
+            SftpLoop_set_bulk(loop, true);
+        }
+        if (loop != NULL && SftpLoop_stat(loop, LOOP_KEEPALIVE_PATH, NULL, NULL)) {
+            SftpLoop_run(loop);
+        }
+        if (loop != NULL && loop->is_dead) {
+            SftpLoop_free(loop);
+            loop = NULL;
+        }
+
+        pthread_mutex_lock(&conn->lock);
+        is_lost = conn->is_lost;
+        pthread_mutex_unlock(&conn->lock);
+
+        pthread_mutex_lock(&conn->keepalive_lock);
+    }
+    pthread_mutex_unlock(&conn->keepalive_lock);
+
+    if (loop != NULL) {
+        SftpLoop_free(loop);
+    }
+    return NULL;
+}
+
+/**
+ * Have ``observer`` told about every request completed by any loop, with the time
+ * since it was submitted. It's called on the thread running the loop, before the
+ * request's callback, so it has to be cheap and thread safe.
+ *
+ * .. note:: Must be set while no loop runs, ``NULL`` removes it.
+ */
+void
+SftpLoop_set_observer(LoopObserverT observer, void *user_data) {
+    loop_observer = observer;
+    loop_observer_data = user_data;
+}
+
+/**
+ * Set how a connection is watched for a dead peer.
+ *
+ * :param keepalive_interval: Seconds without an answer before an SSH keepalive
+ *     is sent, also the interval an idle connection is probed at. 0 disables both.
+ * :param dead_timeout: Seconds without an answer to pending requests before the
+ *     peer counts as dead and the connection is brought back, 0 to wait forever.
+ */
+void
+SftpLoop_set_keepalive(ssh_session session_ssh, uint32_t keepalive_interval,
+                       uint32_t dead_timeout) {
+    LoopConnT *conn;
+    ssize_t index;
+
+    pthread_mutex_lock(&loop_registry_lock);
+    index = loop_registry_find(session_ssh);
+    if (index < 0) {
+        pthread_mutex_unlock(&loop_registry_lock);
+        return;
+    }
+
+    conn = &loop_registry[index];
+    loop_keepalive_stop(conn);
+
+    pthread_mutex_lock(&conn->lock);
+    conn->keepalive_interval = keepalive_interval;
+    conn->dead_timeout = dead_timeout;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (keepalive_interval) {
+        conn->is_keepalive_running =
+            !pthread_create(&conn->keepalive_thread, NULL, loop_keepalive_thread, conn);
+        if (!conn->is_keepalive_running) {
+            DBG_ERR("Couldn't start the keepalive of the connection %s", "");
+        }
+    }
+    pthread_mutex_unlock(&loop_registry_lock);
+}
+
+/** Make ``SftpLoop_for_session`` return ``self`` on the calling thread. */
+void
+SftpLoop_bind_thread(SftpLoopT *self) {
+    thread_loop = self;
+}
+
+/**
+ * Mark the loop as running background work. Its metadata requests still go ahead
+ * of its own READ and WRITE requests, but no longer shrink the bulk window of the
+ * other loops on the connection.
+ */
+void
+SftpLoop_set_bulk(SftpLoopT *self, bool is_bulk) {
+    self->is_bulk = is_bulk;
+}
+
+/** Check if the server announced the extension ``name``. */
+bool
+SftpLoop_has_extension(SftpLoopT *self, const char *name) {
+    for (size_t i = 0; i < self->num_extensions; i++) {
+        if (!strcmp(self->extensions[i], name)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool
+SftpLoop_is_dead(SftpLoopT *self) {
+    return self->is_dead;
+}
+
+/** Number of requests submitted and not completed yet. */
+size_t
+SftpLoop_num_pending(SftpLoopT *self) {
+    return self->num_pending;
+}
+
+/** Start a packet of ``type``, the id of the request is written to ``id``. */
+static LoopPacketT *
+loop_packet_begin(SftpLoopT *self, uint8_t type, uint32_t *id) {
+    LoopPacketT *packet = DBG_CALLOC(1, sizeof *packet);
+
+    packet->allocated = 64;
+    packet->data = DBG_MALLOC(packet->allocated);
+
+    /* Length is filled in by ``loop_submit`` */
+    loop_put_u32(packet, 0);
+    loop_put_u8(packet, type);
+
+    *id = self->next_id++;
+    if (!self->next_id) {
+        self->next_id = 1;
+    }
+    loop_put_u32(packet, *id);
+
+    return packet;
+}
+
+/** Queue a finished packet and remember the request it carries. */
+static uint32_t
+loop_submit(SftpLoopT *self, LoopPacketT *packet, uint32_t id, LoopOpE op,
+            uint64_t offset, uint32_t length, LoopCallbackT callback, void *user_data) {
+    void *grown;
+    bool is_interactive;
+
+    if (self->is_dead) {
+        loop_packet_free(packet);
+        return 0;
+    }
+
+    be32_put(packet->data, packet->length - 4);
+    packet->id = id;
+    packet->op = op;
+
+    if (loop_op_is_bulk(op)) {
+        packet->num_bulk_bytes = length;
+        loop_queue_push(&self->queue_bulk, packet);
+    } else {
+        loop_queue_push(&self->queue_interactive, packet);
+    }
+
+    is_interactive = !self->is_bulk && !loop_op_is_bulk(op);
+    if (is_interactive) {
+        atomic_fetch_add(self->num_interactive, 1);
+    }
+
+    if (self->num_pending == self->pending_allocated) {
+        self->pending_allocated =
+            self->pending_allocated ? self->pending_allocated * 2 : 16;
+        grown =
+            DBG_REALLOC(self->pending, self->pending_allocated * sizeof *self->pending);
+        if (grown == NULL) {
+            exit(EXIT_FAILURE);
+        }
+        self->pending = grown;
+    }
+    self->pending[self->num_pending++] =
+        (LoopRequestT){id,
+                       op,
+                       offset,
+                       length,
+                       callback,
+                       user_data,
+                       is_interactive,
+                       loop_now_ns()};
+    metrics_request_submitted(op);
+
+    return id;
+}
+
+/** Remove the pending request ``id`` and copy it to ``request``. */
+static bool
+loop_take_request(SftpLoopT *self, uint32_t id, LoopRequestT *request) {
+    for (size_t i = 0; i < self->num_pending; i++) {
+        if (self->pending[i].id == id) {
+            *request = self->pending[i];
+            self->pending[i] = self->pending[--self->num_pending];
+
+            if (loop_op_is_bulk(request->op)) {
+                self->num_bulk_bytes_in_flight -= request->length;
+            }
+            if (request->is_interactive) {
+                atomic_fetch_sub(self->num_interactive, 1);
+            }
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * Bytes of bulk requests the loop may have in flight. While interactive requests
+ * wait anywhere on the connection the window shrinks, so their responses queue
+ * behind little file data on the server and in the connection.
+ */
+static size_t
+loop_bulk_window(SftpLoopT *self) {
+    return atomic_load(self->num_interactive) ? LOOP_BULK_WINDOW_CONTENDED
+                                              : LOOP_BULK_WINDOW;
+}
+
+/** Pick the packet to write next, interactive ones go first. */
+static LoopPacketT *
+loop_next_packet(SftpLoopT *self) {
+    LoopPacketT *packet = loop_queue_pop(&self->queue_interactive);
+
+    if (packet == NULL && self->num_bulk_bytes_in_flight < loop_bulk_window(self)) {
+        packet = loop_queue_pop(&self->queue_bulk);
+    }
+
+    return packet;
+}
+
+/** Write queued packets until the channel stops accepting data or the bulk window
+ * is full. */
+static bool
+loop_flush(SftpLoopT *self) {
+    LoopPacketT *packet;
+    int32_t num_bytes_written;
+    bool is_progress = false;
+
+    for (;;) {
+        if (self->packet_sending == NULL) {
+            self->packet_sending = loop_next_packet(self);
+            if (self->packet_sending == NULL) {
+                break;
+            }
+            self->num_bulk_bytes_in_flight += self->packet_sending->num_bulk_bytes;
+        }
+
+        packet = self->packet_sending;
+        num_bytes_written =
+            ssh_channel_write(self->channel, packet->data + packet->num_sent,
+                              packet->length - packet->num_sent);
+        if (num_bytes_written == SSH_ERROR) {
+            DBG_ERR("Couldn't write to SFTP channel: %s",
+                    ssh_get_error(self->session_ssh));
+            self->is_broken = true;
+            break;
+        }
+        if (num_bytes_written <= 0) {
+            break;
+        }
+
+        is_progress = true;
+        packet->num_sent += num_bytes_written;
+        if (packet->num_sent < packet->length) {
+            break;
+        }
+
+        loop_packet_free(packet);
+        self->packet_sending = NULL;
+    }
+
+    return is_progress;
+}
+
+/** Read whatever the channel has buffered without blocking. */
+static bool
+loop_fill(SftpLoopT *self) {
+    int32_t num_bytes_read;
+    uint8_t *grown;
+    bool is_progress = false;
+
+    for (;;) {
+        if (self->in_allocated - self->in_length < LOOP_CHUNK_SIZE) {
+            self->in_allocated = self->in_allocated ? self->in_allocated * 2
+                                                    : 4 * LOOP_CHUNK_SIZE;
+            grown = DBG_REALLOC(self->in_buf, self->in_allocated);
+            if (grown == NULL) {
+                exit(EXIT_FAILURE);
+            }
+            self->in_buf = grown;
+        }
+
+        num_bytes_read =
+            ssh_channel_read_nonblocking(self->channel, self->in_buf + self->in_length,
+                                         self->in_allocated - self->in_length, 0);
+        if (num_bytes_read == SSH_ERROR || num_bytes_read == SSH_EOF ||
+            (num_bytes_read == 0 && ssh_channel_is_eof(self->channel))) {
+            DBG_ERR("SFTP channel closed: %s", ssh_get_error(self->session_ssh));
+            self->is_broken = true;
+            break;
+        }
+        if (num_bytes_read <= 0) {
+            break;
+        }
+
+        is_progress = true;
+        self->in_length += num_bytes_read;
+    }
+
+    return is_progress;
+}
+
+/**
+ * Tell the metrics, the observer if any, and the counters and trace of the thread's
+ * copy that a request completed.
+ *
+ * :param num_bytes: Bytes of data in the answer to a READ, 0 for other requests.
+ */
+static void
+loop_observe(SftpLoopT *self, LoopRequestT *request, uint32_t status,
+             uint32_t num_bytes) {
+    uint64_t latency_ns = loop_now_ns() - request->time_submit_ns;
+
+    if (request->op == LOOP_OP_WRITE && status == SSH_FX_OK) {
+        num_bytes = request->length;
+    }
+    metrics_request_done(request->op, status, latency_ns, num_bytes);
+    stats_count_request(request->op);
+    TRACE_SFTP(SftpLoop_op_str(request->op), self->session_ssh, request->time_submit_ns,
+               request->length, status);
+    if (loop_observer != NULL) {
+        loop_observer(request->op, status, request->length, latency_ns,
+                      loop_observer_data);
+    }
+}
+
+/** Decode one response and call the callback of its request. */
+static void
+loop_handle_packet(SftpLoopT *self, const uint8_t *data, size_t length) {
+    LoopReaderT reader = {data, length, false};
+    LoopResultT result = {0};
+    LoopRequestT request;
+    const uint8_t *bytes;
+    uint32_t len_bytes;
+    uint8_t type = loop_get_u8(&reader);
+    uint32_t id = loop_get_u32(&reader);
+
+    if (!loop_take_request(self, id, &request)) {
+        DBG_ERR("Response to unknown request %u", id);
+        return;
+    }
+
+    result.id = id;
+    result.op = request.op;
+    result.offset = request.offset;
+    result.length = request.length;
+
+    switch (type) {
+        case SSH_FXP_STATUS:
+            result.status = loop_get_u32(&reader);
+            break;
+        case SSH_FXP_HANDLE:
+            len_bytes = loop_get_bytes(&reader, &bytes);
+            if (len_bytes > LOOP_MAX_HANDLE_SIZE) {
+                reader.is_bad = true;
+                break;
+            }
+            memcpy(result.handle.bytes, bytes, len_bytes);
+            result.handle.length = len_bytes;
+            break;
+        case SSH_FXP_DATA:
+            result.len_data = loop_get_bytes(&reader, &result.data);
+            break;
+        case SSH_FXP_ATTRS:
+            loop_get_attr(&reader, &result.attr);
+            break;
+        case SSH_FXP_NAME:
+            result.num_names = loop_get_u32(&reader);
+
+            /* Every entry takes at least 12 bytes, don't trust larger counts */
+            if (result.num_names > reader.length / 12) {
+                reader.is_bad = true;
+                result.num_names = 0;
+                break;
+            }
+
+            result.names = DBG_CALLOC(result.num_names + 1, sizeof *result.names);
+            for (uint32_t i = 0; i < result.num_names && !reader.is_bad; i++) {
+                len_bytes = loop_get_bytes(&reader, &bytes);
+                result.names[i].name =
+                    strndup(bytes ? (const char *)bytes : "", len_bytes);
+                len_bytes = loop_get_bytes(&reader, &bytes);
+                result.names[i].longname =
+                    strndup(bytes ? (const char *)bytes : "", len_bytes);
+                loop_get_attr(&reader, &result.names[i].attr);
+            }
+            break;
+        case SSH_FXP_EXTENDED_REPLY:
+            result.data = reader.data;
+            result.len_data = reader.length;
+            break;
+        default:
+            reader.is_bad = true;
+    }
+
+    if (reader.is_bad) {
+        DBG_ERR("Malformed response of type %d to request %u", type, id);
+        result.status = SSH_FX_BAD_MESSAGE;
+    }
+
+    loop_observe(self, &request, result.status,
+                 request.op == LOOP_OP_READ ? result.len_data : 0);
+    if (request.callback != NULL) {
+        request.callback(self, &result, request.user_data);
+    }
+
+    for (uint32_t i = 0; result.names != NULL && i < result.num_names; i++) {
+        free(result.names[i].name);
+        free(result.names[i].longname);
+    }
+    if (result.names != NULL) {
+        DBG_SAFE_FREE(result.names);
+    }
+}
+
+/** Handle every whole packet in the input buffer. */
+static bool
+loop_dispatch(SftpLoopT *self) {
+    size_t offset = 0;
+    uint32_t length;
+    bool is_progress = false;
+
+    while (self->in_length - offset >= 4) {
+        length = be32_get(self->in_buf + offset);
+        if (length < 5 || length > LOOP_MAX_PACKET_SIZE) {
+            DBG_ERR("Invalid packet length %u from server", length);
+            self->is_broken = true;
+            break;
+        }
+        if (self->in_length - offset - 4 < length) {
+            break;
+        }
+
+        loop_handle_packet(self, self->in_buf + offset + 4, length);
+        offset += 4 + length;
+        is_progress = true;
+    }
+
+    memmove(self->in_buf, self->in_buf + offset, self->in_length - offset);
+    self->in_length -= offset;
+
+    return is_progress;
+}
+
+/** Complete a request with ``SSH_FX_CONNECTION_LOST``, it's already off the pending
+ * list. */
+static void
+loop_fail_request(SftpLoopT *self, LoopRequestT *request) {
+    LoopResultT result = {.id = request->id,
+                          .op = request->op,
+                          .status = SSH_FX_CONNECTION_LOST,
+                          .offset = request->offset,
+                          .length = request->length};
+
+    if (request->is_interactive) {
+        atomic_fetch_sub(self->num_interactive, 1);
+    }
+    loop_observe(self, request, result.status, 0);
+    if (request->callback != NULL) {
+        request->callback(self, &result, request->user_data);
+    }
+}
+
+/** Fail every pending request once the channel is gone. */
+static void
+loop_fail_pending(SftpLoopT *self) {
+    LoopRequestT request;
+
+    while (self->num_pending) {
+        request = self->pending[--self->num_pending];
+        loop_fail_request(self, &request);
+    }
+}
+
+/** Number of requests not written to the channel at all yet. */
+static size_t
+loop_num_queued(SftpLoopT *self) {
+    return self->queue_interactive.length - self->queue_interactive.head +
+           self->queue_bulk.length - self->queue_bulk.head;
+}
+
+/**
+ * Forget the broken channel. Requests that may have reached the server, or that
+ * carry one of its handles, complete with ``SSH_FX_CONNECTION_LOST``. The others
+ * stay queued for the next channel.
+ *
+ * :return: Number of requests failed.
+ */
+static size_t
+loop_drop_channel(SftpLoopT *self) {
+    LoopQueueT kept = {0};
+    LoopPacketT *packet;
+    LoopRequestT *lost = DBG_CALLOC(self->num_pending + 1, sizeof *lost);
+    size_t num_lost = 0;
+    bool is_kept;
+
+    if (self->packet_sending != NULL) {
+        loop_packet_free(self->packet_sending);
+        self->packet_sending = NULL;
+    }
+    while ((packet = loop_queue_pop(&self->queue_interactive)) != NULL) {
+        if (loop_op_is_portable(packet->op)) {
+            loop_queue_push(&kept, packet);
+        } else {
+            loop_packet_free(packet);
+        }
+    }
+    loop_queue_free(&self->queue_interactive);
+    self->queue_interactive = kept;
+
+    loop_queue_free(&self->queue_bulk);
+    self->queue_bulk = (LoopQueueT){0};
+    self->num_bulk_bytes_in_flight = 0;
+    self->in_length = 0;
+
+    for (size_t i = 0; i < self->num_pending;) {
+        is_kept = false;
+        for (size_t j = kept.head; j < kept.length && !is_kept; j++) {
+            is_kept = kept.packets[j]->id == self->pending[i].id;
+        }
+
+        if (is_kept) {
+            i++;
+        } else {
+            lost[num_lost++] = self->pending[i];
+            self->pending[i] = self->pending[--self->num_pending];
+        }
+    }
+
+    /* Callbacks may submit new requests, they go out on the next channel */
+    for (size_t i = 0; i < num_lost; i++) {
+        loop_fail_request(self, &lost[i]);
+    }
+
+    DBG_SAFE_FREE(lost);
+    return num_lost;
+}
+
+/** Tear the connection down and connect it again through the registry's hook, with
+ * the connection's lock held. */
+static void
+loop_reconnect(SftpLoopT *self) {
+    LoopConnT *conn = self->conn;
+
+    /* Nothing written from now on may block on a peer that's gone */
+    shutdown(ssh_get_fd(self->session_ssh), SHUT_RDWR);
+
+    DBG_INFO("Connection lost, reconnecting %s", "");
+    conn->is_lost = !conn->reconnect(self->session_ssh, conn->reconnect_data);
+    if (conn->is_lost) {
+        DBG_ERR("Couldn't reconnect, giving up on the connection %s", "");
+    }
+
+    /* Disconnecting freed every channel, whether or not the connection came back */
+    conn->generation++;
+}
+
+/**
+ * Bring a broken loop back on a new channel, reconnecting first if the connection
+ * itself is gone. The loop is dead if that fails.
+ *
+ * :return: Number of requests that failed along with the old channel.
+ */
+static size_t
+loop_recover(SftpLoopT *self) {
+    LoopConnT *conn = self->conn;
+    size_t num_lost = loop_drop_channel(self);
+    bool is_ok;
+
+    self->is_broken = false;
+    if (conn == NULL) {
+        self->is_dead = true;
+        return num_lost;
+    }
+
+    pthread_mutex_lock(self->lock);
+    if (loop_is_stale(self)) {
+        /* Another loop reconnected, which freed our channel along with its own */
+    } else if ((self->is_timed_out || !ssh_is_connected(self->session_ssh)) &&
+               conn->reconnect != NULL && !conn->is_lost) {
+        loop_reconnect(self);
+    } else {
+        /* Only our channel broke, or the connection can't be brought back */
+        ssh_channel_free(self->channel);
+    }
+    self->channel = NULL;
+    self->generation = conn->generation;
+    self->is_timed_out = false;
+    is_ok = !conn->is_lost && loop_open_channel(self);
+    pthread_mutex_unlock(self->lock);
+
+    self->is_dead = !is_ok;
+    self->last_activity_ms = loop_now_ms();
+    return num_lost;
+}
+
+/** Send keepalives while requests go unanswered and give up on the peer after the
+ * connection's dead-peer timeout. */
+static void
+loop_check_peer(SftpLoopT *self) {
+    uint64_t now = loop_now_ms(), idle;
+    uint32_t keepalive_interval, dead_timeout;
+
+    /* Nothing was written that the server owes us an answer to */
+    if (self->conn == NULL || self->num_pending == loop_num_queued(self)) {
+        self->last_activity_ms = now;
+        return;
+    }
+
+    keepalive_interval = self->conn->keepalive_interval;
+    dead_timeout = self->conn->dead_timeout;
+    idle = now - self->last_activity_ms;
+
+    if (dead_timeout && idle >= dead_timeout * 1000ULL) {
+        DBG_ERR("No answer from the server for %u seconds", dead_timeout);
+        self->is_timed_out = true;
+        self->is_broken = true;
+        return;
+    }
+
+    /* The server's SSH layer answers even while its SFTP server is busy */
+    if (keepalive_interval && idle >= keepalive_interval * 1000ULL &&
+        now - self->last_keepalive_ms >= keepalive_interval * 1000ULL) {
+        loop_enter(self);
+        if (!loop_is_stale(self)) {
+            ssh_send_keepalive(self->session_ssh);
+        }
+        loop_leave(self);
+        self->last_keepalive_ms = now;
+    }
+}
+
+/**
+ * Run the loop until every submitted request, including the ones submitted by
+ * callbacks while it runs, has completed.
+ *
+ * If the channel breaks, or the peer stops answering for the connection's dead-peer
+ * timeout, the loop opens a new channel, reconnecting first if the connection is
+ * gone. Requests the old channel took with it complete with
+ * ``SSH_FX_CONNECTION_LOST``, the rest go on over the new one.
+ *
+ * :return: ``CMD_OK`` or ``CMD_INTERNAL_ERROR`` if requests failed along with a
+ *     channel, ``SftpLoop_is_dead`` tells if the loop gave up for good.
+ *
+ * .. note:: Callbacks run without the connection lock held and must not call
+ *    ``SftpLoop_run`` themselves.
+ */
+CommandStatusE
+SftpLoop_run(SftpLoopT *self) {
+    struct pollfd poll_fd;
+    bool is_progress;
+    int32_t num_ready;
+    uint64_t time_poll_ns;
+    CommandStatusE result = CMD_OK;
+
+    self->last_activity_ms = loop_now_ms();
+    while (!self->is_dead && self->num_pending) {
+        if (self->is_broken) {
+            if (loop_recover(self)) {
+                result = CMD_INTERNAL_ERROR;
+            }
+            continue;
+        }
+
+        loop_enter(self);
+        if (loop_is_stale(self)) {
+            loop_leave(self);
+            self->is_broken = true;
+            continue;
+        }
+
+        is_progress = loop_flush(self);
+        is_progress |= loop_fill(self);
+
+        poll_fd.fd = ssh_get_fd(self->session_ssh);
+        poll_fd.events = POLLIN;
+        if (ssh_get_poll_flags(self->session_ssh) & SSH_WRITE_PENDING) {
+            poll_fd.events |= POLLOUT;
+        }
+        loop_leave(self);
+
+        is_progress |= loop_dispatch(self);
+        if (is_progress) {
+            self->last_activity_ms = loop_now_ms();
+        }
+        if (is_progress || self->is_broken) {
+            continue;
+        }
+
+        loop_check_peer(self);
+        if (self->is_broken) {
+            continue;
+        }
+
+        /* With a shared connection another thread may pull our data off the socket,
+         * so wake up regularly instead of trusting the socket's readiness */
+        time_poll_ns = stats_clock();
+        num_ready =
+            poll(&poll_fd, 1, self->lock != NULL ? LOOP_SHARED_POLL_MS : LOOP_POLL_MS);
+        stats_add_time(STATS_TIME_NETWORK, time_poll_ns);
+        if (num_ready < 0 && errno != EINTR) {
+            DBG_ERR("Couldn't poll connection: %s", strerror(errno));
+            self->is_broken = true;
+        } else if (num_ready > 0 && (poll_fd.revents & POLLIN)) {
+            /* Anything from the peer, a keepalive reply included, shows it's alive */
+            self->last_activity_ms = loop_now_ms();
+        }
+    }
+
+    if (self->is_dead) {
+        loop_fail_pending(self);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    return result;
+}
+
+/**
+ * Submit an OPEN request.
+ *
+ * :param pflags: ``SSH_FXF_*`` flags.
+ * :param permissions: Mode of the file if it gets created.
+ *
+ * :return: Id of the request or 0 if the loop's channel is gone, same for every
+ *     other ``SftpLoop_*`` request.
+ */
+uint32_t
+SftpLoop_open(SftpLoopT *self, const char *path, uint32_t pflags, uint32_t permissions,
+              LoopCallbackT callback, void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_OPEN, &id);
+    LoopAttrT attr = {.flags = SSH_FILEXFER_ATTR_PERMISSIONS, .permissions = permissions};
+
+    loop_put_string(packet, path);
+    loop_put_u32(packet, pflags);
+    loop_put_attr(packet, &attr);
+
+    return loop_submit(self, packet, id, LOOP_OP_OPEN, 0, 0, callback, user_data);
+}
+
+uint32_t
+SftpLoop_close(SftpLoopT *self, LoopHandleT *handle, LoopCallbackT callback,
+               void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_CLOSE, &id);
+
+    loop_put_bytes(packet, handle->bytes, handle->length);
+
+    return loop_submit(self, packet, id, LOOP_OP_CLOSE, 0, 0, callback, user_data);
+}
+
+/**
+ * Submit a READ request.
+ *
+ * .. note:: Servers may return less than ``length`` bytes before the end of the
+ *    file, the callback gets the requested range to ask for the rest.
+ */
+uint32_t
+SftpLoop_read(SftpLoopT *self, LoopHandleT *handle, uint64_t offset, uint32_t length,
+              LoopCallbackT callback, void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_READ, &id);
+
+    loop_put_bytes(packet, handle->bytes, handle->length);
+    loop_put_u64(packet, offset);
+    loop_put_u32(packet, length);
+
+    return loop_submit(self, packet, id, LOOP_OP_READ, offset, length, callback,
+                       user_data);
+}
+
+/** Submit a WRITE request, ``data`` is copied so it can be reused right away. */
+uint32_t
+SftpLoop_write(SftpLoopT *self, LoopHandleT *handle, uint64_t offset, const void *data,
+               uint32_t length, LoopCallbackT callback, void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_WRITE, &id);
+
+    loop_put_bytes(packet, handle->bytes, handle->length);
+    loop_put_u64(packet, offset);
+    loop_put_bytes(packet, data, length);
+
+    return loop_submit(self, packet, id, LOOP_OP_WRITE, offset, length, callback,
+                       user_data);
+}
+
+uint32_t
+SftpLoop_opendir(SftpLoopT *self, const char *path, LoopCallbackT callback,
+                 void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_OPENDIR, &id);
+
+    loop_put_string(packet, path);
+
+    return loop_submit(self, packet, id, LOOP_OP_OPENDIR, 0, 0, callback, user_data);
+}
+
+uint32_t
+SftpLoop_readdir(SftpLoopT *self, LoopHandleT *handle, LoopCallbackT callback,
+                 void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_READDIR, &id);
+
+    loop_put_bytes(packet, handle->bytes, handle->length);
+
+    return loop_submit(self, packet, id, LOOP_OP_READDIR, 0, 0, callback, user_data);
+}
+
+uint32_t
+SftpLoop_stat(SftpLoopT *self, const char *path, LoopCallbackT callback,
+              void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_STAT, &id);
+
+    loop_put_string(packet, path);
+
+    return loop_submit(self, packet, id, LOOP_OP_STAT, 0, 0, callback, user_data);
+}
+
+uint32_t
+SftpLoop_setstat(SftpLoopT *self, const char *path, LoopAttrT *attr,
+                 LoopCallbackT callback, void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_SETSTAT, &id);
+
+    loop_put_string(packet, path);
+    loop_put_attr(packet, attr);
+
+    return loop_submit(self, packet, id, LOOP_OP_SETSTAT, 0, 0, callback, user_data);
+}
+
+uint32_t
+SftpLoop_mkdir(SftpLoopT *self, const char *path, uint32_t permissions,
+               LoopCallbackT callback, void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_MKDIR, &id);
+    LoopAttrT attr = {.flags = SSH_FILEXFER_ATTR_PERMISSIONS, .permissions = permissions};
+
+    loop_put_string(packet, path);
+    loop_put_attr(packet, &attr);
+
+    return loop_submit(self, packet, id, LOOP_OP_MKDIR, 0, 0, callback, user_data);
+}
+
+uint32_t
+SftpLoop_remove(SftpLoopT *self, const char *path, LoopCallbackT callback,
+                void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_REMOVE, &id);
+
+    loop_put_string(packet, path);
+
+    return loop_submit(self, packet, id, LOOP_OP_REMOVE, 0, 0, callback, user_data);
+}
+
+/**
+ * Submit an EXTENDED request.
+ *
+ * :param request: Name of the extension, e.g. ``hardlink@openssh.com``.
+ * :param payload: Already encoded fields following the name.
+ */
+uint32_t
+SftpLoop_extended(SftpLoopT *self, const char *request, const void *payload,
+                  uint32_t len_payload, LoopCallbackT callback, void *user_data) {
+    uint32_t id;
+    LoopPacketT *packet = loop_packet_begin(self, SSH_FXP_EXTENDED, &id);
+
+    loop_put_string(packet, request);
+    loop_packet_reserve(packet, len_payload);
+    memcpy(packet->data + packet->length, payload, len_payload);
+    packet->length += len_payload;
+
+    return loop_submit(self, packet, id, LOOP_OP_EXTENDED, 0, 0, callback, user_data);
+}
+
+/**
+ * Callback copying the result to the ``LoopResultT`` passed as ``user_data``, for
+ * callers that just submit a few requests and run the loop.
+ *
+ * .. note:: ``data`` and ``names`` are cleared, they don't outlive the callback.
+ */
+void
+SftpLoop_store_result(SftpLoopT *self, LoopResultT *result, void *user_data) {
+    LoopResultT *stored = user_data;
+
+    (void)self;
+    *stored = *result;
+    stored->data = NULL;
+    stored->len_data = 0;
+    stored->names = NULL;
+    stored->num_names = 0;
+}
+
+/** Describe an ``SSH_FX_*`` status code. */
+const char *
+SftpLoop_status_str(uint32_t status) {
+    switch (status) {
+        case SSH_FX_OK:
+            return "Success";
+        case SSH_FX_EOF:
+            return "End of file";
+        case SSH_FX_NO_SUCH_FILE:
+            return "No such file";
+        case SSH_FX_PERMISSION_DENIED:
+            return "Permission denied";
+        case SSH_FX_FAILURE:
+            return "Failure";
+        case SSH_FX_BAD_MESSAGE:
+            return "Bad message";
+        case SSH_FX_NO_CONNECTION:
+            return "No connection";
+        case SSH_FX_CONNECTION_LOST:
+            return "Connection lost";
+        case SSH_FX_OP_UNSUPPORTED:
+            return "Operation unsupported";
+        default:
+            return "Unknown error";
+    }
+}
+
+/** Name of an operation, as in reports and traces. */
+const char *
+SftpLoop_op_str(LoopOpE op) {
+    switch (op) {
+        case LOOP_OP_OPEN:
+            return "open";
+        case LOOP_OP_CLOSE:
+            return "close";
+        case LOOP_OP_READ:
+            return "read";
+        case LOOP_OP_WRITE:
+            return "write";
+        case LOOP_OP_OPENDIR:
+            return "opendir";
+        case LOOP_OP_READDIR:
+            return "readdir";
+        case LOOP_OP_STAT:
+            return "stat";
+        case LOOP_OP_SETSTAT:
+            return "setstat";
+        case LOOP_OP_MKDIR:
+            return "mkdir";
+        case LOOP_OP_REMOVE:
+            return "remove";
+        case LOOP_OP_EXTENDED:
+            return "extended";
+        default:
+            return "unknown";
+    }
+}
+
+/** Directory listing in progress */
+typedef struct {
+    char *path;
+    LoopHandleT handle;
+    ListT *contents;
+    uint32_t status;
+} LoopReadDirT;
+
+static void
+loop_read_dir_callback(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    LoopReadDirT *read_dir = user_data;
+    char relative_path[BUF_SIZE_FS_PATH];
+    FileSystemT filesystem = {.relative_path = relative_path};
+
+    if (result->status != SSH_FX_OK) {
+        read_dir->status = result->status;
+        return;
+    }
+
+    for (uint32_t i = 0; i < result->num_names; i++) {
+        switch (result->names[i].attr.type) {
+            case SSH_FILEXFER_TYPE_REGULAR:
+                filesystem.type = FS_REG_FILE;
+                break;
+            case SSH_FILEXFER_TYPE_DIRECTORY:
+                filesystem.type = FS_DIRECTORY;
+                break;
+            default:
+                DBG_INFO("Ignoring filetype %d", result->names[i].attr.type);
+                continue;
+        }
+
+        filesystem.name = result->names[i].name;
+        snprintf(relative_path, BUF_SIZE_FS_PATH, "%s%c%s", read_dir->path,
+                 PATH_SEPARATOR, filesystem.name);
+        FileSystem_list_push(read_dir->contents, &filesystem);
+    }
+
+    /* The next READDIR goes out as soon as this batch is in */
+    if (!SftpLoop_readdir(loop, &read_dir->handle, loop_read_dir_callback, read_dir)) {
+        read_dir->status = SSH_FX_CONNECTION_LOST;
+    }
+}
+
+/**
+ * Read the contents of a remote directory through the loop.
+ *
+ * :param path: Path to the directory.
+ * :param status: Set to the ``SSH_FX_*`` status the read failed with, unless
+ *     ``NULL``. ``SSH_FX_CONNECTION_LOST`` if the channel broke on the way.
+ * :return: List of ``FileSystemT`` or ``NULL`` if the directory couldn't be read.
+ */
+ListT *
+SftpLoop_read_dir(SftpLoopT *self, char *path, uint32_t *status) {
+    LoopResultT result = {.status = SSH_FX_NO_CONNECTION};
+    LoopReadDirT read_dir = {.path = path};
+    CommandStatusE status_run = CMD_INTERNAL_ERROR;
+
+    if (SftpLoop_opendir(self, path, SftpLoop_store_result, &result)) {
+        status_run = SftpLoop_run(self);
+    }
+    if (status_run != CMD_OK || result.status != SSH_FX_OK) {
+        /* The directory may have been opened before the run failed */
+        if (result.status == SSH_FX_OK) {
+            SftpLoop_close(self, &result.handle, NULL, NULL);
+            SftpLoop_run(self);
+            result.status = SSH_FX_CONNECTION_LOST;
+        }
+        DBG_ERR("Couldn't open remote directory `%s`: %s", path,
+                SftpLoop_status_str(result.status));
+        if (status != NULL) {
+            *status = result.status;
+        }
+        return NULL;
+    }
+
+    read_dir.handle = result.handle;
+    read_dir.contents = List_new(1, sizeof(FileSystemT *));
+    if (SftpLoop_readdir(self, &read_dir.handle, loop_read_dir_callback, &read_dir)) {
+        SftpLoop_run(self);
+    }
+
+    SftpLoop_close(self, &read_dir.handle, NULL, NULL);
+    SftpLoop_run(self);
+
+    if (read_dir.status != SSH_FX_EOF) {
+        DBG_ERR("Couldn't read remote directory `%s`: %s", path,
+                SftpLoop_status_str(read_dir.status));
+        FileSystem_list_free(read_dir.contents);
+        if (status != NULL) {
+            *status = read_dir.status;
+        }
+        return NULL;
+    }
+
+    return read_dir.contents;
+}
+
+/**
+ * Run a shell command on a channel of the loop's connection and collect what it
+ * prints. The connection's lock is only held for short reads, so other loops keep
+ * going while the command runs.
+ *
+ * :param command: Command line run by the user's shell on the server.
+ * :param output: Filled with the command's standard output, NUL terminated and cut
+ *     at ``size - 1`` bytes.
+ * :param exit_status: Filled with the command's exit status, -1 if unknown.
+ *
+ * :return: ``CMD_OK`` once the command ran, ``CMD_INTERNAL_ERROR`` if it couldn't be
+ *     started or the connection went away.
+ */
+CommandStatusE
+SftpLoop_exec(SftpLoopT *self, const char *command, char *output, size_t size,
+              int32_t *exit_status) {
+    struct pollfd poll_fd = {.fd = -1, .events = POLLIN};
+    ssh_channel channel;
+    uint32_t generation;
+    size_t length = 0;
+    int32_t num_bytes_read = 0;
+    bool is_ok, is_eof = false, is_stale = false;
+
+    *exit_status = -1;
+    if (self->lock != NULL) {
+        pthread_mutex_lock(self->lock);
+    }
+    generation = self->conn != NULL ? self->conn->generation : 0;
+    channel = ssh_channel_new(self->session_ssh);
+    is_ok = channel != NULL && ssh_channel_open_session(channel) == SSH_OK &&
+            ssh_channel_request_exec(channel, command) == SSH_OK;
+    if (!is_ok) {
+        DBG_ERR("Couldn't run %s: %s", command, ssh_get_error(self->session_ssh));
+    }
+    if (self->lock != NULL) {
+        pthread_mutex_unlock(self->lock);
+    }
+
+    while (is_ok && !is_eof) {
+        if (self->lock != NULL) {
+            pthread_mutex_lock(self->lock);
+        }
+
+        /* A reconnect frees the channel along with every other one. The read doesn't
+         * wait, the loops sharing the connection get the lock while we do */
+        is_stale = self->conn != NULL && self->conn->generation != generation;
+        if (!is_stale) {
+            num_bytes_read = ssh_channel_read_timeout(channel, output + length,
+                                                      size - 1 - length, 0, 0);
+            is_eof = ssh_channel_is_eof(channel);
+            poll_fd.fd = ssh_get_fd(self->session_ssh);
+        }
+
+        if (self->lock != NULL) {
+            pthread_mutex_unlock(self->lock);
+        }
+
+        if (is_stale || num_bytes_read == SSH_ERROR) {
+            DBG_ERR("Lost the channel running %s", command);
+            is_ok = false;
+        } else if (num_bytes_read > 0) {
+            length += num_bytes_read;
+            is_eof |= length + 1 == size;
+        } else if (!is_eof) {
+            /* Another thread may pull our data off the socket, so wake up regularly */
+            poll(&poll_fd, 1, LOOP_SHARED_POLL_MS);
+        }
+    }
+    output[length] = '\0';
+
+    if (self->lock != NULL) {
+        pthread_mutex_lock(self->lock);
+    }
+    is_stale = self->conn != NULL && self->conn->generation != generation;
+    if (channel != NULL && !is_stale) {
+        if (is_ok) {
+            *exit_status = ssh_channel_get_exit_status(channel);
+        }
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+    }
+    if (self->lock != NULL) {
+        pthread_mutex_unlock(self->lock);
+    }
+
+    return is_ok ? CMD_OK : CMD_INTERNAL_ERROR;
+}
@@ -0,0 +1,523 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "seft_client.h"
+#include "seft_commands.h"
+#include "seft_debug.h"
+#include "seft_master.h"
+#include "seft_path.h"
+
+#define MAX_MASTER_ARGS 128
+
+/** A client attached to the master */
+typedef struct {
+    /** Connection to the client */
+    int fd;
+
+    /** Client's stdout, received over ``fd`` when it attached */
+    int fd_out;
+
+    /** Client's stderr, received over ``fd`` when it attached */
+    int fd_err;
+} MasterClientT;
+
+/** Write the whole buffer, ``MSG_NOSIGNAL`` keeps a dead peer from killing us. */
+static CommandStatusE
+master_write_all(int fd, const void *buf, size_t length) {
+    const char *cursor = buf;
+    ssize_t result;
+
+    while (length) {
+        result = send(fd, cursor, length, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return CMD_INTERNAL_ERROR;
+        }
+        cursor += result;
+        length -= result;
+    }
+
+    return CMD_OK;
+}
+
+/** Read exactly ``length`` bytes. */
+static CommandStatusE
+master_read_all(int fd, void *buf, size_t length) {
+    char *cursor = buf;
+    ssize_t result;
+
+    while (length) {
+        result = read(fd, cursor, length);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return CMD_INTERNAL_ERROR;
+        }
+        cursor += result;
+        length -= result;
+    }
+
+    return CMD_OK;
+}
+
+/**
+ * Get the path of the socket a master for ``host_name:port_id`` listens on.
+ * Sockets live in ``$XDG_RUNTIME_DIR``, or in ``/tmp/seft-<uid>`` which must be
+ * private to the user.
+ */
+CommandStatusE
+master_socket_path(char *host_name, uint32_t port_id, char *path_buf, size_t length) {
+    char dir_buf[BUF_SIZE_FS_PATH];
+    struct stat dir_stat;
+    char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+
+    if (runtime_dir != NULL && *runtime_dir) {
+        snprintf(dir_buf, BUF_SIZE_FS_PATH, "%s", runtime_dir);
+    } else {
+        snprintf(dir_buf, BUF_SIZE_FS_PATH, "/tmp/seft-%u", (uint32_t)getuid());
+        mkdir(dir_buf, S_IRWXU);
+
+        if (lstat(dir_buf, &dir_stat) || !S_ISDIR(dir_stat.st_mode) ||
+            dir_stat.st_uid != getuid() || (dir_stat.st_mode & (S_IRWXG | S_IRWXO))) {
+            DBG_ERR("Refusing to use %s for master sockets, it isn't private", dir_buf);
+            return CMD_INTERNAL_ERROR;
+        }
+    }
+
+    if ((size_t)snprintf(path_buf, length, "%s/seft-%s-%u.sock", dir_buf, host_name,
+                         port_id) >= length) {
+        DBG_ERR("Master socket path for %s is too long", host_name);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    return CMD_OK;
+}
+
+/** Send our stdout and stderr to the master, it writes command output into them. */
+static CommandStatusE
+master_send_fds(int fd) {
+    char byte = 0;
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof fds)] = {0};
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr message = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control,
+                             .msg_controllen = sizeof control};
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(header), fds, sizeof fds);
+
+    return sendmsg(fd, &message, MSG_NOSIGNAL) == 1 ? CMD_OK : CMD_INTERNAL_ERROR;
+}
+
+/** Receive the stdout and stderr of a newly attached client. */
+static CommandStatusE
+master_recv_fds(MasterClientT *client) {
+    char byte;
+    int fds[2];
+    char control[CMSG_SPACE(sizeof fds)] = {0};
+    struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+    struct msghdr message = {.msg_iov = &iov,
+                             .msg_iovlen = 1,
+                             .msg_control = control,
+                             .msg_controllen = sizeof control};
+    struct cmsghdr *header;
+
+    if (recvmsg(client->fd, &message, MSG_CMSG_CLOEXEC) != 1) {
+        return CMD_INTERNAL_ERROR;
+    }
+
+    header = CMSG_FIRSTHDR(&message);
+    if (header == NULL || header->cmsg_type != SCM_RIGHTS ||
+        header->cmsg_len != CMSG_LEN(sizeof fds)) {
+        return CMD_INTERNAL_ERROR;
+    }
+
+    memcpy(fds, CMSG_DATA(header), sizeof fds);
+    client->fd_out = fds[0];
+    client->fd_err = fds[1];
+
+    return CMD_OK;
+}
+
+/**
+ * Attach to the master serving ``host_name:port_id``.
+ *
+ * :return: Connection to the master or ``-1`` if no master is running.
+ *     A socket left behind by a dead master is removed.
+ */
+int
+master_attach(char *host_name, uint32_t port_id) {
+    int fd;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    if (master_socket_path(host_name, port_id, addr.sun_path, sizeof addr.sun_path) !=
+        CMD_OK) {
+        return -1;
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof addr)) {
+        if (errno == ECONNREFUSED) {
+            DBG_INFO("Removing stale master socket %s", addr.sun_path);
+            unlink(addr.sun_path);
+        }
+        close(fd);
+        return -1;
+    }
+
+    if (master_send_fds(fd) != CMD_OK) {
+        close(fd);
+        return -1;
+    }
+
+    DBG_INFO("Attached to master at %s", addr.sun_path);
+    return fd;
+}
+
+/** Detach from the master, the master keeps running. */
+void
+master_detach(int master_fd) {
+    if (master_fd >= 0) {
+        close(master_fd);
+    }
+}
+
+/**
+ * Run a command in the master.
+ *
+ * The command line is sent as ``u32 total length`` followed by ``u32 argc`` and
+ * ``argc`` length prefixed strings. The master answers with the ``i32`` status.
+ *
+ * :return: Status of the command, ``CMD_NOT_EXECUTED`` if the master went away.
+ */
+CommandStatusE
+master_forward(int master_fd, char **arg_vec, uint32_t length) {
+    char request[BUF_SIZE_MASTER_REQUEST];
+    uint32_t len_request = sizeof length;
+    uint32_t len_arg;
+    int32_t status;
+
+    memcpy(request, &length, sizeof length);
+    for (uint32_t i = 0; i < length; i++) {
+        len_arg = strlen(arg_vec[i]);
+        if (len_request + sizeof len_arg + len_arg > BUF_SIZE_MASTER_REQUEST) {
+            DBG_ERR("Command line too long to forward: %u arguments", length);
+            return CMD_INVALID_ARGS_COUNT;
+        }
+
+        memcpy(request + len_request, &len_arg, sizeof len_arg);
+        memcpy(request + len_request + sizeof len_arg, arg_vec[i], len_arg);
+        len_request += sizeof len_arg + len_arg;
+    }
+
+    /* Output of the master lands in the same fds, keep it in order */
+    fflush(stdout);
+    fflush(stderr);
+
+    if (master_write_all(master_fd, &len_request, sizeof len_request) != CMD_OK ||
+        master_write_all(master_fd, request, len_request) != CMD_OK ||
+        master_read_all(master_fd, &status, sizeof status) != CMD_OK) {
+        DBG_ERR("Lost connection to master %s", "");
+        return CMD_NOT_EXECUTED;
+    }
+
+    return status;
+}
+
+/** Handle ``master [--check|--stop]`` sent by a client. */
+static CommandStatusE
+master_control(MasterClientT *client, char **arg_vec, uint32_t length, size_t num_clients,
+               bool *is_running) {
+    if (length > 1 && !strcmp(arg_vec[1], "--stop")) {
+        dprintf(client->fd_out, "Stopping master %d\n", getpid());
+        *is_running = false;
+        return CMD_OK;
+    }
+
+    if (length > 1 && strcmp(arg_vec[1], "--check")) {
+        return CMD_INVALID_ARGS_TYPE;
+    }
+
+    dprintf(client->fd_out, "Master running (pid %d, %zu clients attached)\n", getpid(),
+            num_clients);
+    return CMD_OK;
+}
+
+/**
+ * Read a command from a client, run it with the client's stdout and stderr and
+ * send the status back.
+ *
+ * :return: ``CMD_OK`` if the client should stay attached.
+ */
+static CommandStatusE
+master_handle_request(MasterClientT *client, MasterHooksT *hooks, size_t num_clients,
+                      bool *is_running) {
+    char request[BUF_SIZE_MASTER_REQUEST];
+    char *arg_vec[MAX_MASTER_ARGS + 1] = {0};
+    uint32_t len_request, length, len_arg, offset;
+    int32_t status = CMD_OK;
+    int saved_out, saved_err;
+
+    if (master_read_all(client->fd, &len_request, sizeof len_request) != CMD_OK ||
+        len_request < sizeof length || len_request > BUF_SIZE_MASTER_REQUEST ||
+        master_read_all(client->fd, request, len_request) != CMD_OK) {
+        return CMD_NOT_EXECUTED;
+    }
+
+    memcpy(&length, request, sizeof length);
+    offset = sizeof length;
+    if (length > MAX_MASTER_ARGS) {
+        return CMD_NOT_EXECUTED;
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        if (offset + sizeof len_arg > len_request) {
+            length = i;
+            break;
+        }
+        memcpy(&len_arg, request + offset, sizeof len_arg);
+        offset += sizeof len_arg;
+        if (len_arg > len_request - offset) {
+            length = i;
+            break;
+        }
+
+        arg_vec[i] = strndup(request + offset, len_arg);
+        offset += len_arg;
+    }
+
+    if (length && !strcmp(arg_vec[0], MASTER_COMMAND)) {
+        status = master_control(client, arg_vec, length, num_clients, is_running);
+    } else {
+        saved_out = dup(STDOUT_FILENO);
+        saved_err = dup(STDERR_FILENO);
+        dup2(client->fd_out, STDOUT_FILENO);
+        dup2(client->fd_err, STDERR_FILENO);
+
+        status = hooks->dispatch(arg_vec, length);
+
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_out);
+        close(saved_err);
+    }
+
+    for (uint32_t i = 0; i < length; i++) {
+        free(arg_vec[i]);
+    }
+
+    return master_write_all(client->fd, &status, sizeof status);
+}
+
+static void
+master_client_close(MasterClientT *client) {
+    close(client->fd);
+    close(client->fd_out);
+    close(client->fd_err);
+}
+
+/** Serve attached clients until stopped or idle for ``persist`` seconds. */
+static void
+master_serve(int listen_fd, uint32_t persist, MasterHooksT *hooks) {
+    struct pollfd fds[MAX_MASTER_CLIENTS + 1];
+    MasterClientT clients[MAX_MASTER_CLIENTS];
+    MasterClientT client;
+    size_t num_clients = 0;
+    bool is_running = true;
+    int result;
+
+    while (is_running) {
+        fds[0] = (struct pollfd){.fd = listen_fd, .events = POLLIN};
+        for (size_t i = 0; i < num_clients; i++) {
+            fds[i + 1] = (struct pollfd){.fd = clients[i].fd, .events = POLLIN};
+        }
+
+        result = poll(fds, num_clients + 1,
+                      num_clients || !persist ? -1 : (int)persist * 1000);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            DBG_INFO("Master idle for %u seconds, exiting", persist);
+            break;
+        }
+
+        /* Iterating backwards, so a removed client is swapped with one already seen */
+        for (size_t i = num_clients; i-- > 0;) {
+            if (!(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+
+            if (master_handle_request(&clients[i], hooks, num_clients,
+                                      &is_running) != CMD_OK) {
+                master_client_close(&clients[i]);
+                clients[i] = clients[--num_clients];
+            }
+        }
+
+        if (fds[0].revents & POLLIN) {
+            client.fd = accept(listen_fd, NULL, NULL);
+            if (client.fd < 0) {
+                continue;
+            }
+            fcntl(client.fd, F_SETFD, FD_CLOEXEC);
+
+            if (num_clients == MAX_MASTER_CLIENTS || master_recv_fds(&client) != CMD_OK) {
+                close(client.fd);
+                continue;
+            }
+            clients[num_clients++] = client;
+        }
+    }
+
+    for (size_t i = 0; i < num_clients; i++) {
+        master_client_close(&clients[i]);
+    }
+}
+
+/** Open the listening socket of the master, removing a stale one first. */
+static int
+master_listen(char *socket_path) {
+    int fd;
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+    snprintf(addr.sun_path, sizeof addr.sun_path, "%s", socket_path);
+    unlink(socket_path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof addr) || chmod(socket_path, S_IRWXU) ||
+        listen(fd, MAX_MASTER_CLIENTS)) {
+        DBG_ERR("Couldn't listen on %s: %s", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/** Body of the master process, never returns. */
+static void
+master_run(ConnectOptionsT *options, uint32_t persist, MasterHooksT *hooks,
+           int ready_fd) {
+    char socket_path[sizeof((struct sockaddr_un *)0)->sun_path];
+    char status = 1;
+    int listen_fd, null_fd;
+
+    /* May prompt for the passphrase, the terminal is still ours at this point */
+    hooks->open_sessions();
+
+    if (master_socket_path(options->host_name, options->port_id, socket_path,
+                           sizeof socket_path) != CMD_OK ||
+        (listen_fd = master_listen(socket_path)) < 0) {
+        write(ready_fd, &status, 1);
+        hooks->close_sessions();
+        exit(EXIT_FAILURE);
+    }
+
+    setsid();
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    status = 0;
+    write(ready_fd, &status, 1);
+    close(ready_fd);
+
+    null_fd = open("/dev/null", O_RDWR);
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    close(null_fd);
+
+    master_serve(listen_fd, persist, hooks);
+
+    close(listen_fd);
+    unlink(socket_path);
+    hooks->close_sessions();
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * Start a master process holding the sessions of ``options`` and attach to it.
+ *
+ * The master is double forked so it is never left as a zombie of this process.
+ * It authenticates (prompting on this terminal if needed), starts listening on
+ * its socket and only then detaches from the terminal.
+ *
+ * :param options: Options of the connection the master holds.
+ * :param persist: Seconds the master stays alive without attached clients,
+ *     ``0`` to keep it running until ``master --stop``.
+ * :param hooks: Callbacks opening, closing and using the sessions.
+ *
+ * :return: Connection to the master or ``-1`` if it couldn't be started.
+ */
+int
+master_spawn(ConnectOptionsT *options, uint32_t persist, MasterHooksT *hooks) {
+    int ready_pipe[2];
+    char status = 1;
+    pid_t pid;
+
+    if (pipe(ready_pipe)) {
+        DBG_ERR("Couldn't create pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+
+    pid = fork();
+    if (pid < 0) {
+        DBG_ERR("Couldn't fork master: %s", strerror(errno));
+        close(ready_pipe[0]);
+        close(ready_pipe[1]);
+        return -1;
+    }
+
+    if (!pid) {
+        close(ready_pipe[0]);
+        if (fork()) {
+            _exit(EXIT_SUCCESS);
+        }
+        master_run(options, persist, hooks, ready_pipe[1]);
+    }
+
+    close(ready_pipe[1]);
+    waitpid(pid, NULL, 0);
+
+    if (read(ready_pipe[0], &status, 1) != 1 || status) {
+        DBG_ERR("Master for %s failed to start", options->host_name);
+        close(ready_pipe[0]);
+        return -1;
+    }
+    close(ready_pipe[0]);
+
+    return master_attach(options->host_name, options->port_id);
+}
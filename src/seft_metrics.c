@@ -0,0 +1,406 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libssh/sftp.h>
+
+#include "seft_debug.h"
+#include "seft_loop.h"
+#include "seft_metrics.h"
+#include "seft_utils.h"
+
+#define BUF_SIZE_METRICS_PATH 4096
+
+#define BYTES_PER_MIB (1024.0 * 1024.0)
+
+/** Latencies of an operation and its requests in flight */
+typedef struct {
+    atomic_uint_fast64_t buckets[METRICS_NUM_BUCKETS];
+    atomic_uint_fast64_t sum_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t num_errors;
+    atomic_int_fast64_t num_in_flight;
+} MetricsOpT;
+
+/** Counts of a histogram copied at once, so that its quantiles and total agree */
+typedef struct {
+    uint64_t buckets[METRICS_NUM_BUCKETS];
+    uint64_t count;
+} MetricsSnapshotT;
+
+static MetricsOpT metrics_ops[LOOP_NUM_OPS];
+
+/** Bytes of the answers to READ requests and of the WRITE requests acknowledged */
+static atomic_uint_fast64_t metrics_bytes_read = 0;
+static atomic_uint_fast64_t metrics_bytes_written = 0;
+
+/** When the first request was submitted, the rates are taken from there */
+static atomic_uint_fast64_t metrics_time_start_ns = 0;
+static atomic_uint_fast64_t metrics_time_start_unix = 0;
+
+/** Bytes and time of the previous ``stats``, for the rate since then */
+static uint64_t metrics_last_bytes = 0;
+static uint64_t metrics_last_ns = 0;
+static pthread_mutex_t metrics_last_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/** Upper bounds of the Prometheus buckets, in seconds */
+static const double metrics_bounds_s[] = {0.0001, 0.00025, 0.0005, 0.001, 0.0025,
+                                          0.005,  0.01,    0.025,  0.05,  0.1,
+                                          0.25,   0.5,     1,      2.5,   5,
+                                          10,     30,      60};
+
+/** Thread writing the metrics file every ``interval_s`` seconds */
+static struct {
+    pthread_t thread;
+    bool is_running;
+    bool is_stopping;
+    char path[BUF_SIZE_METRICS_PATH];
+    uint32_t interval_s;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} metrics_writer = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint64_t
+metrics_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/** Bucket of ``value``: exact below ``METRICS_SUB_BUCKETS``, then each power of two
+ * split in ``METRICS_SUB_BUCKETS`` buckets of equal width. */
+static size_t
+metrics_bucket(uint64_t value) {
+    uint32_t exponent;
+
+    if (value < METRICS_SUB_BUCKETS) {
+        return value;
+    }
+
+    exponent = 63 - __builtin_clzll(value);
+    if (exponent > METRICS_MAX_EXPONENT) {
+        return METRICS_NUM_BUCKETS - 1;
+    }
+
+    return (exponent - METRICS_SUB_BUCKET_BITS + 1) * METRICS_SUB_BUCKETS +
+           (value >> (exponent - METRICS_SUB_BUCKET_BITS)) - METRICS_SUB_BUCKETS;
+}
+
+/** Least value past the bucket ``index``. */
+static uint64_t
+metrics_bucket_end(size_t index) {
+    uint32_t shift;
+
+    if (index < METRICS_SUB_BUCKETS) {
+        return index + 1;
+    }
+
+    shift = index / METRICS_SUB_BUCKETS - 1;
+    return (uint64_t)(METRICS_SUB_BUCKETS + index % METRICS_SUB_BUCKETS + 1) << shift;
+}
+
+/** Count a request as in flight, from its submission on. */
+void
+metrics_request_submitted(LoopOpE op) {
+    uint64_t time_start = 0;
+
+    if (!atomic_load_explicit(&metrics_time_start_ns, memory_order_relaxed) &&
+        atomic_compare_exchange_strong(&metrics_time_start_ns, &time_start,
+                                       metrics_now_ns())) {
+        atomic_store(&metrics_time_start_unix, time(NULL));
+    }
+
+    atomic_fetch_add_explicit(&metrics_ops[op].num_in_flight, 1, memory_order_relaxed);
+}
+
+/**
+ * Count a request once it got its answer, or was given up on.
+ *
+ * :param latency_ns: Time since its submission.
+ * :param num_bytes: Bytes of data it carried, in the answer of a READ or in a WRITE.
+ */
+void
+metrics_request_done(LoopOpE op, uint32_t status, uint64_t latency_ns,
+                     uint64_t num_bytes) {
+    MetricsOpT *self = &metrics_ops[op];
+    uint64_t max_ns = atomic_load_explicit(&self->max_ns, memory_order_relaxed);
+
+    atomic_fetch_sub_explicit(&self->num_in_flight, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&self->buckets[metrics_bucket(latency_ns)], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&self->sum_ns, latency_ns, memory_order_relaxed);
+    while (latency_ns > max_ns &&
+           !atomic_compare_exchange_weak(&self->max_ns, &max_ns, latency_ns)) {
+    }
+
+    /* The end of a file isn't a failure of the READ asking past it */
+    if (status != SSH_FX_OK && status != SSH_FX_EOF) {
+        atomic_fetch_add_explicit(&self->num_errors, 1, memory_order_relaxed);
+    }
+
+    if (op == LOOP_OP_READ) {
+        atomic_fetch_add_explicit(&metrics_bytes_read, num_bytes, memory_order_relaxed);
+    } else if (op == LOOP_OP_WRITE) {
+        atomic_fetch_add_explicit(&metrics_bytes_written, num_bytes,
+                                  memory_order_relaxed);
+    }
+}
+
+static void
+metrics_snapshot(MetricsOpT *self, MetricsSnapshotT *snapshot) {
+    snapshot->count = 0;
+    for (size_t i = 0; i < METRICS_NUM_BUCKETS; i++) {
+        snapshot->buckets[i] = atomic_load_explicit(&self->buckets[i],
+                                                    memory_order_relaxed);
+        snapshot->count += snapshot->buckets[i];
+    }
+}
+
+/** Latency under which ``quantile`` of the requests were answered, as the end of
+ * its bucket, in ns. */
+static uint64_t
+metrics_quantile(const MetricsSnapshotT *snapshot, double quantile, uint64_t max_ns) {
+    uint64_t rank = quantile * snapshot->count, seen = 0;
+
+    for (size_t i = 0; i < METRICS_NUM_BUCKETS; i++) {
+        seen += snapshot->buckets[i];
+        if (seen > rank) {
+            return MIN(metrics_bucket_end(i) - 1, max_ns);
+        }
+    }
+
+    return max_ns;
+}
+
+static double
+metrics_seconds(void) {
+    uint64_t time_start = atomic_load(&metrics_time_start_ns);
+
+    return time_start ? MAX((metrics_now_ns() - time_start) / 1e9, 1e-6) : 0;
+}
+
+/** Print the latency quantiles of every operation used so far, the requests in
+ * flight and the throughput, since the first request and since the last call. */
+void
+metrics_print(FILE *file) {
+    MetricsSnapshotT *snapshot = DBG_MALLOC(sizeof *snapshot);
+    uint64_t num_bytes = atomic_load(&metrics_bytes_read) +
+                         atomic_load(&metrics_bytes_written);
+    uint64_t now = metrics_now_ns(), max_ns, num_bytes_last, time_last;
+    double seconds = metrics_seconds();
+    MetricsOpT *op;
+
+    fprintf(file, "%-9s %10s %8s %9s %9s %9s %9s %9s %7s\n", "op", "count", "flight",
+            "p50 ms", "p90 ms", "p99 ms", "p99.9 ms", "max ms", "errors");
+    for (size_t i = 0; i < LOOP_NUM_OPS; i++) {
+        op = &metrics_ops[i];
+        metrics_snapshot(op, snapshot);
+        if (!snapshot->count && !atomic_load(&op->num_in_flight)) {
+            continue;
+        }
+
+        max_ns = atomic_load(&op->max_ns);
+        fprintf(file,
+                "%-9s %10" PRIu64 " %8" PRIdFAST64 " %9.3f %9.3f %9.3f %9.3f %9.3f "
+                "%7" PRIu64 "\n",
+                SftpLoop_op_str(i), snapshot->count, atomic_load(&op->num_in_flight),
+                metrics_quantile(snapshot, 0.5, max_ns) / 1e6,
+                metrics_quantile(snapshot, 0.9, max_ns) / 1e6,
+                metrics_quantile(snapshot, 0.99, max_ns) / 1e6,
+                metrics_quantile(snapshot, 0.999, max_ns) / 1e6, max_ns / 1e6,
+                (uint64_t)atomic_load(&op->num_errors));
+    }
+    DBG_SAFE_FREE(snapshot);
+
+    pthread_mutex_lock(&metrics_last_lock);
+    num_bytes_last = metrics_last_bytes;
+    time_last = metrics_last_ns ? metrics_last_ns : atomic_load(&metrics_time_start_ns);
+    metrics_last_bytes = num_bytes;
+    metrics_last_ns = now;
+    pthread_mutex_unlock(&metrics_last_lock);
+
+    fprintf(file,
+            "Read %.1f MiB, wrote %.1f MiB, %.2f MiB/s over %.1f s, %.2f MiB/s since "
+            "the last stats\n",
+            atomic_load(&metrics_bytes_read) / BYTES_PER_MIB,
+            atomic_load(&metrics_bytes_written) / BYTES_PER_MIB,
+            seconds ? num_bytes / BYTES_PER_MIB / seconds : 0, seconds,
+            time_last ? (num_bytes - num_bytes_last) / BYTES_PER_MIB /
+                            MAX((now - time_last) / 1e9, 1e-6)
+                      : 0);
+}
+
+/** Write an operation's histogram, the Prometheus buckets are cumulative and each
+ * counts the requests whose own bucket ends within the bound. */
+static void
+metrics_write_histogram(FILE *file, LoopOpE op, MetricsSnapshotT *snapshot) {
+    const char *name = SftpLoop_op_str(op);
+    uint64_t count = 0;
+    size_t index = 0;
+
+    metrics_snapshot(&metrics_ops[op], snapshot);
+    for (size_t i = 0; i < sizeof metrics_bounds_s / sizeof *metrics_bounds_s; i++) {
+        for (; index < METRICS_NUM_BUCKETS &&
+               metrics_bucket_end(index) <= metrics_bounds_s[i] * 1e9;
+             index++) {
+            count += snapshot->buckets[index];
+        }
+        fprintf(file,
+                "seft_sftp_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %" PRIu64
+                "\n",
+                name, metrics_bounds_s[i], count);
+    }
+    fprintf(file,
+            "seft_sftp_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %" PRIu64
+            "\n"
+            "seft_sftp_request_duration_seconds_sum{op=\"%s\"} %.9f\n"
+            "seft_sftp_request_duration_seconds_count{op=\"%s\"} %" PRIu64 "\n",
+            name, snapshot->count, name,
+            atomic_load(&metrics_ops[op].sum_ns) / 1e9, name, snapshot->count);
+}
+
+/**
+ * Write the metrics in the Prometheus text format, as read by node_exporter's textfile
+ * collector. The file is written next to ``path`` and renamed over it, so a scrape
+ * never reads it half written.
+ */
+CommandStatusE
+metrics_write_prometheus(const char *path) {
+    char path_tmp[BUF_SIZE_METRICS_PATH + 8];
+    MetricsSnapshotT *snapshot;
+    FILE *file;
+
+    snprintf(path_tmp, sizeof path_tmp, "%s.tmp", path);
+    file = fopen(path_tmp, "w");
+    if (file == NULL) {
+        DBG_ERR("Couldn't write %s: %s", path_tmp, strerror(errno));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    snapshot = DBG_MALLOC(sizeof *snapshot);
+    fprintf(file, "# HELP seft_sftp_request_duration_seconds Time from submitting an "
+                  "SFTP request to its answer.\n"
+                  "# TYPE seft_sftp_request_duration_seconds histogram\n");
+    for (size_t i = 0; i < LOOP_NUM_OPS; i++) {
+        metrics_write_histogram(file, i, snapshot);
+    }
+    DBG_SAFE_FREE(snapshot);
+
+    fprintf(file, "# HELP seft_sftp_request_errors_total SFTP requests that failed.\n"
+                  "# TYPE seft_sftp_request_errors_total counter\n");
+    for (size_t i = 0; i < LOOP_NUM_OPS; i++) {
+        fprintf(file, "seft_sftp_request_errors_total{op=\"%s\"} %" PRIu64 "\n",
+                SftpLoop_op_str(i), (uint64_t)atomic_load(&metrics_ops[i].num_errors));
+    }
+
+    fprintf(file, "# HELP seft_sftp_requests_in_flight SFTP requests waiting for their "
+                  "answer.\n"
+                  "# TYPE seft_sftp_requests_in_flight gauge\n");
+    for (size_t i = 0; i < LOOP_NUM_OPS; i++) {
+        fprintf(file, "seft_sftp_requests_in_flight{op=\"%s\"} %" PRIdFAST64 "\n",
+                SftpLoop_op_str(i), atomic_load(&metrics_ops[i].num_in_flight));
+    }
+
+    fprintf(file,
+            "# HELP seft_sftp_bytes_total Bytes read from and written to SFTP servers.\n"
+            "# TYPE seft_sftp_bytes_total counter\n"
+            "seft_sftp_bytes_total{direction=\"read\"} %" PRIu64 "\n"
+            "seft_sftp_bytes_total{direction=\"write\"} %" PRIu64 "\n"
+            "# HELP seft_start_time_seconds Unix time of the first SFTP request.\n"
+            "# TYPE seft_start_time_seconds gauge\n"
+            "seft_start_time_seconds %" PRIu64 "\n",
+            (uint64_t)atomic_load(&metrics_bytes_read),
+            (uint64_t)atomic_load(&metrics_bytes_written),
+            (uint64_t)atomic_load(&metrics_time_start_unix));
+
+    if (fclose(file) || rename(path_tmp, path)) {
+        DBG_ERR("Couldn't write %s: %s", path, strerror(errno));
+        unlink(path_tmp);
+        return CMD_INTERNAL_ERROR;
+    }
+
+    return CMD_OK;
+}
+
+static void *
+metrics_writer_thread(void *arg) {
+    struct timespec deadline;
+
+    (void)arg;
+    pthread_mutex_lock(&metrics_writer.lock);
+    while (!metrics_writer.is_stopping) {
+        metrics_write_prometheus(metrics_writer.path);
+
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += metrics_writer.interval_s;
+        while (!metrics_writer.is_stopping &&
+               pthread_cond_timedwait(&metrics_writer.cond, &metrics_writer.lock,
+                                      &deadline) != ETIMEDOUT) {
+        }
+    }
+
+    /* A last write, with what happened since the previous one */
+    metrics_write_prometheus(metrics_writer.path);
+    pthread_mutex_unlock(&metrics_writer.lock);
+
+    return NULL;
+}
+
+/**
+ * Write the metrics to ``path`` every ``interval_s`` seconds, until
+ * ``metrics_stop_writer``. A writer already running switches to the new path and
+ * interval.
+ */
+void
+metrics_start_writer(const char *path, uint32_t interval_s) {
+    pthread_condattr_t attr;
+
+    pthread_mutex_lock(&metrics_writer.lock);
+    snprintf(metrics_writer.path, sizeof metrics_writer.path, "%s", path);
+    metrics_writer.interval_s = MAX(interval_s, 1);
+    if (metrics_writer.is_running) {
+        pthread_cond_signal(&metrics_writer.cond);
+        pthread_mutex_unlock(&metrics_writer.lock);
+        return;
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&metrics_writer.cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    metrics_writer.is_stopping = false;
+    metrics_writer.is_running =
+        !pthread_create(&metrics_writer.thread, NULL, metrics_writer_thread, NULL);
+    if (!metrics_writer.is_running) {
+        DBG_ERR("Couldn't start writing metrics to %s", path);
+        pthread_cond_destroy(&metrics_writer.cond);
+    }
+    pthread_mutex_unlock(&metrics_writer.lock);
+}
+
+/** Stop the writer, if any, once it wrote the metrics a last time. */
+void
+metrics_stop_writer(void) {
+    pthread_mutex_lock(&metrics_writer.lock);
+    if (!metrics_writer.is_running) {
+        pthread_mutex_unlock(&metrics_writer.lock);
+        return;
+    }
+    metrics_writer.is_stopping = true;
+    pthread_cond_signal(&metrics_writer.cond);
+    pthread_mutex_unlock(&metrics_writer.lock);
+
+    pthread_join(metrics_writer.thread, NULL);
+    pthread_cond_destroy(&metrics_writer.cond);
+    metrics_writer.is_running = false;
+}
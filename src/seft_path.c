@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -13,6 +14,8 @@
 #include "seft_debug.h"
 #include "seft_list.h"
 #include "seft_path.h"
+#include "seft_trace.h"
+#include "seft_utils.h"
 
 /**
  * Split a path string into a list of path components and return the sliced string.
@@ -109,8 +112,6 @@ path_remove_suffix(char *path_str) {
         }
     }
 
-    puts(path_str);
-    printf("%zu %zu\n", len_path_str, num_slash_suffix);
     path_str[len_path_str - num_slash_suffix] = '\0';
 }
 
@@ -135,8 +136,10 @@ path_join(char *path_buf, size_t num_paths, ...) {
         path_remove_prefix(fs_name);
         path_remove_suffix(fs_name);
 
+        /* Terminated here, the buffer isn't necessarily zeroed past the path */
         if (path_len) {
             path_buf[path_len++] = PATH_SEPARATOR;
+            path_buf[path_len] = '\0';
         }
 
         path_len += strlen(fs_name);
@@ -185,7 +188,7 @@ path_split(const char *path_str, size_t length) {
     }
     path_buf[path_buf_len] = '\0';
     List_push(path_list, path_buf, path_buf_len + 1);
-    free(path_buf);
+    DBG_SAFE_FREE(path_buf);
 
     return path_list;
 }
@@ -290,34 +293,56 @@ path_replace(char *path_str, char *path_head_to_replace, char *path_head_replace
     }
 }
 
-/** Create parent directories of the given path if they don't exist. */
+/**
+ * Copy of a path with its first ``path_head_to_replace`` replaced, see
+ * ``path_replace``. Unlike it, the result has room for a longer replacement.
+ *
+ * :return: The new path, it must be freed by the caller.
+ */
+char *
+path_replace_dup(const char *path_str, char *path_head_to_replace,
+                 char *path_head_replacement) {
+    char *replaced = DBG_MALLOC(strlen(path_str) + strlen(path_head_replacement) + 2);
+
+    strcpy(replaced, path_str);
+    path_replace(replaced, path_head_to_replace, path_head_replacement, 1);
+
+    return replaced;
+}
+
+/** Create the directory at the given path and its parents if they don't exist. */
 uint8_t
 path_mkdir_parents(char *path_str, size_t length) {
-    struct stat _dir_stats;
-    int8_t result;
-    char *path_buf;
-    ListT *path_list = path_split(path_str, length);
-    path_buf = List_get(path_list, 0);
-
-    for (size_t i = 0; i < path_list->length; i++) {
-        if (i) {
-            FS_JOIN_PATH(path_buf, List_get(path_list, i));
-        }
+    struct stat dir_stat;
+    char path_buf[BUF_SIZE_FS_PATH];
+    int32_t result;
 
-        if (stat(path_buf, &_dir_stats) == -1) {
-            /* Directory does not exist */
+    length = MIN(length, sizeof path_buf - 1);
+    memcpy(path_buf, path_str, length);
+    path_buf[length] = '\0';
+
+    /* Every separator after the first character ends a parent, cut the path there */
+    for (size_t i = 1; i <= length; i++) {
+        if (i < length && path_buf[i] != PATH_SEPARATOR) {
+            continue;
+        }
 
-            if ((result = mkdir(path_buf, FS_CREATE_PERM))) {
-                DBG_ERR("Couldn't create directory %s: Error code: %d\n", path_buf,
-                        result);
+        path_buf[i] = '\0';
+        TRACE_START(time_trace_ns);
+        result = stat(path_buf, &dir_stat);
+        TRACE_FS("stat", time_trace_ns, 0);
+        if (result == -1) {
+            TRACE_START(time_mkdir_ns);
+            result = mkdir(path_buf, FS_CREATE_PERM);
+            TRACE_FS("mkdir", time_mkdir_ns, 0);
+            if (result && errno != EEXIST) {
+                DBG_ERR("Couldn't create directory %s: %s", path_buf, strerror(errno));
                 return 0;
             }
         }
+        path_buf[i] = i < length ? PATH_SEPARATOR : '\0';
     }
 
-    DBG_SAFE_FREE(path_buf);
-    List_free(path_list);
-
     return 1;
 }
 
@@ -334,8 +359,9 @@ FileSystem_from_path(FileSystemT *filesystem, char *name, char *path) {
 FileSystemT *
 FileSystem_new(void) {
     FileSystemT *filesystem = DBG_MALLOC(sizeof *filesystem);
-    filesystem->name = DBG_MALLOC(BUF_SIZE_FS_NAME);
-    filesystem->relative_path = DBG_MALLOC(BUF_SIZE_FS_PATH);
+    filesystem->name = DBG_CALLOC(BUF_SIZE_FS_NAME, sizeof *filesystem->name);
+    filesystem->relative_path =
+        DBG_CALLOC(BUF_SIZE_FS_PATH, sizeof *filesystem->relative_path);
 
     return filesystem;
 }
@@ -369,7 +395,7 @@ FileSystem_list_free(ListT *self) {
         FileSystem_free(List_get(self, i));
     }
 
-    DBG_SAFE_FREE(self);
+    List_free(self);
 }
 
 void
@@ -419,7 +445,7 @@ path_read_remote_dir(ssh_session session_ssh, sftp_session session_sftp, char *p
                 filesystem->type = FS_DIRECTORY;
                 break;
             default:
-                DBG_INFO("Ignoring filetype %d\n", attr->type);
+                DBG_INFO("Ignoring filetype %d", attr->type);
                 continue;
         }
 
@@ -449,12 +475,15 @@ path_read_local_dir(char *path) {
     FileSystemT *filesystem = FileSystem_new();
     char *attr_relative_path = DBG_CALLOC(BUF_SIZE_FS_PATH, sizeof *attr_relative_path);
     ListT *path_content_list = List_new(1, sizeof(FileSystemT *));
+    TRACE_START(time_trace_ns);
 
     dir = opendir(path);
+    TRACE_FS("opendir", time_trace_ns, 0);
     if (dir == NULL) {
         DBG_ERR("Couldn't open local directory `%s`", path);
         return NULL;
     }
+    TRACE_START(time_readdir_ns);
 
     while ((attr = readdir(dir)) != NULL) {
         FS_JOIN_PATH(attr_relative_path, path, attr->d_name);
@@ -467,7 +496,7 @@ path_read_local_dir(char *path) {
                 filesystem->type = FS_DIRECTORY;
                 break;
             default:
-                DBG_INFO("Ignoring filetype %d\n", attr->d_type);
+                DBG_INFO("Ignoring filetype %d", attr->d_type);
                 continue;
         }
         FileSystem_from_path(filesystem, attr->d_name, attr_relative_path);
@@ -478,6 +507,8 @@ path_read_local_dir(char *path) {
     DBG_SAFE_FREE(attr_relative_path);
     FileSystem_free(filesystem);
 
+    /* The whole listing as one span, its size the number of entries */
+    TRACE_FS("readdir", time_readdir_ns, path_content_list->length);
     result = closedir(dir);
     if (result) {
         DBG_ERR("Couldn't close directory %s", path);
@@ -0,0 +1,440 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_checksum.h"
+#include "seft_client.h"
+#include "seft_commands.h"
+#include "seft_debug.h"
+#include "seft_dedup.h"
+#include "seft_jobs.h"
+#include "seft_limit.h"
+#include "seft_list.h"
+#include "seft_loop.h"
+#include "seft_path.h"
+#include "seft_pool.h"
+#include "seft_stats.h"
+#include "seft_trace.h"
+#include "seft_utils.h"
+
+/** Slot the calling thread works on, ``NULL`` outside of pool workers */
+static __thread PoolSlotT *current_slot = NULL;
+
+/** A file or directory waiting to be copied */
+typedef struct {
+    char *path_source;
+    char *path_dest;
+    FileTypesT type;
+} PoolWorkItemT;
+
+/** State shared by the workers of a parallel copy */
+typedef struct {
+    SessionPoolT *pool;
+    bool is_remote_source;
+
+    /** Background job the copy runs for, workers stop taking work once it's cancelled */
+    JobT *job;
+
+    /** Algorithm the files copied are verified with */
+    ChecksumAlgoE checksum;
+
+    /** Shares of the bandwidth limit each file copied takes */
+    uint32_t weight;
+
+    /** Cap on the bandwidth of the whole copy, ``NULL`` if it has none */
+    LimitCapT *cap;
+
+    /** Manifest the files uploaded are deduplicated against, ``NULL`` if they aren't */
+    DedupT *dedup;
+
+    /** Counters the files copied are added to, ``NULL`` if they aren't counted */
+    StatsT *stats;
+
+    /** Trace the spans of the copy are recorded to, ``NULL`` if it isn't traced */
+    TraceT *trace;
+
+    /** Stack of ``PoolWorkItemT`` waiting for a worker */
+    ListT *queue;
+
+    /** Number of items being processed, new items may still come out of them */
+    size_t num_active;
+
+    size_t num_files;
+    size_t num_failed;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} PoolCopyT;
+
+typedef struct {
+    PoolCopyT *copy;
+    PoolSlotT *slot;
+} PoolWorkerT;
+
+/**
+ * Open a pool of SFTP channels to the server of an existing connection.
+ *
+ * :param options: Options of the existing connection, used to open more
+ *     connections in ``POOL_MODE_CONNECTIONS``.
+ * :param session_ssh: The existing connection.
+ * :param session_sftp: The existing SFTP channel, it becomes the first slot.
+ * :param num_slots: Number of channels wanted.
+ * :param mode: Whether extra channels share ``session_ssh`` or get their own
+ *     connection.
+ *
+ * .. note:: If some channels can't be opened the pool is returned with less slots.
+ */
+SessionPoolT *
+SessionPool_new(ConnectOptionsT *options, ssh_session session_ssh,
+                sftp_session session_sftp, size_t num_slots, PoolModeE mode) {
+    SessionPoolT *self = DBG_CALLOC(1, sizeof *self);
+    ConnectOptionsT slot_options;
+    PoolSlotT *slot;
+    pthread_mutex_t *session_lock = SftpLoop_session_lock(session_ssh);
+
+    num_slots = MIN(MAX(num_slots, 1), MAX_POOL_SLOTS);
+    self->mode = mode;
+    for (size_t i = 0; i < MAX_POOL_SLOTS; i++) {
+        pthread_mutex_init(&self->locks[i], NULL);
+    }
+
+    /* Slots on the existing connection share its lock with every other user of it,
+     * e.g. background jobs and the foreground commands */
+    self->slots[0] = (PoolSlotT){.session_ssh = session_ssh,
+                                 .session_sftp = session_sftp,
+                                 .lock = session_lock != NULL ? session_lock
+                                                              : &self->locks[0]};
+    self->slots[0].loop = SftpLoop_new(session_ssh, self->slots[0].lock);
+    if (self->slots[0].loop != NULL) {
+        SftpLoop_set_bulk(self->slots[0].loop, true);
+    }
+    self->num_slots = 1;
+
+    for (size_t i = 1; i < num_slots; i++) {
+        slot = &self->slots[i];
+
+        if (mode == POOL_MODE_CONNECTIONS) {
+            slot_options = *options;
+            slot->session_ssh = try_ssh_init(&slot_options);
+            memset(slot_options.passphrase, 0, BUF_SIZE_PASSPHRASE);
+            if (slot->session_ssh == NULL) {
+                break;
+            }
+            slot->is_owner_ssh = true;
+            slot->lock = &self->locks[i];
+        } else {
+            slot->session_ssh = session_ssh;
+            slot->lock = self->slots[0].lock;
+        }
+
+        /* Transfers only go through the loop, the blocking session is kept for
+         * callers that still want one */
+        slot->session_sftp = session_sftp;
+        slot->loop = SftpLoop_new(slot->session_ssh, slot->lock);
+        if (slot->loop == NULL) {
+            if (slot->is_owner_ssh) {
+                clean_ssh_session(slot->session_ssh);
+            }
+            break;
+        }
+        SftpLoop_set_bulk(slot->loop, true);
+        self->num_slots++;
+    }
+
+    if (self->num_slots < num_slots) {
+        DBG_ERR("Only %zu of %zu channels could be opened", self->num_slots, num_slots);
+    }
+
+    return self;
+}
+
+/** Close the channels and connections opened by the pool. */
+void
+SessionPool_free(SessionPoolT *self) {
+    for (size_t i = self->num_slots; i-- > 0;) {
+        if (self->slots[i].loop != NULL) {
+            SftpLoop_free(self->slots[i].loop);
+        }
+        if (self->slots[i].is_owner_ssh) {
+            clean_ssh_session(self->slots[i].session_ssh);
+        }
+    }
+
+    for (size_t i = 0; i < MAX_POOL_SLOTS; i++) {
+        pthread_mutex_destroy(&self->locks[i]);
+    }
+    DBG_SAFE_FREE(self);
+}
+
+/** Make the calling thread work on ``slot``, ``NULL`` to leave the pool. */
+void
+SessionPool_bind_thread(PoolSlotT *slot) {
+    current_slot = slot;
+    SftpLoop_bind_thread(slot != NULL ? slot->loop : NULL);
+}
+
+/** Lock the connection of the calling thread, a no-op outside of pool workers. */
+void
+session_lock(void) {
+    if (current_slot != NULL) {
+        pthread_mutex_lock(current_slot->lock);
+    }
+}
+
+/** Unlock the connection locked by ``session_lock``. */
+void
+session_unlock(void) {
+    if (current_slot != NULL) {
+        pthread_mutex_unlock(current_slot->lock);
+    }
+}
+
+/** Check if the calling thread is a pool worker. */
+bool
+session_is_pooled(void) {
+    return current_slot != NULL;
+}
+
+/** Queue an item, takes ownership of both paths. */
+static void
+pool_copy_push(PoolCopyT *copy, char *path_source, char *path_dest, FileTypesT type) {
+    PoolWorkItemT item = {path_source, path_dest, type};
+
+    pthread_mutex_lock(&copy->lock);
+    List_push(copy->queue, &item, sizeof item);
+    pthread_cond_signal(&copy->cond);
+    pthread_mutex_unlock(&copy->lock);
+}
+
+/** Create the destination of a directory and queue its contents. */
+static CommandStatusE
+pool_copy_dir(PoolCopyT *copy, PoolSlotT *slot, PoolWorkItemT *item) {
+    ListT *dir_contents;
+    FileSystemT *filesystem;
+    char *path_dest;
+    LoopResultT result = {.status = SSH_FX_NO_CONNECTION};
+
+    if (copy->is_remote_source) {
+        mkdir(item->path_dest, FS_CREATE_PERM);
+        dir_contents = SftpLoop_read_dir(slot->loop, item->path_source, NULL);
+    } else {
+        if (SftpLoop_mkdir(slot->loop, item->path_dest, FS_CREATE_PERM,
+                           SftpLoop_store_result, &result)) {
+            SftpLoop_run(slot->loop);
+        }
+        /* SFTP v3 servers report an existing directory as a plain failure */
+        if (result.status != SSH_FX_OK && result.status != SSH_FX_FAILURE &&
+            result.status != SSH_FX_FILE_ALREADY_EXISTS) {
+            DBG_ERR("Couldn't create directory %s: %s", item->path_dest,
+                    SftpLoop_status_str(result.status));
+        }
+
+        dir_contents = path_read_local_dir(item->path_source);
+    }
+
+    if (dir_contents == NULL) {
+        return CMD_INTERNAL_ERROR;
+    }
+
+    for (size_t i = 0; i < dir_contents->length; i++) {
+        filesystem = List_get(dir_contents, i);
+        if (path_is_dotted(filesystem->name, strlen(filesystem->name))) {
+            continue;
+        }
+
+        path_dest = DBG_CALLOC(BUF_SIZE_FS_PATH, sizeof *path_dest);
+        snprintf(path_dest, BUF_SIZE_FS_PATH, "%s%c%s", item->path_dest, PATH_SEPARATOR,
+                 filesystem->name);
+        pool_copy_push(copy, strdup(filesystem->relative_path), path_dest,
+                       filesystem->type);
+    }
+
+    FileSystem_list_free(dir_contents);
+    return CMD_OK;
+}
+
+static CommandStatusE
+pool_copy_item(PoolCopyT *copy, PoolSlotT *slot, PoolWorkItemT *item) {
+    switch (item->type) {
+        case FS_DIRECTORY:
+            return pool_copy_dir(copy, slot, item);
+        case FS_REG_FILE:
+            if (copy->is_remote_source) {
+                return copy_file_from_remote_to_local(slot->session_ssh,
+                                                      slot->session_sftp,
+                                                      item->path_source, item->path_dest);
+            }
+            return copy_file_from_local_to_remote(slot->session_ssh, slot->session_sftp,
+                                                  item->path_source, item->path_dest);
+        default:
+            return CMD_OK;
+    }
+}
+
+/** Pull items off the shared queue until every item has been processed. */
+static void *
+pool_copy_worker(void *arg) {
+    PoolWorkerT *worker = arg;
+    PoolCopyT *copy = worker->copy;
+    PoolSlotT *slot_previous = current_slot;
+    JobT *job_previous = job_current();
+    ChecksumAlgoE checksum_previous = checksum_current();
+    uint32_t weight_previous = limit_current_weight();
+    LimitCapT *cap_previous = limit_current_cap();
+    DedupT *dedup_previous = dedup_current();
+    StatsT *stats_previous = stats_current();
+    TraceT *trace_previous = trace_current();
+    PoolWorkItemT *item;
+    CommandStatusE status;
+
+    SessionPool_bind_thread(worker->slot);
+    job_bind_thread(copy->job);
+    checksum_bind_thread(copy->checksum);
+    limit_bind_thread(copy->weight);
+    limit_bind_cap(copy->cap);
+    dedup_bind_thread(copy->dedup);
+    stats_bind_thread(copy->stats);
+    trace_bind_thread(copy->trace);
+
+    for (;;) {
+        pthread_mutex_lock(&copy->lock);
+        while (List_is_empty(copy->queue) && copy->num_active) {
+            pthread_cond_wait(&copy->cond, &copy->lock);
+        }
+
+        if (List_is_empty(copy->queue)) {
+            pthread_cond_broadcast(&copy->cond);
+            pthread_mutex_unlock(&copy->lock);
+            break;
+        }
+
+        item = List_pop(copy->queue);
+        copy->num_active++;
+        pthread_mutex_unlock(&copy->lock);
+
+        /* Drain the queue without copying once the job is cancelled */
+        status = job_is_cancelled() ? CMD_NOT_EXECUTED
+                                    : pool_copy_item(copy, worker->slot, item);
+
+        pthread_mutex_lock(&copy->lock);
+        copy->num_active--;
+        copy->num_files += item->type == FS_REG_FILE;
+        copy->num_failed += status != CMD_OK;
+        if (!copy->num_active && List_is_empty(copy->queue)) {
+            pthread_cond_broadcast(&copy->cond);
+        }
+        pthread_mutex_unlock(&copy->lock);
+
+        DBG_SAFE_FREE(item->path_source);
+        DBG_SAFE_FREE(item->path_dest);
+        DBG_SAFE_FREE(item);
+    }
+
+    /* The last resort worker runs on the thread that called ``SessionPool_copy`` */
+    trace_bind_thread(trace_previous);
+    stats_bind_thread(stats_previous);
+    dedup_bind_thread(dedup_previous);
+    limit_bind_cap(cap_previous);
+    limit_bind_thread(weight_previous);
+    checksum_bind_thread(checksum_previous);
+    job_bind_thread(job_previous);
+    SessionPool_bind_thread(slot_previous);
+    return NULL;
+}
+
+/**
+ * Copy a directory tree with one worker per channel of the pool. Workers take
+ * directories and files off a shared queue, so directory reads and transfers of
+ * different channels overlap.
+ *
+ * :param abs_path_source: Path of the tree to copy.
+ * :param abs_path_dest: Path the tree is copied to.
+ * :param is_remote_source: Whether the source is on the server.
+ */
+CommandStatusE
+SessionPool_copy(SessionPoolT *self, char *abs_path_source, char *abs_path_dest,
+                 bool is_remote_source) {
+    PoolCopyT copy = {.pool = self,
+                      .is_remote_source = is_remote_source,
+                      .job = job_current(),
+                      .checksum = checksum_current(),
+                      .weight = limit_current_weight(),
+                      .cap = limit_current_cap(),
+                      .dedup = dedup_current(),
+                      .stats = stats_current(),
+                      .trace = trace_current()};
+    PoolWorkerT workers[MAX_POOL_SLOTS];
+    pthread_t threads[MAX_POOL_SLOTS];
+    size_t num_threads = 0;
+    LoopResultT attr = {.status = SSH_FX_NO_CONNECTION};
+    SftpLoopT *loop;
+    struct stat local_stat;
+    bool is_dir;
+
+    /* Only directories are worth spreading over workers, and only once the first
+     * slot has its event loop */
+    if (self->slots[0].loop == NULL) {
+        is_dir = false;
+    } else if (is_remote_source) {
+        loop = SftpLoop_for_session(self->slots[0].session_ssh);
+        if (loop != NULL &&
+            SftpLoop_stat(loop, abs_path_source, SftpLoop_store_result, &attr)) {
+            SftpLoop_run(loop);
+        }
+        is_dir = attr.status == SSH_FX_OK &&
+                 attr.attr.type == SSH_FILEXFER_TYPE_DIRECTORY;
+    } else {
+        is_dir = !stat(abs_path_source, &local_stat) && S_ISDIR(local_stat.st_mode);
+    }
+
+    if (!is_dir && is_remote_source) {
+        return copy_from_remote_to_local(self->slots[0].session_ssh,
+                                         self->slots[0].session_sftp, abs_path_source,
+                                         abs_path_dest);
+    } else if (!is_dir) {
+        return copy_from_local_to_remote(self->slots[0].session_ssh,
+                                         self->slots[0].session_sftp, abs_path_source,
+                                         abs_path_dest);
+    }
+
+    copy.queue = List_new(1, sizeof(PoolWorkItemT));
+    pthread_mutex_init(&copy.lock, NULL);
+    pthread_cond_init(&copy.cond, NULL);
+    pool_copy_push(&copy, strdup(abs_path_source), strdup(abs_path_dest), FS_DIRECTORY);
+
+    for (size_t i = 0; i < self->num_slots; i++) {
+        workers[i] = (PoolWorkerT){&copy, &self->slots[i]};
+        if (pthread_create(&threads[num_threads], NULL, pool_copy_worker, &workers[i])) {
+            DBG_ERR("Couldn't start worker %zu", i);
+            continue;
+        }
+        num_threads++;
+    }
+
+    /* No worker could be started, do the work on this thread */
+    if (!num_threads) {
+        workers[0] = (PoolWorkerT){&copy, &self->slots[0]};
+        pool_copy_worker(&workers[0]);
+    }
+
+    for (size_t i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    printf("Copied %zu files over %zu %s, %zu failed\n", copy.num_files, self->num_slots,
+           self->mode == POOL_MODE_CHANNELS ? "channels" : "connections",
+           copy.num_failed);
+
+    pthread_cond_destroy(&copy.cond);
+    pthread_mutex_destroy(&copy.lock);
+    List_free(copy.queue);
+
+    return copy.num_failed ? CMD_INTERNAL_ERROR : CMD_OK;
+}
@@ -0,0 +1,707 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_client.h"
+#include "seft_debug.h"
+#include "seft_list.h"
+#include "seft_loop.h"
+#include "seft_path.h"
+#include "seft_push.h"
+#include "seft_utils.h"
+
+/** Size of the description of why a host failed */
+#define BUF_SIZE_PUSH_ERROR 128
+
+/** What a slot of the ring asks every host to do */
+typedef enum {
+    /** Create the directory ``path`` */
+    PUSH_OP_MKDIR,
+
+    /** Open ``path`` for writing, the data of the file follows */
+    PUSH_OP_FILE,
+
+    /** Write ``length`` bytes of ``data`` at ``offset`` of the open file */
+    PUSH_OP_DATA,
+
+    /** Close the open file once its writes completed */
+    PUSH_OP_END,
+} PushOpE;
+
+/** An operation read from the local tree, shared by every host */
+typedef struct {
+    PushOpE op;
+    char *path;
+    uint32_t permissions;
+    uint64_t offset;
+    uint32_t length;
+
+    /** The slot's part of the ring's data, ``LOOP_CHUNK_SIZE`` bytes */
+    uint8_t *data;
+} PushSlotT;
+
+typedef struct PushS PushT;
+typedef struct PushHostS PushHostT;
+
+/** A file open on a host, freed once it's closed */
+typedef struct {
+    PushHostT *host;
+    char *path;
+    LoopHandleT handle;
+
+    /** First failure of the file, its remaining writes are skipped after one */
+    uint32_t status;
+    size_t num_writes;
+} PushFileT;
+
+/** A host the files are pushed to, with a worker thread and a connection of its own */
+struct PushHostS {
+    PushT *push;
+    ConnectOptionsT options;
+    ssh_session session_ssh;
+    SftpLoopT *loop;
+    pthread_t thread;
+    bool is_thread;
+
+    /** Sequence number of the next slot the host submits */
+    uint64_t seq_next;
+
+    /** Set once the host can't go on, it no longer holds the ring back then */
+    bool is_failed;
+    char error[BUF_SIZE_PUSH_ERROR];
+
+    /** File the slots being submitted belong to, writes wait for its OPEN */
+    PushFileT *file;
+    bool is_open_pending;
+
+    size_t num_files;
+    size_t num_files_failed;
+    uint64_t num_bytes;
+    double time_done;
+};
+
+/**
+ * A push of a local tree to several hosts. The local files are read once into a
+ * ring of slots every host consumes at its own pace, a slot is reused once the
+ * slowest host still going submitted it.
+ *
+ * Every field but ``slots[].data`` contents is guarded by ``lock``.
+ */
+struct PushS {
+    PushSlotT slots[PUSH_RING_SLOTS];
+    uint8_t *data;
+
+    /** Sequence number of the next slot the reader fills */
+    uint64_t seq_head;
+
+    /** Set once the reader filled its last slot */
+    bool is_done;
+
+    PushHostT hosts[MAX_PUSH_HOSTS];
+    size_t num_hosts;
+
+    size_t num_read_failed;
+    uint64_t num_bytes_read;
+    double time_start;
+
+    pthread_mutex_t lock;
+
+    /** Signalled when the reader fills a slot and when a host takes one */
+    pthread_cond_t cond;
+};
+
+/** Give up on a host, must be called with the lock held. */
+static void
+push_host_fail(PushHostT *self, const char *error) {
+    if (!self->is_failed) {
+        snprintf(self->error, sizeof self->error, "%s", error);
+        self->is_failed = true;
+    }
+    pthread_cond_broadcast(&self->push->cond);
+}
+
+/** Account for a file once a host closed it or gave up on it, must be called with
+ * the lock held. */
+static void
+push_file_done(PushFileT *self, uint32_t status) {
+    if (self->status == SSH_FX_OK) {
+        self->status = status;
+    }
+    if (self->status != SSH_FX_OK) {
+        DBG_ERR("Couldn't push %s to %s: %s", self->path, self->host->options.host_name,
+                SftpLoop_status_str(self->status));
+        self->host->num_files_failed++;
+    }
+
+    DBG_SAFE_FREE(self->path);
+    DBG_SAFE_FREE(self);
+}
+
+static void push_on_open(SftpLoopT *loop, LoopResultT *result, void *user_data);
+static void push_on_write(SftpLoopT *loop, LoopResultT *result, void *user_data);
+static void push_on_close(SftpLoopT *loop, LoopResultT *result, void *user_data);
+
+/**
+ * Submit the slots filled since the host last looked, until the window of the file
+ * is full or its OPEN is still pending. Must be called with the lock held, on the
+ * thread of the host.
+ */
+static void
+push_host_pump(PushHostT *self) {
+    PushT *push = self->push;
+    PushSlotT *slot;
+    uint32_t id;
+
+    while (!self->is_failed && self->seq_next < push->seq_head) {
+        slot = &push->slots[self->seq_next % PUSH_RING_SLOTS];
+        id = 1;
+
+        switch (slot->op) {
+            case PUSH_OP_MKDIR:
+                /* SFTP v3 servers report an existing directory as a plain failure */
+                id = SftpLoop_mkdir(self->loop, slot->path, slot->permissions, NULL,
+                                    NULL);
+                break;
+            case PUSH_OP_FILE:
+                self->file = DBG_CALLOC(1, sizeof *self->file);
+                self->file->host = self;
+                self->file->path = strdup(slot->path);
+                self->is_open_pending = true;
+                self->num_files++;
+                id = SftpLoop_open(self->loop, slot->path,
+                                   SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
+                                   slot->permissions, push_on_open, self->file);
+                break;
+            case PUSH_OP_DATA:
+                if (self->is_open_pending) {
+                    return;
+                } else if (self->file->status != SSH_FX_OK) {
+                    break;
+                } else if (self->file->num_writes >= LOOP_WINDOW) {
+                    return;
+                }
+                id = SftpLoop_write(self->loop, &self->file->handle, slot->offset,
+                                    slot->data, slot->length, push_on_write, self->file);
+                self->file->num_writes += id != 0;
+                break;
+            case PUSH_OP_END:
+                /* A CLOSE would be written ahead of the WRITEs still queued */
+                if (self->is_open_pending || self->file->num_writes) {
+                    return;
+                }
+                if (self->file->status == SSH_FX_OK) {
+                    id = SftpLoop_close(self->loop, &self->file->handle, push_on_close,
+                                        self->file);
+                } else {
+                    push_file_done(self->file, SSH_FX_OK);
+                }
+                if (id) {
+                    self->file = NULL;
+                }
+                break;
+        }
+
+        if (!id) {
+            push_host_fail(self, "lost the connection");
+            return;
+        }
+
+        /* The WRITE packet holds a copy of the data, the slot may be reused */
+        self->seq_next++;
+        pthread_cond_broadcast(&push->cond);
+    }
+}
+
+static void
+push_on_open(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    PushFileT *file = user_data;
+    PushHostT *host = file->host;
+
+    (void)loop;
+    pthread_mutex_lock(&host->push->lock);
+    file->status = result->status;
+    file->handle = result->handle;
+    host->is_open_pending = false;
+    push_host_pump(host);
+    pthread_mutex_unlock(&host->push->lock);
+}
+
+static void
+push_on_write(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    PushFileT *file = user_data;
+    PushHostT *host = file->host;
+
+    (void)loop;
+    pthread_mutex_lock(&host->push->lock);
+    file->num_writes--;
+    if (result->status == SSH_FX_OK) {
+        host->num_bytes += result->length;
+    } else if (file->status == SSH_FX_OK) {
+        file->status = result->status;
+    }
+    push_host_pump(host);
+    pthread_mutex_unlock(&host->push->lock);
+}
+
+static void
+push_on_close(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    PushFileT *file = user_data;
+    PushHostT *host = file->host;
+
+    (void)loop;
+    pthread_mutex_lock(&host->push->lock);
+    push_file_done(file, result->status);
+    pthread_mutex_unlock(&host->push->lock);
+}
+
+/**
+ * Connect to a host unless the calling thread already did, then submit the slots of
+ * the ring as the reader fills them until the last one or a failure of the host.
+ */
+static void *
+push_host_worker(void *arg) {
+    PushHostT *self = arg;
+    PushT *push = self->push;
+    CommandStatusE result;
+
+    /* The passphrase is known by now, so this never prompts */
+    if (self->session_ssh == NULL) {
+        self->session_ssh = try_ssh_init(&self->options);
+    }
+
+    /* The connection belongs to this thread alone, its loop needs no lock */
+    if (self->session_ssh != NULL) {
+        self->loop = SftpLoop_new(self->session_ssh, NULL);
+    }
+
+    pthread_mutex_lock(&push->lock);
+    if (self->loop == NULL) {
+        push_host_fail(self, "couldn't connect");
+    }
+
+    while (!self->is_failed) {
+        push_host_pump(self);
+        if (self->is_failed) {
+            break;
+        } else if (SftpLoop_num_pending(self->loop)) {
+            pthread_mutex_unlock(&push->lock);
+            result = SftpLoop_run(self->loop);
+            pthread_mutex_lock(&push->lock);
+            if (result != CMD_OK) {
+                push_host_fail(self, "lost the connection");
+            }
+        } else if (push->is_done && self->seq_next == push->seq_head) {
+            break;
+        } else {
+            pthread_cond_wait(&push->cond, &push->lock);
+        }
+    }
+    pthread_mutex_unlock(&push->lock);
+
+    /* Callbacks of the requests still in flight submit nothing after a failure */
+    if (self->loop != NULL) {
+        SftpLoop_run(self->loop);
+    }
+
+    pthread_mutex_lock(&push->lock);
+    if (self->file != NULL) {
+        push_file_done(self->file, SSH_FX_CONNECTION_LOST);
+        self->file = NULL;
+    }
+    self->time_done = get_time_monotonic();
+    pthread_mutex_unlock(&push->lock);
+
+    if (self->loop != NULL) {
+        SftpLoop_free(self->loop);
+    }
+    if (self->session_ssh != NULL) {
+        clean_ssh_session(self->session_ssh);
+    }
+
+    return NULL;
+}
+
+/**
+ * Wait until every host still going took the slot the reader fills next, must be
+ * called with the lock held.
+ *
+ * :return: The slot, ``NULL`` once every host failed.
+ */
+static PushSlotT *
+push_reserve(PushT *self) {
+    PushSlotT *slot;
+    uint64_t seq_min;
+    bool is_live;
+
+    for (;;) {
+        seq_min = self->seq_head;
+        is_live = false;
+        for (size_t i = 0; i < self->num_hosts; i++) {
+            if (!self->hosts[i].is_failed) {
+                seq_min = MIN(seq_min, self->hosts[i].seq_next);
+                is_live = true;
+            }
+        }
+
+        if (!is_live) {
+            return NULL;
+        } else if (self->seq_head - seq_min < PUSH_RING_SLOTS) {
+            break;
+        }
+
+        /* The slowest host is a whole ring behind */
+        pthread_cond_wait(&self->cond, &self->lock);
+    }
+
+    slot = &self->slots[self->seq_head % PUSH_RING_SLOTS];
+    if (slot->path != NULL) {
+        DBG_SAFE_FREE(slot->path);
+        slot->path = NULL;
+    }
+
+    return slot;
+}
+
+/** Hand the reserved slot to the hosts, must be called with the lock held. */
+static void
+push_publish(PushT *self) {
+    self->seq_head++;
+    pthread_cond_broadcast(&self->cond);
+}
+
+/**
+ * Queue an operation without data for every host.
+ *
+ * :return: false once every host failed.
+ */
+static bool
+push_emit(PushT *self, PushOpE op, const char *path, uint32_t permissions) {
+    PushSlotT *slot;
+
+    pthread_mutex_lock(&self->lock);
+    slot = push_reserve(self);
+    if (slot != NULL) {
+        slot->op = op;
+        slot->path = path != NULL ? strdup(path) : NULL;
+        slot->permissions = permissions;
+        push_publish(self);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    return slot != NULL;
+}
+
+/**
+ * Read a local file once into the ring, a chunk at a time.
+ *
+ * :return: false once every host failed.
+ */
+static bool
+push_emit_file(PushT *self, const char *path_local, const char *path_remote,
+               uint32_t permissions) {
+    PushSlotT *slot;
+    uint64_t offset = 0;
+    ssize_t num_bytes_read;
+    int32_t fd;
+
+    fd = open(path_local, O_RDONLY);
+    if (fd < 0) {
+        DBG_ERR("Couldn't open local file %s", path_local);
+        self->num_read_failed++;
+        return true;
+    }
+
+    if (!push_emit(self, PUSH_OP_FILE, path_remote, permissions)) {
+        close(fd);
+        return false;
+    }
+
+    for (;;) {
+        pthread_mutex_lock(&self->lock);
+        slot = push_reserve(self);
+        pthread_mutex_unlock(&self->lock);
+        if (slot == NULL) {
+            close(fd);
+            return false;
+        }
+
+        /* No host looks at a slot before it's published */
+        num_bytes_read = pread(fd, slot->data, LOOP_CHUNK_SIZE, offset);
+        if (num_bytes_read <= 0) {
+            break;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        slot->op = PUSH_OP_DATA;
+        slot->offset = offset;
+        slot->length = num_bytes_read;
+        push_publish(self);
+        pthread_mutex_unlock(&self->lock);
+        offset += num_bytes_read;
+    }
+
+    if (num_bytes_read < 0) {
+        DBG_ERR("Couldn't read local file %s, the hosts got %lu bytes of it", path_local,
+                (unsigned long)offset);
+        self->num_read_failed++;
+    }
+    self->num_bytes_read += offset;
+    close(fd);
+
+    return push_emit(self, PUSH_OP_END, NULL, 0);
+}
+
+/**
+ * Read a local file or tree into the ring, directories first.
+ *
+ * :return: false once every host failed.
+ */
+static bool
+push_walk(PushT *self, char *path_local, const char *path_remote) {
+    char path_child[BUF_SIZE_FS_PATH];
+    FileSystemT *filesystem;
+    struct stat attr;
+    ListT *local_dir;
+    bool is_live = true;
+
+    if (stat(path_local, &attr)) {
+        DBG_ERR("Couldn't stat local path %s", path_local);
+        self->num_read_failed++;
+        return true;
+    }
+
+    if (S_ISREG(attr.st_mode)) {
+        return push_emit_file(self, path_local, path_remote, attr.st_mode & 0777);
+    } else if (!S_ISDIR(attr.st_mode)) {
+        return true;
+    }
+
+    if (!push_emit(self, PUSH_OP_MKDIR, path_remote, FS_CREATE_PERM)) {
+        return false;
+    }
+
+    local_dir = path_read_local_dir(path_local);
+    if (local_dir == NULL) {
+        self->num_read_failed++;
+        return true;
+    }
+
+    for (size_t i = 0; i < local_dir->length && is_live; i++) {
+        filesystem = List_get(local_dir, i);
+        if (path_is_dotted(filesystem->name, strlen(filesystem->name))) {
+            continue;
+        }
+
+        snprintf(path_child, sizeof path_child, "%s%c%s", path_remote, PATH_SEPARATOR,
+                 filesystem->name);
+        is_live = push_walk(self, filesystem->relative_path, path_child);
+    }
+
+    FileSystem_list_free(local_dir);
+
+    return is_live;
+}
+
+/**
+ * Read the hosts file, one ``host[:port]`` per line, ``#`` starts a comment.
+ *
+ * :return: false if the file can't be read.
+ */
+static bool
+push_read_hosts(PushT *self, const char *path_hosts, const ConnectOptionsT *options) {
+    char line[BUF_SIZE_FS_PATH];
+    PushHostT *host;
+    char *name, *port;
+    FILE *file;
+
+    file = fopen(path_hosts, "r");
+    if (file == NULL) {
+        DBG_ERR("Couldn't open hosts file %s", path_hosts);
+        return false;
+    }
+
+    while (fgets(line, sizeof line, file) != NULL) {
+        line[strcspn(line, "#")] = '\0';
+        name = strtok(line, " \t\r\n");
+        if (name == NULL) {
+            continue;
+        } else if (self->num_hosts == MAX_PUSH_HOSTS) {
+            DBG_ERR("Pushing to the first %d hosts only", MAX_PUSH_HOSTS);
+            break;
+        }
+
+        host = &self->hosts[self->num_hosts++];
+        host->push = self;
+        host->options =
+            (ConnectOptionsT){.port_id = options->port_id ? options->port_id
+                                                          : PUSH_DEFAULT_PORT,
+                              .compression = options->compression,
+                              .keepalive_interval = options->keepalive_interval,
+                              .dead_timeout = options->dead_timeout};
+
+        port = strrchr(name, ':');
+        if (port != NULL) {
+            *port++ = '\0';
+            host->options.port_id = strtoul(port, NULL, 10);
+        }
+        host->options.host_name = strdup(name);
+
+        /* The host of the current connection is tried with its credentials */
+        if (options->host_name != NULL && !strcmp(name, options->host_name)) {
+            memcpy(host->options.passphrase, options->passphrase,
+                   sizeof host->options.passphrase);
+        }
+    }
+
+    fclose(file);
+
+    return true;
+}
+
+/** Print how every host did. */
+static size_t
+push_print(PushT *self) {
+    size_t num_ok = 0;
+    PushHostT *host;
+    double seconds;
+    bool is_ok;
+
+    for (size_t i = 0; i < self->num_hosts; i++) {
+        host = &self->hosts[i];
+        is_ok = !host->is_failed && !host->num_files_failed;
+        num_ok += is_ok;
+        seconds = MAX(host->time_done - self->time_start, 1e-6);
+
+        printf("%s:%u %s: %zu of %zu files, %.1f MiB in %.2f s (%.1f MiB/s)%s%s\n",
+               host->options.host_name, host->options.port_id, is_ok ? "OK" : "FAILED",
+               host->num_files - host->num_files_failed, host->num_files,
+               host->num_bytes / 1048576.0, seconds,
+               host->num_bytes / 1048576.0 / seconds, host->is_failed ? ", " : "",
+               host->is_failed ? host->error : "");
+    }
+
+    printf("Pushed %.1f MiB to %zu of %zu hosts in %.2f s, reading it once\n",
+           self->num_bytes_read / 1048576.0, num_ok, self->num_hosts,
+           get_time_monotonic() - self->time_start);
+
+    return num_ok;
+}
+
+/**
+ * Push a local file or tree to every host of a hosts file. Each file is read once,
+ * into a ring of ``PUSH_RING_SLOTS`` chunks, and written to every host concurrently.
+ * Each host has a connection and a thread of its own with up to ``LOOP_WINDOW``
+ * writes in flight, so a slow host lags behind without slowing the others until
+ * it's a whole ring behind. A host that fails is dropped and the others go on.
+ *
+ * The first host whose passphrase isn't known asks for it, the other hosts are
+ * tried with the same one.
+ *
+ * :param options: Options of the current connection, the hosts get its port unless
+ *     their line names one.
+ * :param path_remote: Path the local file or tree gets on every host.
+ *
+ * :return: ``CMD_OK`` if every host got every file.
+ */
+CommandStatusE
+push_run(const ConnectOptionsT *options, const char *path_hosts, char *path_local,
+         const char *path_remote) {
+    PushT *self = DBG_CALLOC(1, sizeof *self);
+    char passphrase[BUF_SIZE_PASSPHRASE] = {0};
+    CommandStatusE result = CMD_OK;
+    PushHostT *host;
+
+    if (!push_read_hosts(self, path_hosts, options)) {
+        DBG_SAFE_FREE(self);
+        return CMD_INVALID_ARGS_TYPE;
+    } else if (!self->num_hosts) {
+        DBG_ERR("No hosts in %s", path_hosts);
+        DBG_SAFE_FREE(self);
+        return CMD_INVALID_ARGS_TYPE;
+    }
+
+    self->data = DBG_MALLOC((size_t)PUSH_RING_SLOTS * LOOP_CHUNK_SIZE);
+    for (size_t i = 0; i < PUSH_RING_SLOTS; i++) {
+        self->slots[i].data = self->data + i * LOOP_CHUNK_SIZE;
+    }
+    pthread_mutex_init(&self->lock, NULL);
+    pthread_cond_init(&self->cond, NULL);
+    self->time_start = get_time_monotonic();
+
+    /* Prompting only works here, the hosts connect in parallel once it's done */
+    for (size_t i = 0; i < self->num_hosts; i++) {
+        host = &self->hosts[i];
+        if (*host->options.passphrase) {
+            continue;
+        } else if (*passphrase) {
+            memcpy(host->options.passphrase, passphrase, sizeof passphrase);
+            continue;
+        }
+
+        host->session_ssh = try_ssh_init(&host->options);
+        if (host->session_ssh == NULL) {
+            push_host_fail(host, "couldn't connect");
+            host->time_done = get_time_monotonic();
+        } else {
+            memcpy(passphrase, host->options.passphrase, sizeof passphrase);
+        }
+    }
+
+    for (size_t i = 0; i < self->num_hosts; i++) {
+        host = &self->hosts[i];
+        if (host->is_failed) {
+            continue;
+        }
+
+        host->is_thread = !pthread_create(&host->thread, NULL, push_host_worker, host);
+        if (!host->is_thread) {
+            push_host_fail(host, "couldn't start a thread");
+            host->time_done = get_time_monotonic();
+            if (host->session_ssh != NULL) {
+                clean_ssh_session(host->session_ssh);
+            }
+        }
+    }
+
+    push_walk(self, path_local, path_remote);
+
+    pthread_mutex_lock(&self->lock);
+    self->is_done = true;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+
+    for (size_t i = 0; i < self->num_hosts; i++) {
+        if (self->hosts[i].is_thread) {
+            pthread_join(self->hosts[i].thread, NULL);
+        }
+    }
+
+    if (push_print(self) < self->num_hosts || self->num_read_failed) {
+        result = CMD_INTERNAL_ERROR;
+    }
+
+    for (size_t i = 0; i < self->num_hosts; i++) {
+        clean_connect_options(&self->hosts[i].options);
+    }
+    for (size_t i = 0; i < PUSH_RING_SLOTS; i++) {
+        if (self->slots[i].path != NULL) {
+            DBG_SAFE_FREE(self->slots[i].path);
+        }
+    }
+    memset(passphrase, 0, sizeof passphrase);
+    pthread_cond_destroy(&self->cond);
+    pthread_mutex_destroy(&self->lock);
+    DBG_SAFE_FREE(self->data);
+    DBG_SAFE_FREE(self);
+
+    return result;
+}
@@ -0,0 +1,615 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <libssh/libssh.h>
+#include <libssh/sftp.h>
+
+#include "seft_debug.h"
+#include "seft_jobs.h"
+#include "seft_list.h"
+#include "seft_loop.h"
+#include "seft_path.h"
+#include "seft_remote.h"
+#include "seft_utils.h"
+
+/** A chunk read from the source, waiting to be written to the destination */
+typedef struct RemoteChunkS {
+    uint64_t offset;
+    uint32_t length;
+    struct RemoteChunkS *next;
+    uint8_t data[];
+} RemoteChunkT;
+
+/**
+ * A file streamed from one remote file to another through this computer, chunks
+ * never touch the local disk. Between two hosts the source is read on a thread of
+ * its own, so both connections are busy at once.
+ */
+typedef struct {
+    SftpLoopT *loop_source;
+    SftpLoopT *loop_dest;
+    LoopHandleT handle_source;
+    LoopHandleT handle_dest;
+
+    /** Reads run on their own thread, the loops belong to different connections */
+    bool is_threaded;
+
+    /** Background job the copy runs for, the reader thread checks it too */
+    JobT *job;
+
+    uint64_t offset_next;
+    uint64_t offset_stop;
+    size_t num_reads;
+    size_t num_writes;
+
+    /** Bytes of the reads in flight and of the chunks queued, at most
+     * ``REMOTE_STREAM_BUDGET`` */
+    uint64_t num_bytes_held;
+
+    RemoteChunkT *queue_head;
+    RemoteChunkT *queue_tail;
+
+    /** Set once the reader issues no more reads */
+    bool is_read_done;
+
+    uint32_t status_read;
+    uint32_t status_write;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} RemoteStreamT;
+
+/** State of a remote to remote copy of a tree */
+typedef struct {
+    SftpLoopT *loop_source;
+    SftpLoopT *loop_dest;
+
+    /** Cleared once the server showed it can't run ``cp`` */
+    bool is_exec_usable;
+
+    size_t num_files;
+    size_t num_failed;
+    size_t num_server_side;
+    uint64_t num_bytes_streamed;
+} RemoteCopyT;
+
+static void
+remote_on_status(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    uint32_t *status = user_data;
+
+    (void)loop;
+    if (*status == SSH_FX_OK) {
+        *status = result->status;
+    }
+}
+
+static void
+remote_put_string(uint8_t *buf, size_t *length, const void *data, uint32_t len_data) {
+    buf[(*length)++] = len_data >> 24;
+    buf[(*length)++] = len_data >> 16;
+    buf[(*length)++] = len_data >> 8;
+    buf[(*length)++] = len_data;
+    memcpy(buf + *length, data, len_data);
+    *length += len_data;
+}
+
+static void
+remote_put_u64(uint8_t *buf, size_t *length, uint64_t value) {
+    for (size_t i = 0; i < 8; i++) {
+        buf[(*length)++] = value >> (56 - 8 * i);
+    }
+}
+
+/**
+ * Copy a file on the server with the ``copy-data`` extension, the data stays on
+ * the server. The destination is created with the permissions of the source.
+ *
+ * :return: ``SSH_FX_OK`` once the copy is done, the first failure otherwise.
+ */
+uint32_t
+remote_copy_data(SftpLoopT *loop, const char *path_source, const char *path_dest) {
+    LoopResultT attr = {.status = SSH_FX_NO_CONNECTION};
+    LoopResultT source = {.status = SSH_FX_NO_CONNECTION};
+    LoopResultT dest = {.status = SSH_FX_NO_CONNECTION};
+    uint8_t payload[2 * (4 + LOOP_MAX_HANDLE_SIZE) + 3 * 8];
+    uint32_t status = SSH_FX_OK;
+    size_t length = 0;
+
+    SftpLoop_stat(loop, path_source, SftpLoop_store_result, &attr);
+    SftpLoop_open(loop, path_source, SSH_FXF_READ, 0, SftpLoop_store_result, &source);
+    SftpLoop_run(loop);
+    if (attr.status == SSH_FX_OK && source.status == SSH_FX_OK) {
+        SftpLoop_open(loop, path_dest, SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
+                      attr.attr.permissions & 0777, SftpLoop_store_result, &dest);
+        SftpLoop_run(loop);
+    }
+
+    if (attr.status != SSH_FX_OK || source.status != SSH_FX_OK ||
+        dest.status != SSH_FX_OK) {
+        status = attr.status != SSH_FX_OK     ? attr.status
+                 : source.status != SSH_FX_OK ? source.status
+                                              : dest.status;
+    } else {
+        /* Read from offset 0 up to the end (length 0), write from offset 0 */
+        remote_put_string(payload, &length, source.handle.bytes, source.handle.length);
+        remote_put_u64(payload, &length, 0);
+        remote_put_u64(payload, &length, 0);
+        remote_put_string(payload, &length, dest.handle.bytes, dest.handle.length);
+        remote_put_u64(payload, &length, 0);
+
+        SftpLoop_extended(loop, "copy-data", payload, length, remote_on_status, &status);
+    }
+
+    if (source.status == SSH_FX_OK) {
+        SftpLoop_close(loop, &source.handle, NULL, NULL);
+    }
+    if (dest.status == SSH_FX_OK) {
+        SftpLoop_close(loop, &dest.handle, remote_on_status, &status);
+    }
+    SftpLoop_run(loop);
+
+    return status;
+}
+
+/** Copy a file or a tree with ``cp --reflink=auto`` on the server, which clones the
+ * blocks on filesystems that can and copies them on the server otherwise. */
+static bool
+remote_copy_exec(RemoteCopyT *self, const char *path_source, const char *path_dest,
+                 bool is_dir) {
+    char quoted_source[2 * BUF_SIZE_FS_PATH], quoted_dest[2 * BUF_SIZE_FS_PATH];
+    char command[4 * BUF_SIZE_FS_PATH + 64], output[BUF_SIZE_FS_PATH];
+    int32_t exit_status = -1;
+
+    if (!self->is_exec_usable || !shell_quote(path_source, quoted_source,
+                                              sizeof quoted_source) ||
+        !shell_quote(path_dest, quoted_dest, sizeof quoted_dest)) {
+        return false;
+    }
+
+    /* ``-T`` merges a tree into an existing destination instead of nesting it */
+    snprintf(command, sizeof command, "cp %s--reflink=auto -- %s %s 2>&1",
+             is_dir ? "-R -T " : "", quoted_source, quoted_dest);
+    if (SftpLoop_exec(self->loop_source, command, output, sizeof output,
+                      &exit_status) != CMD_OK ||
+        exit_status == 126 || exit_status == 127) {
+        DBG_INFO("The server can't run cp, streaming through this computer: %s", "");
+        self->is_exec_usable = false;
+        return false;
+    }
+
+    if (exit_status != 0) {
+        DBG_DEBUG("cp %s failed with status %d: %s", path_source, exit_status, output);
+        return false;
+    }
+
+    return true;
+}
+
+static void remote_stream_on_read(SftpLoopT *loop, LoopResultT *result,
+                                   void *user_data);
+static void remote_stream_on_write(SftpLoopT *loop, LoopResultT *result,
+                                   void *user_data);
+
+/** Keep reads in flight while the budget allows. Must be called with the lock held,
+ * on the thread running the source loop. */
+static void
+remote_stream_fill(RemoteStreamT *self) {
+    uint32_t length;
+
+    /* A cancelled job drains the requests in flight and gives up */
+    if (job_is_cancelled() && self->status_read == SSH_FX_OK) {
+        self->status_read = SSH_FX_FAILURE;
+    }
+
+    while (self->status_read == SSH_FX_OK && self->status_write == SSH_FX_OK &&
+           self->num_reads < LOOP_WINDOW && self->offset_next < self->offset_stop &&
+           self->num_bytes_held + LOOP_CHUNK_SIZE <= REMOTE_STREAM_BUDGET) {
+        length = MIN(LOOP_CHUNK_SIZE, self->offset_stop - self->offset_next);
+        if (!SftpLoop_read(self->loop_source, &self->handle_source, self->offset_next,
+                           length, remote_stream_on_read, self)) {
+            self->status_read = SSH_FX_CONNECTION_LOST;
+            break;
+        }
+
+        self->offset_next += length;
+        self->num_reads++;
+        self->num_bytes_held += length;
+    }
+}
+
+/** Hand queued chunks to the destination loop, whose WRITE packets keep a copy of
+ * the data. Must be called with the lock held, on the thread running the
+ * destination loop. */
+static void
+remote_stream_drain(RemoteStreamT *self) {
+    RemoteChunkT *chunk;
+
+    while (self->queue_head != NULL &&
+           (self->num_writes < LOOP_WINDOW || self->status_write != SSH_FX_OK)) {
+        chunk = self->queue_head;
+        self->queue_head = chunk->next;
+        if (self->queue_head == NULL) {
+            self->queue_tail = NULL;
+        }
+
+        /* After a failure the chunks are only dropped */
+        if (self->status_write == SSH_FX_OK) {
+            if (SftpLoop_write(self->loop_dest, &self->handle_dest, chunk->offset,
+                               chunk->data, chunk->length, remote_stream_on_write,
+                               self)) {
+                self->num_writes++;
+            } else {
+                self->status_write = SSH_FX_CONNECTION_LOST;
+            }
+        }
+
+        self->num_bytes_held -= chunk->length;
+        DBG_SAFE_FREE(chunk);
+    }
+
+    pthread_cond_broadcast(&self->cond);
+    if (!self->is_threaded) {
+        remote_stream_fill(self);
+    }
+}
+
+static void
+remote_stream_on_read(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    RemoteStreamT *self = user_data;
+    RemoteChunkT *chunk;
+    uint32_t length_rest;
+
+    pthread_mutex_lock(&self->lock);
+    self->num_reads--;
+
+    if (result->status == SSH_FX_EOF ||
+        (result->status == SSH_FX_OK && !result->len_data)) {
+        /* The file shrank since it was opened */
+        self->offset_stop = MIN(self->offset_stop, result->offset);
+        self->num_bytes_held -= result->length;
+    } else if (result->status != SSH_FX_OK) {
+        remote_on_status(loop, result, &self->status_read);
+        self->num_bytes_held -= result->length;
+    } else {
+        chunk = DBG_MALLOC(sizeof *chunk + result->len_data);
+        *chunk = (RemoteChunkT){.offset = result->offset, .length = result->len_data};
+        memcpy(chunk->data, result->data, result->len_data);
+        if (self->queue_tail != NULL) {
+            self->queue_tail->next = chunk;
+        } else {
+            self->queue_head = chunk;
+        }
+        self->queue_tail = chunk;
+
+        /* Short read, the rest of the chunk keeps its share of the budget */
+        length_rest = result->length - MIN(result->len_data, result->length);
+        if (length_rest && SftpLoop_read(loop, &self->handle_source,
+                                         result->offset + result->len_data, length_rest,
+                                         remote_stream_on_read, self)) {
+            self->num_reads++;
+        } else if (length_rest) {
+            self->status_read = SSH_FX_CONNECTION_LOST;
+            self->num_bytes_held -= length_rest;
+        }
+    }
+
+    if (self->is_threaded) {
+        pthread_cond_broadcast(&self->cond);
+    } else {
+        remote_stream_drain(self);
+    }
+    remote_stream_fill(self);
+    pthread_mutex_unlock(&self->lock);
+}
+
+static void
+remote_stream_on_write(SftpLoopT *loop, LoopResultT *result, void *user_data) {
+    RemoteStreamT *self = user_data;
+
+    pthread_mutex_lock(&self->lock);
+    self->num_writes--;
+    remote_on_status(loop, result, &self->status_write);
+    remote_stream_drain(self);
+    pthread_mutex_unlock(&self->lock);
+}
+
+/** Read the source on a thread of its own, until the end of the file or a failure
+ * on either side. */
+static void *
+remote_stream_reader(void *arg) {
+    RemoteStreamT *self = arg;
+
+    job_bind_thread(self->job);
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        remote_stream_fill(self);
+        if (!self->num_reads) {
+            if (self->offset_next >= self->offset_stop ||
+                self->status_read != SSH_FX_OK || self->status_write != SSH_FX_OK) {
+                break;
+            }
+
+            /* The destination is behind, wait until it takes some chunks */
+            pthread_cond_wait(&self->cond, &self->lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&self->lock);
+        SftpLoop_run(self->loop_source);
+        pthread_mutex_lock(&self->lock);
+    }
+
+    self->is_read_done = true;
+    pthread_cond_broadcast(&self->cond);
+    pthread_mutex_unlock(&self->lock);
+    job_bind_thread(NULL);
+
+    return NULL;
+}
+
+/** Write what the reader thread queues to the destination, until it's done. */
+static void
+remote_stream_writer(RemoteStreamT *self) {
+    pthread_mutex_lock(&self->lock);
+    for (;;) {
+        remote_stream_drain(self);
+        if (self->num_writes) {
+            pthread_mutex_unlock(&self->lock);
+            SftpLoop_run(self->loop_dest);
+            pthread_mutex_lock(&self->lock);
+        } else if (self->is_read_done && self->queue_head == NULL) {
+            break;
+        } else {
+            pthread_cond_wait(&self->cond, &self->lock);
+        }
+    }
+    pthread_mutex_unlock(&self->lock);
+}
+
+/**
+ * Stream a file from the source loop to the destination loop, pipelined on both
+ * sides. On a single connection the reads and writes share one loop.
+ */
+static uint32_t
+remote_stream(RemoteCopyT *copy, const char *path_source, const char *path_dest) {
+    RemoteStreamT self = {.loop_source = copy->loop_source,
+                          .loop_dest = copy->loop_dest,
+                          .is_threaded = copy->loop_source != copy->loop_dest,
+                          .job = job_current(),
+                          .offset_stop = UINT64_MAX};
+    LoopResultT attr = {.status = SSH_FX_NO_CONNECTION};
+    LoopResultT source = {.status = SSH_FX_NO_CONNECTION};
+    LoopResultT dest = {.status = SSH_FX_NO_CONNECTION};
+    uint32_t status_close = SSH_FX_OK, status;
+    pthread_t reader;
+
+    SftpLoop_stat(self.loop_source, path_source, SftpLoop_store_result, &attr);
+    SftpLoop_open(self.loop_source, path_source, SSH_FXF_READ, 0, SftpLoop_store_result,
+                  &source);
+    SftpLoop_run(self.loop_source);
+    if (attr.status == SSH_FX_OK && source.status == SSH_FX_OK) {
+        SftpLoop_open(self.loop_dest, path_dest,
+                      SSH_FXF_WRITE | SSH_FXF_CREAT | SSH_FXF_TRUNC,
+                      attr.attr.permissions & 0777, SftpLoop_store_result, &dest);
+        SftpLoop_run(self.loop_dest);
+    }
+
+    if (attr.status != SSH_FX_OK || source.status != SSH_FX_OK ||
+        dest.status != SSH_FX_OK) {
+        status = attr.status != SSH_FX_OK     ? attr.status
+                 : source.status != SSH_FX_OK ? source.status
+                                              : dest.status;
+        if (source.status == SSH_FX_OK) {
+            SftpLoop_close(self.loop_source, &source.handle, NULL, NULL);
+            SftpLoop_run(self.loop_source);
+        }
+        return status;
+    }
+
+    self.handle_source = source.handle;
+    self.handle_dest = dest.handle;
+
+    /* Reads stop at the size the file had, like downloads do */
+    self.offset_stop = attr.attr.size;
+    pthread_mutex_init(&self.lock, NULL);
+    pthread_cond_init(&self.cond, NULL);
+
+    if (!self.is_threaded) {
+        pthread_mutex_lock(&self.lock);
+        remote_stream_fill(&self);
+        pthread_mutex_unlock(&self.lock);
+        SftpLoop_run(self.loop_source);
+    } else if (pthread_create(&reader, NULL, remote_stream_reader, &self)) {
+        self.status_read = SSH_FX_FAILURE;
+    } else {
+        remote_stream_writer(&self);
+        pthread_join(reader, NULL);
+    }
+
+    SftpLoop_close(self.loop_source, &self.handle_source, NULL, NULL);
+    SftpLoop_run(self.loop_source);
+    SftpLoop_close(self.loop_dest, &self.handle_dest, remote_on_status, &status_close);
+    SftpLoop_run(self.loop_dest);
+
+    pthread_cond_destroy(&self.cond);
+    pthread_mutex_destroy(&self.lock);
+
+    status = self.status_read != SSH_FX_OK    ? self.status_read
+             : self.status_write != SSH_FX_OK ? self.status_write
+                                              : status_close;
+    if (status == SSH_FX_OK) {
+        copy->num_bytes_streamed += MIN(self.offset_stop, attr.attr.size);
+    }
+
+    return status;
+}
+
+/** Copy a file, on the server if the source and destination share it. */
+static CommandStatusE
+remote_copy_file(RemoteCopyT *self, const char *path_source, const char *path_dest) {
+    uint32_t status = SSH_FX_OP_UNSUPPORTED;
+
+    self->num_files++;
+    if (self->loop_source == self->loop_dest) {
+        if (SftpLoop_has_extension(self->loop_source, "copy-data")) {
+            status = remote_copy_data(self->loop_source, path_source, path_dest);
+            DBG_DEBUG("copy-data of %s: %s", path_source, SftpLoop_status_str(status));
+        }
+        if (status != SSH_FX_OK &&
+            remote_copy_exec(self, path_source, path_dest, false)) {
+            status = SSH_FX_OK;
+        }
+        if (status == SSH_FX_OK) {
+            self->num_server_side++;
+            return CMD_OK;
+        }
+    }
+
+    status = remote_stream(self, path_source, path_dest);
+    if (status != SSH_FX_OK) {
+        DBG_ERR("Couldn't copy %s to %s: %s", path_source, path_dest,
+                SftpLoop_status_str(status));
+        self->num_failed++;
+        return CMD_INTERNAL_ERROR;
+    }
+
+    return CMD_OK;
+}
+
+/** Copy a tree file by file, its directories are created on the destination first. */
+static void
+remote_copy_tree(RemoteCopyT *self, char *path_source, const char *path_dest) {
+    char path_child[BUF_SIZE_FS_PATH];
+    uint32_t status_mkdir = SSH_FX_OK;
+    FileSystemT *filesystem;
+    ListT *remote_dir;
+
+    /* SFTP v3 servers report an existing directory as a plain failure */
+    if (SftpLoop_mkdir(self->loop_dest, path_dest, FS_CREATE_PERM, remote_on_status,
+                       &status_mkdir)) {
+        SftpLoop_run(self->loop_dest);
+    }
+    DBG_DEBUG("mkdir %s: %s", path_dest, SftpLoop_status_str(status_mkdir));
+
+    remote_dir = SftpLoop_read_dir(self->loop_source, path_source, NULL);
+    if (remote_dir == NULL) {
+        self->num_failed++;
+        return;
+    }
+
+    for (size_t i = 0; i < remote_dir->length && !job_is_cancelled(); i++) {
+        filesystem = List_get(remote_dir, i);
+        if (path_is_dotted(filesystem->name, strlen(filesystem->name))) {
+            continue;
+        }
+
+        snprintf(path_child, sizeof path_child, "%s%c%s", path_dest, PATH_SEPARATOR,
+                 filesystem->name);
+        if (filesystem->type == FS_DIRECTORY) {
+            remote_copy_tree(self, filesystem->relative_path, path_child);
+        } else if (filesystem->type == FS_REG_FILE) {
+            remote_copy_file(self, filesystem->relative_path, path_child);
+        }
+    }
+
+    FileSystem_list_free(remote_dir);
+}
+
+/** Copy ``path`` to ``buf`` without repeated separators or a trailing one. */
+static void
+remote_path_normalize(const char *path, char *buf, size_t size) {
+    size_t length = 0;
+
+    for (; *path != '\0' && length + 1 < size; path++) {
+        if (*path != PATH_SEPARATOR || !length || buf[length - 1] != PATH_SEPARATOR) {
+            buf[length++] = *path;
+        }
+    }
+    if (length > 1 && buf[length - 1] == PATH_SEPARATOR) {
+        length--;
+    }
+    buf[length] = '\0';
+}
+
+/** Whether ``path`` is ``path_dir`` or under it, as written: a link or a ``..`` on
+ * the way isn't resolved. */
+static bool
+remote_is_within(const char *path, const char *path_dir) {
+    char buf_path[BUF_SIZE_FS_PATH], buf_dir[BUF_SIZE_FS_PATH];
+    size_t len_dir;
+
+    remote_path_normalize(path, buf_path, sizeof buf_path);
+    remote_path_normalize(path_dir, buf_dir, sizeof buf_dir);
+    len_dir = strlen(buf_dir);
+    if (!len_dir) {
+        return !*buf_path;
+    }
+
+    return !strncmp(buf_path, buf_dir, len_dir) &&
+           (buf_path[len_dir] == '\0' || buf_path[len_dir] == PATH_SEPARATOR ||
+            buf_dir[len_dir - 1] == PATH_SEPARATOR);
+}
+
+/**
+ * Copy a file or a tree between two remote paths without the data touching the
+ * local disk.
+ *
+ * On a single host the server copies the data itself: with ``copy-data`` when it has
+ * it, with ``cp --reflink=auto`` over an exec channel otherwise. Files it can't copy
+ * are streamed through this computer. Between two hosts every file is streamed,
+ * reads from the source overlap writes to the destination and at most
+ * ``REMOTE_STREAM_BUDGET`` bytes are held in memory.
+ *
+ * :param loop_source: Loop of the connection holding the source.
+ * :param loop_dest: Loop of the connection the copy goes to, ``loop_source`` for
+ *     the same host.
+ */
+CommandStatusE
+copy_from_remote_to_remote(SftpLoopT *loop_source, SftpLoopT *loop_dest,
+                           char *path_source, char *path_dest) {
+    RemoteCopyT self = {.loop_source = loop_source,
+                        .loop_dest = loop_dest,
+                        .is_exec_usable = loop_source == loop_dest};
+    LoopResultT attr = {.status = SSH_FX_NO_CONNECTION};
+    double time_start = get_time_monotonic();
+
+    /* Opening the destination would truncate the source, or the tree would copy
+     * itself into itself */
+    if (loop_source == loop_dest && remote_is_within(path_dest, path_source)) {
+        DBG_ERR("Can't copy %s to %s, it's the same path or under it", path_source,
+                path_dest);
+        return CMD_INVALID_ARGS_TYPE;
+    }
+
+    if (SftpLoop_stat(loop_source, path_source, SftpLoop_store_result, &attr)) {
+        SftpLoop_run(loop_source);
+    }
+    if (attr.status != SSH_FX_OK) {
+        DBG_ERR("Couldn't stat %s: %s", path_source, SftpLoop_status_str(attr.status));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    if (attr.attr.type != SSH_FILEXFER_TYPE_DIRECTORY) {
+        remote_copy_file(&self, path_source, path_dest);
+    } else if (!SftpLoop_has_extension(loop_source, "copy-data") &&
+               remote_copy_exec(&self, path_source, path_dest, true)) {
+        /* ``copy-data`` goes file by file, ``cp`` copies the whole tree at once */
+        printf("Copied %s on the server in %.2f s\n", path_source,
+               get_time_monotonic() - time_start);
+        return CMD_OK;
+    } else {
+        remote_copy_tree(&self, path_source, path_dest);
+    }
+
+    printf("Copied %zu of %zu files in %.2f s: %zu on the server, %.1f MiB streamed\n",
+           self.num_files - self.num_failed, self.num_files,
+           get_time_monotonic() - time_start, self.num_server_side,
+           self.num_bytes_streamed / 1048576.0);
+
+    return self.num_failed ? CMD_INTERNAL_ERROR : CMD_OK;
+}
@@ -0,0 +1,314 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "seft_debug.h"
+#include "seft_list.h"
+#include "seft_stats.h"
+#include "seft_utils.h"
+
+#define BYTES_PER_MIB (1024.0 * 1024.0)
+
+/** Record of a file at least ``StatsT.min_file_size`` long */
+typedef struct {
+    char *path;
+    uint64_t size;
+
+    /** Bytes that went over the wire, more than ``size`` if chunks were sent again */
+    uint64_t num_bytes;
+
+    uint64_t elapsed_ns;
+    uint32_t num_resumes;
+    bool is_ok;
+} StatsFileT;
+
+struct StatsS {
+    uint64_t time_start_ns;
+
+    /** Files smaller than this are only counted, not recorded one by one */
+    uint64_t min_file_size;
+
+    /** Set once the copy is over, the wall time stops there */
+    uint64_t time_stop_ns;
+
+    atomic_uint_fast64_t num_bytes;
+    atomic_uint_fast64_t num_files;
+    atomic_uint_fast64_t num_failed;
+
+    /** Transfers resumed after a reconnect and listings read again */
+    atomic_uint_fast64_t num_retries;
+
+    atomic_uint_fast64_t num_requests[LOOP_NUM_OPS];
+    atomic_uint_fast64_t times_ns[STATS_NUM_TIMES];
+
+    /** ``StatsFileT`` of the files above ``min_file_size``, in the order they ended */
+    ListT *files;
+    pthread_mutex_t lock;
+};
+
+static const char *stats_time_names[STATS_NUM_TIMES] = {
+    [STATS_TIME_NETWORK] = "network",
+    [STATS_TIME_DISK] = "disk",
+    [STATS_TIME_THROTTLE] = "throttle",
+};
+
+/** Counters the calling thread's copies add to */
+static __thread StatsT *thread_stats = NULL;
+
+static uint64_t
+stats_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Start counting for a copy.
+ *
+ * :param min_file_size: Files at least this long get a record of their own in the
+ *     JSON report, ``UINT64_MAX`` for none.
+ */
+StatsT *
+Stats_new(uint64_t min_file_size) {
+    StatsT *self = DBG_CALLOC(1, sizeof *self);
+
+    self->time_start_ns = stats_now_ns();
+    self->min_file_size = min_file_size;
+    self->files = List_new(1, sizeof(StatsFileT *));
+    pthread_mutex_init(&self->lock, NULL);
+
+    return self;
+}
+
+void
+Stats_free(StatsT *self) {
+    StatsFileT *file;
+
+    if (self == NULL) {
+        return;
+    }
+
+    while ((file = List_pop(self->files)) != NULL) {
+        DBG_SAFE_FREE(file->path);
+        DBG_SAFE_FREE(file);
+    }
+    List_free(self->files);
+    pthread_mutex_destroy(&self->lock);
+    DBG_SAFE_FREE(self);
+}
+
+static double
+stats_seconds(StatsT *self) {
+    if (!self->time_stop_ns) {
+        self->time_stop_ns = stats_now_ns();
+    }
+
+    return MAX((self->time_stop_ns - self->time_start_ns) / 1e9, 1e-6);
+}
+
+/** Print a summary of the copy, the wall time ends with the first report. */
+void
+Stats_print(StatsT *self, FILE *file) {
+    double seconds = stats_seconds(self);
+    uint64_t num_bytes = atomic_load(&self->num_bytes);
+    uint64_t num_requests;
+    const char *separator = "";
+
+    fprintf(file, "%" PRIu64 " files (%" PRIu64 " failed), %.1f MiB in %.2f s, "
+                  "%.2f MiB/s, %" PRIu64 " retries\n",
+            (uint64_t)atomic_load(&self->num_files),
+            (uint64_t)atomic_load(&self->num_failed), num_bytes / BYTES_PER_MIB,
+            seconds, num_bytes / BYTES_PER_MIB / seconds,
+            (uint64_t)atomic_load(&self->num_retries));
+
+    fprintf(file, "Requests:");
+    for (size_t i = 0; i < LOOP_NUM_OPS; i++) {
+        num_requests = atomic_load(&self->num_requests[i]);
+        if (num_requests) {
+            fprintf(file, "%s %s %" PRIu64, separator, SftpLoop_op_str(i), num_requests);
+            separator = ",";
+        }
+    }
+    fprintf(file, "%s\n", *separator ? "" : " none");
+
+    /* Summed over the threads of the copy, parallel jobs can wait longer than the
+     * wall time */
+    fprintf(file, "Blocked:");
+    for (size_t i = 0; i < STATS_NUM_TIMES; i++) {
+        fprintf(file, "%s %s %.2f s", i ? "," : "", stats_time_names[i],
+                atomic_load(&self->times_ns[i]) / 1e9);
+    }
+    fprintf(file, "\n");
+}
+
+/** Write ``str`` as a JSON string, paths may hold quotes and control characters. */
+static void
+stats_json_string(FILE *file, const char *str) {
+    fputc('"', file);
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\') {
+            fprintf(file, "\\%c", *str);
+        } else if ((unsigned char)*str < 0x20) {
+            fprintf(file, "\\u%04x", *str);
+        } else {
+            fputc(*str, file);
+        }
+    }
+    fputc('"', file);
+}
+
+/** Write the counters and the records of the large files to ``path_json``. */
+CommandStatusE
+Stats_write_json(StatsT *self, const char *path_json) {
+    FILE *file = fopen(path_json, "w");
+    double seconds = stats_seconds(self);
+    uint64_t num_bytes = atomic_load(&self->num_bytes);
+    StatsFileT *record;
+
+    if (file == NULL) {
+        DBG_ERR("Couldn't write %s: %s", path_json, strerror(errno));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    fprintf(file,
+            "{\"seconds\": %.3f, \"bytes\": %" PRIu64 ", \"files\": %" PRIu64 ", "
+            "\"failed\": %" PRIu64 ", \"mib_s\": %.2f, \"retries\": %" PRIu64 ",\n",
+            seconds, num_bytes, (uint64_t)atomic_load(&self->num_files),
+            (uint64_t)atomic_load(&self->num_failed),
+            num_bytes / BYTES_PER_MIB / seconds,
+            (uint64_t)atomic_load(&self->num_retries));
+
+    fprintf(file, " \"requests\": {");
+    for (size_t i = 0; i < LOOP_NUM_OPS; i++) {
+        fprintf(file, "%s\"%s\": %" PRIu64, i ? ", " : "", SftpLoop_op_str(i),
+                (uint64_t)atomic_load(&self->num_requests[i]));
+    }
+    fprintf(file, "},\n \"blocked_s\": {");
+    for (size_t i = 0; i < STATS_NUM_TIMES; i++) {
+        fprintf(file, "%s\"%s\": %.3f", i ? ", " : "", stats_time_names[i],
+                atomic_load(&self->times_ns[i]) / 1e9);
+    }
+    fprintf(file, "},\n \"min_file_size\": %" PRIu64 ",\n \"files_recorded\": [\n",
+            self->min_file_size);
+
+    pthread_mutex_lock(&self->lock);
+    for (size_t i = 0; i < self->files->length; i++) {
+        record = List_get(self->files, i);
+        fprintf(file, "  {\"path\": ");
+        stats_json_string(file, record->path);
+        fprintf(file,
+                ", \"status\": \"%s\", \"size\": %" PRIu64 ", \"bytes\": %" PRIu64 ", "
+                "\"seconds\": %.3f, \"mib_s\": %.2f, \"resumes\": %" PRIu32 "}%s\n",
+                record->is_ok ? "ok" : "failed", record->size, record->num_bytes,
+                record->elapsed_ns / 1e9,
+                record->num_bytes / BYTES_PER_MIB / MAX(record->elapsed_ns / 1e9, 1e-6),
+                record->num_resumes, i + 1 < self->files->length ? "," : "");
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    fprintf(file, " ]}\n");
+    if (fclose(file)) {
+        DBG_ERR("Couldn't write %s: %s", path_json, strerror(errno));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    return CMD_OK;
+}
+
+/** Count the copies of the calling thread in ``stats``, ``NULL`` to stop. Pool
+ * workers inherit it from the thread that started the copy. */
+void
+stats_bind_thread(StatsT *stats) {
+    thread_stats = stats;
+}
+
+StatsT *
+stats_current(void) {
+    return thread_stats;
+}
+
+/** Start of a span for ``stats_add_time``, 0 without counters bound so that copies
+ * not counted don't read the clock. */
+uint64_t
+stats_clock(void) {
+    return thread_stats != NULL ? stats_now_ns() : 0;
+}
+
+/** Add the time since ``time_start_ns``, from ``stats_clock``, to ``kind``. */
+void
+stats_add_time(StatsTimeE kind, uint64_t time_start_ns) {
+    if (thread_stats != NULL && time_start_ns) {
+        atomic_fetch_add_explicit(&thread_stats->times_ns[kind],
+                                  stats_now_ns() - time_start_ns,
+                                  memory_order_relaxed);
+    }
+}
+
+/** Count a request completed by a loop of the calling thread. */
+void
+stats_count_request(LoopOpE op) {
+    if (thread_stats != NULL) {
+        atomic_fetch_add_explicit(&thread_stats->num_requests[op], 1,
+                                  memory_order_relaxed);
+    }
+}
+
+void
+stats_count_retry(void) {
+    if (thread_stats != NULL) {
+        atomic_fetch_add_explicit(&thread_stats->num_retries, 1, memory_order_relaxed);
+    }
+}
+
+/**
+ * Count a file once its copy is over, successful or not.
+ *
+ * :param size: Size of the file.
+ * :param num_bytes: Bytes sent or received for it.
+ * :param time_start_ns: When its copy started, from ``stats_clock``.
+ * :param num_resumes: Times it picked up again after a reconnect.
+ */
+void
+stats_file_done(const char *path, uint64_t size, uint64_t num_bytes,
+                uint64_t time_start_ns, uint32_t num_resumes, bool is_ok) {
+    StatsT *self = thread_stats;
+    StatsFileT *record;
+    size_t len_path;
+
+    if (self == NULL) {
+        return;
+    }
+
+    atomic_fetch_add_explicit(&self->num_files, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&self->num_bytes, num_bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&self->num_retries, num_resumes, memory_order_relaxed);
+    if (!is_ok) {
+        atomic_fetch_add_explicit(&self->num_failed, 1, memory_order_relaxed);
+    }
+
+    if (size < self->min_file_size) {
+        return;
+    }
+
+    len_path = strlen(path);
+    record = DBG_MALLOC(sizeof *record);
+    *record = (StatsFileT){.path = DBG_MALLOC(len_path + 1),
+                           .size = size,
+                           .num_bytes = num_bytes,
+                           .elapsed_ns = stats_now_ns() - time_start_ns,
+                           .num_resumes = num_resumes,
+                           .is_ok = is_ok};
+    memcpy(record->path, path, len_path + 1);
+
+    pthread_mutex_lock(&self->lock);
+    List_realloc(self->files, self->files->length + 1);
+    self->files->list[self->files->length++] = record;
+    pthread_mutex_unlock(&self->lock);
+}
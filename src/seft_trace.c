@@ -0,0 +1,273 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "seft_debug.h"
+#include "seft_loop.h"
+#include "seft_trace.h"
+
+/** A local call or an SFTP request, from its start to its end */
+typedef struct {
+    /** Name of the call or of the ``LoopOpE``, a string that outlives the trace */
+    const char *name;
+
+    /** Connection the request went over, ``NULL`` for local calls */
+    const void *session;
+
+    uint64_t time_start_ns;
+    uint64_t duration_ns;
+
+    /** Bytes the call moved or entries it listed, or length of the READ or WRITE */
+    uint64_t value;
+
+    /** ``SSH_FX_*`` status of requests */
+    uint32_t status;
+} TraceSpanT;
+
+typedef struct TraceBlockS {
+    struct TraceBlockS *next;
+    size_t length;
+    TraceSpanT spans[TRACE_BLOCK_SIZE];
+} TraceBlockT;
+
+/** Spans of a thread, only that thread writes to it so it takes no lock */
+typedef struct TraceBufferS {
+    struct TraceBufferS *next;
+
+    /** Thread id in the trace, threads are numbered as they record their first span */
+    uint32_t tid;
+
+    TraceBlockT *head;
+    TraceBlockT *tail;
+} TraceBufferT;
+
+struct TraceS {
+    /** Tells the buffers of this trace from those of an earlier one at the same
+     * address */
+    uint64_t id;
+
+    uint64_t time_start_ns;
+
+    /** Buffers of every thread that recorded a span, newest first */
+    _Atomic(TraceBufferT *) buffers;
+    atomic_uint num_threads;
+};
+
+static atomic_uint_fast64_t trace_next_id = 1;
+
+/** Trace the calling thread records to */
+static __thread TraceT *thread_trace = NULL;
+
+/** Buffer of the calling thread in the trace whose id is ``thread_buffer_trace_id``,
+ * stale once that trace is freed */
+static __thread TraceBufferT *thread_buffer = NULL;
+static __thread uint64_t thread_buffer_trace_id = 0;
+
+static uint64_t
+trace_now_ns(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+TraceT *
+Trace_new(void) {
+    TraceT *self = DBG_CALLOC(1, sizeof *self);
+
+    self->id = atomic_fetch_add(&trace_next_id, 1);
+    self->time_start_ns = trace_now_ns();
+    atomic_init(&self->buffers, NULL);
+    atomic_init(&self->num_threads, 0);
+
+    return self;
+}
+
+void
+Trace_free(TraceT *self) {
+    TraceBufferT *buffer, *buffer_next;
+    TraceBlockT *block, *block_next;
+
+    if (self == NULL) {
+        return;
+    }
+
+    for (buffer = atomic_load(&self->buffers); buffer != NULL; buffer = buffer_next) {
+        buffer_next = buffer->next;
+        for (block = buffer->head; block != NULL; block = block_next) {
+            block_next = block->next;
+            DBG_SAFE_FREE(block);
+        }
+        DBG_SAFE_FREE(buffer);
+    }
+    DBG_SAFE_FREE(self);
+}
+
+static void
+trace_write_span(FILE *file, const TraceT *self, pid_t pid, uint32_t tid,
+                 const TraceSpanT *span, uint64_t *async_id) {
+    double ts_us = (span->time_start_ns - self->time_start_ns) / 1e3;
+
+    if (span->session == NULL) {
+        fprintf(file,
+                ",\n{\"name\": \"%s\", \"cat\": \"fs\", \"ph\": \"X\", \"pid\": %d, "
+                "\"tid\": %" PRIu32 ", \"ts\": %.3f, \"dur\": %.3f, "
+                "\"args\": {\"size\": %" PRIu64 "}}",
+                span->name, (int)pid, tid, ts_us, span->duration_ns / 1e3, span->value);
+        return;
+    }
+
+    /* Requests overlap on their thread, they go on async tracks of their own */
+    (*async_id)++;
+    fprintf(file,
+            ",\n{\"name\": \"%s\", \"cat\": \"sftp\", \"ph\": \"b\", \"id\": %" PRIu64
+            ", \"pid\": %d, \"tid\": %" PRIu32 ", \"ts\": %.3f, "
+            "\"args\": {\"session\": \"%p\", \"length\": %" PRIu64
+            ", \"status\": \"%s\"}}",
+            span->name, *async_id, (int)pid, tid, ts_us, span->session, span->value,
+            SftpLoop_status_str(span->status));
+    fprintf(file,
+            ",\n{\"name\": \"%s\", \"cat\": \"sftp\", \"ph\": \"e\", \"id\": %" PRIu64
+            ", \"pid\": %d, \"tid\": %" PRIu32 ", \"ts\": %.3f}",
+            span->name, *async_id, (int)pid, tid, ts_us + span->duration_ns / 1e3);
+}
+
+/**
+ * Write the spans in the Chrome trace-event format, for ``chrome://tracing`` or
+ * Perfetto. Local calls are complete events on their thread, SFTP requests async
+ * events since many of them are in flight at once.
+ *
+ * .. note:: Every thread recording to the trace must be done.
+ */
+CommandStatusE
+Trace_write(TraceT *self, const char *path_json) {
+    FILE *file = fopen(path_json, "w");
+    pid_t pid = getpid();
+    uint64_t async_id = 0;
+    TraceBufferT *buffer;
+    TraceBlockT *block;
+
+    if (file == NULL) {
+        DBG_ERR("Couldn't write %s: %s", path_json, strerror(errno));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    fprintf(file, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n"
+                  "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+                  "\"args\": {\"name\": \"seft\"}}",
+            (int)pid);
+    for (buffer = atomic_load(&self->buffers); buffer != NULL; buffer = buffer->next) {
+        fprintf(file,
+                ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": %d, "
+                "\"tid\": %" PRIu32 ", \"args\": {\"name\": \"thread %" PRIu32 "\"}}",
+                (int)pid, buffer->tid, buffer->tid);
+        for (block = buffer->head; block != NULL; block = block->next) {
+            for (size_t i = 0; i < block->length; i++) {
+                trace_write_span(file, self, pid, buffer->tid, &block->spans[i],
+                                 &async_id);
+            }
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file)) {
+        DBG_ERR("Couldn't write %s: %s", path_json, strerror(errno));
+        return CMD_INTERNAL_ERROR;
+    }
+
+    return CMD_OK;
+}
+
+/** Record the spans of the calling thread to ``trace``, ``NULL`` to stop. Pool
+ * workers inherit it from the thread that started the copy. */
+void
+trace_bind_thread(TraceT *trace) {
+    thread_trace = trace;
+}
+
+TraceT *
+trace_current(void) {
+    return thread_trace;
+}
+
+/** Start of a span, 0 if the thread isn't tracing so that ``trace_span`` drops it. */
+uint64_t
+trace_clock(void) {
+    return thread_trace != NULL ? trace_now_ns() : 0;
+}
+
+/** Buffer of the calling thread in ``trace``, added to it on the thread's first
+ * span. */
+static TraceBufferT *
+trace_thread_buffer(TraceT *trace) {
+    TraceBufferT *buffer;
+
+    if (thread_buffer_trace_id == trace->id) {
+        return thread_buffer;
+    }
+
+    buffer = DBG_CALLOC(1, sizeof *buffer);
+    buffer->tid = atomic_fetch_add(&trace->num_threads, 1) + 1;
+    buffer->next = atomic_load(&trace->buffers);
+    while (!atomic_compare_exchange_weak(&trace->buffers, &buffer->next, buffer)) {
+    }
+
+    thread_buffer = buffer;
+    thread_buffer_trace_id = trace->id;
+    return buffer;
+}
+
+/**
+ * Record a span of the calling thread, ended now. Use the ``TRACE_*`` macros,
+ * which compile to nothing in builds without tracing.
+ *
+ * :param name: Name of the span, it must outlive the trace.
+ * :param session: Connection of an SFTP request, ``NULL`` for a local call.
+ * :param time_start_ns: Start of the span, from ``trace_clock``.
+ * :param value: Bytes moved or entries listed by a local call, length of a READ or
+ *     WRITE.
+ * :param status: ``SSH_FX_*`` status of a request.
+ */
+void
+trace_span(const char *name, const void *session, uint64_t time_start_ns,
+           uint64_t value, uint32_t status) {
+    TraceBufferT *buffer;
+    TraceBlockT *block;
+
+    if (thread_trace == NULL || !time_start_ns) {
+        return;
+    }
+
+    /* Requests submitted before the trace started are cut at its start */
+    if (time_start_ns < thread_trace->time_start_ns) {
+        time_start_ns = thread_trace->time_start_ns;
+    }
+
+    buffer = trace_thread_buffer(thread_trace);
+    block = buffer->tail;
+    if (block == NULL || block->length == TRACE_BLOCK_SIZE) {
+        block = DBG_MALLOC(sizeof *block);
+        block->next = NULL;
+        block->length = 0;
+        if (buffer->tail != NULL) {
+            buffer->tail->next = block;
+        } else {
+            buffer->head = block;
+        }
+        buffer->tail = block;
+    }
+
+    block->spans[block->length++] = (TraceSpanT){.name = name,
+                                                 .session = session,
+                                                 .time_start_ns = time_start_ns,
+                                                 .duration_ns =
+                                                     trace_now_ns() - time_start_ns,
+                                                 .value = value,
+                                                 .status = status};
+}
@@ -2,6 +2,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "seft_client.h"
@@ -9,6 +11,7 @@
 #include "seft_path.h"
 #include "seft_utils.h"
 #include "seft_ansi_colors.h"
+#include "seft_debug.h"
 
 #define MAX_COLS 128
 
@@ -135,7 +138,7 @@ char_list_equalized_slice(ListT *self, size_t len_rows, size_t len_cols) {
     char *list_item;
 
     for (size_t i = 0; i < len_rows; i++) {
-        row = List_new(1, sizeof *list_item);
+        row = List_new(1, sizeof(char *));
 
         for (size_t j = 0; j < len_cols; j++) {
             start = len_rows * j;
@@ -246,3 +249,83 @@ check_path_type(char *path_str, size_t length, bool is_dir, uint8_t flag) {
 
     return is_valid;
 }
+
+/** Helper function to get a monotonic timestamp in seconds, used to time operations. */
+double
+get_time_monotonic(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/**
+ * Helper function to get the path of a file in seft's cache directory.
+ * The directory (``$XDG_CACHE_HOME/seft`` or ``$HOME/.cache/seft``) is created
+ * if it doesn't exist.
+ *
+ * :param file_name: Name of the file inside the cache directory.
+ * :return: Path to the file, it must be freed by the caller. ``NULL`` if the cache
+ *     directory couldn't be determined.
+ */
+char *
+get_cache_path(const char *file_name) {
+    char *path_buf;
+    char *cache_home = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+
+    if ((cache_home == NULL || !*cache_home) && home == NULL) {
+        DBG_ERR("Couldn't determine cache directory: %s", "HOME is not set");
+        return NULL;
+    }
+
+    path_buf = DBG_CALLOC(BUF_SIZE_FS_PATH, sizeof *path_buf);
+    if (cache_home != NULL && *cache_home) {
+        snprintf(path_buf, BUF_SIZE_FS_PATH, "%s", cache_home);
+    } else {
+        snprintf(path_buf, BUF_SIZE_FS_PATH, "%s/.cache", home);
+    }
+    mkdir(path_buf, FS_CREATE_PERM);
+
+    strncat(path_buf, "/seft", BUF_SIZE_FS_PATH - strlen(path_buf) - 1);
+    mkdir(path_buf, FS_CREATE_PERM);
+
+    snprintf(path_buf + strlen(path_buf), BUF_SIZE_FS_PATH - strlen(path_buf), "/%s",
+             file_name);
+
+    return path_buf;
+}
+
+/**
+ * Helper function to check if a buffer holds only zeros.
+ *
+ * .. note:: Once the first byte is zero, the buffer is all zeros exactly when it
+ *    equals itself shifted by one byte, which lets ``memcmp`` compare it a vector at
+ *    a time.
+ */
+bool
+buf_is_zero(const void *buf, size_t length) {
+    const uint8_t *bytes = buf;
+
+    return !length || (!bytes[0] && !memcmp(bytes, bytes + 1, length - 1));
+}
+
+/** Quote ``str`` for a POSIX shell, false if it doesn't fit ``size``. */
+bool
+shell_quote(const char *str, char *quoted, size_t size) {
+    size_t length = 0;
+
+    quoted[length++] = '\'';
+    for (; *str && length + 5 < size; str++) {
+        if (*str == '\'') {
+            memcpy(quoted + length, "'\\''", 4);
+            length += 4;
+        } else {
+            quoted[length++] = *str;
+        }
+    }
+    quoted[length++] = '\'';
+    quoted[length] = '\0';
+
+    return *str == '\0';
+}